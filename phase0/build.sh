@@ -1,5 +1,17 @@
-clang knn_k_dt_de_reciprocal.c -o knn_k_dt_de_reciprocal.exe -O3 -march=native
-clang knn_k_dt_de_reciprocal_rooted.c -o knn_k_dt_de_reciprocal_rooted.exe -O3 -march=native
-clang knn_k_dt_de_average.c -o knn_k_dt_de_average.exe -O3 -march=native
-clang knn_k_dt_de_linear.c -o knn_k_dt_de_linear.exe -O3 -march=native
-clang knn_k_dt_de_linear_rooted.c -o knn_k_dt_de_linear_rooted.exe -O3 -march=native
\ No newline at end of file
+CC=${CC:-clang}
+LIBS=${LIBS:-}
+case "$(uname -s)" in
+    Linux*|Darwin*) LIBS="$LIBS -lm -lpthread" ;;
+esac
+$CC knn_k_dt_de_reciprocal.c -o knn_k_dt_de_reciprocal.exe -O3 -ffp-contract=off $LIBS
+$CC knn_k_dt_de_reciprocal_rooted.c -o knn_k_dt_de_reciprocal_rooted.exe -O3 -ffp-contract=off $LIBS
+$CC knn_k_dt_de_average.c -o knn_k_dt_de_average.exe -O3 -ffp-contract=off $LIBS
+$CC knn_k_dt_de_linear.c -o knn_k_dt_de_linear.exe -O3 -ffp-contract=off $LIBS
+$CC knn_k_dt_de_linear_rooted.c -o knn_k_dt_de_linear_rooted.exe -O3 -ffp-contract=off $LIBS
+$CC knn_bench.c -o knn_bench.exe -O3 -ffp-contract=off $LIBS
+$CC knn_verify.c knn_lib.c -o knn_verify.exe -O3 -ffp-contract=off -DKNN_CHUNK_ROWS=64 $LIBS
+$CC knn_server.c knn_lib.c -o knn_server.exe -O3 -ffp-contract=off $LIBS
+$CC knn_client.c -o knn_client.exe -O3 -ffp-contract=off $LIBS
+$CC knn_reduce.c -o knn_reduce.exe -O3 -ffp-contract=off $LIBS
+$CC knn_hnsw.c knn_lib.c -o knn_hnsw.exe -O3 -ffp-contract=off $LIBS
+$CC knn_ivfpq.c knn_lib.c knn_quantized.c -o knn_ivfpq.exe -O3 -ffp-contract=off $LIBS
\ No newline at end of file
@@ -0,0 +1,212 @@
+#ifndef KNN_ARENA_H
+#define KNN_ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "knn_platform.h"
+
+// one arena per sweep program for the dataset arrays, the module rows and every thread's scratch: each block starts on
+// a 64 byte cache line, so the kernels' vector loads of a row never split a line and no two threads' scratch share one,
+// the temporaries a call frees before it returns, such as the pca fit and the cascade's block sums, stay on the heap
+//
+// a block of ARENA_LARGE_BYTES or more gets its own pages, huge pages from 2 mb up, so a scan over 60000 rows of 784
+// floats walks about a hundred tlb entries instead of 45000, smaller blocks are cut from shared chunks, and every page
+// is faulted in when the block is handed out so the first combo's scan does not pay for it
+//
+// arena blocks live until the program exits, arenaFree only frees when the arena is off, which it is until arenaStart
+// and in every program that never calls it, then arenaCalloc is plain calloc
+//
+// KNN_ARENA=0 leaves the arena off, KNN_HUGEPAGES=0 keeps small pages, 1 asks for transparent huge pages, the default,
+// and 2 for reserved ones, falling back to transparent and then small pages when none are free
+#define ARENA_ALIGNMENT 64
+#define ARENA_LARGE_BYTES (256u << 10)
+#define ARENA_CHUNK_BYTES (1u << 20)
+
+// blocks and bytes asked for, bytes mapped with the rounding to pages, and the part on huge pages
+typedef struct {
+    long long blockCount;
+    long long requestedBytes;
+    long long mappedBytes;
+    long long hugeBytes;
+    int mappingCount;
+    int hugeMappingCount;
+    uint64_t nanoseconds;
+} ArenaCounts;
+
+typedef struct {
+    int started;
+    HANDLE lock;
+    PageKind pageKind;
+    // the chunk small blocks are cut from
+    char* chunk;
+    size_t chunkUsed;
+    size_t chunkSize;
+    ArenaCounts counts;
+} KnnArena;
+
+static KnnArena arena;
+
+static const char* arenaPageKindName(PageKind kind)
+{
+    return kind == PAGES_EXPLICIT ? "reserved" : kind == PAGES_TRANSPARENT ? "transparent" : "off";
+}
+
+// on unless KNN_ARENA=0, call before the first block the program wants in the arena
+static void arenaStart(void)
+{
+    const char* override = getenv("KNN_ARENA");
+    if (override != NULL && override[0] != '\0' && atoi(override) == 0)
+    {
+        return;
+    }
+    const char* hugePages = getenv("KNN_HUGEPAGES");
+    int kind = hugePages != NULL && hugePages[0] != '\0' ? atoi(hugePages) : PAGES_TRANSPARENT;
+    arena.pageKind = kind <= 0 ? PAGES_SMALL : kind == 1 ? PAGES_TRANSPARENT : PAGES_EXPLICIT;
+    arena.lock = CreateMutex(NULL, FALSE, NULL);
+    if (arena.lock == NULL)
+    {
+        printf("Failed to create the arena lock.\n");
+        exit(1);
+    }
+    arena.started = 1;
+}
+
+// maps and faults in pages for a block or a chunk, NULL when the system has none left
+static char* arenaMap(size_t* size, PageKind kind)
+{
+    uint64_t start = platformNanoseconds();
+    char* address = (char*)platformAllocatePages(size, &kind);
+    arena.counts.nanoseconds += platformNanoseconds() - start;
+    if (address == NULL)
+    {
+        return NULL;
+    }
+    arena.counts.mappingCount++;
+    arena.counts.mappedBytes += *size;
+    if (kind != PAGES_SMALL)
+    {
+        arena.counts.hugeMappingCount++;
+        arena.counts.hugeBytes += *size;
+    }
+    return address;
+}
+
+// zeroed and cache line aligned like calloc, NULL when out of memory
+static void* arenaCalloc(size_t count, size_t size)
+{
+    if (!arena.started)
+    {
+        return calloc(count, size);
+    }
+    size_t bytes = count * size > 0 ? count * size : 1;
+    bytes = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    WaitForSingleObject(arena.lock, INFINITE);
+    char* block;
+    if (bytes >= ARENA_LARGE_BYTES)
+    {
+        size_t mappedSize = bytes;
+        block = arenaMap(&mappedSize, bytes >= PLATFORM_HUGE_PAGE_BYTES ? arena.pageKind : PAGES_SMALL);
+    }
+    else
+    {
+        // the rest of a chunk too small for the block is left unused
+        if (arena.chunk == NULL || arena.chunkUsed + bytes > arena.chunkSize)
+        {
+            size_t chunkSize = ARENA_CHUNK_BYTES;
+            arena.chunk = arenaMap(&chunkSize, PAGES_SMALL);
+            arena.chunkUsed = 0;
+            arena.chunkSize = arena.chunk != NULL ? chunkSize : 0;
+        }
+        block = arena.chunk != NULL ? arena.chunk + arena.chunkUsed : NULL;
+        arena.chunkUsed += block != NULL ? bytes : 0;
+    }
+    if (block != NULL)
+    {
+        arena.counts.blockCount++;
+        arena.counts.requestedBytes += count * size;
+    }
+    ReleaseMutex(arena.lock);
+    return block;
+}
+
+// frees a block that came from calloc while the arena was off, arena blocks stay until the program exits
+static void arenaFree(void* block)
+{
+    if (!arena.started)
+    {
+        free(block);
+    }
+}
+
+// moves an array some other module allocated with calloc into the arena, exits when out of memory
+static void* arenaAdopt(void* block, size_t count, size_t size)
+{
+    if (!arena.started || block == NULL)
+    {
+        return block;
+    }
+    void* adopted = arenaCalloc(count, size);
+    if (adopted == NULL)
+    {
+        printf("Failed to allocate memory in the arena.\n");
+        exit(1);
+    }
+    memcpy(adopted, block, count * size);
+    free(block);
+    return adopted;
+}
+
+// the kernel's own count of anonymous memory on transparent huge pages, -1 where there is none to read
+static long long arenaTransparentHugeBytes(void)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    char line[256];
+    long long kilobytes = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "AnonHugePages: %lld kB", &kilobytes) == 1)
+        {
+            break;
+        }
+    }
+    fclose(file);
+    return kilobytes >= 0 ? kilobytes * 1024 : -1;
+#endif
+}
+
+static void arenaReport(void)
+{
+    if (!arena.started)
+    {
+        printf("Arena: off\n");
+        return;
+    }
+    const double megabyte = 1024.0 * 1024.0;
+    printf("Arena: %lld blocks, %.1f mb requested, %.1f mb mapped in %d mappings, huge pages: %s, %.1f mb in %d mappings, prefaulted in %.3f s",
+        arena.counts.blockCount,
+        arena.counts.requestedBytes / megabyte,
+        arena.counts.mappedBytes / megabyte,
+        arena.counts.mappingCount,
+        arenaPageKindName(arena.pageKind),
+        arena.counts.hugeBytes / megabyte,
+        arena.counts.hugeMappingCount,
+        (double)arena.counts.nanoseconds / 1000000000.0);
+    long long transparentBytes = arenaTransparentHugeBytes();
+    if (transparentBytes >= 0)
+    {
+        printf(", %.1f mb backed by transparent huge pages", transparentBytes / megabyte);
+    }
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef KNN_BAND_H
+#define KNN_BAND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "knn_arena.h"
+#include "knn_sort.h"
+
+// exact search without a tree for the combos where the distance is a metric: no threshold, any positive exponent
+// the rooted lp distance is a metric for exponents of 1 and up and the plain sum of powers below 1, so with the norm
+// of a row being its distance to zero in that metric, the reverse triangle inequality |norm a - norm b| <= distance(a, b)
+// holds, and the sweeps rank the same with or without the root
+//
+// each combo takes the norm of every train row under its exponent and sorts the rows by it, about one query's worth
+// of work, a query then measures rows outward from its own norm, nearest norm first, and stops once the norm gap alone
+// puts every row left beyond the kmax-th smallest distance measured, those rows keep an infinite distance
+//
+// the gap is shrunk by the double rounding of the norms and the float rounding of the distance loop, and compared
+// after the same root the rooted programs take, strictly, so a skipped row can never tie its way into the neighbours
+
+// rows of the combos searched, rows measured, combos and the combos that searched the band
+typedef struct {
+    long long rowCount;
+    long long measuredCount;
+    long long comboCount;
+    long long activeComboCount;
+} BandCounts;
+
+typedef struct {
+    int trainCount;
+    int inputSize;
+    const float* inputs;
+    // whether the current combo searches the band
+    int active;
+    int enabled;
+    int rooted;
+    float distanceExponent;
+    double relativeSlack;
+    double absoluteSlack;
+    // train rows in ascending norm order with their norms, rooted norms for exponents of 1 and up
+    int* order;
+    double* norms;
+    double testNorm;
+    // the next rows to measure below and above the query's norm
+    int below;
+    int above;
+    DistanceHeap heap;
+    BandCounts counts;
+} BandScratch;
+
+typedef struct {
+    int index;
+    double norm;
+} BandNorm;
+
+// 1 unless KNN_BAND=0 turns the band off
+static int bandSelect(void)
+{
+    const char* override = getenv("KNN_BAND");
+    if (override != NULL && override[0] != '\0')
+    {
+        return atoi(override) != 0;
+    }
+    return 1;
+}
+
+static int compareBandNorm(const void* a, const void* b)
+{
+    const BandNorm* norm1 = (const BandNorm*)a;
+    const BandNorm* norm2 = (const BandNorm*)b;
+    if (norm1->norm < norm2->norm)
+    {
+        return -1;
+    }
+    if (norm1->norm > norm2->norm)
+    {
+        return 1;
+    }
+    return norm1->index - norm2->index;
+}
+
+// enabled 0 leaves the band off for every combo and allocates nothing
+static void bandScratchCreate(BandScratch* scratch, int trainCount, int inputSize, const float* inputs, int enabled)
+{
+    memset(scratch, 0, sizeof(BandScratch));
+    scratch->trainCount = trainCount;
+    scratch->inputSize = inputSize;
+    scratch->inputs = inputs;
+    scratch->enabled = enabled;
+    if (!enabled)
+    {
+        return;
+    }
+    scratch->order = (int*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(int));
+    scratch->norms = (double*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(double));
+    if (scratch->order == NULL || scratch->norms == NULL)
+    {
+        printf("Failed to allocate memory for band scratch.\n");
+        exit(1);
+    }
+}
+
+static void bandScratchFree(BandScratch* scratch)
+{
+    arenaFree(scratch->order);
+    arenaFree(scratch->norms);
+    distanceHeapFree(&scratch->heap);
+    memset(scratch, 0, sizeof(BandScratch));
+}
+
+// the sum of |input|^exponent in double, rooted for exponents of 1 and up
+static double bandNorm(const BandScratch* scratch, const float* input)
+{
+    double norm = 0.0;
+    for (int inputIndex = 0; inputIndex < scratch->inputSize; inputIndex++)
+    {
+        if (input[inputIndex] != 0.0f)
+        {
+            norm += pow(fabs(input[inputIndex]), scratch->distanceExponent);
+        }
+    }
+    return scratch->distanceExponent >= 1.0f ? pow(norm, 1.0 / scratch->distanceExponent) : norm;
+}
+
+// sorts the train rows by norm for a combo, the band stays off for it unless the distance is a metric and every norm is finite
+static void bandPrepare(BandScratch* scratch, int kMax, float distanceThreshold, float distanceExponent, int rooted)
+{
+    scratch->counts.comboCount++;
+    scratch->active = scratch->enabled && distanceThreshold <= 0.0f && distanceExponent > 0.0f && scratch->trainCount > kMax;
+    if (!scratch->active)
+    {
+        return;
+    }
+    scratch->distanceExponent = distanceExponent;
+    scratch->rooted = rooted;
+    distanceHeapReset(&scratch->heap, kMax);
+
+    BandNorm* norms = (BandNorm*)calloc(scratch->trainCount, sizeof(BandNorm));
+    if (norms == NULL)
+    {
+        printf("Failed to allocate memory for band norms.\n");
+        exit(1);
+    }
+    for (int row = 0; row < scratch->trainCount; row++)
+    {
+        norms[row].index = row;
+        norms[row].norm = bandNorm(scratch, &scratch->inputs[(size_t)row * scratch->inputSize]);
+        if (!isfinite(norms[row].norm))
+        {
+            scratch->active = 0;
+            free(norms);
+            return;
+        }
+    }
+    qsort(norms, scratch->trainCount, sizeof(BandNorm), compareBandNorm);
+    for (int position = 0; position < scratch->trainCount; position++)
+    {
+        scratch->order[position] = norms[position].index;
+        scratch->norms[position] = norms[position].norm;
+    }
+    free(norms);
+    scratch->counts.activeComboCount++;
+
+    // a norm is a double sum of inputSize pows, each within an ulp or so, and the distance loop rounds each add to float,
+    // off by at most half a float epsilon of the sum, or half the smallest denormal once it underflows, and each float
+    // difference by half an epsilon, which the exponent scales, twice all that covers the rounding of the bound itself
+    scratch->relativeSlack = (scratch->inputSize + 2.0 * distanceExponent + 16) * (double)FLT_EPSILON;
+    scratch->absoluteSlack = scratch->inputSize * (double)FLT_TRUE_MIN;
+}
+
+// starts a query at the train rows nearest its norm
+static void bandLoadTest(BandScratch* scratch, const float* testInput)
+{
+    scratch->testNorm = bandNorm(scratch, testInput);
+    scratch->heap.count = 0;
+    scratch->counts.rowCount += scratch->trainCount;
+    int low = 0;
+    int high = scratch->trainCount;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (scratch->norms[middle] < scratch->testNorm)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    scratch->below = low - 1;
+    scratch->above = low;
+}
+
+// the smallest distance a row at this norm can have from the query, as the sweep would store it,
+// the root's exponent 1 / exponent is off by an ulp too, which moves a norm by up to |ln norm| ulps, never more than 745
+static float bandGapDistance(const BandScratch* scratch, double norm)
+{
+    double gap = fabs(norm - scratch->testNorm) - (norm + scratch->testNorm) * (scratch->inputSize + 760) * DBL_EPSILON;
+    if (gap <= 0.0)
+    {
+        return 0.0f;
+    }
+    double bound = scratch->distanceExponent >= 1.0f ? pow(gap, scratch->distanceExponent) : gap;
+    bound = bound * (1.0 - scratch->relativeSlack) - scratch->absoluteSlack;
+    if (bound <= 0.0)
+    {
+        return 0.0f;
+    }
+
+    // a float at or below the distance the loop returns, then the same root the rooted programs apply
+    float distance = (float)bound;
+    if (scratch->rooted)
+    {
+        distance = pow(distance, 1.0f / scratch->distanceExponent);
+    }
+    return distance;
+}
+
+// the next train row to measure, nearest norm first, or -1 once every row left is provably beyond the kmax nearest
+static int bandNext(BandScratch* scratch)
+{
+    for (;;)
+    {
+        int belowOpen = scratch->below >= 0;
+        int aboveOpen = scratch->above < scratch->trainCount;
+        if (!belowOpen && !aboveOpen)
+        {
+            return -1;
+        }
+        int useBelow = belowOpen && (!aboveOpen || scratch->testNorm - scratch->norms[scratch->below] <= scratch->norms[scratch->above] - scratch->testNorm);
+        int position = useBelow ? scratch->below : scratch->above;
+
+        // the gap only grows further out on a side, so once it is strictly past the largest kept distance the side is done
+        if (scratch->heap.count == scratch->heap.size && bandGapDistance(scratch, scratch->norms[position]) > scratch->heap.values[0])
+        {
+            if (useBelow)
+            {
+                scratch->below = -1;
+            }
+            else
+            {
+                scratch->above = scratch->trainCount;
+            }
+            continue;
+        }
+        if (useBelow)
+        {
+            scratch->below--;
+        }
+        else
+        {
+            scratch->above++;
+        }
+        return scratch->order[position];
+    }
+}
+
+// records a measured distance as the sweep stores it
+static void bandOffer(BandScratch* scratch, float distance)
+{
+    scratch->counts.measuredCount++;
+    distanceHeapOffer(&scratch->heap, distance);
+}
+
+static void bandCountsAdd(BandCounts* total, const BandCounts* counts)
+{
+    total->rowCount += counts->rowCount;
+    total->measuredCount += counts->measuredCount;
+    total->comboCount += counts->comboCount;
+    total->activeComboCount += counts->activeComboCount;
+}
+
+static void bandReport(const BandCounts* counts)
+{
+    printf("Band on in %lld of %lld combos, rows: %lld, measured: %.1f%%\n", counts->activeComboCount, counts->comboCount, counts->rowCount, counts->rowCount > 0 ? 100.0 * counts->measuredCount / counts->rowCount : 0.0);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef KNN_BATCH_H
+#define KNN_BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_arena.h"
+#include "knn_sparse.h"
+
+// parameter batched sweeps: a thread claims a block of combos that share an exponent, consecutive thresholds of one
+// grid column, and for each test and train row pair walks the inputs once, keeping every nonzero difference with its
+// power, then sums those terms for every threshold in the block, so the pow calls and the row reads are shared by the
+// whole block and each combo only pays a compare and an add per term
+//
+// the terms are kept in input order and each combo adds the ones above its threshold to a float, exactly as the kernels
+// and the sparse merge do, so the distances are bit identical to a combo run alone, a difference of zero is dropped
+// because a threshold of zero or more always skips it
+//
+// the grid is threshold major, combo t * exponentCount + e, blocks run down one exponent's column
+// off by default, a batched sweep runs without the cascade, the band, warm starts and interleaved rows, which all prune
+// or speed up the per combo scan, KNN_BATCH sets the block size, 101 runs the sweep's whole column of thresholds per
+// block, which keeps 101 distances per train row and thread, 24 mb at 60000 rows
+#define BATCH_COMBOS_DEFAULT 0
+
+typedef struct {
+    int thresholdCount;
+    int exponentCount;
+    int blockSize;
+    // blocks per exponent column
+    int columnBlockCount;
+} BatchGrid;
+
+// one nonzero difference of a row pair and its power under the block's exponent
+typedef struct {
+    float difference;
+    double power;
+} BatchTerm;
+
+// the per thread state of a sweep: the current test row's distances for every combo of the block
+typedef struct {
+    int capacity;
+    int trainCount;
+    int inputSize;
+    int comboCount;
+    // the combo knn() reads, comboCount is 0 outside a block
+    int current;
+    float* distances;
+    BatchTerm* terms;
+} BatchScratch;
+
+// the block size, 0 unless KNN_BATCH turns batching on
+static int batchSelect(void)
+{
+    const char* override = getenv("KNN_BATCH");
+    if (override != NULL && override[0] != '\0')
+    {
+        int blockSize = atoi(override);
+        return blockSize > 0 ? blockSize : 0;
+    }
+    return BATCH_COMBOS_DEFAULT;
+}
+
+static void batchGridCreate(BatchGrid* grid, int thresholdCount, int exponentCount, int blockSize)
+{
+    grid->thresholdCount = thresholdCount;
+    grid->exponentCount = exponentCount;
+    grid->blockSize = blockSize < thresholdCount ? blockSize : thresholdCount;
+    grid->columnBlockCount = grid->blockSize > 0 ? (thresholdCount + grid->blockSize - 1) / grid->blockSize : 0;
+}
+
+static int batchBlockCount(const BatchGrid* grid)
+{
+    return grid->columnBlockCount * grid->exponentCount;
+}
+
+// the grid indices of a block's combos, ascending threshold, returns how many
+static int batchBlockCombos(const BatchGrid* grid, int block, int* comboIndices)
+{
+    int exponentIndex = block / grid->columnBlockCount;
+    int thresholdStart = block % grid->columnBlockCount * grid->blockSize;
+    int comboCount = 0;
+    for (int thresholdIndex = thresholdStart; thresholdIndex < thresholdStart + grid->blockSize && thresholdIndex < grid->thresholdCount; thresholdIndex++)
+    {
+        comboIndices[comboCount++] = thresholdIndex * grid->exponentCount + exponentIndex;
+    }
+    return comboCount;
+}
+
+// capacity 0 leaves batching off and allocates nothing
+static void batchScratchCreate(BatchScratch* scratch, int capacity, int trainCount, int inputSize)
+{
+    memset(scratch, 0, sizeof(BatchScratch));
+    scratch->capacity = capacity;
+    scratch->trainCount = trainCount;
+    scratch->inputSize = inputSize;
+    if (capacity <= 0)
+    {
+        return;
+    }
+    scratch->distances = (float*)arenaCalloc((size_t)capacity * (trainCount > 0 ? trainCount : 1), sizeof(float));
+    scratch->terms = (BatchTerm*)arenaCalloc(inputSize > 0 ? inputSize : 1, sizeof(BatchTerm));
+    if (scratch->distances == NULL || scratch->terms == NULL)
+    {
+        printf("Failed to allocate memory for batch scratch.\n");
+        exit(1);
+    }
+}
+
+static void batchScratchFree(BatchScratch* scratch)
+{
+    arenaFree(scratch->distances);
+    arenaFree(scratch->terms);
+    memset(scratch, 0, sizeof(BatchScratch));
+}
+
+// the nonzero terms of a dense row pair, as the kernels compute them
+static int batchDenseTerms(BatchTerm* terms, int inputSize, const float* testInput, const float* trainInput, float distanceExponent)
+{
+    int termCount = 0;
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        float difference = fabs(testInput[inputIndex] - trainInput[inputIndex]);
+        if (difference == 0.0f)
+        {
+            continue;
+        }
+        terms[termCount].difference = difference;
+        terms[termCount].power = pow(difference, distanceExponent);
+        termCount++;
+    }
+    return termCount;
+}
+
+// the nonzero terms of the loaded sparse test row and one train row, as sparseDistance merges them
+static int batchSparseTerms(BatchTerm* terms, const SparseScratch* sparse, int trainIndex, float distanceExponent)
+{
+    const SparseRows* rows = sparse->rows;
+    size_t trainEntry = rows->rowStarts[trainIndex];
+    size_t trainEnd = rows->rowStarts[trainIndex + 1];
+    int testEntry = 0;
+    int termCount = 0;
+    while (testEntry < sparse->testCount || trainEntry < trainEnd)
+    {
+        int testPosition = testEntry < sparse->testCount ? sparse->testIndices[testEntry] : rows->inputSize;
+        int trainPosition = trainEntry < trainEnd ? rows->indices[trainEntry] : rows->inputSize;
+        if (testPosition < trainPosition)
+        {
+            terms[termCount].difference = fabs(sparse->testValues[testEntry]);
+            terms[termCount].power = sparse->testPowers[testEntry];
+            termCount++;
+            testEntry++;
+        }
+        else if (trainPosition < testPosition)
+        {
+            terms[termCount].difference = fabs(rows->values[trainEntry]);
+            terms[termCount].power = sparse->powers[trainEntry];
+            termCount++;
+            trainEntry++;
+        }
+        else
+        {
+            float difference = fabs(sparse->testValues[testEntry] - rows->values[trainEntry]);
+            if (difference != 0.0f)
+            {
+                terms[termCount].difference = difference;
+                terms[termCount].power = pow(difference, distanceExponent);
+                termCount++;
+            }
+            testEntry++;
+            trainEntry++;
+        }
+    }
+    return termCount;
+}
+
+// every combo's distance from the test row to every train row, sparse is NULL or has no rows for a dense run,
+// a sparse run needs sparseLoadTest for the test row first
+static void batchLoadTest(
+    BatchScratch* scratch,
+    const SparseScratch* sparse,
+    const float* testInput,
+    const float* trainInputs,
+    int comboCount,
+    const float* distanceThresholds,
+    float distanceExponent
+)
+{
+    int trainCount = scratch->trainCount;
+    scratch->comboCount = comboCount;
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        int termCount = sparse != NULL && sparse->rows != NULL
+            ? batchSparseTerms(scratch->terms, sparse, trainIndex, distanceExponent)
+            : batchDenseTerms(scratch->terms, scratch->inputSize, testInput, &trainInputs[(size_t)trainIndex * scratch->inputSize], distanceExponent);
+        for (int combo = 0; combo < comboCount; combo++)
+        {
+            float distanceThreshold = distanceThresholds[combo];
+            float distance = 0.0f;
+            for (int term = 0; term < termCount; term++)
+            {
+                if (scratch->terms[term].difference <= distanceThreshold)
+                {
+                    continue;
+                }
+                distance += scratch->terms[term].power;
+            }
+            scratch->distances[(size_t)combo * trainCount + trainIndex] = distance;
+        }
+    }
+}
+
+// the current combo's distance to a train row
+static inline float batchDistance(const BatchScratch* scratch, int trainIndex)
+{
+    return scratch->distances[(size_t)scratch->current * scratch->trainCount + trainIndex];
+}
+
+#endif
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_dispatch.h"
+#include "knn_interleave.h"
+#include "knn_synthetic.h"
+
+#define EPSILON 0.0000001f
+
+typedef struct {
+    const char* name;
+    double bytes;
+    double* nanoseconds;
+    double* cycles;
+} StageTiming;
+
+typedef struct {
+    int trainCount;
+    int inputSize;
+    int outputSize;
+    int kMin;
+    int kMax;
+    int kCount;
+    float distanceThreshold;
+    float distanceExponent;
+    float* trainInputs;
+    float* trainOutputs;
+    float* testInput;
+    float* distances;
+    InterleavedRows interleavedRows;
+    InterleaveScratch interleave;
+    IndexDistance* unsortedDistances;
+    IndexDistance* indexDistances;
+    RadixBuffers radixBuffers;
+    float* maxDistances;
+    float* weightSums;
+    float* predictionOutputs;
+    int predictionArgmax;
+} BenchState;
+
+typedef void (*StageFunction)(BenchState* state);
+
+int argmax(int size, float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+int compareIndexDistance(const void* a, const void* b)
+{
+    IndexDistance* id1 = (IndexDistance*)a;
+    IndexDistance* id2 = (IndexDistance*)b;
+    if (id1->distance < id2->distance)
+    {
+        return -1;
+    }
+    if (id1->distance > id2->distance)
+    {
+        return 1;
+    }
+    return id1->index - id2->index;
+}
+
+int compareDouble(const void* a, const void* b)
+{
+    double d1 = *(double*)a;
+    double d2 = *(double*)b;
+    if (d1 < d2)
+    {
+        return -1;
+    }
+    if (d1 > d2)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+void stageDistance(BenchState* state)
+{
+    for (int trainIndex = 0; trainIndex < state->trainCount; trainIndex++)
+    {
+        state->distances[trainIndex] = kernels->distance(state->inputSize, state->testInput, &state->trainInputs[(size_t)trainIndex * state->inputSize], state->distanceThreshold, state->distanceExponent);
+    }
+}
+
+// the same pass over the train rows in interleaved blocks
+void stageDistanceInterleaved(BenchState* state)
+{
+    interleaveLoadTest(&state->interleave, state->testInput, state->distanceThreshold, state->distanceExponent);
+    for (int trainIndex = 0; trainIndex < state->trainCount; trainIndex++)
+    {
+        state->distances[trainIndex] = interleaveDistance(&state->interleave, state->testInput, trainIndex, state->distanceThreshold, state->distanceExponent);
+    }
+}
+
+void stageResetQsort(BenchState* state)
+{
+    memcpy(state->indexDistances, state->unsortedDistances, state->trainCount * sizeof(IndexDistance));
+}
+
+void stageQsort(BenchState* state)
+{
+    qsort(state->indexDistances, state->trainCount, sizeof(IndexDistance), compareIndexDistance);
+}
+
+void stageResetRadix(BenchState* state)
+{
+    memcpy(state->radixBuffers.distances, state->distances, state->trainCount * sizeof(float));
+}
+
+void stageRadix(BenchState* state)
+{
+    kernels->sortDistances(state->trainCount, &state->radixBuffers);
+}
+
+// the max distance and voting passes are the linear weighting ones from knn_k_dt_de_linear.c
+void stageMaxDistance(BenchState* state)
+{
+    memset(state->maxDistances, 0, state->kCount * sizeof(float));
+    for (int neighbourIndex = 0; neighbourIndex < state->kMax && neighbourIndex < state->trainCount; neighbourIndex++)
+    {
+        float distance = state->indexDistances[neighbourIndex].distance;
+        for (int kIndex = 0; kIndex < state->kCount; kIndex++)
+        {
+            int k = state->kMin + kIndex;
+            if (neighbourIndex < k)
+            {
+                if (distance > state->maxDistances[kIndex])
+                {
+                    state->maxDistances[kIndex] = distance;
+                }
+            }
+        }
+    }
+}
+
+void stageVote(BenchState* state)
+{
+    memset(state->weightSums, 0, state->kCount * sizeof(float));
+    memset(state->predictionOutputs, 0, state->kCount * state->outputSize * sizeof(float));
+    for (int neighbourIndex = 0; neighbourIndex < state->kMax && neighbourIndex < state->trainCount; neighbourIndex++)
+    {
+        int trainIndex = state->indexDistances[neighbourIndex].index;
+        float distance = state->indexDistances[neighbourIndex].distance;
+        for (int kIndex = 0; kIndex < state->kCount; kIndex++)
+        {
+            int k = state->kMin + kIndex;
+            if (neighbourIndex < k)
+            {
+                float maxDistance = state->maxDistances[kIndex];
+                float weight = 1.0f - (distance / (maxDistance + EPSILON));
+                state->weightSums[kIndex] += weight;
+                kernels->accumulate(state->outputSize, &state->trainOutputs[trainIndex * state->outputSize], weight, &state->predictionOutputs[kIndex * state->outputSize]);
+            }
+        }
+    }
+    for (int kIndex = 0; kIndex < state->kCount; kIndex++)
+    {
+        float weightSum = state->weightSums[kIndex];
+        for (int outputIndex = 0; outputIndex < state->outputSize; outputIndex++)
+        {
+            state->predictionOutputs[kIndex * state->outputSize + outputIndex] /= weightSum;
+        }
+    }
+}
+
+void stageArgmax(BenchState* state)
+{
+    for (int kIndex = 0; kIndex < state->kCount; kIndex++)
+    {
+        state->predictionArgmax += argmax(state->outputSize, &state->predictionOutputs[kIndex * state->outputSize]);
+    }
+}
+
+// runs a stage warmup times untimed then repetitions times timed, the reset function runs outside the timed region
+void timeStage(BenchState* state, StageTiming* timing, StageFunction reset, StageFunction stage, int warmup, int repetitions)
+{
+    for (int repetition = 0; repetition < warmup; repetition++)
+    {
+        if (reset != NULL)
+        {
+            reset(state);
+        }
+        stage(state);
+    }
+    for (int repetition = 0; repetition < repetitions; repetition++)
+    {
+        if (reset != NULL)
+        {
+            reset(state);
+        }
+        uint64_t startNanoseconds = platformNanoseconds();
+        uint64_t startCycles = platformCycles();
+        stage(state);
+        uint64_t endCycles = platformCycles();
+        uint64_t endNanoseconds = platformNanoseconds();
+        timing->nanoseconds[repetition] = (double)(endNanoseconds - startNanoseconds);
+        timing->cycles[repetition] = (double)(endCycles - startCycles);
+    }
+    qsort(timing->nanoseconds, repetitions, sizeof(double), compareDouble);
+    qsort(timing->cycles, repetitions, sizeof(double), compareDouble);
+}
+
+double percentile(double* sorted, int count, double fraction)
+{
+    int index = (int)ceil(fraction * count) - 1;
+    if (index < 0)
+    {
+        index = 0;
+    }
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+FILE* openBenchFile(char* filename)
+{
+    // append so runs from different versions accumulate in one file, header only when the file is new
+    FILE* file = fopen(filename, "a+");
+    if (file == NULL)
+    {
+        printf("Could not open file %s\n", filename);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+    {
+        fprintf(file, "Label,Isa,Stage,TrainCount,InputSize,KMax,DistanceThreshold,DistanceExponent,Warmup,Repetitions,MedianNs,P99Ns,NsPerPair,GBPerSecond,PixelsPerCycle\n");
+    }
+    return file;
+}
+
+// usage: knn_bench [trainCount] [inputSize] [kMax] [repetitions] [warmup] [distanceThreshold] [distanceExponent] [label] [resultsFile]
+int main(int argc, char** argv)
+{
+    int trainCount = argc > 1 ? atoi(argv[1]) : 60000;
+    int inputSize = argc > 2 ? atoi(argv[2]) : 784;
+    int kMax = argc > 3 ? atoi(argv[3]) : 20;
+    int repetitions = argc > 4 ? atoi(argv[4]) : 50;
+    int warmup = argc > 5 ? atoi(argv[5]) : 5;
+    float distanceThreshold = argc > 6 ? (float)atof(argv[6]) : 0.05f;
+    float distanceExponent = argc > 7 ? (float)atof(argv[7]) : 2.5f;
+    char* label = argc > 8 ? argv[8] : "current";
+    char* resultsFilename = argc > 9 ? argv[9] : "./knn_bench.csv";
+    int outputSize = 10;
+    int kMin = 1;
+
+    if (trainCount < 1 || inputSize < 1 || kMax < 1 || repetitions < 1 || warmup < 0)
+    {
+        printf("Invalid benchmark arguments.\n");
+        exit(1);
+    }
+
+    selectKernels();
+    printf("Kernel ISA: %s\n", kernels->name);
+    printf("TrainCount: %d, InputSize: %d, KMax: %d, Repetitions: %d, Warmup: %d\n", trainCount, inputSize, kMax, repetitions, warmup);
+
+    BenchState state;
+    memset(&state, 0, sizeof(BenchState));
+    state.trainCount = trainCount;
+    state.inputSize = inputSize;
+    state.outputSize = outputSize;
+    state.kMin = kMin;
+    state.kMax = kMax;
+    state.kCount = kMax - kMin + 1;
+    state.distanceThreshold = distanceThreshold;
+    state.distanceExponent = distanceExponent;
+    state.distances = (float*)calloc(trainCount, sizeof(float));
+    state.unsortedDistances = (IndexDistance*)calloc(trainCount, sizeof(IndexDistance));
+    state.indexDistances = (IndexDistance*)calloc(trainCount, sizeof(IndexDistance));
+    state.maxDistances = (float*)calloc(state.kCount, sizeof(float));
+    state.weightSums = (float*)calloc(state.kCount, sizeof(float));
+    state.predictionOutputs = (float*)calloc(state.kCount * outputSize, sizeof(float));
+    if (state.distances == NULL || state.unsortedDistances == NULL || state.indexDistances == NULL || state.maxDistances == NULL || state.weightSums == NULL || state.predictionOutputs == NULL)
+    {
+        printf("Failed to allocate memory for benchmark state.\n");
+        exit(1);
+    }
+    radixBuffersCreate(&state.radixBuffers, trainCount);
+
+    // fixed seed mnist shaped rows so every run measures the same work
+    SyntheticConfig syntheticConfig;
+    syntheticDefaults(&syntheticConfig, 1);
+    float* testOutput = NULL;
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &state.trainInputs, &state.trainOutputs);
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, 1, inputSize, outputSize, &state.testInput, &testOutput);
+    interleavedRowsCreate(&state.interleavedRows, trainCount, inputSize, state.trainInputs, kernels->interleaveLanes);
+    interleaveScratchCreate(&state.interleave, &state.interleavedRows);
+
+    // prime the buffers each later stage consumes
+    stageDistance(&state);
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        state.unsortedDistances[trainIndex].index = trainIndex;
+        state.unsortedDistances[trainIndex].distance = state.distances[trainIndex];
+    }
+    stageResetQsort(&state);
+    stageQsort(&state);
+    stageMaxDistance(&state);
+
+    int neighbourCount = kMax < trainCount ? kMax : trainCount;
+    StageTiming timings[] = {
+        { .name = "distance", .bytes = (double)trainCount * inputSize * sizeof(float) },
+        { .name = "interleaved", .bytes = (double)trainCount * inputSize * sizeof(float) },
+        { .name = "qsort", .bytes = (double)trainCount * sizeof(IndexDistance) },
+        { .name = "radix", .bytes = (double)trainCount * (sizeof(float) + 2 * sizeof(uint64_t)) },
+        { .name = "maxDistance", .bytes = (double)neighbourCount * sizeof(IndexDistance) },
+        { .name = "vote", .bytes = (double)neighbourCount * (sizeof(IndexDistance) + outputSize * sizeof(float)) },
+        { .name = "argmax", .bytes = (double)state.kCount * outputSize * sizeof(float) },
+    };
+    StageFunction resets[] = { NULL, NULL, stageResetQsort, stageResetRadix, NULL, NULL, NULL };
+    StageFunction stages[] = { stageDistance, stageDistanceInterleaved, stageQsort, stageRadix, stageMaxDistance, stageVote, stageArgmax };
+    int stageCount = (int)(sizeof(timings) / sizeof(timings[0]));
+
+    FILE* resultsFile = openBenchFile(resultsFilename);
+    for (int stageIndex = 0; stageIndex < stageCount; stageIndex++)
+    {
+        StageTiming* timing = &timings[stageIndex];
+        timing->nanoseconds = (double*)calloc(repetitions, sizeof(double));
+        timing->cycles = (double*)calloc(repetitions, sizeof(double));
+        if (timing->nanoseconds == NULL || timing->cycles == NULL)
+        {
+            printf("Failed to allocate memory for stage timings.\n");
+            exit(1);
+        }
+
+        timeStage(&state, timing, resets[stageIndex], stages[stageIndex], warmup, repetitions);
+
+        // every stage is normalized by the pairs and pixels of one test row against the whole train set
+        double medianNanoseconds = percentile(timing->nanoseconds, repetitions, 0.5);
+        double p99Nanoseconds = percentile(timing->nanoseconds, repetitions, 0.99);
+        double medianCycles = percentile(timing->cycles, repetitions, 0.5);
+        double nanosecondsPerPair = medianNanoseconds / trainCount;
+        double gigabytesPerSecond = medianNanoseconds > 0.0 ? timing->bytes / medianNanoseconds : 0.0;
+        double pixelsPerCycle = medianCycles > 0.0 ? (double)trainCount * inputSize / medianCycles : 0.0;
+
+        fprintf(resultsFile, "%s,%s,%s,%d,%d,%d,%f,%f,%d,%d,%.0f,%.0f,%f,%f,%f\n", label, kernels->name, timing->name, trainCount, inputSize, kMax, distanceThreshold, distanceExponent, warmup, repetitions, medianNanoseconds, p99Nanoseconds, nanosecondsPerPair, gigabytesPerSecond, pixelsPerCycle);
+        printf("Stage: %-12s Median: %12.0f ns, P99: %12.0f ns, NsPerPair: %10.4f, GB/s: %8.3f, PixelsPerCycle: %8.4f\n", timing->name, medianNanoseconds, p99Nanoseconds, nanosecondsPerPair, gigabytesPerSecond, pixelsPerCycle);
+
+        free(timing->nanoseconds);
+        free(timing->cycles);
+    }
+    fclose(resultsFile);
+    radixBuffersFree(&state.radixBuffers);
+
+    // keep the argmax stage observable so it is not optimized away
+    printf("Checksum: %d\n", state.predictionArgmax);
+    return 0;
+}
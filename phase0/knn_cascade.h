@@ -0,0 +1,422 @@
+#ifndef KNN_CASCADE_H
+#define KNN_CASCADE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_sort.h"
+
+// exact pruning of the distance pass with pooled images: inputs are summed over blocks, 4x4 then 2x2 pixels on a square
+// image (runs of 16 and 4 inputs otherwise), and the block sums of two rows give a lower bound on their distance,
+// a row whose bound reaches the largest of the kmax smallest distances measured so far is skipped without its full distance
+//
+// the bound, for a block of m inputs with sums a and b: the kept differences sum to at least x = |a - b| - m * threshold,
+// so their powers sum to at least m^(1 - exponent) * x^exponent for exponent >= 1 (power mean) and x^exponent below 1
+// (subadditivity), the bound is shrunk by the float rounding of the sums and of the distance loop so it never exceeds
+// the distance the kernels return
+//
+// a skipped row is given an infinite distance, which is exact for the neighbours: rows are scanned in index order and
+// ties rank by index, so a row whose distance is at least the kmax-th smallest so far can never be among the kmax nearest,
+// and the rooted programs keep that order since the root is monotonic
+//
+// the bounds cost about a third of a full distance and a high threshold or a small exponent leaves them loose,
+// so by default each combo times its first test rows with and without the cascade and keeps the faster
+#define CASCADE_LEVEL_COUNT 2
+// test rows timed each way before a combo picks
+#define CASCADE_TIMED_ROWS 2
+
+// pixels per block side at each level, coarse first
+static const int cascadeBlockSides[CASCADE_LEVEL_COUNT] = { 4, 2 };
+
+typedef struct {
+    int blockCount;
+    // block of every input, and inputs per block
+    int* inputBlocks;
+    int* blockSizes;
+} CascadeLevel;
+
+typedef enum {
+    CASCADE_OFF,
+    CASCADE_ON,
+    CASCADE_TIMED
+} CascadeMode;
+
+typedef struct {
+    int rowCount;
+    int inputSize;
+    CascadeLevel levels[CASCADE_LEVEL_COUNT];
+    // rowCount x blockCount block sums per level, and the largest absolute input of every row
+    float* sums[CASCADE_LEVEL_COUNT];
+    float* maxima;
+} CascadeRows;
+
+// rows checked and rows pruned at each level, and combos that kept the cascade on
+typedef struct {
+    long long rowCount;
+    long long prunedCounts[CASCADE_LEVEL_COUNT];
+    long long comboCount;
+    long long activeComboCount;
+} CascadeCounts;
+
+// the per thread state of a sweep: per block terms of the bound for the current combo, the current test row's sums,
+// and a max heap of the kmax smallest distances measured for it
+typedef struct {
+    const CascadeRows* rows;
+    CascadeMode mode;
+    // whether the current test row is pruned, and the timing that decides it for a timed combo
+    int active;
+    int testIndex;
+    uint64_t lastNanoseconds;
+    uint64_t onNanoseconds;
+    uint64_t offNanoseconds;
+    float distanceExponent;
+    // m^(1 - exponent) of the largest block for exponents above 1, and m * threshold of every block
+    double levelFactors[CASCADE_LEVEL_COUNT];
+    double* blockThresholds[CASCADE_LEVEL_COUNT];
+    double relativeSlack;
+    double absoluteSlack;
+    float* testSums[CASCADE_LEVEL_COUNT];
+    float testMaximum;
+    double* sumScratch;
+    DistanceHeap heap;
+    // a bound at or above this prunes the row, only above it once seeded, when the first rows offered were measured
+    // out of index order and a kept row may come after a lower row that ties it, which must reach the sort
+    double limit;
+    int seeded;
+    CascadeCounts counts;
+} CascadeScratch;
+
+// timed per combo unless KNN_CASCADE=0|1 turns it off or on, blocks need a few dozen inputs to bound anything
+static CascadeMode cascadeSelect(int inputSize)
+{
+    const char* override = getenv("KNN_CASCADE");
+    if (override != NULL && override[0] != '\0')
+    {
+        return atoi(override) != 0 ? CASCADE_ON : CASCADE_OFF;
+    }
+    return inputSize >= 64 ? CASCADE_TIMED : CASCADE_OFF;
+}
+
+static void cascadeLevelCreate(CascadeLevel* level, int inputSize, int blockSide)
+{
+    level->inputBlocks = (int*)arenaCalloc(inputSize, sizeof(int));
+    if (level->inputBlocks == NULL)
+    {
+        printf("Failed to allocate memory for cascade blocks.\n");
+        exit(1);
+    }
+
+    // a square image is cut into blockSide x blockSide tiles, anything else into runs of as many inputs
+    int side = (int)(sqrt((double)inputSize) + 0.5);
+    if (side * side == inputSize)
+    {
+        int tilesPerRow = (side + blockSide - 1) / blockSide;
+        level->blockCount = tilesPerRow * tilesPerRow;
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            level->inputBlocks[inputIndex] = (inputIndex / side / blockSide) * tilesPerRow + (inputIndex % side) / blockSide;
+        }
+    }
+    else
+    {
+        int runLength = blockSide * blockSide;
+        level->blockCount = (inputSize + runLength - 1) / runLength;
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            level->inputBlocks[inputIndex] = inputIndex / runLength;
+        }
+    }
+
+    level->blockSizes = (int*)arenaCalloc(level->blockCount, sizeof(int));
+    if (level->blockSizes == NULL)
+    {
+        printf("Failed to allocate memory for cascade blocks.\n");
+        exit(1);
+    }
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        level->blockSizes[level->inputBlocks[inputIndex]]++;
+    }
+}
+
+// block sums in double rounded once to float, so a sum is off by at most a float rounding of m times the largest input
+static void cascadeSums(const CascadeLevel* level, int inputSize, const float* input, double* scratch, float* sums)
+{
+    memset(scratch, 0, level->blockCount * sizeof(double));
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        scratch[level->inputBlocks[inputIndex]] += input[inputIndex];
+    }
+    for (int blockIndex = 0; blockIndex < level->blockCount; blockIndex++)
+    {
+        sums[blockIndex] = (float)scratch[blockIndex];
+    }
+}
+
+static float cascadeMaximum(int inputSize, const float* input)
+{
+    float maximum = 0.0f;
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        if (fabsf(input[inputIndex]) > maximum)
+        {
+            maximum = fabsf(input[inputIndex]);
+        }
+    }
+    return maximum;
+}
+
+static void cascadeRowsCreate(CascadeRows* rows, int count, int inputSize, const float* inputs)
+{
+    memset(rows, 0, sizeof(CascadeRows));
+    rows->rowCount = count;
+    rows->inputSize = inputSize;
+    rows->maxima = (float*)arenaCalloc(count > 0 ? count : 1, sizeof(float));
+    double* scratch = (double*)calloc(inputSize, sizeof(double));
+    if (rows->maxima == NULL || scratch == NULL)
+    {
+        printf("Failed to allocate memory for cascade rows.\n");
+        exit(1);
+    }
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        CascadeLevel* level = &rows->levels[levelIndex];
+        cascadeLevelCreate(level, inputSize, cascadeBlockSides[levelIndex]);
+        rows->sums[levelIndex] = (float*)arenaCalloc((size_t)(count > 0 ? count : 1) * level->blockCount, sizeof(float));
+        if (rows->sums[levelIndex] == NULL)
+        {
+            printf("Failed to allocate memory for cascade rows.\n");
+            exit(1);
+        }
+        for (int row = 0; row < count; row++)
+        {
+            cascadeSums(level, inputSize, &inputs[(size_t)row * inputSize], scratch, &rows->sums[levelIndex][(size_t)row * level->blockCount]);
+        }
+    }
+    for (int row = 0; row < count; row++)
+    {
+        rows->maxima[row] = cascadeMaximum(inputSize, &inputs[(size_t)row * inputSize]);
+    }
+    free(scratch);
+}
+
+static void cascadeRowsFree(CascadeRows* rows)
+{
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        arenaFree(rows->levels[levelIndex].inputBlocks);
+        arenaFree(rows->levels[levelIndex].blockSizes);
+        arenaFree(rows->sums[levelIndex]);
+    }
+    arenaFree(rows->maxima);
+    memset(rows, 0, sizeof(CascadeRows));
+}
+
+// rows may be NULL when the sweep runs without the cascade, then nothing is allocated
+static void cascadeScratchCreate(CascadeScratch* scratch, const CascadeRows* rows, CascadeMode mode)
+{
+    memset(scratch, 0, sizeof(CascadeScratch));
+    if (rows == NULL || mode == CASCADE_OFF)
+    {
+        return;
+    }
+    scratch->rows = rows;
+    scratch->mode = mode;
+    scratch->sumScratch = (double*)arenaCalloc(rows->inputSize, sizeof(double));
+    int failed = scratch->sumScratch == NULL;
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        int blockCount = rows->levels[levelIndex].blockCount;
+        scratch->blockThresholds[levelIndex] = (double*)arenaCalloc(blockCount, sizeof(double));
+        scratch->testSums[levelIndex] = (float*)arenaCalloc(blockCount, sizeof(float));
+        failed |= scratch->blockThresholds[levelIndex] == NULL || scratch->testSums[levelIndex] == NULL;
+    }
+    if (failed)
+    {
+        printf("Failed to allocate memory for cascade scratch.\n");
+        exit(1);
+    }
+}
+
+static void cascadeScratchFree(CascadeScratch* scratch)
+{
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        arenaFree(scratch->blockThresholds[levelIndex]);
+        arenaFree(scratch->testSums[levelIndex]);
+    }
+    distanceHeapFree(&scratch->heap);
+    arenaFree(scratch->sumScratch);
+    memset(scratch, 0, sizeof(CascadeScratch));
+}
+
+// per block terms of the bound for a combo, and a heap for its kmax
+static void cascadePrepare(CascadeScratch* scratch, int kMax, float distanceThreshold, float distanceExponent)
+{
+    const CascadeRows* rows = scratch->rows;
+    distanceHeapReset(&scratch->heap, kMax);
+    scratch->testIndex = 0;
+    scratch->onNanoseconds = 0;
+    scratch->offNanoseconds = 0;
+    scratch->counts.comboCount++;
+    scratch->counts.activeComboCount += scratch->mode == CASCADE_ON;
+    scratch->distanceExponent = distanceExponent;
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        const CascadeLevel* level = &rows->levels[levelIndex];
+        int largestBlock = 0;
+        for (int blockIndex = 0; blockIndex < level->blockCount; blockIndex++)
+        {
+            if (level->blockSizes[blockIndex] > largestBlock)
+            {
+                largestBlock = level->blockSizes[blockIndex];
+            }
+            scratch->blockThresholds[levelIndex][blockIndex] = (double)level->blockSizes[blockIndex] * distanceThreshold;
+        }
+        scratch->levelFactors[levelIndex] = distanceExponent > 1.0f ? pow((double)largestBlock, 1.0 - distanceExponent) : 1.0;
+    }
+
+    // the distance loop rounds every add to float, off by at most half a float epsilon of the sum per input,
+    // or half the smallest denormal once it underflows, twice that covers the double rounding of the bound itself
+    scratch->relativeSlack = (rows->inputSize + 16) * (double)FLT_EPSILON;
+    scratch->absoluteSlack = rows->inputSize * (double)FLT_TRUE_MIN;
+}
+
+// a timed combo runs its first test rows with the cascade and the next as many without, then keeps the faster,
+// each row's thread cpu time runs to the next call so it covers the whole query
+static void cascadeLoadTest(CascadeScratch* scratch, const float* testInput)
+{
+    const CascadeRows* rows = scratch->rows;
+    scratch->active = 1;
+    if (scratch->mode == CASCADE_TIMED && scratch->testIndex <= 2 * CASCADE_TIMED_ROWS)
+    {
+        uint64_t nanoseconds = platformThreadNanoseconds();
+        if (scratch->testIndex > 0)
+        {
+            if (scratch->testIndex <= CASCADE_TIMED_ROWS)
+            {
+                scratch->onNanoseconds += nanoseconds - scratch->lastNanoseconds;
+            }
+            else
+            {
+                scratch->offNanoseconds += nanoseconds - scratch->lastNanoseconds;
+            }
+        }
+        scratch->lastNanoseconds = nanoseconds;
+        if (scratch->testIndex == 2 * CASCADE_TIMED_ROWS)
+        {
+            scratch->counts.activeComboCount += scratch->onNanoseconds <= scratch->offNanoseconds;
+        }
+        scratch->active = scratch->testIndex < CASCADE_TIMED_ROWS;
+    }
+    else if (scratch->mode == CASCADE_TIMED)
+    {
+        scratch->active = scratch->onNanoseconds <= scratch->offNanoseconds;
+    }
+    scratch->testIndex++;
+    scratch->counts.rowCount += rows->rowCount;
+    if (!scratch->active)
+    {
+        return;
+    }
+
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        cascadeSums(&rows->levels[levelIndex], rows->inputSize, testInput, scratch->sumScratch, scratch->testSums[levelIndex]);
+    }
+    scratch->testMaximum = cascadeMaximum(rows->inputSize, testInput);
+    scratch->heap.count = 0;
+    scratch->limit = INFINITY;
+    scratch->seeded = 0;
+}
+
+static inline double cascadePower(double value, float distanceExponent)
+{
+    if (distanceExponent == 1.0f)
+    {
+        return value;
+    }
+    if (distanceExponent == 2.0f)
+    {
+        return value * value;
+    }
+    return pow(value, distanceExponent);
+}
+
+// 1 when the bound of a train row already reaches the kmax-th smallest distance of the test row, coarse level first
+static int cascadePrune(CascadeScratch* scratch, int trainIndex)
+{
+    const CascadeRows* rows = scratch->rows;
+    if (!scratch->active || scratch->limit == INFINITY)
+    {
+        return 0;
+    }
+
+    // a block sum is within a float rounding of m times the largest input, as is the difference of float inputs
+    double sumError = (double)FLT_EPSILON * ((double)scratch->testMaximum + rows->maxima[trainIndex]);
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        const CascadeLevel* level = &rows->levels[levelIndex];
+        const float* testSums = scratch->testSums[levelIndex];
+        const float* trainSums = &rows->sums[levelIndex][(size_t)trainIndex * level->blockCount];
+        const double* blockThresholds = scratch->blockThresholds[levelIndex];
+        double limit = scratch->limit / scratch->levelFactors[levelIndex];
+        double bound = 0.0;
+        for (int blockIndex = 0; blockIndex < level->blockCount; blockIndex++)
+        {
+            double difference = fabs((double)testSums[blockIndex] - trainSums[blockIndex]) * (1.0 - FLT_EPSILON) - level->blockSizes[blockIndex] * sumError - blockThresholds[blockIndex];
+            if (difference <= 0.0)
+            {
+                continue;
+            }
+            bound += cascadePower(difference, scratch->distanceExponent);
+            if (bound > limit || (bound == limit && !scratch->seeded))
+            {
+                scratch->counts.prunedCounts[levelIndex]++;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// records the distance of a row that was measured, keeping the kmax smallest
+static void cascadeOffer(CascadeScratch* scratch, float distance)
+{
+    // a bound b proves distance >= b * (1 - relative) - absolute, so pruning needs that to reach the largest kept distance
+    if (scratch->active && distanceHeapOffer(&scratch->heap, distance) && scratch->relativeSlack < 0.5)
+    {
+        scratch->limit = ((double)scratch->heap.values[0] + scratch->absoluteSlack) / (1.0 - scratch->relativeSlack);
+    }
+}
+
+static void cascadeCountsAdd(CascadeCounts* total, const CascadeCounts* counts)
+{
+    total->rowCount += counts->rowCount;
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        total->prunedCounts[levelIndex] += counts->prunedCounts[levelIndex];
+    }
+    total->comboCount += counts->comboCount;
+    total->activeComboCount += counts->activeComboCount;
+}
+
+// the share of rows each level pruned and of rows whose full distance was measured
+static void cascadeReport(const CascadeCounts* counts)
+{
+    long long measuredCount = counts->rowCount;
+    printf("Cascade on in %lld of %lld combos, rows: %lld", counts->activeComboCount, counts->comboCount, counts->rowCount);
+    for (int levelIndex = 0; levelIndex < CASCADE_LEVEL_COUNT; levelIndex++)
+    {
+        long long prunedCount = counts->prunedCounts[levelIndex];
+        measuredCount -= prunedCount;
+        printf(", pruned by %dx%d sums: %.1f%%", cascadeBlockSides[levelIndex], cascadeBlockSides[levelIndex], counts->rowCount > 0 ? 100.0 * prunedCount / counts->rowCount : 0.0);
+    }
+    printf(", measured: %.1f%%\n", counts->rowCount > 0 ? 100.0 * measuredCount / counts->rowCount : 0.0);
+}
+
+#endif
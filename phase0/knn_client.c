@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_synthetic.h"
+#include "knn_protocol.h"
+
+#ifdef _WIN32
+
+int main(int argc, char** argv)
+{
+    printf("knn_client needs unix domain sockets and pthreads, it is not available on windows yet.\n");
+    return 1;
+}
+
+#else
+
+#include <pthread.h>
+#include <sys/un.h>
+
+// local load generator for knn_server, each connection keeps pipeline requests in flight
+// queries are synthetic test rows from KNN_SYNTHETIC, so with the server's setting the accuracy is meaningful too
+typedef struct {
+    const char* socketPath;
+    int connectionIndex;
+    int requestCount;
+    int pipeline;
+    int inputSize;
+    int outputSize;
+    float* queries;
+    int* labels;
+    double* latencies;
+    int correctCount;
+    int failed;
+} ClientArgs;
+
+int argmax(int size, float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+int compareDouble(const void* a, const void* b)
+{
+    double d1 = *(double*)a;
+    double d2 = *(double*)b;
+    if (d1 < d2)
+    {
+        return -1;
+    }
+    if (d1 > d2)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+double percentile(double* sorted, int count, double fraction)
+{
+    int index = (int)ceil(fraction * count) - 1;
+    if (index < 0)
+    {
+        index = 0;
+    }
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+int connectServer(const char* socketPath, KnnHello* hello)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || readFull(fd, hello, sizeof(KnnHello)) != 0 || hello->magic != KNN_PROTOCOL_MAGIC)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int sendQuery(int fd, ClientArgs* clientArgs, int requestIndex, uint64_t* sendNanoseconds)
+{
+    KnnRequestHeader header;
+    header.id = (uint32_t)requestIndex;
+    sendNanoseconds[requestIndex] = platformNanoseconds();
+    if (writeFull(fd, &header, sizeof(header)) != 0)
+    {
+        return -1;
+    }
+    return writeFull(fd, &clientArgs->queries[(size_t)requestIndex * clientArgs->inputSize], clientArgs->inputSize * sizeof(float));
+}
+
+void* clientEntry(void* arg)
+{
+    ClientArgs* clientArgs = (ClientArgs*)arg;
+    KnnHello hello;
+    int fd = connectServer(clientArgs->socketPath, &hello);
+    uint64_t* sendNanoseconds = (uint64_t*)calloc(clientArgs->requestCount, sizeof(uint64_t));
+    float* predictionOutput = (float*)calloc(clientArgs->outputSize, sizeof(float));
+    if (fd < 0 || sendNanoseconds == NULL || predictionOutput == NULL)
+    {
+        printf("Connection %d failed.\n", clientArgs->connectionIndex);
+        clientArgs->failed = 1;
+        return NULL;
+    }
+
+    // fill the pipeline, then send one more for every answer
+    int sentCount = 0;
+    while (sentCount < clientArgs->requestCount && sentCount < clientArgs->pipeline)
+    {
+        if (sendQuery(fd, clientArgs, sentCount, sendNanoseconds) != 0)
+        {
+            clientArgs->failed = 1;
+            break;
+        }
+        sentCount++;
+    }
+    for (int receivedCount = 0; receivedCount < sentCount && !clientArgs->failed; receivedCount++)
+    {
+        KnnResponseHeader header;
+        if (readFull(fd, &header, sizeof(header)) != 0 || readFull(fd, predictionOutput, clientArgs->outputSize * sizeof(float)) != 0 || header.id >= (uint32_t)sentCount)
+        {
+            printf("Connection %d lost after %d responses.\n", clientArgs->connectionIndex, receivedCount);
+            clientArgs->failed = 1;
+            break;
+        }
+        clientArgs->latencies[receivedCount] = (double)(platformNanoseconds() - sendNanoseconds[header.id]);
+        if (header.label == clientArgs->labels[header.id])
+        {
+            clientArgs->correctCount++;
+        }
+        if (sentCount < clientArgs->requestCount)
+        {
+            if (sendQuery(fd, clientArgs, sentCount, sendNanoseconds) != 0)
+            {
+                clientArgs->failed = 1;
+                break;
+            }
+            sentCount++;
+        }
+    }
+
+    close(fd);
+    free(sendNanoseconds);
+    free(predictionOutput);
+    return NULL;
+}
+
+// usage: knn_client [socketPath] [connections=4] [requestsPerConnection=250] [pipeline=8]
+int main(int argc, char** argv)
+{
+    const char* socketPath = argc > 1 ? argv[1] : KNN_DEFAULT_SOCKET;
+    int connectionCount = argc > 2 ? atoi(argv[2]) : 4;
+    int requestCount = argc > 3 ? atoi(argv[3]) : 250;
+    int pipeline = argc > 4 ? atoi(argv[4]) : 8;
+    if (connectionCount < 1 || requestCount < 1 || pipeline < 1)
+    {
+        printf("Invalid client arguments.\n");
+        exit(1);
+    }
+
+    // the hello tells us the row shape before generating queries
+    KnnHello hello;
+    int probeFd = connectServer(socketPath, &hello);
+    if (probeFd < 0)
+    {
+        printf("Could not connect to %s\n", socketPath);
+        exit(1);
+    }
+    close(probeFd);
+    int inputSize = (int)hello.inputSize;
+    int outputSize = (int)hello.outputSize;
+
+    int trainCount = 1;
+    int testCount = connectionCount * requestCount;
+    SyntheticConfig syntheticConfig;
+    if (!syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize))
+    {
+        syntheticDefaults(&syntheticConfig, 1);
+    }
+    if (inputSize != (int)hello.inputSize || outputSize != (int)hello.outputSize)
+    {
+        printf("KNN_SYNTHETIC shape does not match the server.\n");
+        exit(1);
+    }
+    int totalCount = connectionCount * requestCount;
+    float* queries = NULL;
+    float* outputs = NULL;
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, totalCount, inputSize, outputSize, &queries, &outputs);
+    int* labels = (int*)calloc(totalCount, sizeof(int));
+    double* latencies = (double*)calloc(totalCount, sizeof(double));
+    ClientArgs* clientArgs = (ClientArgs*)calloc(connectionCount, sizeof(ClientArgs));
+    pthread_t* threads = (pthread_t*)calloc(connectionCount, sizeof(pthread_t));
+    if (labels == NULL || latencies == NULL || clientArgs == NULL || threads == NULL)
+    {
+        printf("Failed to allocate memory for client.\n");
+        exit(1);
+    }
+    for (int queryIndex = 0; queryIndex < totalCount; queryIndex++)
+    {
+        labels[queryIndex] = argmax(outputSize, &outputs[(size_t)queryIndex * outputSize]);
+    }
+
+    printf("Connections: %d, requests per connection: %d, pipeline: %d, k: %u\n", connectionCount, requestCount, pipeline, hello.k);
+    uint64_t startNanoseconds = platformNanoseconds();
+    for (int connectionIndex = 0; connectionIndex < connectionCount; connectionIndex++)
+    {
+        ClientArgs* args = &clientArgs[connectionIndex];
+        args->socketPath = socketPath;
+        args->connectionIndex = connectionIndex;
+        args->requestCount = requestCount;
+        args->pipeline = pipeline;
+        args->inputSize = inputSize;
+        args->outputSize = outputSize;
+        args->queries = &queries[(size_t)connectionIndex * requestCount * inputSize];
+        args->labels = &labels[connectionIndex * requestCount];
+        args->latencies = &latencies[connectionIndex * requestCount];
+        if (pthread_create(&threads[connectionIndex], NULL, clientEntry, args) != 0)
+        {
+            printf("Failed to create client thread.\n");
+            exit(1);
+        }
+    }
+
+    int failed = 0;
+    int correctCount = 0;
+    for (int connectionIndex = 0; connectionIndex < connectionCount; connectionIndex++)
+    {
+        pthread_join(threads[connectionIndex], NULL);
+        failed |= clientArgs[connectionIndex].failed;
+        correctCount += clientArgs[connectionIndex].correctCount;
+    }
+    double seconds = (double)(platformNanoseconds() - startNanoseconds) / 1000000000.0;
+    if (failed)
+    {
+        printf("Some connections failed.\n");
+        exit(1);
+    }
+
+    qsort(latencies, totalCount, sizeof(double), compareDouble);
+    printf("Requests: %d, seconds: %.3f, throughput: %.1f/s, p50: %.3f ms, p99: %.3f ms, max: %.3f ms, accuracy: %.2f%%\n",
+        totalCount,
+        seconds,
+        (double)totalCount / seconds,
+        percentile(latencies, totalCount, 0.50) / 1000000.0,
+        percentile(latencies, totalCount, 0.99) / 1000000.0,
+        latencies[totalCount - 1] / 1000000.0,
+        100.0 * correctCount / totalCount);
+
+    free(queries);
+    free(outputs);
+    free(labels);
+    free(latencies);
+    free(clientArgs);
+    free(threads);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef KNN_CURVE_H
+#define KNN_CURVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knn_arena.h"
+
+// learning curves from one sweep: the train rows are loaded in a fixed order, so a smaller train set is a prefix of the
+// full one, and each query's distances to the full set already hold every prefix's, one pass over them in index order
+// keeps a running kmax nearest list and snapshots it as it crosses each prefix's last row, then each prefix votes on its
+// snapshot exactly as a sweep loaded with only that many rows would, ties keep the lower index first like the sort
+//
+// the cascade, the band and the prefilters leave the rows they skip at an infinite distance, which is only safe for
+// the full set's kmax nearest, so a curve sweep runs without them, batching, sparse rows and interleaving are exact
+//
+// off by default, KNN_CURVE=1000,2000,5000 sets the prefix train counts, the full train count is always swept and
+// counts at or past it are dropped, the results gain a leading TrainCount column
+#define CURVE_PREFIX_MAX 32
+
+// the prefix train counts, ascending
+typedef struct {
+    int prefixCount;
+    int trainCounts[CURVE_PREFIX_MAX];
+} CurvePrefixes;
+
+// the per thread state of a sweep: the running nearest list, each prefix's snapshot of it and prediction per k,
+// and the correct counts per combo, prefix and k of the combos a worker claimed
+typedef struct {
+    const CurvePrefixes* prefixes;
+    int outputSize;
+    int kCount;
+    // neighbour slots per prefix, grown to the largest kmax seen
+    int capacity;
+    int kMax;
+    int listCount;
+    int* listIndices;
+    float* listDistances;
+    int* neighbourCounts;
+    int* neighbourIndices;
+    float* neighbourDistances;
+    float* predictionOutputs;
+    // the combo of the claim the counts go to
+    int combo;
+    int* correctCounts;
+} CurveScratch;
+
+// parses KNN_CURVE into the prefixes shorter than the full train set, returns their number, 0 when off
+static int curveSelect(CurvePrefixes* prefixes, int trainCount)
+{
+    memset(prefixes, 0, sizeof(CurvePrefixes));
+    const char* override = getenv("KNN_CURVE");
+    if (override == NULL || override[0] == '\0')
+    {
+        return 0;
+    }
+    const char* field = override;
+    while (*field != '\0')
+    {
+        char* end;
+        long count = strtol(field, &end, 10);
+        if (end == field)
+        {
+            printf("Invalid KNN_CURVE: %s\n", override);
+            exit(1);
+        }
+        int last = prefixes->prefixCount > 0 ? prefixes->trainCounts[prefixes->prefixCount - 1] : 0;
+        if (count > last && count < trainCount && prefixes->prefixCount < CURVE_PREFIX_MAX)
+        {
+            prefixes->trainCounts[prefixes->prefixCount++] = (int)count;
+        }
+        else if (count <= last)
+        {
+            printf("KNN_CURVE train counts must ascend: %s\n", override);
+            exit(1);
+        }
+        field = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+        {
+            printf("Invalid KNN_CURVE: %s\n", override);
+            exit(1);
+        }
+    }
+    return prefixes->prefixCount;
+}
+
+// prefixes without counts leave the scratch off and allocate nothing
+static void curveScratchCreate(CurveScratch* scratch, const CurvePrefixes* prefixes, int outputSize, int kCount, int comboCapacity)
+{
+    memset(scratch, 0, sizeof(CurveScratch));
+    if (prefixes == NULL || prefixes->prefixCount == 0)
+    {
+        return;
+    }
+    scratch->prefixes = prefixes;
+    scratch->outputSize = outputSize;
+    scratch->kCount = kCount;
+    scratch->neighbourCounts = (int*)arenaCalloc(prefixes->prefixCount, sizeof(int));
+    scratch->predictionOutputs = (float*)arenaCalloc((size_t)prefixes->prefixCount * kCount * outputSize, sizeof(float));
+    scratch->correctCounts = (int*)arenaCalloc((size_t)comboCapacity * prefixes->prefixCount * kCount, sizeof(int));
+    if (scratch->neighbourCounts == NULL || scratch->predictionOutputs == NULL || scratch->correctCounts == NULL)
+    {
+        printf("Failed to allocate memory for curve scratch.\n");
+        exit(1);
+    }
+}
+
+static void curveScratchFree(CurveScratch* scratch)
+{
+    arenaFree(scratch->listIndices);
+    arenaFree(scratch->listDistances);
+    arenaFree(scratch->neighbourCounts);
+    arenaFree(scratch->neighbourIndices);
+    arenaFree(scratch->neighbourDistances);
+    arenaFree(scratch->predictionOutputs);
+    arenaFree(scratch->correctCounts);
+    memset(scratch, 0, sizeof(CurveScratch));
+}
+
+// the kmax of the combo, growing the lists when it needs more slots than any before
+static void curvePrepare(CurveScratch* scratch, int kMax)
+{
+    if (kMax > scratch->capacity)
+    {
+        arenaFree(scratch->listIndices);
+        arenaFree(scratch->listDistances);
+        arenaFree(scratch->neighbourIndices);
+        arenaFree(scratch->neighbourDistances);
+        scratch->listIndices = (int*)arenaCalloc(kMax, sizeof(int));
+        scratch->listDistances = (float*)arenaCalloc(kMax, sizeof(float));
+        scratch->neighbourIndices = (int*)arenaCalloc((size_t)scratch->prefixes->prefixCount * kMax, sizeof(int));
+        scratch->neighbourDistances = (float*)arenaCalloc((size_t)scratch->prefixes->prefixCount * kMax, sizeof(float));
+        if (scratch->listIndices == NULL || scratch->listDistances == NULL || scratch->neighbourIndices == NULL || scratch->neighbourDistances == NULL)
+        {
+            printf("Failed to allocate memory for curve neighbours.\n");
+            exit(1);
+        }
+        scratch->capacity = kMax;
+    }
+    scratch->kMax = kMax;
+}
+
+// the train rows the pass reads, up to the last row of the longest prefix
+static inline int curveRowCount(const CurveScratch* scratch)
+{
+    return scratch->prefixes->trainCounts[scratch->prefixes->prefixCount - 1];
+}
+
+// empties the running list for the next query
+static inline void curveLoadTest(CurveScratch* scratch)
+{
+    scratch->listCount = 0;
+}
+
+// keeps a row in the running list, rows come in index order so a strict compare leaves equal distances lowest index
+// first, a row that ends a prefix snapshots the list as that prefix's neighbours
+static inline void curveOffer(CurveScratch* scratch, int trainIndex, float distance)
+{
+    int position = scratch->listCount;
+    if (position < scratch->kMax || distance < scratch->listDistances[position - 1])
+    {
+        if (position == scratch->kMax)
+        {
+            position--;
+        }
+        else
+        {
+            scratch->listCount++;
+        }
+        while (position > 0 && distance < scratch->listDistances[position - 1])
+        {
+            scratch->listIndices[position] = scratch->listIndices[position - 1];
+            scratch->listDistances[position] = scratch->listDistances[position - 1];
+            position--;
+        }
+        scratch->listIndices[position] = trainIndex;
+        scratch->listDistances[position] = distance;
+    }
+    for (int prefix = 0; prefix < scratch->prefixes->prefixCount; prefix++)
+    {
+        if (scratch->prefixes->trainCounts[prefix] == trainIndex + 1)
+        {
+            scratch->neighbourCounts[prefix] = scratch->listCount;
+            memcpy(&scratch->neighbourIndices[(size_t)prefix * scratch->capacity], scratch->listIndices, scratch->listCount * sizeof(int));
+            memcpy(&scratch->neighbourDistances[(size_t)prefix * scratch->capacity], scratch->listDistances, scratch->listCount * sizeof(float));
+        }
+    }
+}
+
+// the prefix's prediction per k, the vote writes it
+static inline float* curvePredictions(CurveScratch* scratch, int prefix)
+{
+    return &scratch->predictionOutputs[(size_t)prefix * scratch->kCount * scratch->outputSize];
+}
+
+// the correct counts per prefix and k of a combo of the claim
+static inline int* curveCorrectCounts(CurveScratch* scratch, int combo)
+{
+    return &scratch->correctCounts[(size_t)combo * scratch->prefixes->prefixCount * scratch->kCount];
+}
+
+// counts each prefix's correct predictions per k for the current combo, the argmax keeps the first largest output
+static void curveCount(CurveScratch* scratch, int testArgmax)
+{
+    int* correctCounts = curveCorrectCounts(scratch, scratch->combo);
+    for (int prefix = 0; prefix < scratch->prefixes->prefixCount; prefix++)
+    {
+        float* predictionOutputs = curvePredictions(scratch, prefix);
+        for (int kIndex = 0; kIndex < scratch->kCount; kIndex++)
+        {
+            float* values = &predictionOutputs[kIndex * scratch->outputSize];
+            int maxIndex = 0;
+            for (int outputIndex = 1; outputIndex < scratch->outputSize; outputIndex++)
+            {
+                if (values[outputIndex] > values[maxIndex])
+                {
+                    maxIndex = outputIndex;
+                }
+            }
+            if (maxIndex == testArgmax)
+            {
+                correctCounts[prefix * scratch->kCount + kIndex]++;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef KNN_DISPATCH_H
+#define KNN_DISPATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_sort.h"
+
+#if KNN_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// the terms of a block of interleaved rows whose inputs take few distinct values: each input as an index into the
+// values, and the term of every test and train value pair under the combo's threshold and exponent
+typedef struct {
+    int valueCount;
+    // the block's inputs in its interleaved layout
+    const unsigned char* blockCodes;
+    // the test row's inputs, -1 for a value no train row has
+    const int* testCodes;
+    const double* terms;
+} BlockTerms;
+
+// the distance, selection and voting kernels are compiled once per instruction set, the generic copy as scalar loops and
+// the others on vectors of its width, and the best one the cpu supports is picked at startup,
+// KNN_ISA=generic|sse4.2|avx2|avx512 overrides it
+typedef struct {
+    const char* name;
+    float (*distance)(int inputSize, const float* testInput, const float* trainInput, float distanceThreshold, float distanceExponent);
+    void (*distanceBlock)(int inputSize, int lanes, const float* testInput, const float* blockInputs, const BlockTerms* blockTerms, float distanceThreshold, float distanceExponent, float* distances);
+    // train rows per interleaved block, a full vector of floats or two
+    int interleaveLanes;
+    void (*sortDistances)(int count, RadixBuffers* radixBuffers);
+    void (*accumulate)(int outputSize, const float* trainOutput, float weight, float* predictionOutput);
+} KnnKernels;
+
+#define KERNEL_TARGET
+#define KERNEL(name) name##Generic
+#define KERNEL_LANES 1
+#include "knn_kernels.h"
+#undef KERNEL_LANES
+#undef KERNEL
+#undef KERNEL_TARGET
+
+#if KNN_X86
+#define KERNEL_TARGET __attribute__((target("sse4.2,popcnt")))
+#define KERNEL(name) name##Sse42
+#define KERNEL_LANES 4
+#include "knn_kernels.h"
+#undef KERNEL_LANES
+#undef KERNEL
+#undef KERNEL_TARGET
+
+#define KERNEL_TARGET __attribute__((target("avx2,bmi2")))
+#define KERNEL(name) name##Avx2
+#define KERNEL_LANES 8
+#include "knn_kernels.h"
+#undef KERNEL_LANES
+#undef KERNEL
+#undef KERNEL_TARGET
+
+#define KERNEL_TARGET __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,bmi2")))
+#define KERNEL(name) name##Avx512
+#define KERNEL_LANES 16
+#include "knn_kernels.h"
+#undef KERNEL_LANES
+#undef KERNEL
+#undef KERNEL_TARGET
+#endif
+
+// ordered worst to best
+static const KnnKernels kernelTable[] = {
+    { "generic", distanceGeneric, distanceBlockGeneric, 8, sortDistancesGeneric, accumulateGeneric },
+#if KNN_X86
+    { "sse4.2", distanceSse42, distanceBlockSse42, 8, sortDistancesSse42, accumulateSse42 },
+    { "avx2", distanceAvx2, distanceBlockAvx2, 8, sortDistancesAvx2, accumulateAvx2 },
+    { "avx512", distanceAvx512, distanceBlockAvx512, 16, sortDistancesAvx512, accumulateAvx512 },
+#endif
+};
+
+#define KERNEL_TABLE_COUNT ((int)(sizeof(kernelTable) / sizeof(kernelTable[0])))
+
+static const KnnKernels* kernels = &kernelTable[0];
+
+#if KNN_X86
+static uint64_t readXcr0(void)
+{
+    uint32_t eax;
+    uint32_t edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+// number of kernelTable entries this cpu and os can run
+static int supportedKernelCount(void)
+{
+#if KNN_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return 1;
+    }
+
+    // sse4.2 and popcnt
+    if (!(ecx & (1u << 20)) || !(ecx & (1u << 23)))
+    {
+        return 1;
+    }
+
+    // avx needs osxsave with the os saving xmm and ymm state
+    int hasAvx = (ecx & (1u << 28)) != 0;
+    int hasOsxsave = (ecx & (1u << 27)) != 0;
+    if (!hasAvx || !hasOsxsave)
+    {
+        return 2;
+    }
+    uint64_t xcr0 = readXcr0();
+    if ((xcr0 & 0x6) != 0x6)
+    {
+        return 2;
+    }
+
+    // avx2 and bmi2
+    if (__get_cpuid_max(0, NULL) < 7)
+    {
+        return 2;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (!(ebx & (1u << 5)) || !(ebx & (1u << 8)))
+    {
+        return 2;
+    }
+
+    // avx512 f, dq, bw and vl with the os saving opmask and zmm state
+    uint32_t avx512Bits = (1u << 16) | (1u << 17) | (1u << 30) | (1u << 31);
+    if ((ebx & avx512Bits) != avx512Bits || (xcr0 & 0xE0) != 0xE0)
+    {
+        return 3;
+    }
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+static const KnnKernels* selectKernels(void)
+{
+    int supportedCount = supportedKernelCount();
+    const char* override = getenv("KNN_ISA");
+    if (override != NULL && override[0] != '\0')
+    {
+        for (int kernelIndex = 0; kernelIndex < KERNEL_TABLE_COUNT; kernelIndex++)
+        {
+            if (strcmp(override, kernelTable[kernelIndex].name) != 0)
+            {
+                continue;
+            }
+            if (kernelIndex >= supportedCount)
+            {
+                printf("KNN_ISA=%s is not supported by this cpu.\n", override);
+                exit(1);
+            }
+            kernels = &kernelTable[kernelIndex];
+            return kernels;
+        }
+        printf("Unknown KNN_ISA value: %s\n", override);
+        exit(1);
+    }
+    kernels = &kernelTable[supportedCount - 1];
+    return kernels;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_synthetic.h"
+#include "knn_lib.h"
+
+// picks hnsw operating points: builds or loads a graph over the KNN_SYNTHETIC train set, then sweeps efSearch
+// and reports recall@k of the graph's neighbours against the exact scan, how often the voted label agrees, and the speedup
+int argmax(int size, float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+KnnModel* createModel(int inputSize, int outputSize, int trainCount, float* trainInputs, float* trainOutputs, KnnParameters* parameters)
+{
+    KnnModel* model = knnModelCreate(inputSize, outputSize, trainCount, trainInputs, trainOutputs, parameters, 1, 32);
+    if (model == NULL)
+    {
+        printf("Failed to create knn model.\n");
+        exit(1);
+    }
+    return model;
+}
+
+// usage: knn_hnsw [m=16] [efConstruction=200] [threads=1] [k=10] [distanceThreshold=0] [distanceExponent=2] [indexPath]
+// the graph is loaded from indexPath when it holds one for these settings and written there after a build otherwise
+// mnist shaped with 60000 train and 100 test rows when KNN_SYNTHETIC is not set
+int main(int argc, char** argv)
+{
+    KnnParameters parameters;
+    knnParametersDefaults(&parameters);
+    parameters.hnsw.m = argc > 1 ? atoi(argv[1]) : 16;
+    parameters.hnsw.efConstruction = argc > 2 ? atoi(argv[2]) : 200;
+    int threadCount = argc > 3 ? atoi(argv[3]) : 1;
+    parameters.k = argc > 4 ? atoi(argv[4]) : 10;
+    parameters.distanceThreshold = argc > 5 ? (float)atof(argv[5]) : 0.0f;
+    parameters.distanceExponent = argc > 6 ? (float)atof(argv[6]) : 2.0f;
+    const char* indexPath = argc > 7 ? argv[7] : NULL;
+    if (threadCount < 1 || parameters.k < 1)
+    {
+        printf("Invalid hnsw arguments.\n");
+        exit(1);
+    }
+
+    int trainCount = 60000;
+    int testCount = 100;
+    int inputSize = 784;
+    int outputSize = 10;
+    SyntheticConfig syntheticConfig;
+    if (!syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize))
+    {
+        syntheticDefaults(&syntheticConfig, 1);
+    }
+    float* trainInputs = NULL;
+    float* trainOutputs = NULL;
+    float* testInputs = NULL;
+    float* testOutputs = NULL;
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, testCount, inputSize, outputSize, &testInputs, &testOutputs);
+
+    int k = parameters.k;
+    float* predictionOutputs = (float*)calloc((size_t)testCount * outputSize, sizeof(float));
+    int* exactLabels = (int*)calloc(testCount, sizeof(int));
+    int* labels = (int*)calloc(testCount, sizeof(int));
+    KnnNeighbour* exactNeighbours = (KnnNeighbour*)calloc((size_t)testCount * k, sizeof(KnnNeighbour));
+    KnnNeighbour* neighbours = (KnnNeighbour*)calloc((size_t)testCount * k, sizeof(KnnNeighbour));
+    if (predictionOutputs == NULL || exactLabels == NULL || labels == NULL || exactNeighbours == NULL || neighbours == NULL)
+    {
+        printf("Failed to allocate memory for hnsw results.\n");
+        exit(1);
+    }
+
+    // the exact neighbours every operating point is measured against
+    KnnParameters exactParameters = parameters;
+    exactParameters.index = KNN_INDEX_NONE;
+    KnnModel* exactModel = createModel(inputSize, outputSize, trainCount, trainInputs, trainOutputs, &exactParameters);
+    uint64_t startNanoseconds = platformNanoseconds();
+    if (knnPredictBatch(exactModel, 0, testCount, testInputs, predictionOutputs, exactLabels, exactNeighbours) != 0)
+    {
+        printf("Failed to run the exact scan.\n");
+        exit(1);
+    }
+    double exactMilliseconds = (double)(platformNanoseconds() - startNanoseconds) / 1000000.0 / testCount;
+    long long exactDistances = knnModelDistanceCount(exactModel);
+    knnModelFree(exactModel);
+    int correctCount = 0;
+    for (int testIndex = 0; testIndex < testCount; testIndex++)
+    {
+        correctCount += exactLabels[testIndex] == argmax(outputSize, &testOutputs[(size_t)testIndex * outputSize]);
+    }
+    printf("Train: %d, test: %d, inputs: %d, k: %d, threshold: %f, exponent: %f\n", trainCount, testCount, inputSize, k, parameters.distanceThreshold, parameters.distanceExponent);
+    printf("Exact scan: %.3f ms per query, %.0f distances per query, accuracy: %.2f%%\n", exactMilliseconds, (double)exactDistances / testCount, 100.0 * correctCount / testCount);
+
+    parameters.index = KNN_INDEX_HNSW;
+    KnnModel* model = createModel(inputSize, outputSize, trainCount, trainInputs, trainOutputs, &parameters);
+    FILE* indexFile = NULL;
+    int loaded = 0;
+    if (indexPath != NULL && fopen_s(&indexFile, indexPath, "rb") == 0)
+    {
+        fclose(indexFile);
+        startNanoseconds = platformNanoseconds();
+        loaded = knnModelLoadIndex(model, indexPath) == 0;
+        if (loaded)
+        {
+            printf("Loaded %s in %.3f s\n", indexPath, (double)(platformNanoseconds() - startNanoseconds) / 1000000000.0);
+        }
+    }
+    if (!loaded)
+    {
+        startNanoseconds = platformNanoseconds();
+        if (knnModelBuildIndex(model, threadCount) != 0)
+        {
+            printf("Failed to build the hnsw graph.\n");
+            exit(1);
+        }
+        printf("Built m: %d, efConstruction: %d, threads: %d in %.3f s\n", parameters.hnsw.m, parameters.hnsw.efConstruction, threadCount, (double)(platformNanoseconds() - startNanoseconds) / 1000000000.0);
+        if (indexPath != NULL && knnModelSaveIndex(model, indexPath) == 0)
+        {
+            printf("Saved %s\n", indexPath);
+        }
+    }
+
+    printf("\n%10s %10s %10s %12s %12s %10s\n", "efSearch", "Recall", "Label", "Distances", "ms/query", "Speedup");
+    int efSearches[] = { 10, 16, 32, 64, 128, 256, 512 };
+    int efSearchCount = (int)(sizeof(efSearches) / sizeof(efSearches[0]));
+    for (int efIndex = 0; efIndex < efSearchCount; efIndex++)
+    {
+        // efSearch below k is raised to k, so only the first such setting is run
+        if (efSearches[efIndex] < k && efIndex + 1 < efSearchCount && efSearches[efIndex + 1] <= k)
+        {
+            continue;
+        }
+        parameters.hnsw.efSearch = efSearches[efIndex];
+        knnModelSetParameters(model, &parameters);
+        long long distanceCount = knnModelDistanceCount(model);
+        startNanoseconds = platformNanoseconds();
+        if (knnPredictBatch(model, 0, testCount, testInputs, predictionOutputs, labels, neighbours) != 0)
+        {
+            printf("Failed to run the hnsw search.\n");
+            exit(1);
+        }
+        double milliseconds = (double)(platformNanoseconds() - startNanoseconds) / 1000000.0 / testCount;
+        distanceCount = knnModelDistanceCount(model) - distanceCount;
+
+        // recall@k is the share of the exact k nearest the graph found, in any order
+        long long foundCount = 0;
+        long long exactCount = 0;
+        int agreeCount = 0;
+        for (int testIndex = 0; testIndex < testCount; testIndex++)
+        {
+            KnnNeighbour* exact = &exactNeighbours[(size_t)testIndex * k];
+            KnnNeighbour* found = &neighbours[(size_t)testIndex * k];
+            for (int exactIndex = 0; exactIndex < k && exact[exactIndex].index >= 0; exactIndex++)
+            {
+                exactCount++;
+                for (int foundIndex = 0; foundIndex < k; foundIndex++)
+                {
+                    if (found[foundIndex].index == exact[exactIndex].index)
+                    {
+                        foundCount++;
+                        break;
+                    }
+                }
+            }
+            agreeCount += labels[testIndex] == exactLabels[testIndex];
+        }
+        printf("%10d %9.2f%% %9.2f%% %12.0f %12.3f %9.1fx\n", efSearches[efIndex] > k ? efSearches[efIndex] : k, 100.0 * foundCount / exactCount, 100.0 * agreeCount / testCount, (double)distanceCount / testCount, milliseconds, exactMilliseconds / milliseconds);
+    }
+
+    knnModelFree(model);
+    free(trainInputs);
+    free(trainOutputs);
+    free(testInputs);
+    free(testOutputs);
+    free(predictionOutputs);
+    free(exactLabels);
+    free(labels);
+    free(exactNeighbours);
+    free(neighbours);
+    return 0;
+}
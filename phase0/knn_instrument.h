@@ -0,0 +1,297 @@
+#ifndef KNN_INSTRUMENT_H
+#define KNN_INSTRUMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "knn_platform.h"
+#include "knn_perf.h"
+
+// per thread phase timers, build with -DKNN_INSTRUMENT=1 to enable
+// when disabled every INSTRUMENT_ macro expands to nothing so the hot path is untouched
+#ifndef KNN_INSTRUMENT
+#define KNN_INSTRUMENT 0
+#endif
+
+// at runtime KNN_PERF=1 also attributes hardware counters to the distance, sort and vote phases
+
+// adds a ComboNanoseconds column to the results file, needs KNN_INSTRUMENT
+#ifndef INSTRUMENT_RESULTS_COLUMN
+#define INSTRUMENT_RESULTS_COLUMN 0
+#endif
+
+#define INSTRUMENT_MAX_THREADS 256
+
+typedef enum {
+    PHASE_DISTANCE,
+    PHASE_SORT,
+    PHASE_VOTE,
+    PHASE_PARAMETERS_LOCK,
+    PHASE_RESULTS_LOCK,
+    PHASE_IO,
+    PHASE_LOAD,
+    PHASE_COUNT
+} InstrumentPhase;
+
+static const char* instrumentPhaseNames[PHASE_COUNT] = {
+    "Distance",
+    "Sort",
+    "Vote",
+    "ParamLock",
+    "ResultLock",
+    "CsvIO",
+    "Load",
+};
+
+// one cache line aligned block per thread so counters never false share
+typedef struct {
+    _Alignas(64) uint64_t ticks[PHASE_COUNT];
+    uint64_t calls[PHASE_COUNT];
+    uint64_t combos;
+    uint64_t rows;
+    uint64_t perf[PHASE_COUNT][PERF_EVENT_COUNT];
+} InstrumentCounters;
+
+typedef struct {
+    uint64_t ticks;
+    // 0 when the counters could not be read at the start, the phase then adds no counts
+    int perfValid;
+    uint64_t perf[PERF_EVENT_COUNT];
+} InstrumentMark;
+
+#if KNN_INSTRUMENT
+
+static InstrumentCounters instrumentCounters[INSTRUMENT_MAX_THREADS];
+static int instrumentThreadCount = 0;
+static _Thread_local InstrumentCounters* instrumentCurrent = NULL;
+static uint64_t instrumentStartTicks = 0;
+static uint64_t instrumentStartNanoseconds = 0;
+static int instrumentPerfRequested = 0;
+static int instrumentPerfFailures = 0;
+static int instrumentPerfEvents[PERF_EVENT_COUNT];
+static int instrumentPerfMultiplexed = 0;
+static _Thread_local PerfGroup instrumentPerfGroup;
+static _Thread_local int instrumentPerfOpen = 0;
+
+static void instrumentStart(void)
+{
+    const char* perf = getenv("KNN_PERF");
+    instrumentPerfRequested = perf != NULL && perf[0] != '\0' && perf[0] != '0';
+    instrumentStartTicks = platformCycles();
+    instrumentStartNanoseconds = platformNanoseconds();
+}
+
+// claims a counter block for the calling thread
+static void instrumentThread(void)
+{
+    int slot = __atomic_fetch_add(&instrumentThreadCount, 1, __ATOMIC_RELAXED);
+    if (slot >= INSTRUMENT_MAX_THREADS)
+    {
+        printf("Too many instrumented threads.\n");
+        exit(1);
+    }
+    instrumentCurrent = &instrumentCounters[slot];
+
+    // without counters, e.g. in a restricted container, only the timers run
+    if (!instrumentPerfRequested)
+    {
+        return;
+    }
+    char reason[256];
+    if (perfOpen(&instrumentPerfGroup, reason, sizeof(reason)) != 0)
+    {
+        if (__atomic_fetch_add(&instrumentPerfFailures, 1, __ATOMIC_RELAXED) == 0)
+        {
+            printf("Hardware counters unavailable, %s, continuing with timers only.\n", reason);
+        }
+        return;
+    }
+    instrumentPerfOpen = 1;
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        if (perfHasEvent(&instrumentPerfGroup, (PerfEvent)event))
+        {
+            instrumentPerfEvents[event] = 1;
+        }
+    }
+}
+
+// closes the calling thread's counter group, its counts are already in its block
+static void instrumentThreadEnd(void)
+{
+    if (instrumentPerfOpen)
+    {
+        perfClose(&instrumentPerfGroup);
+        instrumentPerfOpen = 0;
+    }
+}
+
+// only the compute phases read counters, a read is a syscall and the lock and io phases are too short to attribute
+static inline int instrumentPerfPhase(InstrumentPhase phase)
+{
+    return instrumentPerfOpen && phase <= PHASE_VOTE;
+}
+
+static inline InstrumentMark instrumentBegin(InstrumentPhase phase)
+{
+    InstrumentMark mark;
+    mark.perfValid = instrumentPerfPhase(phase) && perfRead(&instrumentPerfGroup, mark.perf) == 0;
+    mark.ticks = platformCycles();
+    return mark;
+}
+
+static inline void instrumentEnd(InstrumentPhase phase, InstrumentMark* mark)
+{
+    instrumentCurrent->ticks[phase] += platformCycles() - mark->ticks;
+    instrumentCurrent->calls[phase]++;
+    // a failed read at either end leaves the phase without counts rather than adding absolute values
+    if (mark->perfValid && instrumentPerfPhase(phase))
+    {
+        uint64_t values[PERF_EVENT_COUNT];
+        if (perfRead(&instrumentPerfGroup, values) == 0)
+        {
+            for (int event = 0; event < PERF_EVENT_COUNT; event++)
+            {
+                instrumentCurrent->perf[phase][event] += values[event] - mark->perf[event];
+            }
+            if (instrumentPerfGroup.timeRunning < instrumentPerfGroup.timeEnabled)
+            {
+                instrumentPerfMultiplexed = 1;
+            }
+        }
+    }
+}
+
+// derived metrics per compute phase, rows are train rows scanned so misses per row compare across train sizes
+static void instrumentPerfReport(InstrumentCounters* total)
+{
+    int anyEvents = 0;
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        anyEvents |= instrumentPerfEvents[event];
+    }
+    if (!anyEvents)
+    {
+        return;
+    }
+
+    printf("\nHardware counters, rows: %llu\n", (unsigned long long)total->rows);
+    printf("%-8s", "Phase");
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        printf(" %14s", perfEventNames[event]);
+    }
+    printf(" %8s %12s %12s %12s\n", "IPC", "CacheMiss/R", "L1DMiss/R", "BrMiss/R");
+
+    for (int phase = 0; phase <= PHASE_VOTE; phase++)
+    {
+        uint64_t* values = total->perf[phase];
+        double rows = total->rows > 0 ? (double)total->rows : 1.0;
+        printf("%-8s", instrumentPhaseNames[phase]);
+        for (int event = 0; event < PERF_EVENT_COUNT; event++)
+        {
+            if (instrumentPerfEvents[event])
+            {
+                printf(" %14llu", (unsigned long long)values[event]);
+            }
+            else
+            {
+                printf(" %14s", "n/a");
+            }
+        }
+        double ipc = values[PERF_CYCLES] > 0 ? (double)values[PERF_INSTRUCTIONS] / (double)values[PERF_CYCLES] : 0.0;
+        printf(" %8.3f %12.3f %12.3f %12.3f\n", ipc, (double)values[PERF_CACHE_MISSES] / rows, (double)values[PERF_L1D_MISSES] / rows, (double)values[PERF_BRANCH_MISSES] / rows);
+    }
+    if (instrumentPerfMultiplexed)
+    {
+        printf("Counters were multiplexed, raw counts cover only the time the group was scheduled.\n");
+    }
+}
+
+static void instrumentReport(void)
+{
+    uint64_t elapsedTicks = platformCycles() - instrumentStartTicks;
+    uint64_t elapsedNanoseconds = platformNanoseconds() - instrumentStartNanoseconds;
+    double ticksPerMillisecond = elapsedNanoseconds > 0 ? (double)elapsedTicks * 1000000.0 / (double)elapsedNanoseconds : 1.0;
+    int threadCount = instrumentThreadCount < INSTRUMENT_MAX_THREADS ? instrumentThreadCount : INSTRUMENT_MAX_THREADS;
+
+    InstrumentCounters total;
+    memset(&total, 0, sizeof(InstrumentCounters));
+
+    printf("\nInstrumentation (ms), wall: %.1f ms\n", (double)elapsedNanoseconds / 1000000.0);
+    printf("%-8s", "Thread");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        printf(" %12s", instrumentPhaseNames[phase]);
+    }
+    printf(" %10s\n", "Combos");
+
+    for (int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        InstrumentCounters* counters = &instrumentCounters[threadIndex];
+        printf("%-8d", threadIndex);
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            printf(" %12.1f", (double)counters->ticks[phase] / ticksPerMillisecond);
+            total.ticks[phase] += counters->ticks[phase];
+            total.calls[phase] += counters->calls[phase];
+            for (int event = 0; event < PERF_EVENT_COUNT; event++)
+            {
+                total.perf[phase][event] += counters->perf[phase][event];
+            }
+        }
+        total.rows += counters->rows;
+        printf(" %10llu\n", (unsigned long long)counters->combos);
+        total.combos += counters->combos;
+    }
+
+    printf("%-8s", "Total");
+    uint64_t totalTicks = 0;
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        printf(" %12.1f", (double)total.ticks[phase] / ticksPerMillisecond);
+        totalTicks += total.ticks[phase];
+    }
+    printf(" %10llu\n", (unsigned long long)total.combos);
+
+    printf("%-8s", "Share%");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        printf(" %12.1f", totalTicks > 0 ? 100.0 * (double)total.ticks[phase] / (double)totalTicks : 0.0);
+    }
+    printf("\n");
+
+    printf("%-8s", "Calls");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        printf(" %12llu", (unsigned long long)total.calls[phase]);
+    }
+    printf("\n");
+
+    instrumentPerfReport(&total);
+}
+
+#define INSTRUMENT_START() instrumentStart()
+#define INSTRUMENT_THREAD() instrumentThread()
+#define INSTRUMENT_THREAD_END() instrumentThreadEnd()
+#define INSTRUMENT_BEGIN(phase) InstrumentMark instrumentMark##phase = instrumentBegin(phase)
+#define INSTRUMENT_END(phase) instrumentEnd(phase, &instrumentMark##phase)
+#define INSTRUMENT_ROWS(count) instrumentCurrent->rows += (count)
+#define INSTRUMENT_COMBO() instrumentCurrent->combos++
+#define INSTRUMENT_REPORT() instrumentReport()
+
+#else
+
+#define INSTRUMENT_START()
+#define INSTRUMENT_THREAD()
+#define INSTRUMENT_THREAD_END()
+#define INSTRUMENT_BEGIN(phase)
+#define INSTRUMENT_END(phase)
+#define INSTRUMENT_ROWS(count)
+#define INSTRUMENT_COMBO()
+#define INSTRUMENT_REPORT()
+
+#endif
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef KNN_INTERLEAVE_H
+#define KNN_INTERLEAVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_arena.h"
+#include "knn_dispatch.h"
+
+// an interleaved copy of the train rows for dense scans: blocks of 8 or 16 rows stored input by input, input i of the
+// block's row l at i * lanes + l, so the distance kernel reads one test input against a whole vector of train rows and
+// keeps a sum per lane instead of reducing a vector per row, the copy is made once at load time
+//
+// a scan that visits every row in index order, dense with no band, prefilter, batch or active cascade, measures a block
+// when it reaches its first row and reads the other lanes back, the last block is padded with zero rows nobody reads
+//
+// the distances are bit identical to the row kernel, exponents of 1 and 2 need no pow and run fully vertical, about ten
+// times the row kernel at 784 inputs, other exponents would pay a pow per term and lane, so rows whose inputs take at
+// most INTERLEAVE_VALUES_MAX distinct values, like the digits' 256 grey levels, also keep each input as an index into
+// those values, and each combo tabulates the term of every test and train value pair once, pow of the same float
+// difference the kernel would take, then a block gathers its terms from the table, about twelve times the row kernel
+// at exponent 2.5 with avx512 and seven with avx2, a test value no train row has and rows with more values still pay
+// the pow
+//
+// off by default, KNN_INTERLEAVE=1 turns it on with the kernels' lane count, 8 or 16 sets it and 0 turns it off
+#define INTERLEAVE_VALUES_MAX 256
+
+typedef struct {
+    int rowCount;
+    int inputSize;
+    int lanes;
+    int blockCount;
+    float* inputs;
+    // the distinct input values ascending, 0 when there are more than INTERLEAVE_VALUES_MAX or a nan
+    int valueCount;
+    float values[INTERLEAVE_VALUES_MAX];
+    // the inputs as indices into the values, laid out as the inputs
+    unsigned char* codes;
+} InterleavedRows;
+
+// the per thread state of a sweep: the distances of the block measured last, and with the rows' values, the current
+// test row's indices and the term table of the combo's threshold and exponent
+typedef struct {
+    const InterleavedRows* rows;
+    float* distances;
+    int* testCodes;
+    double* terms;
+    float termsThreshold;
+    float termsExponent;
+    BlockTerms blockTerms;
+} InterleaveScratch;
+
+// the lanes per block, 0 when off
+static int interleaveSelect(const KnnKernels* selected)
+{
+    const char* override = getenv("KNN_INTERLEAVE");
+    if (override == NULL || override[0] == '\0')
+    {
+        return 0;
+    }
+    int lanes = atoi(override);
+    return lanes == 8 || lanes == 16 ? lanes : lanes == 1 ? selected->interleaveLanes : 0;
+}
+
+// the index of a value among the rows' values, -1 when it is not one, a zero of either sign matches both since their
+// differences to any value are equal
+static inline int interleaveValueCode(const InterleavedRows* rows, float value)
+{
+    int low = 0;
+    int high = rows->valueCount;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (rows->values[middle] < value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < rows->valueCount && rows->values[low] == value ? low : -1;
+}
+
+// lanes 0 leaves the rows empty and allocates nothing
+static void interleavedRowsCreate(InterleavedRows* rows, int rowCount, int inputSize, const float* inputs, int lanes)
+{
+    memset(rows, 0, sizeof(InterleavedRows));
+    if (lanes <= 0)
+    {
+        return;
+    }
+    rows->rowCount = rowCount;
+    rows->inputSize = inputSize;
+    rows->lanes = lanes;
+    rows->blockCount = (rowCount + lanes - 1) / lanes;
+    rows->inputs = (float*)arenaCalloc((size_t)(rows->blockCount > 0 ? rows->blockCount : 1) * lanes * inputSize, sizeof(float));
+    if (rows->inputs == NULL)
+    {
+        printf("Failed to allocate memory for interleaved rows.\n");
+        exit(1);
+    }
+    for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+    {
+        float* block = &rows->inputs[(size_t)(rowIndex / lanes) * lanes * inputSize];
+        const float* row = &inputs[(size_t)rowIndex * inputSize];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            block[(size_t)inputIndex * lanes + rowIndex % lanes] = row[inputIndex];
+        }
+    }
+
+    // the distinct values, the padding rows' zero among them
+    size_t inputCount = (size_t)rows->blockCount * lanes * inputSize;
+    for (size_t inputIndex = 0; inputIndex < inputCount; inputIndex++)
+    {
+        float value = rows->inputs[inputIndex];
+        int position = interleaveValueCode(rows, value);
+        if (position >= 0)
+        {
+            continue;
+        }
+        if (isnan(value) || rows->valueCount == INTERLEAVE_VALUES_MAX)
+        {
+            rows->valueCount = 0;
+            return;
+        }
+        position = rows->valueCount++;
+        while (position > 0 && rows->values[position - 1] > value)
+        {
+            rows->values[position] = rows->values[position - 1];
+            position--;
+        }
+        rows->values[position] = value;
+    }
+    rows->codes = (unsigned char*)arenaCalloc(inputCount > 0 ? inputCount : 1, sizeof(unsigned char));
+    if (rows->codes == NULL)
+    {
+        printf("Failed to allocate memory for interleaved codes.\n");
+        exit(1);
+    }
+    for (size_t inputIndex = 0; inputIndex < inputCount; inputIndex++)
+    {
+        rows->codes[inputIndex] = (unsigned char)interleaveValueCode(rows, rows->inputs[inputIndex]);
+    }
+}
+
+static void interleavedRowsFree(InterleavedRows* rows)
+{
+    arenaFree(rows->inputs);
+    arenaFree(rows->codes);
+    memset(rows, 0, sizeof(InterleavedRows));
+}
+
+// rows without a layout leave the scratch off
+static void interleaveScratchCreate(InterleaveScratch* scratch, const InterleavedRows* rows)
+{
+    memset(scratch, 0, sizeof(InterleaveScratch));
+    if (rows == NULL || rows->inputs == NULL)
+    {
+        return;
+    }
+    scratch->rows = rows;
+    scratch->distances = (float*)arenaCalloc(rows->lanes, sizeof(float));
+    if (scratch->distances == NULL)
+    {
+        printf("Failed to allocate memory for interleave scratch.\n");
+        exit(1);
+    }
+    if (rows->valueCount > 0)
+    {
+        scratch->testCodes = (int*)arenaCalloc(rows->inputSize > 0 ? rows->inputSize : 1, sizeof(int));
+        scratch->terms = (double*)arenaCalloc((size_t)rows->valueCount * rows->valueCount, sizeof(double));
+        if (scratch->testCodes == NULL || scratch->terms == NULL)
+        {
+            printf("Failed to allocate memory for interleave terms.\n");
+            exit(1);
+        }
+        scratch->termsThreshold = NAN;
+        scratch->termsExponent = NAN;
+        scratch->blockTerms.valueCount = rows->valueCount;
+        scratch->blockTerms.testCodes = scratch->testCodes;
+        scratch->blockTerms.terms = scratch->terms;
+    }
+}
+
+static void interleaveScratchFree(InterleaveScratch* scratch)
+{
+    arenaFree(scratch->distances);
+    arenaFree(scratch->testCodes);
+    arenaFree(scratch->terms);
+    memset(scratch, 0, sizeof(InterleaveScratch));
+}
+
+// the term table for the combo, kept across test rows of the same threshold and exponent, and the test row's indices,
+// call before the test row's first block
+static void interleaveLoadTest(InterleaveScratch* scratch, const float* testInput, float distanceThreshold, float distanceExponent)
+{
+    const InterleavedRows* rows = scratch->rows;
+    if (rows->valueCount == 0)
+    {
+        return;
+    }
+    if (scratch->termsThreshold != distanceThreshold || scratch->termsExponent != distanceExponent)
+    {
+        for (int testCode = 0; testCode < rows->valueCount; testCode++)
+        {
+            for (int trainCode = 0; trainCode < rows->valueCount; trainCode++)
+            {
+                float difference = fabsf(rows->values[testCode] - rows->values[trainCode]);
+                scratch->terms[(size_t)testCode * rows->valueCount + trainCode] = difference <= distanceThreshold ? 0.0 : pow(difference, distanceExponent);
+            }
+        }
+        scratch->termsThreshold = distanceThreshold;
+        scratch->termsExponent = distanceExponent;
+    }
+    for (int inputIndex = 0; inputIndex < rows->inputSize; inputIndex++)
+    {
+        scratch->testCodes[inputIndex] = interleaveValueCode(rows, testInput[inputIndex]);
+    }
+}
+
+// the distance to a train row of a scan in index order, measuring its block at the block's first row
+static inline float interleaveDistance(InterleaveScratch* scratch, const float* testInput, int trainIndex, float distanceThreshold, float distanceExponent)
+{
+    const InterleavedRows* rows = scratch->rows;
+    int lane = trainIndex % rows->lanes;
+    if (lane == 0)
+    {
+        const BlockTerms* blockTerms = NULL;
+        if (rows->valueCount > 0)
+        {
+            scratch->blockTerms.blockCodes = &rows->codes[(size_t)trainIndex * rows->inputSize];
+            blockTerms = &scratch->blockTerms;
+        }
+        kernels->distanceBlock(rows->inputSize, rows->lanes, testInput, &rows->inputs[(size_t)trainIndex * rows->inputSize], blockTerms, distanceThreshold, distanceExponent, scratch->distances);
+    }
+    return scratch->distances[lane];
+}
+
+#endif
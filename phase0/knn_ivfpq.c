@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_synthetic.h"
+#include "knn_lib.h"
+#include "knn_quantized.h"
+
+// picks ivfpq operating points: trains or opens an index over the KNN_SYNTHETIC train set, then sweeps probes and re-ranking
+// and reports recall@k against the exact scan, how often the voted label agrees, the memory scanned and the speedup
+int argmax(int size, float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+// an index in the file is reused when it was trained on this many rows of this shape with these settings
+int indexMatches(KnnIvfpq* index, int inputSize, int outputSize, int trainCount, const KnnIvfpqTrainParameters* trainParameters)
+{
+    KnnIvfpqTrainParameters fileParameters;
+    knnIvfpqGetTrainParameters(index, &fileParameters);
+    return knnIvfpqInputSize(index) == inputSize && knnIvfpqOutputSize(index) == outputSize && knnIvfpqTrainCount(index) == trainCount
+        && fileParameters.subspaceCount == trainParameters->subspaceCount && (trainParameters->listCount == 0 || fileParameters.listCount == trainParameters->listCount)
+        && fileParameters.distanceThreshold == trainParameters->distanceThreshold && fileParameters.distanceExponent == trainParameters->distanceExponent
+        && fileParameters.storeInputs;
+}
+
+// usage: knn_ivfpq [subspaces=16] [lists=0] [threads=1] [k=10] [distanceThreshold=0] [distanceExponent=2] [indexPath=knn_ivfpq.index]
+// lists 0 picks sqrt(train), the index is trained and written to indexPath unless it already holds one for these settings
+// mnist shaped with 60000 train and 100 test rows when KNN_SYNTHETIC is not set
+int main(int argc, char** argv)
+{
+    KnnIvfpqTrainParameters trainParameters;
+    knnIvfpqTrainDefaults(&trainParameters);
+    trainParameters.subspaceCount = argc > 1 ? atoi(argv[1]) : 16;
+    trainParameters.listCount = argc > 2 ? atoi(argv[2]) : 0;
+    int threadCount = argc > 3 ? atoi(argv[3]) : 1;
+    int k = argc > 4 ? atoi(argv[4]) : 10;
+    trainParameters.distanceThreshold = argc > 5 ? (float)atof(argv[5]) : 0.0f;
+    trainParameters.distanceExponent = argc > 6 ? (float)atof(argv[6]) : 2.0f;
+    const char* indexPath = argc > 7 ? argv[7] : "knn_ivfpq.index";
+    if (threadCount < 1 || k < 1 || trainParameters.listCount < 0)
+    {
+        printf("Invalid ivfpq arguments.\n");
+        exit(1);
+    }
+
+    int trainCount = 60000;
+    int testCount = 100;
+    int inputSize = 784;
+    int outputSize = 10;
+    SyntheticConfig syntheticConfig;
+    if (!syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize))
+    {
+        syntheticDefaults(&syntheticConfig, 1);
+    }
+    float* trainInputs = NULL;
+    float* trainOutputs = NULL;
+    float* testInputs = NULL;
+    float* testOutputs = NULL;
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, testCount, inputSize, outputSize, &testInputs, &testOutputs);
+
+    float* predictionOutputs = (float*)calloc((size_t)testCount * outputSize, sizeof(float));
+    int* exactLabels = (int*)calloc(testCount, sizeof(int));
+    int* labels = (int*)calloc(testCount, sizeof(int));
+    KnnNeighbour* exactNeighbours = (KnnNeighbour*)calloc((size_t)testCount * k, sizeof(KnnNeighbour));
+    KnnNeighbour* neighbours = (KnnNeighbour*)calloc((size_t)testCount * k, sizeof(KnnNeighbour));
+    if (predictionOutputs == NULL || exactLabels == NULL || labels == NULL || exactNeighbours == NULL || neighbours == NULL)
+    {
+        printf("Failed to allocate memory for ivfpq results.\n");
+        exit(1);
+    }
+
+    // the exact neighbours every operating point is measured against
+    KnnParameters exactParameters;
+    knnParametersDefaults(&exactParameters);
+    exactParameters.k = k;
+    exactParameters.distanceThreshold = trainParameters.distanceThreshold;
+    exactParameters.distanceExponent = trainParameters.distanceExponent;
+    exactParameters.index = KNN_INDEX_NONE;
+    KnnModel* exactModel = knnModelCreate(inputSize, outputSize, trainCount, trainInputs, trainOutputs, &exactParameters, 1, 32);
+    if (exactModel == NULL)
+    {
+        printf("Failed to create knn model.\n");
+        exit(1);
+    }
+    uint64_t startNanoseconds = platformNanoseconds();
+    if (knnPredictBatch(exactModel, 0, testCount, testInputs, predictionOutputs, exactLabels, exactNeighbours) != 0)
+    {
+        printf("Failed to run the exact scan.\n");
+        exit(1);
+    }
+    double exactMilliseconds = (double)(platformNanoseconds() - startNanoseconds) / 1000000.0 / testCount;
+    knnModelFree(exactModel);
+    int correctCount = 0;
+    for (int testIndex = 0; testIndex < testCount; testIndex++)
+    {
+        correctCount += exactLabels[testIndex] == argmax(outputSize, &testOutputs[(size_t)testIndex * outputSize]);
+    }
+    printf("Train: %d, test: %d, inputs: %d, k: %d, threshold: %f, exponent: %f\n", trainCount, testCount, inputSize, k, trainParameters.distanceThreshold, trainParameters.distanceExponent);
+    printf("Exact scan: %.3f ms per query, accuracy: %.2f%%\n", exactMilliseconds, 100.0 * correctCount / testCount);
+
+    // re-ranking up to 20 * k rows, so the shortlist is sized for it at open
+    int rerankCounts[] = { 0, 2, 5, 20 };
+    int rerankCountCount = (int)(sizeof(rerankCounts) / sizeof(rerankCounts[0]));
+    KnnIvfpqParameters parameters;
+    knnIvfpqParametersDefaults(&parameters);
+    parameters.k = k;
+    parameters.rerankCount = rerankCounts[rerankCountCount - 1] * k;
+
+    FILE* indexFile = NULL;
+    KnnIvfpq* index = NULL;
+    if (fopen_s(&indexFile, indexPath, "rb") == 0)
+    {
+        fclose(indexFile);
+        index = knnIvfpqOpen(indexPath, &parameters, 1);
+        if (index != NULL && !indexMatches(index, inputSize, outputSize, trainCount, &trainParameters))
+        {
+            printf("%s was trained for other data or settings, training again.\n", indexPath);
+            knnIvfpqClose(index);
+            index = NULL;
+        }
+    }
+    if (index == NULL)
+    {
+        startNanoseconds = platformNanoseconds();
+        if (knnIvfpqTrain(indexPath, inputSize, outputSize, trainCount, trainInputs, trainOutputs, &trainParameters, threadCount) != 0)
+        {
+            printf("Failed to train the ivfpq index.\n");
+            exit(1);
+        }
+        printf("Trained %s with %d threads in %.3f s\n", indexPath, threadCount, (double)(platformNanoseconds() - startNanoseconds) / 1000000000.0);
+        index = knnIvfpqOpen(indexPath, &parameters, 1);
+        if (index == NULL)
+        {
+            exit(1);
+        }
+    }
+    else
+    {
+        printf("Opened %s\n", indexPath);
+    }
+    KnnIvfpqTrainParameters fileParameters;
+    knnIvfpqGetTrainParameters(index, &fileParameters);
+    size_t scannedBytes = knnIvfpqScannedBytes(index);
+    size_t floatBytes = (size_t)trainCount * inputSize * sizeof(float);
+    printf("Lists: %d, subspaces: %d, scanned memory: %.1f MB, %.1f bytes per row, float rows: %.1f MB, %.1fx smaller\n",
+        fileParameters.listCount,
+        fileParameters.subspaceCount,
+        scannedBytes / 1000000.0,
+        (double)scannedBytes / trainCount,
+        floatBytes / 1000000.0,
+        (double)floatBytes / scannedBytes);
+
+    printf("\n%8s %8s %10s %10s %12s %12s %12s %10s\n", "Probes", "Rerank", "Recall", "Label", "Codes", "Distances", "ms/query", "Speedup");
+    int probeCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    int probeCountCount = (int)(sizeof(probeCounts) / sizeof(probeCounts[0]));
+    for (int probeIndex = 0; probeIndex < probeCountCount && probeCounts[probeIndex] <= fileParameters.listCount; probeIndex++)
+    {
+        for (int rerankIndex = 0; rerankIndex < rerankCountCount; rerankIndex++)
+        {
+            parameters.probeCount = probeCounts[probeIndex];
+            parameters.rerankCount = rerankCounts[rerankIndex] * k;
+            knnIvfpqSetParameters(index, &parameters);
+            long long codeCount = knnIvfpqCodeCount(index);
+            long long distanceCount = knnIvfpqDistanceCount(index);
+            startNanoseconds = platformNanoseconds();
+            if (knnIvfpqPredictBatch(index, 0, testCount, testInputs, predictionOutputs, labels, neighbours) != 0)
+            {
+                printf("Failed to run the ivfpq search.\n");
+                exit(1);
+            }
+            double milliseconds = (double)(platformNanoseconds() - startNanoseconds) / 1000000.0 / testCount;
+            codeCount = knnIvfpqCodeCount(index) - codeCount;
+            distanceCount = knnIvfpqDistanceCount(index) - distanceCount;
+
+            // recall@k is the share of the exact k nearest the index found, in any order
+            long long foundCount = 0;
+            long long exactCount = 0;
+            int agreeCount = 0;
+            for (int testIndex = 0; testIndex < testCount; testIndex++)
+            {
+                KnnNeighbour* exact = &exactNeighbours[(size_t)testIndex * k];
+                KnnNeighbour* found = &neighbours[(size_t)testIndex * k];
+                for (int exactIndex = 0; exactIndex < k && exact[exactIndex].index >= 0; exactIndex++)
+                {
+                    exactCount++;
+                    for (int foundIndex = 0; foundIndex < k; foundIndex++)
+                    {
+                        if (found[foundIndex].index == exact[exactIndex].index)
+                        {
+                            foundCount++;
+                            break;
+                        }
+                    }
+                }
+                agreeCount += labels[testIndex] == exactLabels[testIndex];
+            }
+            printf("%8d %8d %9.2f%% %9.2f%% %12.0f %12.0f %12.3f %9.1fx\n", parameters.probeCount, parameters.rerankCount, 100.0 * foundCount / exactCount, 100.0 * agreeCount / testCount, (double)codeCount / testCount, (double)distanceCount / testCount, milliseconds, exactMilliseconds / milliseconds);
+        }
+    }
+
+    knnIvfpqClose(index);
+    free(trainInputs);
+    free(trainOutputs);
+    free(testInputs);
+    free(testOutputs);
+    free(predictionOutputs);
+    free(exactLabels);
+    free(labels);
+    free(exactNeighbours);
+    free(neighbours);
+    return 0;
+}
@@ -2,16 +2,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <windows.h>
-#include <share.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_dispatch.h"
+#include "knn_instrument.h"
+#include "knn_synthetic.h"
+#include "knn_sparse.h"
+#include "knn_cascade.h"
+#include "knn_band.h"
+#include "knn_pca.h"
+#include "knn_sketch.h"
+#include "knn_batch.h"
+#include "knn_warm.h"
+#include "knn_interleave.h"
+#include "knn_scan.h"
+#include "knn_curve.h"
+#include "knn_numa.h"
+#include "knn_train.h"
 
 #define THREAD_COUNT 8
 #define EPSILON 0.0000001f
-
-typedef struct {
-    int index;
-    float distance;
-} IndexDistance;
+// whether this program ranks by the rooted distance
+#define DISTANCE_ROOTED 0
+#define USE_RADIX_SORT 0
 
 typedef struct {
     int kCount;
@@ -24,8 +37,10 @@ typedef struct {
 typedef struct {
     FILE* resultsFile;
     KnnParameters* knnParameters;
-    int knnParametersIndex;
     int knnParametersCount;
+    NumaQueues numaQueues;
+    // workers started so far, each takes the next index
+    int threadCount;
     HANDLE parametersLock;
     HANDLE resultsLock;
     int kCount;
@@ -36,6 +51,26 @@ typedef struct {
     float* trainInputs;
     float* trainOutputs;
     int* trainArgmax;
+    SparseRows* sparseTrain;
+    CascadeRows* cascadeTrain;
+    CascadeMode cascadeMode;
+    CascadeCounts cascadeCounts;
+    int bandEnabled;
+    BandCounts bandCounts;
+    PcaFilter* pcaFilter;
+    PcaCounts pcaCounts;
+    SketchRows* sketchTrain;
+    SketchRows* sketchTest;
+    int sketchShortlistCount;
+    double sketchRecall;
+    SketchCounts sketchCounts;
+    BatchGrid batchGrid;
+    int warmRunLength;
+    InterleavedRows* interleavedTrain;
+    CurvePrefixes curvePrefixes;
+    NumaTopology* numaTopology;
+    NumaReplica* numaReplicas;
+    NumaCounts numaCounts[NUMA_NODE_MAX];
     float* testInputs;
     float* testOutputs;
     int* testArgmax;
@@ -78,7 +113,7 @@ int loadMNIST(const char* filename, int count, int inputSize, int outputSize, fl
     }
 
     // allocate memory for inputs
-    *inputs = (float*)calloc(count * inputSize, sizeof(float));
+    *inputs = (float*)arenaCalloc(count * inputSize, sizeof(float));
     if (*inputs == NULL)
     {
         printf("Could not allocate memory for inputs\n");
@@ -87,7 +122,7 @@ int loadMNIST(const char* filename, int count, int inputSize, int outputSize, fl
     }
 
     // allocate memory for outputs
-    *outputs = (float*)calloc(count * outputSize, sizeof(float));
+    *outputs = (float*)arenaCalloc(count * outputSize, sizeof(float));
     if (*outputs == NULL)
     {
         printf("Could not allocate memory for outputs\n");
@@ -164,64 +199,25 @@ int argmax(int size, float* values)
     return maxIndex;
 }
 
-int compareIndexDistance(const void* a, const void* b)
-{
-    IndexDistance* id1 = (IndexDistance*)a;
-    IndexDistance* id2 = (IndexDistance*)b;
-    if (id1->distance < id2->distance) 
-    {
-        return -1;
-    }
-    if (id1->distance > id2->distance)
-    {
-        return 1;
-    }
-    return 0;
-}
-
-int knn(
-    int inputSize, 
-    int outputSize, 
-    int trainCount, 
-    float* trainInputs, 
-    float* trainOutputs, 
-    float* testInput, 
+// the prediction per k from the nearest neighbourCount rows, ranked low to high distance
+void knnVote(
+    int outputSize,
+    int neighbourCount,
+    float* trainOutputs,
     float* maxDistances,
     float* weightSums,
-    float* predictionOutputs, 
-    IndexDistance* indexDistances, 
-    int kCount, 
-    int kMin, 
-    int kMax, 
-    float distanceThreshold, 
-    float distanceExponent
+    float* predictionOutputs,
+    IndexDistance* indexDistances,
+    int kCount,
+    int kMin,
+    int kMax
 )
 {
-    // calculate distances between test input and train inputs
-    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
-    {
-        float distance = 0.0f;
-        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
-        {
-            float difference = fabs(testInput[inputIndex] - trainInputs[trainIndex * inputSize + inputIndex]);
-            if (difference <= distanceThreshold)
-            {
-                continue;
-            }
-            distance += pow(difference, distanceExponent);
-        }
-        indexDistances[trainIndex].index = trainIndex;
-        indexDistances[trainIndex].distance = distance;
-    }
-
-    // sort low to high distance
-    qsort(indexDistances, trainCount, sizeof(IndexDistance), compareIndexDistance);
-
     // zero max distances
     memset(maxDistances, 0, kCount * sizeof(float));
 
     // find max distances for each k
-    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < neighbourCount; neighbourIndex++)
     {
         float distance = indexDistances[neighbourIndex].distance;
         for (int kIndex = 0; kIndex < kCount; kIndex++)
@@ -244,7 +240,7 @@ int knn(
     memset(predictionOutputs, 0, kCount * outputSize * sizeof(float));
 
     // iterate neighbours up to kmax
-    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < neighbourCount; neighbourIndex++)
     {
         int trainIndex = indexDistances[neighbourIndex].index;
         float distance = indexDistances[neighbourIndex].distance;
@@ -256,11 +252,7 @@ int knn(
                 float maxDistance = maxDistances[kIndex];
                 float weight = 1.0f - (distance / (maxDistance + EPSILON));
                 weightSums[kIndex] += weight;
-                for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
-                {
-                    float outputValue = trainOutputs[trainIndex * outputSize + outputIndex];
-                    predictionOutputs[kIndex * outputSize + outputIndex] += outputValue * weight;
-                }
+                kernels->accumulate(outputSize, &trainOutputs[trainIndex * outputSize], weight, &predictionOutputs[kIndex * outputSize]);
             }
         }
     }
@@ -275,6 +267,77 @@ int knn(
             predictionOutputs[kIndex * outputSize + outputIndex] /= weightSum;
         }
     }
+}
+
+int knn(
+    int inputSize, 
+    int outputSize, 
+    int trainCount, 
+    float* trainInputs, 
+    float* trainOutputs, 
+    float* testInput, 
+    float* maxDistances,
+    float* weightSums,
+    float* predictionOutputs, 
+    IndexDistance* indexDistances, 
+    RadixBuffers* radixBuffers,
+    SparseScratch* sparse,
+    CascadeScratch* cascade,
+    BandScratch* band,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    BatchScratch* batch,
+    WarmScratch* warm,
+    InterleaveScratch* interleave,
+    CurveScratch* curve,
+    int kCount, 
+    int kMin, 
+    int kMax, 
+    float distanceThreshold, 
+    float distanceExponent
+)
+{
+    // calculate distances between test input and train inputs
+    INSTRUMENT_BEGIN(PHASE_DISTANCE);
+    scanDistances(kernels, inputSize, trainCount, trainInputs, testInput, indexDistances, radixBuffers, sparse, cascade, band, pca, sketch, batch, warm, interleave, distanceThreshold, distanceExponent, DISTANCE_ROOTED, USE_RADIX_SORT);
+    INSTRUMENT_END(PHASE_DISTANCE);
+    INSTRUMENT_ROWS(trainCount);
+
+    INSTRUMENT_BEGIN(PHASE_SORT);
+
+    // a learning curve ranks every train prefix in one pass over the distances in index order, ahead of the sort
+    if (curve->prefixes != NULL)
+    {
+        curveLoadTest(curve);
+        int rowCount = curveRowCount(curve);
+        for (int trainIndex = 0; trainIndex < rowCount; trainIndex++)
+        {
+            curveOffer(curve, trainIndex, scanDistance(indexDistances, radixBuffers, USE_RADIX_SORT, trainIndex));
+        }
+    }
+
+    // sort low to high distance, the neighbours seed the same test row in the next combo of the run
+    scanSelect(kernels, trainCount, indexDistances, radixBuffers, warm, kMax, USE_RADIX_SORT);
+    INSTRUMENT_END(PHASE_SORT);
+
+    INSTRUMENT_BEGIN(PHASE_VOTE);
+    knnVote(outputSize, trainCount, trainOutputs, maxDistances, weightSums, predictionOutputs, indexDistances, kCount, kMin, kMax);
+
+    // each train prefix of a learning curve votes on its own nearest rows, the head of the ranking is free to hold them
+    if (curve->prefixes != NULL)
+    {
+        for (int prefix = 0; prefix < curve->prefixes->prefixCount; prefix++)
+        {
+            for (int neighbourIndex = 0; neighbourIndex < curve->neighbourCounts[prefix]; neighbourIndex++)
+            {
+                indexDistances[neighbourIndex].index = curve->neighbourIndices[(size_t)prefix * curve->capacity + neighbourIndex];
+                indexDistances[neighbourIndex].distance = curve->neighbourDistances[(size_t)prefix * curve->capacity + neighbourIndex];
+            }
+            knnVote(outputSize, curve->neighbourCounts[prefix], trainOutputs, maxDistances, weightSums, curvePredictions(curve, prefix), indexDistances, kCount, kMin, kMax);
+        }
+    }
+
+    INSTRUMENT_END(PHASE_VOTE);
 
     // done
     return 0;
@@ -293,6 +356,16 @@ void knnTest(
     float* weightSums,
     float* predictionOutputs,
     IndexDistance* indexDistances, 
+    RadixBuffers* radixBuffers,
+    SparseScratch* sparse,
+    CascadeScratch* cascade,
+    BandScratch* band,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    BatchScratch* batch,
+    WarmScratch* warm,
+    InterleaveScratch* interleave,
+    CurveScratch* curve,
     int kCount,
     int kMin,
     int kMax, 
@@ -303,21 +376,74 @@ void knnTest(
 {
     // zero correct counts
     memset(correctCounts, 0, kCount * sizeof(int));
+    if (curve->prefixes != NULL)
+    {
+        memset(curveCorrectCounts(curve, curve->combo), 0, (size_t)curve->prefixes->prefixCount * kCount * sizeof(int));
+        curvePrepare(curve, kMax);
+    }
+
+    // train powers for this exponent, shared by every test row
+    if (sparse->rows != NULL)
+    {
+        sparsePrepareExponent(sparse, distanceExponent);
+    }
+    if (band->enabled)
+    {
+        bandPrepare(band, kMax, distanceThreshold, distanceExponent, DISTANCE_ROOTED);
+    }
+    if (cascade->rows != NULL && !band->active)
+    {
+        cascadePrepare(cascade, kMax, distanceThreshold, distanceExponent);
+    }
+    if (pca->filter != NULL)
+    {
+        pcaPrepare(pca, kMax);
+    }
+    if (sketch->trainRows != NULL)
+    {
+        sketchPrepare(sketch, kMax, inputSize, trainInputs, testInputs, distanceThreshold, distanceExponent, kernels->distance);
+    }
+    if (warm->marks != NULL)
+    {
+        warmPrepare(warm, kMax);
+    }
 
     // run through each test
     for (int testIndex = 0; testIndex < testCount; testIndex++)
     {
+        if (pca->filter != NULL)
+        {
+            pcaLoadTest(pca, testIndex);
+        }
+        if (sketch->trainRows != NULL)
+        {
+            sketchLoadTest(sketch, testIndex);
+        }
+        if (warm->marks != NULL)
+        {
+            warmLoadTest(warm, testIndex);
+        }
         knn(
             inputSize, 
             outputSize, 
             trainCount, 
             trainInputs, 
             trainOutputs, 
-            &testInputs[testIndex * inputSize],
+            &testInputs[(size_t)testIndex * inputSize],
             maxDistances,
             weightSums,
             predictionOutputs, 
             indexDistances,
+            radixBuffers,
+            sparse,
+            cascade,
+            band,
+            pca,
+            sketch,
+            batch,
+            warm,
+            interleave,
+            curve,
             kCount,
             kMin,
             kMax, 
@@ -336,10 +462,123 @@ void knnTest(
                 correctCounts[kIndex]++;
             }
         }
+        if (curve->prefixes != NULL)
+        {
+            curveCount(curve, testArgmax[testIndex]);
+        }
+    }
+}
+
+// the same counts as knnTest for a block of combos that share an exponent, each test row's distances are batched over them,
+// correctCounts holds kCount counts per combo
+void knnTestBatch(
+    int inputSize,
+    int outputSize,
+    int trainCount,
+    float* trainInputs,
+    float* trainOutputs,
+    int testCount,
+    float* testInputs,
+    int* testArgmax,
+    float* maxDistances,
+    float* weightSums,
+    float* predictionOutputs,
+    IndexDistance* indexDistances,
+    RadixBuffers* radixBuffers,
+    SparseScratch* sparse,
+    CascadeScratch* cascade,
+    BandScratch* band,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    BatchScratch* batch,
+    WarmScratch* warm,
+    InterleaveScratch* interleave,
+    CurveScratch* curve,
+    int kCount,
+    int kMin,
+    int kMax,
+    int comboCount,
+    float* distanceThresholds,
+    float distanceExponent,
+    int* correctCounts
+)
+{
+    // zero correct counts
+    memset(correctCounts, 0, (size_t)comboCount * kCount * sizeof(int));
+    if (curve->prefixes != NULL)
+    {
+        memset(curveCorrectCounts(curve, 0), 0, (size_t)comboCount * curve->prefixes->prefixCount * kCount * sizeof(int));
+        curvePrepare(curve, kMax);
+    }
+
+    // train powers for this exponent, shared by every test row and combo
+    if (sparse->rows != NULL)
+    {
+        sparsePrepareExponent(sparse, distanceExponent);
+    }
+
+    // run through each test, then rank and vote once per combo on its batched distances
+    for (int testIndex = 0; testIndex < testCount; testIndex++)
+    {
+        float* testInput = &testInputs[(size_t)testIndex * inputSize];
+        INSTRUMENT_BEGIN(PHASE_DISTANCE);
+        if (sparse->rows != NULL)
+        {
+            sparseLoadTest(sparse, testInput, distanceExponent);
+        }
+        batchLoadTest(batch, sparse, testInput, trainInputs, comboCount, distanceThresholds, distanceExponent);
+        INSTRUMENT_END(PHASE_DISTANCE);
+        for (int combo = 0; combo < comboCount; combo++)
+        {
+            batch->current = combo;
+            curve->combo = combo;
+            knn(
+                inputSize,
+                outputSize,
+                trainCount,
+                trainInputs,
+                trainOutputs,
+                testInput,
+                maxDistances,
+                weightSums,
+                predictionOutputs,
+                indexDistances,
+                radixBuffers,
+                sparse,
+                cascade,
+                band,
+                pca,
+                sketch,
+                batch,
+                warm,
+                interleave,
+                curve,
+                kCount,
+                kMin,
+                kMax,
+                distanceThresholds[combo],
+                distanceExponent
+            );
+
+            // iterate k to count corrects
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                int predictionArgmax = argmax(outputSize, &predictionOutputs[kIndex * outputSize]);
+                if (predictionArgmax == testArgmax[testIndex])
+                {
+                    correctCounts[combo * kCount + kIndex]++;
+                }
+            }
+            if (curve->prefixes != NULL)
+            {
+                curveCount(curve, testArgmax[testIndex]);
+            }
+        }
     }
+    batch->comboCount = 0;
 }
 
-FILE* createResultsFile(char* filename)
+FILE* createResultsFile(char* filename, int curve)
 {
     FILE* file = _fsopen(filename, "w", _SH_DENYNO);
     if (file == NULL)
@@ -347,7 +586,16 @@ FILE* createResultsFile(char* filename)
         printf("Could not create file %s\n", filename);
         exit(1);
     }
+    // a learning curve sweep leads each row with the train count it was counted on
+    if (curve)
+    {
+        fprintf(file, "TrainCount,");
+    }
+#if KNN_INSTRUMENT && INSTRUMENT_RESULTS_COLUMN
+    fprintf(file, "K,DistanceThreshold,DistanceExponent,CorrectCount,ComboNanoseconds\n");
+#else
     fprintf(file, "K,DistanceThreshold,DistanceExponent,CorrectCount\n");
+#endif
     return file;
 }
 
@@ -355,111 +603,282 @@ DWORD WINAPI threadEntry(LPVOID arg)
 {
     ThreadArgs* threadArgs = (ThreadArgs*)arg;
 
-    IndexDistance* indexDistances = (IndexDistance*)calloc(threadArgs->trainCount, sizeof(IndexDistance));
+    INSTRUMENT_THREAD();
+
+    // pin first, so the scratch below is first touched on the worker's node, and scan that node's copy of the inputs
+    WaitForSingleObject(threadArgs->parametersLock, INFINITE);
+    int threadIndex = threadArgs->threadCount++;
+    ReleaseMutex(threadArgs->parametersLock);
+    int node = threadArgs->numaTopology != NULL ? numaPin(threadArgs->numaTopology, threadIndex) : 0;
+    NumaReplica* replica = threadArgs->numaReplicas != NULL ? &threadArgs->numaReplicas[node] : NULL;
+    float* trainInputs = replica != NULL ? replica->localTrainInputs : threadArgs->trainInputs;
+    float* testInputs = replica != NULL ? replica->localTestInputs : threadArgs->testInputs;
+    SparseRows* sparseTrain = replica != NULL && replica->sparse ? &replica->localSparseTrain : threadArgs->sparseTrain;
+
+    IndexDistance* indexDistances = (IndexDistance*)arenaCalloc(threadArgs->trainCount, sizeof(IndexDistance));
     if (indexDistances == NULL) 
     {
         printf("Failed to allocate memory for index distances.\n");
         exit(1);
     }
 
-    float* maxDistances = (float*)calloc(threadArgs->kCount, sizeof(float));
+    RadixBuffers radixBuffers = { 0 };
+#if USE_RADIX_SORT
+    radixBuffersCreate(&radixBuffers, threadArgs->trainCount);
+#endif
+
+    SparseScratch sparse;
+    sparseScratchCreate(&sparse, sparseTrain);
+    CascadeScratch cascade;
+    cascadeScratchCreate(&cascade, threadArgs->cascadeTrain, threadArgs->cascadeMode);
+    BandScratch band;
+    bandScratchCreate(&band, threadArgs->trainCount, threadArgs->inputSize, trainInputs, threadArgs->bandEnabled);
+    PcaScratch pca;
+    pcaScratchCreate(&pca, threadArgs->pcaFilter);
+    SketchScratch sketch;
+    sketchScratchCreate(&sketch, threadArgs->sketchTrain, threadArgs->sketchTest, threadArgs->sketchShortlistCount, threadArgs->sketchRecall);
+    BatchScratch batch;
+    int batching = threadArgs->batchGrid.blockSize > 0;
+    batchScratchCreate(&batch, threadArgs->batchGrid.blockSize, threadArgs->trainCount, threadArgs->inputSize);
+    WarmScratch warm;
+    warmScratchCreate(&warm, threadArgs->warmRunLength, threadArgs->trainCount, threadArgs->testCount);
+    InterleaveScratch interleave;
+    interleaveScratchCreate(&interleave, threadArgs->interleavedTrain);
+    int comboCapacity = batching ? threadArgs->batchGrid.blockSize : warm.runLength;
+    CurveScratch curve;
+    curveScratchCreate(&curve, threadArgs->curvePrefixes.prefixCount > 0 ? &threadArgs->curvePrefixes : NULL, threadArgs->outputSize, threadArgs->kCount, comboCapacity);
+
+    float* maxDistances = (float*)arenaCalloc(threadArgs->kCount, sizeof(float));
     if (maxDistances == NULL) 
     {
         printf("Failed to allocate memory for max distances.\n");
         exit(1);
     }
 
-    float* weightSums = (float*)calloc(threadArgs->kCount, sizeof(float));
+    float* weightSums = (float*)arenaCalloc(threadArgs->kCount, sizeof(float));
     if (weightSums == NULL) 
     {
         printf("Failed to allocate memory for weight sums.\n");
         exit(1);
     }
 
-    float* predictionOutputs = (float*)calloc(threadArgs->outputSize * threadArgs->kCount, sizeof(float));
+    float* predictionOutputs = (float*)arenaCalloc(threadArgs->outputSize * threadArgs->kCount, sizeof(float));
     if (predictionOutputs == NULL) 
     {
         printf("Failed to allocate memory for prediction outputs.\n");
         exit(1);
     }
 
-    int* correctCounts = (int*)calloc(threadArgs->kCount, sizeof(int));
+    int* correctCounts = (int*)arenaCalloc((size_t)threadArgs->kCount * comboCapacity, sizeof(int));
     if (correctCounts == NULL) 
     {
         printf("Failed to allocate memory for correct counts.\n");
         exit(1);
     }
 
+    int* comboIndices = (int*)arenaCalloc(comboCapacity, sizeof(int));
+    float* distanceThresholds = (float*)arenaCalloc(comboCapacity, sizeof(float));
+    if (comboIndices == NULL || distanceThresholds == NULL)
+    {
+        printf("Failed to allocate memory for batch combos.\n");
+        exit(1);
+    }
+
+    uint64_t startNanoseconds = platformNanoseconds();
+    long long comboTotal = 0;
+
     // loop till complete
     for (;;)
     {
         // lock parameters
+        INSTRUMENT_BEGIN(PHASE_PARAMETERS_LOCK);
         WaitForSingleObject(threadArgs->parametersLock, INFINITE);
+        INSTRUMENT_END(PHASE_PARAMETERS_LOCK);
 
-        // get index
-        int knnParametersIndex = threadArgs->knnParametersIndex;
+        // get index, a batched sweep claims a block of combos that share an exponent, an unbatched one a run of
+        // adjacent combos for warm starts, from the share of the worker's node first
+        int claimCount;
+        int knnParametersIndex = numaClaim(&threadArgs->numaQueues, node, batching ? 1 : comboCapacity, &claimCount);
 
         // if we are done break
-        if (knnParametersIndex >= threadArgs->knnParametersCount)
+        if (knnParametersIndex < 0)
         {
             ReleaseMutex(threadArgs->parametersLock);
             break;
         }
 
         // get parameters
-        KnnParameters knnParameters = threadArgs->knnParameters[knnParametersIndex];
-
-        // increment index
-        threadArgs->knnParametersIndex++;
+        int comboCount = claimCount;
+        if (batching)
+        {
+            comboCount = batchBlockCombos(&threadArgs->batchGrid, knnParametersIndex, comboIndices);
+        }
+        else
+        {
+            for (int combo = 0; combo < comboCount; combo++)
+            {
+                comboIndices[combo] = knnParametersIndex + combo;
+            }
+        }
+        KnnParameters knnParameters = threadArgs->knnParameters[comboIndices[0]];
 
         // release parameters
         ReleaseMutex(threadArgs->parametersLock);
 
+#if KNN_INSTRUMENT && INSTRUMENT_RESULTS_COLUMN
+        uint64_t comboStartNanoseconds = platformNanoseconds();
+#endif
+
         // test knn
-        knnTest(
-            threadArgs->inputSize, 
-            threadArgs->outputSize, 
-            threadArgs->trainCount, 
-            threadArgs->trainInputs, 
-            threadArgs->trainOutputs, 
-            threadArgs->testCount, 
-            threadArgs->testInputs, 
-            threadArgs->testArgmax,
-            maxDistances,
-            weightSums,
-            predictionOutputs,
-            indexDistances,
-            threadArgs->kCount,
-            knnParameters.kMin, 
-            knnParameters.kMax,
-            knnParameters.distanceThreshold, 
-            knnParameters.distanceExponent,
-            correctCounts
-        );
+        if (batching)
+        {
+            for (int combo = 0; combo < comboCount; combo++)
+            {
+                distanceThresholds[combo] = threadArgs->knnParameters[comboIndices[combo]].distanceThreshold;
+            }
+            knnTestBatch(
+                threadArgs->inputSize,
+                threadArgs->outputSize,
+                threadArgs->trainCount,
+                trainInputs,
+                threadArgs->trainOutputs,
+                threadArgs->testCount,
+                testInputs,
+                threadArgs->testArgmax,
+                maxDistances,
+                weightSums,
+                predictionOutputs,
+                indexDistances,
+                &radixBuffers,
+                &sparse,
+                &cascade,
+                &band,
+                &pca,
+                &sketch,
+                &batch,
+                &warm,
+                &interleave,
+                &curve,
+                threadArgs->kCount,
+                knnParameters.kMin,
+                knnParameters.kMax,
+                comboCount,
+                distanceThresholds,
+                knnParameters.distanceExponent,
+                correctCounts
+            );
+        }
+        else
+        {
+            warmRunStart(&warm);
+            for (int combo = 0; combo < comboCount; combo++)
+            {
+                knnParameters = threadArgs->knnParameters[comboIndices[combo]];
+                curve.combo = combo;
+                knnTest(
+                    threadArgs->inputSize, 
+                    threadArgs->outputSize, 
+                    threadArgs->trainCount, 
+                    trainInputs, 
+                    threadArgs->trainOutputs, 
+                    threadArgs->testCount, 
+                    testInputs, 
+                    threadArgs->testArgmax,
+                    maxDistances,
+                    weightSums,
+                    predictionOutputs,
+                    indexDistances,
+                    &radixBuffers,
+                    &sparse,
+                    &cascade,
+                    &band,
+                    &pca,
+                    &sketch,
+                    &batch,
+                    &warm,
+                    &interleave,
+                    &curve,
+                    threadArgs->kCount,
+                    knnParameters.kMin,
+                    knnParameters.kMax,
+                    knnParameters.distanceThreshold, 
+                    knnParameters.distanceExponent,
+                    &correctCounts[combo * threadArgs->kCount]
+                );
+            }
+        }
+#if KNN_INSTRUMENT && INSTRUMENT_RESULTS_COLUMN
+        uint64_t comboNanoseconds = (platformNanoseconds() - comboStartNanoseconds) / comboCount;
+#endif
 
         // lock results
+        INSTRUMENT_BEGIN(PHASE_RESULTS_LOCK);
         WaitForSingleObject(threadArgs->resultsLock, INFINITE);
+        INSTRUMENT_END(PHASE_RESULTS_LOCK);
 
-        // iterate k
-        for (int kIndex = 0; kIndex < threadArgs->kCount; kIndex++)
+        // iterate combos and k
+        INSTRUMENT_BEGIN(PHASE_IO);
+        for (int combo = 0; combo < comboCount; combo++)
         {
-            int k = knnParameters.kMin + kIndex;
-            int correctCount = correctCounts[kIndex];
+            knnParameters = threadArgs->knnParameters[comboIndices[combo]];
 
-            // write results
-            fprintf(threadArgs->resultsFile, "%d,%f,%f,%d\n", k, knnParameters.distanceThreshold, knnParameters.distanceExponent, correctCount);
+            // a learning curve sweep writes each train prefix's counts ahead of the full set's
+            for (int prefix = 0; curve.prefixes != NULL && prefix < curve.prefixes->prefixCount; prefix++)
+            {
+                int* prefixCounts = &curveCorrectCounts(&curve, combo)[prefix * threadArgs->kCount];
+                for (int kIndex = 0; kIndex < threadArgs->kCount; kIndex++)
+                {
+                    int k = knnParameters.kMin + kIndex;
+#if KNN_INSTRUMENT && INSTRUMENT_RESULTS_COLUMN
+                    fprintf(threadArgs->resultsFile, "%d,%d,%f,%f,%d,%llu\n", curve.prefixes->trainCounts[prefix], k, knnParameters.distanceThreshold, knnParameters.distanceExponent, prefixCounts[kIndex], (unsigned long long)comboNanoseconds);
+#else
+                    fprintf(threadArgs->resultsFile, "%d,%d,%f,%f,%d\n", curve.prefixes->trainCounts[prefix], k, knnParameters.distanceThreshold, knnParameters.distanceExponent, prefixCounts[kIndex]);
+#endif
+                }
+            }
+            for (int kIndex = 0; kIndex < threadArgs->kCount; kIndex++)
+            {
+                int k = knnParameters.kMin + kIndex;
+                int correctCount = correctCounts[combo * threadArgs->kCount + kIndex];
 
-            // console log results
-            printf("K: %d, DistanceThreshold: %f, DistanceExponent: %f, CorrectCount: %d\n", k, knnParameters.distanceThreshold, knnParameters.distanceExponent, correctCount);
+                // write results
+                if (curve.prefixes != NULL)
+                {
+                    fprintf(threadArgs->resultsFile, "%d,", threadArgs->trainCount);
+                }
+#if KNN_INSTRUMENT && INSTRUMENT_RESULTS_COLUMN
+                fprintf(threadArgs->resultsFile, "%d,%f,%f,%d,%llu\n", k, knnParameters.distanceThreshold, knnParameters.distanceExponent, correctCount, (unsigned long long)comboNanoseconds);
+#else
+                fprintf(threadArgs->resultsFile, "%d,%f,%f,%d\n", k, knnParameters.distanceThreshold, knnParameters.distanceExponent, correctCount);
+#endif
+
+                // console log results
+                printf("K: %d, DistanceThreshold: %f, DistanceExponent: %f, CorrectCount: %d\n", k, knnParameters.distanceThreshold, knnParameters.distanceExponent, correctCount);
+            }
+            INSTRUMENT_COMBO();
         }
 
         // flush
         fflush(threadArgs->resultsFile);
+        INSTRUMENT_END(PHASE_IO);
 
         // release results
         ReleaseMutex(threadArgs->resultsLock);
+        comboTotal += comboCount;
     }
 
+    // prune and node counts for the reports in main
+    WaitForSingleObject(threadArgs->resultsLock, INFINITE);
+    threadArgs->numaCounts[node].threadCount++;
+    threadArgs->numaCounts[node].comboCount += comboTotal;
+    threadArgs->numaCounts[node].nanoseconds += platformNanoseconds() - startNanoseconds;
+    cascadeCountsAdd(&threadArgs->cascadeCounts, &cascade.counts);
+    bandCountsAdd(&threadArgs->bandCounts, &band.counts);
+    pcaCountsAdd(&threadArgs->pcaCounts, &pca.counts);
+    sketchCountsAdd(&threadArgs->sketchCounts, &sketch.counts);
+    ReleaseMutex(threadArgs->resultsLock);
+
+    INSTRUMENT_THREAD_END();
     return 0;
 }
 
@@ -478,14 +897,39 @@ int main()
     float* testOutputs = NULL;
     int* testArgmax = NULL;
 
-    result = loadMNIST("d:/data/mnist_train.csv", trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    SyntheticConfig syntheticConfig;
+    int synthetic = syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize);
+
+    // the dataset arrays and every thread's scratch come from cache line aligned, prefaulted, huge page backed mappings
+    arenaStart();
+
+    INSTRUMENT_START();
+    INSTRUMENT_THREAD();
+
+    // a train set knn_reduce wrote replaces the train rows, the test rows stay
+    INSTRUMENT_BEGIN(PHASE_LOAD);
+    const char* trainPath = trainCsvPath();
+    if (trainPath != NULL)
+    {
+        trainCount = trainCsvLoad(trainPath, inputSize, outputSize, &trainInputs, &trainOutputs);
+        printf("Train: %d rows from %s\n", trainCount, trainPath);
+        result = 0;
+    }
+    else if (synthetic)
+    {
+        result = loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    }
+    else
+    {
+        result = loadMNIST("d:/data/mnist_train.csv", trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    }
     if (result != 0) 
     {
         printf("Failed to load training data.\n");
         exit(1);
     }
 
-    trainArgmax = (int*)calloc(trainCount, sizeof(int));
+    trainArgmax = (int*)arenaCalloc(trainCount, sizeof(int));
     if (trainArgmax == NULL) 
     {
         printf("Failed to allocate memory for training argmax.\n");
@@ -497,14 +941,34 @@ int main()
         trainArgmax[trainIndex] = argmax(outputSize, &trainOutputs[trainIndex * outputSize]);
     }
 
-    result = loadMNIST("d:/data/mnist_test.csv", testCount, inputSize, outputSize, &testInputs, &testOutputs);
+    if (synthetic)
+    {
+        result = loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, testCount, inputSize, outputSize, &testInputs, &testOutputs);
+    }
+    else
+    {
+        result = loadMNIST("d:/data/mnist_test.csv", testCount, inputSize, outputSize, &testInputs, &testOutputs);
+    }
     if (result != 0) 
     {
         printf("Failed to load test data.\n");
         exit(1);
     }
+    INSTRUMENT_END(PHASE_LOAD);
 
-    testArgmax = (int*)calloc(testCount, sizeof(int));
+    // the generator allocates with calloc, its arrays move into the arena like the csv loader's
+    if (synthetic)
+    {
+        if (trainPath == NULL)
+        {
+            trainInputs = (float*)arenaAdopt(trainInputs, (size_t)trainCount * inputSize, sizeof(float));
+            trainOutputs = (float*)arenaAdopt(trainOutputs, (size_t)trainCount * outputSize, sizeof(float));
+        }
+        testInputs = (float*)arenaAdopt(testInputs, (size_t)testCount * inputSize, sizeof(float));
+        testOutputs = (float*)arenaAdopt(testOutputs, (size_t)testCount * outputSize, sizeof(float));
+    }
+
+    testArgmax = (int*)arenaCalloc(testCount, sizeof(int));
     if (testArgmax == NULL) 
     {
         printf("Failed to allocate memory for test argmax.\n");
@@ -526,8 +990,10 @@ int main()
     float distanceExponentMax = 20.0f;
     float distanceExponentStep = 0.1f;
     int knnParametersCount = 0;
+    int thresholdCount = 0;
     for (float distanceThreshold = distanceThresholdMin; distanceThreshold <= distanceThresholdMax; distanceThreshold += distanceThresholdStep) 
     {
+        thresholdCount++;
         for (float distanceExponent = distanceExponentMin; distanceExponent <= distanceExponentMax; distanceExponent += distanceExponentStep) 
         {
             knnParametersCount++;
@@ -535,7 +1001,132 @@ int main()
     }
     printf("KNN Parameters Count: %d\n", knnParametersCount);
 
-    KnnParameters* knnParameters = (KnnParameters*)calloc(knnParametersCount, sizeof(KnnParameters));
+    selectKernels();
+    printf("Kernel ISA: %s\n", kernels->name);
+
+    // mostly zero inputs like mnist run on sparse rows
+    SparseRows sparseTrain;
+    float density = sparseDensity(trainCount, inputSize, trainInputs);
+    int useSparse = sparseSelect(density);
+    if (useSparse)
+    {
+        sparseRowsCreate(&sparseTrain, trainCount, inputSize, trainInputs);
+    }
+    printf("Inputs: %s, density: %.1f%%\n", useSparse ? "sparse" : "dense", 100.0f * density);
+
+    // learning curve when KNN_CURVE is set: every shorter train prefix votes on the full set's distances in the same sweep,
+    // the cascade, the band and the prefilters skip rows a prefix may rank among its nearest, so they stay off
+    CurvePrefixes curvePrefixes;
+    int curved = curveSelect(&curvePrefixes, trainCount) > 0;
+    if (curved)
+    {
+        printf("Curve: train counts");
+        for (int prefix = 0; prefix < curvePrefixes.prefixCount; prefix++)
+        {
+            printf(" %d,", curvePrefixes.trainCounts[prefix]);
+        }
+        printf(" %d\n", trainCount);
+    }
+    else
+    {
+        printf("Curve: off\n");
+    }
+
+    // approximate when KNN_PCA is set: rank by a pca projection and measure only each test row's shortlist
+    PcaFilter pcaFilter;
+    int pcaComponentCount;
+    int pcaShortlistCount = curved ? 0 : pcaSelect(kMax, trainCount, inputSize, &pcaComponentCount);
+    if (pcaShortlistCount > 0)
+    {
+        uint64_t pcaStart = platformNanoseconds();
+        int cached = pcaFilterCreate(&pcaFilter, trainCount, inputSize, trainInputs, testCount, testInputs, pcaComponentCount, pcaShortlistCount, THREAD_COUNT, pcaCachePath());
+        printf("PCA: %d components %s %s, shortlist: %d of %d rows, %.3f s\n", pcaComponentCount, cached ? "loaded from" : "fitted to", pcaCachePath(), pcaShortlistCount, trainCount, (double)(platformNanoseconds() - pcaStart) / 1000000000.0);
+    }
+    else
+    {
+        printf("PCA: off\n");
+    }
+
+    // approximate when KNN_SKETCH is set and pca is not: prefilter by the hamming distance of binarized rows
+    SketchRows sketchTrain;
+    SketchRows sketchTest;
+    double sketchRecall = SKETCH_RECALL_DEFAULT;
+    int sketchShortlistCount = pcaShortlistCount == 0 && !curved ? sketchSelect(kMax, trainCount, &sketchRecall) : 0;
+    if (sketchShortlistCount > 0)
+    {
+        sketchRowsCreate(&sketchTrain, trainCount, inputSize, trainInputs);
+        sketchRowsCreate(&sketchTest, testCount, inputSize, testInputs);
+        printf("Sketch: %d words per row, shortlist: %d of %d rows to start, target recall: %.2f%%\n", sketchTrain.wordCount, sketchShortlistCount, trainCount, 100.0 * sketchRecall);
+    }
+    else
+    {
+        printf("Sketch: off\n");
+    }
+    int prefiltered = pcaShortlistCount > 0 || sketchShortlistCount > 0;
+
+    // exact parameter batching: blocks of combos that share an exponent sum their distances from one pass over each row pair
+    BatchGrid batchGrid;
+    batchGridCreate(&batchGrid, thresholdCount, knnParametersCount / thresholdCount, prefiltered ? 0 : batchSelect());
+    if (batchGrid.blockSize > 0)
+    {
+        printf("Batch: %d combos per block, blocks: %d\n", batchGrid.blockSize, batchBlockCount(&batchGrid));
+    }
+    else
+    {
+        printf("Batch: off\n");
+    }
+
+    // pooled lower bounds that skip rows which cannot be neighbours
+    CascadeRows cascadeTrain;
+    CascadeMode cascadeMode = prefiltered || curved || batchGrid.blockSize > 0 ? CASCADE_OFF : cascadeSelect(inputSize);
+    if (cascadeMode != CASCADE_OFF)
+    {
+        cascadeRowsCreate(&cascadeTrain, trainCount, inputSize, trainInputs);
+    }
+    printf("Cascade: %s\n", cascadeMode == CASCADE_TIMED ? "timed per combo" : cascadeMode == CASCADE_ON ? "on" : "off");
+
+    // runs of adjacent combos start each query's cascade from the neighbours the previous combo found
+    int warmRunLength = cascadeMode != CASCADE_OFF ? warmSelect() : 1;
+    if (warmRunLength > 1)
+    {
+        printf("Warm: runs of %d combos\n", warmRunLength);
+    }
+    else
+    {
+        printf("Warm: off\n");
+    }
+
+    // metric combos search outward from the query's norm instead
+    int useBand = !prefiltered && !curved && batchGrid.blockSize == 0 && bandSelect();
+    printf("Band: %s\n", useBand ? "on for metric combos" : "off");
+
+    // dense scans read the train rows interleaved in blocks, so the distance kernel runs down a vector of rows at once
+    InterleavedRows interleavedTrain;
+    interleavedRowsCreate(&interleavedTrain, trainCount, inputSize, trainInputs, useSparse || prefiltered || batchGrid.blockSize > 0 ? 0 : interleaveSelect(kernels));
+    if (interleavedTrain.inputs != NULL)
+    {
+        printf("Interleave: %d rows per block\n", interleavedTrain.lanes);
+    }
+    else
+    {
+        printf("Interleave: off\n");
+    }
+
+    // on multi socket machines workers are pinned per node and each node scans its own copy of the inputs
+    NumaTopology numaTopology;
+    numaDetect(&numaTopology);
+    int useNuma = numaSelect(&numaTopology);
+    NumaReplica* numaReplicas = useNuma && numaTopology.nodeCount > 1 ? numaReplicate(&numaTopology, trainCount, testCount, inputSize, trainInputs, testInputs, useSparse) : NULL;
+    if (useNuma)
+    {
+        printf("NUMA: %d nodes, workers pinned, %s\n", numaTopology.nodeCount, numaReplicas != NULL ? "inputs replicated per node" : "one copy of the inputs");
+    }
+    else
+    {
+        printf("NUMA: off, nodes: %d\n", numaTopology.nodeCount);
+    }
+
+    KnnParameters* knnParameters = (KnnParameters*)arenaCalloc(knnParametersCount, sizeof(KnnParameters));
     if (knnParameters == NULL) 
     {
         printf("Failed to allocate memory for knn parameters.\n");
@@ -556,7 +1147,7 @@ int main()
         }
     }
 
-    FILE* resultsFile = createResultsFile("./knn_k_dt_de_linear.csv");
+    FILE* resultsFile = createResultsFile("./knn_k_dt_de_linear.csv", curved);
     
     HANDLE parametersLock = CreateMutex(NULL, FALSE, NULL);
     HANDLE resultsLock = CreateMutex(NULL, FALSE, NULL);
@@ -566,7 +1157,7 @@ int main()
         exit(1);
     }
 
-    ThreadArgs* threadArgs = (ThreadArgs*)calloc(1, sizeof(ThreadArgs));
+    ThreadArgs* threadArgs = (ThreadArgs*)arenaCalloc(1, sizeof(ThreadArgs));
     if (threadArgs == NULL) 
     {
         printf("Failed to allocate memory for thread args.\n");
@@ -574,7 +1165,7 @@ int main()
     }
     threadArgs->resultsFile = resultsFile;
     threadArgs->knnParameters = knnParameters;
-    threadArgs->knnParametersIndex = 0;
+    numaQueuesCreate(&threadArgs->numaQueues, useNuma ? numaTopology.nodeCount : 1, batchGrid.blockSize > 0 ? batchBlockCount(&batchGrid) : knnParametersCount);
     threadArgs->knnParametersCount = knnParametersCount;
     threadArgs->parametersLock = parametersLock;
     threadArgs->resultsLock = resultsLock;
@@ -589,6 +1180,21 @@ int main()
     threadArgs->testInputs = testInputs;
     threadArgs->testOutputs = testOutputs;
     threadArgs->testArgmax = testArgmax;
+    threadArgs->sparseTrain = useSparse ? &sparseTrain : NULL;
+    threadArgs->cascadeTrain = cascadeMode != CASCADE_OFF ? &cascadeTrain : NULL;
+    threadArgs->cascadeMode = cascadeMode;
+    threadArgs->bandEnabled = useBand;
+    threadArgs->pcaFilter = pcaShortlistCount > 0 ? &pcaFilter : NULL;
+    threadArgs->sketchTrain = sketchShortlistCount > 0 ? &sketchTrain : NULL;
+    threadArgs->sketchTest = sketchShortlistCount > 0 ? &sketchTest : NULL;
+    threadArgs->sketchShortlistCount = sketchShortlistCount;
+    threadArgs->sketchRecall = sketchRecall;
+    threadArgs->batchGrid = batchGrid;
+    threadArgs->warmRunLength = warmRunLength;
+    threadArgs->interleavedTrain = interleavedTrain.inputs != NULL ? &interleavedTrain : NULL;
+    threadArgs->curvePrefixes = curvePrefixes;
+    threadArgs->numaTopology = useNuma ? &numaTopology : NULL;
+    threadArgs->numaReplicas = numaReplicas;
 
     HANDLE threads[THREAD_COUNT];
     for (int threadIndex = 0; threadIndex < THREAD_COUNT; threadIndex++) {
@@ -599,6 +1205,29 @@ int main()
         }
     }
     WaitForMultipleObjects(THREAD_COUNT, threads, TRUE, INFINITE);
+    if (cascadeMode != CASCADE_OFF)
+    {
+        cascadeReport(&threadArgs->cascadeCounts);
+    }
+    if (useBand)
+    {
+        bandReport(&threadArgs->bandCounts);
+    }
+    if (pcaShortlistCount > 0)
+    {
+        pcaReport(&threadArgs->pcaCounts, kMax);
+    }
+    if (sketchShortlistCount > 0)
+    {
+        sketchReport(&threadArgs->sketchCounts, kMax);
+    }
+    if (useNuma)
+    {
+        numaReport(&numaTopology, threadArgs->numaCounts);
+    }
+    arenaReport();
+    INSTRUMENT_REPORT();
+    INSTRUMENT_THREAD_END();
     fclose(resultsFile);
     return 0;
 }
\ No newline at end of file
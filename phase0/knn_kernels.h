@@ -0,0 +1,182 @@
+// no include guard, knn_dispatch.h includes this once per instruction set
+// with KERNEL(name) giving each copy a unique name, KERNEL_TARGET its target attribute and KERNEL_LANES the floats per
+// vector, 1 for the scalar loops, 4 for sse, 8 for avx2 and 16 for avx512
+//
+// every copy is bit identical to the scalar loops: the vectors only take differences, compare them with the threshold
+// and multiply and add elementwise, sums keep their order, and the build passes -ffp-contract=off so no product and add
+// is fused into an fma
+
+#if KERNEL_LANES > 1
+// |test - train| of KERNEL_LANES inputs into differences, and a bit per input the threshold keeps,
+// the scalar compare negated so a nan difference is kept as the scalar loop keeps it
+KERNEL_TARGET static inline unsigned int KERNEL(differences)(const float* testInput, const float* trainInput, float distanceThreshold, float* differences)
+{
+#if KERNEL_LANES == 16
+    __m512 difference = _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(testInput), _mm512_loadu_ps(trainInput)));
+    _mm512_storeu_ps(differences, difference);
+    return (unsigned int)(uint16_t)~_mm512_cmp_ps_mask(difference, _mm512_set1_ps(distanceThreshold), _CMP_LE_OQ);
+#elif KERNEL_LANES == 8
+    __m256 difference = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(_mm256_loadu_ps(testInput), _mm256_loadu_ps(trainInput)));
+    _mm256_storeu_ps(differences, difference);
+    return ~(unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(difference, _mm256_set1_ps(distanceThreshold), _CMP_LE_OQ)) & 0xFFu;
+#else
+    __m128 difference = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_loadu_ps(testInput), _mm_loadu_ps(trainInput)));
+    _mm_storeu_ps(differences, difference);
+    return ~(unsigned int)_mm_movemask_ps(_mm_cmple_ps(difference, _mm_set1_ps(distanceThreshold))) & 0xFu;
+#endif
+}
+#endif
+
+// thresholded power distance between one test row and one train row, kept bit identical to the scalar loop,
+// the vector copies take a vector of differences and the threshold at once, then pay a pow only for the kept terms,
+// in input order, so the mostly equal zero pixels of digit rows cost no branch each
+KERNEL_TARGET static float KERNEL(distance)(int inputSize, const float* testInput, const float* trainInput, float distanceThreshold, float distanceExponent)
+{
+    float distance = 0.0f;
+    int inputIndex = 0;
+#if KERNEL_LANES > 1
+    float differences[KERNEL_LANES];
+    for (; inputIndex + KERNEL_LANES <= inputSize; inputIndex += KERNEL_LANES)
+    {
+        unsigned int kept = KERNEL(differences)(&testInput[inputIndex], &trainInput[inputIndex], distanceThreshold, differences);
+        while (kept != 0)
+        {
+            distance += pow(differences[__builtin_ctz(kept)], distanceExponent);
+            kept &= kept - 1;
+        }
+    }
+#endif
+    for (; inputIndex < inputSize; inputIndex++)
+    {
+        float difference = fabs(testInput[inputIndex] - trainInput[inputIndex]);
+        if (difference <= distanceThreshold)
+        {
+            continue;
+        }
+        distance += pow(difference, distanceExponent);
+    }
+    return distance;
+}
+
+// the same distances for a block of interleaved train rows, input i of lane l at blockInputs[i * lanes + l], so one test
+// input is compared against every lane at once and each lane keeps its own sum, no reduction across the vector,
+// every lane adds its terms in input order as distance does and a difference the threshold skips adds an exact zero,
+// so each result is bit identical to it, exponents of 1 and 2 need no pow since a float difference and its square are
+// exact in double, other exponents read each term from the block's table, whose terms are the same pow of the same
+// difference, and only pay a pow per lane for a test value missing from the table or rows without one
+//
+// the skip is a mask on the difference's bits rather than a branch, the compilers leave a select that feeds double math
+// unvectorized, and it is the scalar compare negated so a nan difference is still added
+KERNEL_TARGET static void KERNEL(distanceBlock)(int inputSize, int lanes, const float* testInput, const float* blockInputs, const BlockTerms* blockTerms, float distanceThreshold, float distanceExponent, float* distances)
+{
+    int power = distanceExponent == 1.0f ? 1 : distanceExponent == 2.0f ? 2 : 0;
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        distances[lane] = 0.0f;
+    }
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        float testValue = testInput[inputIndex];
+        const float* laneInputs = &blockInputs[(size_t)inputIndex * lanes];
+        if (power == 0)
+        {
+            int testCode = blockTerms != NULL ? blockTerms->testCodes[inputIndex] : -1;
+            if (testCode >= 0)
+            {
+                const double* terms = &blockTerms->terms[(size_t)testCode * blockTerms->valueCount];
+                const unsigned char* laneCodes = &blockTerms->blockCodes[(size_t)inputIndex * lanes];
+                int lane = 0;
+#if KERNEL_LANES == 16
+                // widen each lane's sum to double, add its gathered term and round back, as the scalar add does
+                for (; lane + 8 <= lanes; lane += 8)
+                {
+                    __m256i codes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&laneCodes[lane]));
+                    __m512d sums = _mm512_add_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&distances[lane])), _mm512_i32gather_pd(codes, terms, 8));
+                    _mm256_storeu_ps(&distances[lane], _mm512_cvtpd_ps(sums));
+                }
+#elif KERNEL_LANES == 8
+                for (; lane + 4 <= lanes; lane += 4)
+                {
+                    int packed;
+                    memcpy(&packed, &laneCodes[lane], sizeof(packed));
+                    __m128i codes = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+                    __m256d sums = _mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(&distances[lane])), _mm256_i32gather_pd(terms, codes, 8));
+                    _mm_storeu_ps(&distances[lane], _mm256_cvtpd_ps(sums));
+                }
+#endif
+                for (; lane < lanes; lane++)
+                {
+                    distances[lane] += terms[laneCodes[lane]];
+                }
+                continue;
+            }
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                float difference = fabsf(testValue - laneInputs[lane]);
+                if (difference <= distanceThreshold)
+                {
+                    continue;
+                }
+                distances[lane] += pow(difference, distanceExponent);
+            }
+            continue;
+        }
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            float difference = fabsf(testValue - laneInputs[lane]);
+            uint32_t bits;
+            memcpy(&bits, &difference, sizeof(bits));
+            bits &= -(uint32_t)!(difference <= distanceThreshold);
+            float kept;
+            memcpy(&kept, &bits, sizeof(kept));
+            distances[lane] += power == 1 ? (double)kept : (double)kept * kept;
+        }
+    }
+}
+
+// packs the distance buffer into keys and radix sorts them, leaving the full ranking in radixBuffers->sorted
+KERNEL_TARGET static void KERNEL(sortDistances)(int count, RadixBuffers* radixBuffers)
+{
+    const float* distances = radixBuffers->distances;
+    uint64_t* keys = radixBuffers->keys;
+    for (int index = 0; index < count; index++)
+    {
+        keys[index] = packDistanceKey(distances[index], index);
+    }
+    radixBuffers->sorted = radixSortKeys(count, keys, radixBuffers->scratch);
+}
+
+// adds one weighted train output row into a prediction row, a product and a sum per output as the scalar loop rounds them
+KERNEL_TARGET static void KERNEL(accumulate)(int outputSize, const float* trainOutput, float weight, float* predictionOutput)
+{
+    int outputIndex = 0;
+#if KERNEL_LANES == 16
+    // masked, so the ten outputs of a digit row take one vector
+    __m512 weights = _mm512_set1_ps(weight);
+    for (; outputIndex < outputSize; outputIndex += 16)
+    {
+        int remaining = outputSize - outputIndex;
+        __mmask16 mask = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512 product = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, &trainOutput[outputIndex]), weights);
+        _mm512_mask_storeu_ps(&predictionOutput[outputIndex], mask, _mm512_add_ps(_mm512_maskz_loadu_ps(mask, &predictionOutput[outputIndex]), product));
+    }
+#elif KERNEL_LANES == 8
+    __m256 weights = _mm256_set1_ps(weight);
+    for (; outputIndex + 8 <= outputSize; outputIndex += 8)
+    {
+        __m256 product = _mm256_mul_ps(_mm256_loadu_ps(&trainOutput[outputIndex]), weights);
+        _mm256_storeu_ps(&predictionOutput[outputIndex], _mm256_add_ps(_mm256_loadu_ps(&predictionOutput[outputIndex]), product));
+    }
+#elif KERNEL_LANES == 4
+    __m128 weights = _mm_set1_ps(weight);
+    for (; outputIndex + 4 <= outputSize; outputIndex += 4)
+    {
+        __m128 product = _mm_mul_ps(_mm_loadu_ps(&trainOutput[outputIndex]), weights);
+        _mm_storeu_ps(&predictionOutput[outputIndex], _mm_add_ps(_mm_loadu_ps(&predictionOutput[outputIndex]), product));
+    }
+#endif
+    for (; outputIndex < outputSize; outputIndex++)
+    {
+        predictionOutput[outputIndex] += trainOutput[outputIndex] * weight;
+    }
+}
@@ -0,0 +1,2362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "knn_platform.h"
+#include "knn_dispatch.h"
+#include "knn_lib.h"
+
+#define EPSILON 0.0000001f
+
+// train rows per tile, sized so a tile of rows stays in l2 while every query of the batch scans it
+#define KNN_TILE_BYTES (256 * 1024)
+
+// the train store grows in fixed chunks so appends never move rows a running query is reading
+#ifndef KNN_CHUNK_ROWS
+#define KNN_CHUNK_ROWS 4096
+#endif
+#define KNN_MAX_CHUNKS 16384
+
+// vantage point tree nodes with this many rows or fewer are leaves scanned row by row
+#define KNN_VP_LEAF_ROWS 16
+// a tree covers 2^level full chunks, up to all KNN_MAX_CHUNKS of them
+#define KNN_VP_LEVELS 15
+
+// hnsw layers above the bottom one, levels are drawn with probability m^-level so this is never reached in practice
+#define KNN_HNSW_MAX_LEVEL 16
+#define KNN_HNSW_MAGIC 0x484E4E4Bu
+#define KNN_HNSW_FILE_VERSION 1
+
+// compact once this fraction of stored rows are tombstones
+#define KNN_COMPACT_FRACTION 0.25f
+
+#define KNN_ALIVE UINT64_MAX
+
+// a vantage point with the rows nearer to it than radius under inside and the rest under outside,
+// or a leaf when row is -1, children are node indices and -1 when empty
+typedef struct {
+    int row;
+    float radius;
+    int inside;
+    int outside;
+    int leafStart;
+    int leafCount;
+} KnnVpNode;
+
+// exact index over the rows of an aligned run of full chunks for one exponent, immutable once published,
+// rows are generation rows and deleted rows stay in it as vantage points, the search skips them as neighbours,
+// snapshots hold a reference so a tree merged into a larger one is freed when the last of them lets go
+typedef struct {
+    float distanceExponent;
+    int chunkIndex;
+    int level;
+    int references;
+    int retired;
+    KnnVpNode* nodes;
+    int nodeCount;
+    int* leafRows;
+    int leafRowCount;
+} KnnVpTree;
+
+typedef struct {
+    int row;
+    float distance;
+} KnnVpEntry;
+
+// hnsw state of the rows of one chunk, allocated when the first of them is linked
+typedef struct {
+    unsigned char* levels;
+    int* locks;
+    // per row 1 + 2m ints, the neighbour count then the neighbour rows on the bottom layer
+    int* links;
+    // per row level * (1 + m) ints for the layers above, NULL for rows only on the bottom layer
+    int** upperLinks;
+    // set once the row's insertion has finished, so a compaction knows its links are complete
+    unsigned char* linked;
+} KnnHnswChunk;
+
+// approximate index over the rows of one generation for one distance, rows are linked in place in generation order
+// as predictions or knnModelBuildIndex claim them, each row's links under its own spin lock so searches run alongside,
+// deleted rows stay in it as waypoints until a compaction carries the graph over without them
+typedef struct {
+    float distanceThreshold;
+    float distanceExponent;
+    int m;
+    int efConstruction;
+    double levelScale;
+    // guards the entry point and chunk allocation, held through the link of a row that becomes the new top
+    HANDLE lock;
+    int entryPoint;
+    int maxLevel;
+    int claimedRows;
+    // set when a claimed row could not get its chunk's arrays and so will never be marked linked
+    int failed;
+    KnnHnswChunk* chunks;
+} KnnHnsw;
+
+typedef struct {
+    float distance;
+    int row;
+} KnnHnswEntry;
+
+// per thread search state, sized to the rows of the generation, a writer that grows the generation past it allocates
+// larger buffers under storeLock and the thread swaps them in as it takes its next snapshot, so predictions never allocate
+typedef struct {
+    unsigned int* visited;
+    unsigned int visitedEpoch;
+    int capacity;
+    KnnHnswEntry* candidates;
+    KnnHnswEntry* results;
+    int links[1 + 2 * KNN_HNSW_MAX_M];
+} KnnHnswScratch;
+
+typedef struct {
+    float* inputs;
+    float* outputs;
+    int* ids;
+    // store version at which the row was deleted, KNN_ALIVE until then
+    uint64_t* deletedVersions;
+} KnnChunk;
+
+// rows in append order, a compaction builds a new generation and the old one lives until its last reader lets go
+typedef struct {
+    KnnChunk* chunks;
+    int chunkCount;
+    int rowCount;
+    int references;
+    int retired;
+    // the leading treeChunks full chunks are covered by one tree per set bit of their count, as in a binary counter,
+    // trees[level] over 2^level chunks and higher levels first, built for treeExponent by the writer that fills a chunk,
+    // which merges the trees below into the next level up as the counter carries
+    KnnVpTree* trees[KNN_VP_LEVELS];
+    int treeChunks;
+    float treeExponent;
+    // built by the first hnsw prediction or knnModelBuildIndex, NULL until then
+    KnnHnsw* hnsw;
+} KnnGeneration;
+
+// what a prediction sees, rows past rowCount or deleted at or before version are invisible to it,
+// with a reference to each tree of the generation at the time
+typedef struct {
+    KnnGeneration* generation;
+    int rowCount;
+    uint64_t version;
+    KnnVpTree* trees[KNN_VP_LEVELS];
+} KnnSnapshot;
+
+typedef struct {
+    int index;
+    float distance;
+    const float* output;
+} KnnCandidate;
+
+// per thread buffers, sized at create so prediction never allocates, predictions are voted straight into the caller's rows
+typedef struct {
+    KnnCandidate* indexDistances;
+    int* neighbourCounts;
+    float* weightSums;
+    float* maxDistances;
+    long long distanceCount;
+    KnnHnswScratch hnsw;
+    // larger buffers waiting for the thread's next snapshot, capacity 0 when there are none
+    KnnHnswScratch hnswGrown;
+} KnnScratch;
+
+// one query's walk down one chunk tree
+typedef struct {
+    KnnModel* model;
+    KnnScratch* scratch;
+    const KnnSnapshot* snapshot;
+    const KnnVpTree* tree;
+    const float* query;
+    KnnCandidate* indexDistances;
+    int* neighbourCount;
+    float slackRelative;
+    float slackAbsolute;
+} KnnVpSearch;
+
+struct KnnModel {
+    int inputSize;
+    int outputSize;
+    int kCapacity;
+    int threadCount;
+    int batchSize;
+    int tileRows;
+    KnnParameters parameters;
+    const KnnKernels* kernels;
+    KnnScratch* scratch;
+
+    // writers and snapshot acquisition take storeLock, scanning a snapshot does not
+    HANDLE storeLock;
+    KnnGeneration* generation;
+    uint64_t version;
+    int liveCount;
+    int nextId;
+    // row of each id in the current generation, -1 once deleted
+    int* idRows;
+    int idCapacity;
+
+    // one compaction at a time, the background one a delete starts or a knnModelCompact call
+    HANDLE compactLock;
+    // set under storeLock while a background compaction is queued or running, its thread is joined before the next
+    int compactQueued;
+    HANDLE compactThread;
+    // rows of the current generation deleted while a compaction copies it, replayed onto the copy when it is swapped in
+    int deleteLogging;
+    int* deletedRows;
+    int deletedRowCount;
+    int deletedRowCapacity;
+    int deleteLogFailed;
+
+    // serializes building trees and creating graphs, searching published ones does not take it
+    HANDLE indexLock;
+};
+
+static void knnVpTreeFree(KnnVpTree* tree)
+{
+    if (tree == NULL)
+    {
+        return;
+    }
+    free(tree->nodes);
+    free(tree->leafRows);
+    free(tree);
+}
+
+// under storeLock, a tree no snapshot holds is freed now, one a snapshot holds when its last reference goes
+static void knnVpTreeRetire(KnnVpTree* tree)
+{
+    if (tree == NULL)
+    {
+        return;
+    }
+    if (tree->references == 0)
+    {
+        knnVpTreeFree(tree);
+        return;
+    }
+    tree->retired = 1;
+}
+
+static void knnHnswFree(KnnHnsw* hnsw)
+{
+    if (hnsw == NULL)
+    {
+        return;
+    }
+    if (hnsw->chunks != NULL)
+    {
+        for (int chunkIndex = 0; chunkIndex < KNN_MAX_CHUNKS; chunkIndex++)
+        {
+            KnnHnswChunk* chunk = &hnsw->chunks[chunkIndex];
+            if (chunk->upperLinks != NULL)
+            {
+                for (int chunkRow = 0; chunkRow < KNN_CHUNK_ROWS; chunkRow++)
+                {
+                    free(chunk->upperLinks[chunkRow]);
+                }
+            }
+            free(chunk->levels);
+            free(chunk->locks);
+            free(chunk->links);
+            free(chunk->upperLinks);
+            free(chunk->linked);
+        }
+    }
+    free(hnsw->chunks);
+    free(hnsw);
+}
+
+static void knnHnswScratchFree(KnnHnswScratch* hnswScratch)
+{
+    free(hnswScratch->visited);
+    free(hnswScratch->candidates);
+    free(hnswScratch->results);
+    memset(hnswScratch, 0, sizeof(KnnHnswScratch));
+}
+
+static KnnGeneration* knnGenerationCreate(void)
+{
+    KnnGeneration* generation = (KnnGeneration*)calloc(1, sizeof(KnnGeneration));
+    if (generation == NULL)
+    {
+        return NULL;
+    }
+    generation->chunks = (KnnChunk*)calloc(KNN_MAX_CHUNKS, sizeof(KnnChunk));
+    if (generation->chunks == NULL)
+    {
+        free(generation);
+        return NULL;
+    }
+    return generation;
+}
+
+static void knnGenerationFree(KnnGeneration* generation)
+{
+    if (generation == NULL)
+    {
+        return;
+    }
+    for (int chunkIndex = 0; chunkIndex < generation->chunkCount; chunkIndex++)
+    {
+        KnnChunk* chunk = &generation->chunks[chunkIndex];
+        free(chunk->inputs);
+        free(chunk->outputs);
+        free(chunk->ids);
+        free(chunk->deletedVersions);
+    }
+    for (int level = 0; level < KNN_VP_LEVELS; level++)
+    {
+        knnVpTreeFree(generation->trees[level]);
+    }
+    knnHnswFree(generation->hnsw);
+    free(generation->chunks);
+    free(generation);
+}
+
+// makes room for one more row at the end of the generation, returns its row or -1
+static int knnGenerationReserve(KnnGeneration* generation, int inputSize, int outputSize)
+{
+    int row = generation->rowCount;
+    int chunkIndex = row / KNN_CHUNK_ROWS;
+    if (chunkIndex >= KNN_MAX_CHUNKS)
+    {
+        printf("Knn train store is full.\n");
+        return -1;
+    }
+    if (chunkIndex == generation->chunkCount)
+    {
+        KnnChunk* chunk = &generation->chunks[chunkIndex];
+        chunk->inputs = (float*)malloc((size_t)KNN_CHUNK_ROWS * inputSize * sizeof(float));
+        chunk->outputs = (float*)malloc((size_t)KNN_CHUNK_ROWS * outputSize * sizeof(float));
+        chunk->ids = (int*)malloc(KNN_CHUNK_ROWS * sizeof(int));
+        chunk->deletedVersions = (uint64_t*)malloc(KNN_CHUNK_ROWS * sizeof(uint64_t));
+        if (chunk->inputs == NULL || chunk->outputs == NULL || chunk->ids == NULL || chunk->deletedVersions == NULL)
+        {
+            printf("Failed to allocate memory for knn train chunk.\n");
+            free(chunk->inputs);
+            free(chunk->outputs);
+            free(chunk->ids);
+            free(chunk->deletedVersions);
+            memset(chunk, 0, sizeof(KnnChunk));
+            return -1;
+        }
+        generation->chunkCount++;
+    }
+    return row;
+}
+
+static void knnGenerationWrite(KnnGeneration* generation, int row, int inputSize, int outputSize, const float* input, const float* output, int id, uint64_t deletedVersion)
+{
+    KnnChunk* chunk = &generation->chunks[row / KNN_CHUNK_ROWS];
+    int chunkRow = row % KNN_CHUNK_ROWS;
+    memcpy(&chunk->inputs[(size_t)chunkRow * inputSize], input, inputSize * sizeof(float));
+    memcpy(&chunk->outputs[(size_t)chunkRow * outputSize], output, outputSize * sizeof(float));
+    chunk->ids[chunkRow] = id;
+    chunk->deletedVersions[chunkRow] = deletedVersion;
+}
+
+// allocates search buffers for capacity rows, returns 0 on success
+static int knnHnswScratchCreate(KnnHnswScratch* hnswScratch, int capacity)
+{
+    memset(hnswScratch, 0, sizeof(KnnHnswScratch));
+    hnswScratch->visited = (unsigned int*)calloc(capacity, sizeof(unsigned int));
+    hnswScratch->candidates = (KnnHnswEntry*)malloc(((size_t)capacity + 1) * sizeof(KnnHnswEntry));
+    hnswScratch->results = (KnnHnswEntry*)malloc(((size_t)capacity + 1) * sizeof(KnnHnswEntry));
+    if (hnswScratch->visited == NULL || hnswScratch->candidates == NULL || hnswScratch->results == NULL)
+    {
+        printf("Failed to allocate memory for knn hnsw search.\n");
+        knnHnswScratchFree(hnswScratch);
+        return -1;
+    }
+    hnswScratch->capacity = capacity;
+    return 0;
+}
+
+// under storeLock, gives every thread whose buffers cover fewer than rowCount rows larger ones for its next snapshot,
+// doubling so a growing store reallocates rarely, returns 0 on success
+static int knnHnswScratchGrowLocked(KnnModel* model, int rowCount)
+{
+    for (int threadIndex = 0; threadIndex < model->threadCount; threadIndex++)
+    {
+        KnnScratch* scratch = &model->scratch[threadIndex];
+        int capacity = scratch->hnswGrown.capacity > scratch->hnsw.capacity ? scratch->hnswGrown.capacity : scratch->hnsw.capacity;
+        if (rowCount <= capacity)
+        {
+            continue;
+        }
+        capacity = capacity > 0 ? capacity : KNN_CHUNK_ROWS;
+        while (capacity < rowCount)
+        {
+            capacity *= 2;
+        }
+        KnnHnswScratch grown;
+        if (knnHnswScratchCreate(&grown, capacity) != 0)
+        {
+            return -1;
+        }
+        knnHnswScratchFree(&scratch->hnswGrown);
+        scratch->hnswGrown = grown;
+    }
+    return 0;
+}
+
+// scratch is the predicting thread's, which swaps in the buffers a writer grew for it, NULL for other callers
+static KnnSnapshot knnSnapshotAcquire(KnnModel* model, KnnScratch* scratch)
+{
+    KnnSnapshot snapshot;
+    WaitForSingleObject(model->storeLock, INFINITE);
+    if (scratch != NULL && scratch->hnswGrown.capacity > 0)
+    {
+        knnHnswScratchFree(&scratch->hnsw);
+        scratch->hnsw = scratch->hnswGrown;
+        memset(&scratch->hnswGrown, 0, sizeof(KnnHnswScratch));
+    }
+    snapshot.generation = model->generation;
+    snapshot.rowCount = model->generation->rowCount;
+    snapshot.version = model->version;
+    snapshot.generation->references++;
+    for (int level = 0; level < KNN_VP_LEVELS; level++)
+    {
+        snapshot.trees[level] = snapshot.generation->trees[level];
+        if (snapshot.trees[level] != NULL)
+        {
+            snapshot.trees[level]->references++;
+        }
+    }
+    ReleaseMutex(model->storeLock);
+    return snapshot;
+}
+
+// drops a reference taken under storeLock, freeing a retired generation its last reader lets go of
+static void knnGenerationRelease(KnnModel* model, KnnGeneration* generation)
+{
+    WaitForSingleObject(model->storeLock, INFINITE);
+    generation->references--;
+    int freeGeneration = generation->retired && generation->references == 0;
+    ReleaseMutex(model->storeLock);
+    if (freeGeneration)
+    {
+        knnGenerationFree(generation);
+    }
+}
+
+static void knnSnapshotRelease(KnnModel* model, KnnSnapshot* snapshot)
+{
+    WaitForSingleObject(model->storeLock, INFINITE);
+    for (int level = 0; level < KNN_VP_LEVELS; level++)
+    {
+        KnnVpTree* tree = snapshot->trees[level];
+        if (tree != NULL && --tree->references == 0 && tree->retired)
+        {
+            knnVpTreeFree(tree);
+        }
+    }
+    ReleaseMutex(model->storeLock);
+    knnGenerationRelease(model, snapshot->generation);
+}
+
+// appends under storeLock, the row becomes visible to snapshots taken after the version bump
+static int knnAppendLocked(KnnModel* model, const float* input, const float* output)
+{
+    if (model->nextId == model->idCapacity)
+    {
+        int idCapacity = model->idCapacity > 0 ? model->idCapacity * 2 : KNN_CHUNK_ROWS;
+        int* idRows = (int*)realloc(model->idRows, (size_t)idCapacity * sizeof(int));
+        if (idRows == NULL)
+        {
+            printf("Failed to allocate memory for knn ids.\n");
+            return -1;
+        }
+        model->idRows = idRows;
+        model->idCapacity = idCapacity;
+    }
+    KnnGeneration* generation = model->generation;
+    // a row that starts a chunk grows the hnsw search buffers first, so the graph never holds a row they cannot cover
+    if (generation->rowCount % KNN_CHUNK_ROWS == 0 && model->parameters.index == KNN_INDEX_HNSW && knnHnswScratchGrowLocked(model, generation->rowCount + KNN_CHUNK_ROWS) != 0)
+    {
+        return -1;
+    }
+    int row = knnGenerationReserve(generation, model->inputSize, model->outputSize);
+    if (row < 0)
+    {
+        return -1;
+    }
+    int id = model->nextId++;
+    knnGenerationWrite(generation, row, model->inputSize, model->outputSize, input, output, id, KNN_ALIVE);
+    model->idRows[id] = row;
+    generation->rowCount++;
+    model->liveCount++;
+    model->version++;
+    return id;
+}
+
+// the tree prunes with the triangle inequality, so only a true metric may use it:
+// the rooted lp distance for exponents of 1 and up, or the plain sum at exponent 1, with no threshold
+static int knnIndexActive(const KnnParameters* parameters)
+{
+    return parameters->index == KNN_INDEX_VPTREE && parameters->distanceThreshold <= 0.0f && parameters->distanceExponent >= 1.0f && (parameters->rooted || parameters->distanceExponent == 1.0f);
+}
+
+// the distance knn() ranks by, rooted when the parameters ask for it
+static inline float knnRowDistance(const KnnModel* model, const float* testInput, const float* trainInput)
+{
+    const KnnParameters* parameters = &model->parameters;
+    float distance = model->kernels->distance(model->inputSize, testInput, trainInput, parameters->distanceThreshold, parameters->distanceExponent);
+    if (parameters->rooted)
+    {
+        distance = pow(distance, 1.0f / parameters->distanceExponent);
+    }
+    return distance;
+}
+
+static int compareVpEntry(const void* a, const void* b)
+{
+    const KnnVpEntry* e1 = (const KnnVpEntry*)a;
+    const KnnVpEntry* e2 = (const KnnVpEntry*)b;
+    if (e1->distance < e2->distance)
+    {
+        return -1;
+    }
+    if (e1->distance > e2->distance)
+    {
+        return 1;
+    }
+    return e1->row - e2->row;
+}
+
+static inline const float* knnRowInput(const KnnModel* model, const KnnGeneration* generation, int row)
+{
+    return &generation->chunks[row / KNN_CHUNK_ROWS].inputs[(size_t)(row % KNN_CHUNK_ROWS) * model->inputSize];
+}
+
+// splits entries around a pseudo random vantage point at the median distance, returns the node index or -1 for no rows
+static int knnVpBuildNode(const KnnModel* model, KnnVpTree* tree, const KnnGeneration* generation, KnnVpEntry* entries, int count, uint64_t* seed)
+{
+    if (count == 0)
+    {
+        return -1;
+    }
+    int nodeIndex = tree->nodeCount++;
+    KnnVpNode* node = &tree->nodes[nodeIndex];
+    node->row = -1;
+    node->inside = -1;
+    node->outside = -1;
+
+    int split = count;
+    float radius = 0.0f;
+    if (count > KNN_VP_LEAF_ROWS)
+    {
+        *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int pick = (int)((*seed >> 33) % (uint64_t)count);
+        KnnVpEntry vantage = entries[pick];
+        entries[pick] = entries[0];
+        entries[0] = vantage;
+        const float* vantageInput = knnRowInput(model, generation, vantage.row);
+        for (int entryIndex = 1; entryIndex < count; entryIndex++)
+        {
+            entries[entryIndex].distance = knnRowDistance(model, vantageInput, knnRowInput(model, generation, entries[entryIndex].row));
+        }
+        qsort(&entries[1], count - 1, sizeof(KnnVpEntry), compareVpEntry);
+
+        // inside is strictly nearer than radius, so a run of equal distances never straddles the split,
+        // when the median run starts at the nearest row the radius moves up past it instead
+        split = 1 + (count - 1) / 2;
+        radius = entries[split].distance;
+        while (split > 1 && entries[split - 1].distance == radius)
+        {
+            split--;
+        }
+        if (split == 1)
+        {
+            while (split < count && entries[split].distance == radius)
+            {
+                split++;
+            }
+            if (split < count)
+            {
+                radius = entries[split].distance;
+            }
+        }
+    }
+
+    // rows all at the same distance from the vantage point cannot be split, they stay a leaf
+    if (split == count)
+    {
+        node->leafStart = tree->leafRowCount;
+        node->leafCount = count;
+        for (int entryIndex = 0; entryIndex < count; entryIndex++)
+        {
+            tree->leafRows[tree->leafRowCount++] = entries[entryIndex].row;
+        }
+        return nodeIndex;
+    }
+    node->row = entries[0].row;
+    node->radius = radius;
+    int inside = knnVpBuildNode(model, tree, generation, &entries[1], split - 1, seed);
+    int outside = knnVpBuildNode(model, tree, generation, &entries[split], count - split, seed);
+    tree->nodes[nodeIndex].inside = inside;
+    tree->nodes[nodeIndex].outside = outside;
+    return nodeIndex;
+}
+
+// builds over every row of 2^level full chunks from chunkIndex, deleted ones included, with the distance the current parameters define
+static KnnVpTree* knnVpTreeBuild(const KnnModel* model, const KnnGeneration* generation, int chunkIndex, int level)
+{
+    int rowStart = chunkIndex * KNN_CHUNK_ROWS;
+    int rowCount = KNN_CHUNK_ROWS << level;
+    KnnVpTree* tree = (KnnVpTree*)calloc(1, sizeof(KnnVpTree));
+    KnnVpEntry* entries = (KnnVpEntry*)malloc((size_t)rowCount * sizeof(KnnVpEntry));
+    if (tree != NULL)
+    {
+        tree->nodes = (KnnVpNode*)malloc((size_t)rowCount * sizeof(KnnVpNode));
+        tree->leafRows = (int*)malloc((size_t)rowCount * sizeof(int));
+    }
+    if (tree == NULL || entries == NULL || tree->nodes == NULL || tree->leafRows == NULL)
+    {
+        printf("Failed to allocate memory for knn tree, scanning instead.\n");
+        knnVpTreeFree(tree);
+        free(entries);
+        return NULL;
+    }
+    tree->distanceExponent = model->parameters.distanceExponent;
+    tree->chunkIndex = chunkIndex;
+    tree->level = level;
+    for (int entryIndex = 0; entryIndex < rowCount; entryIndex++)
+    {
+        entries[entryIndex].row = rowStart + entryIndex;
+        entries[entryIndex].distance = 0.0f;
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)chunkIndex << 4 | (uint64_t)level);
+    knnVpBuildNode(model, tree, generation, entries, rowCount, &seed);
+    free(entries);
+    return tree;
+}
+
+// the next step of the binary counter from treeChunks toward fullChunks: the largest aligned run of chunks that fits,
+// a single chunk once caught up, and like a counter's carry the tree it ends takes in the trees below it,
+// returns that tree's level and sets its first chunk
+static int knnTreeNext(int treeChunks, int fullChunks, int* chunkIndex)
+{
+    int step = 0;
+    while (step + 1 < KNN_VP_LEVELS && treeChunks % (2 << step) == 0 && treeChunks + (2 << step) <= fullChunks)
+    {
+        step++;
+    }
+    int next = treeChunks + (1 << step);
+    int level = 0;
+    while (!(next & (1 << level)))
+    {
+        level++;
+    }
+    *chunkIndex = next - (1 << level);
+    return level;
+}
+
+// builds the trees the generation's full chunks still lack for its treeExponent, each outside storeLock so appends,
+// deletes and snapshots go on, then publishes it and retires the trees it merged, the caller holds a reference
+// or owns the generation outright, returns 0 on success
+static int knnTreesCatchUp(KnnModel* model, KnnGeneration* generation)
+{
+    while (1)
+    {
+        WaitForSingleObject(model->storeLock, INFINITE);
+        int fullChunks = generation->rowCount / KNN_CHUNK_ROWS;
+        int treeChunks = generation->treeChunks;
+        int done = generation->retired || treeChunks >= fullChunks || generation->treeExponent != model->parameters.distanceExponent;
+        ReleaseMutex(model->storeLock);
+        if (done)
+        {
+            return 0;
+        }
+        int chunkIndex = 0;
+        int level = knnTreeNext(treeChunks, fullChunks, &chunkIndex);
+        KnnVpTree* tree = knnVpTreeBuild(model, generation, chunkIndex, level);
+        if (tree == NULL)
+        {
+            return -1;
+        }
+        WaitForSingleObject(model->storeLock, INFINITE);
+        for (int merged = 0; merged < level; merged++)
+        {
+            knnVpTreeRetire(generation->trees[merged]);
+            generation->trees[merged] = NULL;
+        }
+        generation->trees[level] = tree;
+        generation->treeChunks = chunkIndex + (1 << level);
+        ReleaseMutex(model->storeLock);
+    }
+}
+
+// brings the current generation's trees up to its full chunks, rebuilding them all when the exponent changed,
+// on the writing thread so predictions only ever search published trees, returns 0 on success
+static int knnTreesUpdate(KnnModel* model)
+{
+    if (!knnIndexActive(&model->parameters))
+    {
+        return 0;
+    }
+    WaitForSingleObject(model->indexLock, INFINITE);
+    WaitForSingleObject(model->storeLock, INFINITE);
+    KnnGeneration* generation = model->generation;
+    generation->references++;
+    if (generation->treeExponent != model->parameters.distanceExponent)
+    {
+        for (int level = 0; level < KNN_VP_LEVELS; level++)
+        {
+            knnVpTreeRetire(generation->trees[level]);
+            generation->trees[level] = NULL;
+        }
+        generation->treeChunks = 0;
+        generation->treeExponent = model->parameters.distanceExponent;
+    }
+    ReleaseMutex(model->storeLock);
+    int result = knnTreesCatchUp(model, generation);
+    knnGenerationRelease(model, generation);
+    ReleaseMutex(model->indexLock);
+    return result;
+}
+
+static KnnHnsw* knnHnswCreate(const KnnParameters* parameters)
+{
+    KnnHnsw* hnsw = (KnnHnsw*)calloc(1, sizeof(KnnHnsw));
+    if (hnsw == NULL)
+    {
+        return NULL;
+    }
+    hnsw->chunks = (KnnHnswChunk*)calloc(KNN_MAX_CHUNKS, sizeof(KnnHnswChunk));
+    hnsw->lock = CreateMutex(NULL, FALSE, NULL);
+    if (hnsw->chunks == NULL || hnsw->lock == NULL)
+    {
+        knnHnswFree(hnsw);
+        return NULL;
+    }
+    hnsw->distanceThreshold = parameters->distanceThreshold;
+    hnsw->distanceExponent = parameters->distanceExponent;
+    hnsw->m = parameters->hnsw.m;
+    hnsw->efConstruction = parameters->hnsw.efConstruction;
+    hnsw->levelScale = 1.0 / log((double)parameters->hnsw.m);
+    hnsw->entryPoint = -1;
+    return hnsw;
+}
+
+// the root does not change the order of distances, so rooted and plain share a graph
+static int knnHnswMatches(const KnnHnsw* hnsw, const KnnParameters* parameters)
+{
+    return hnsw->distanceThreshold == parameters->distanceThreshold && hnsw->distanceExponent == parameters->distanceExponent && hnsw->m == parameters->hnsw.m && hnsw->efConstruction == parameters->hnsw.efConstruction;
+}
+
+// level drawn from the row so a graph comes out the same whichever thread links the row
+static int knnHnswLevel(const KnnHnsw* hnsw, int row)
+{
+    uint64_t hash = (uint64_t)row * 0x9E3779B97F4A7C15ULL + 0x632BE59BD9B4E019ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    double uniform = ((double)(hash >> 11) + 1.0) / 9007199254740992.0;
+    int level = (int)(-log(uniform) * hnsw->levelScale);
+    return level < KNN_HNSW_MAX_LEVEL ? level : KNN_HNSW_MAX_LEVEL;
+}
+
+static inline int* knnHnswLinks(const KnnHnsw* hnsw, int row, int level)
+{
+    KnnHnswChunk* chunk = &hnsw->chunks[row / KNN_CHUNK_ROWS];
+    int chunkRow = row % KNN_CHUNK_ROWS;
+    if (level == 0)
+    {
+        return &chunk->links[(size_t)chunkRow * (1 + 2 * hnsw->m)];
+    }
+    return &chunk->upperLinks[chunkRow][(level - 1) * (1 + hnsw->m)];
+}
+
+static inline void knnHnswLockRow(const KnnHnsw* hnsw, int row)
+{
+    int* lock = &hnsw->chunks[row / KNN_CHUNK_ROWS].locks[row % KNN_CHUNK_ROWS];
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+        }
+    }
+}
+
+static inline void knnHnswUnlockRow(const KnnHnsw* hnsw, int row)
+{
+    __atomic_store_n(&hnsw->chunks[row / KNN_CHUNK_ROWS].locks[row % KNN_CHUNK_ROWS], 0, __ATOMIC_RELEASE);
+}
+
+// gives a row its level and empty link lists, allocating its chunk's arrays on first use, returns 0 on success
+static int knnHnswAllocateRow(KnnHnsw* hnsw, int row, int level)
+{
+    KnnHnswChunk* chunk = &hnsw->chunks[row / KNN_CHUNK_ROWS];
+    int chunkRow = row % KNN_CHUNK_ROWS;
+    int failed = 0;
+    WaitForSingleObject(hnsw->lock, INFINITE);
+    if (chunk->levels == NULL)
+    {
+        chunk->locks = (int*)calloc(KNN_CHUNK_ROWS, sizeof(int));
+        chunk->links = (int*)calloc((size_t)KNN_CHUNK_ROWS * (1 + 2 * hnsw->m), sizeof(int));
+        chunk->upperLinks = (int**)calloc(KNN_CHUNK_ROWS, sizeof(int*));
+        chunk->linked = (unsigned char*)calloc(KNN_CHUNK_ROWS, sizeof(unsigned char));
+        unsigned char* levels = (unsigned char*)calloc(KNN_CHUNK_ROWS, sizeof(unsigned char));
+        if (chunk->locks == NULL || chunk->links == NULL || chunk->upperLinks == NULL || chunk->linked == NULL || levels == NULL)
+        {
+            free(chunk->locks);
+            free(chunk->links);
+            free(chunk->upperLinks);
+            free(chunk->linked);
+            free(levels);
+            memset(chunk, 0, sizeof(KnnHnswChunk));
+            failed = 1;
+        }
+        else
+        {
+            __atomic_store_n(&chunk->levels, levels, __ATOMIC_RELEASE);
+        }
+    }
+    ReleaseMutex(hnsw->lock);
+    if (!failed && level > 0)
+    {
+        chunk->upperLinks[chunkRow] = (int*)calloc((size_t)level * (1 + hnsw->m), sizeof(int));
+        failed = chunk->upperLinks[chunkRow] == NULL;
+    }
+    if (failed)
+    {
+        printf("Failed to allocate memory for knn hnsw row.\n");
+        return -1;
+    }
+    chunk->levels[chunkRow] = (unsigned char)level;
+    return 0;
+}
+
+static inline int knnHnswEntryBefore(const KnnHnswEntry* a, const KnnHnswEntry* b)
+{
+    return a->distance < b->distance || (a->distance == b->distance && a->row < b->row);
+}
+
+// binary heaps, nearest on top for the candidates still to expand, farthest on top for the results kept so far
+static void knnHnswHeapPush(KnnHnswEntry* heap, int* count, KnnHnswEntry entry, int farthestOnTop)
+{
+    int position = (*count)++;
+    while (position > 0)
+    {
+        int parent = (position - 1) / 2;
+        int above = farthestOnTop ? knnHnswEntryBefore(&heap[parent], &entry) : knnHnswEntryBefore(&entry, &heap[parent]);
+        if (!above)
+        {
+            break;
+        }
+        heap[position] = heap[parent];
+        position = parent;
+    }
+    heap[position] = entry;
+}
+
+static KnnHnswEntry knnHnswHeapPop(KnnHnswEntry* heap, int* count, int farthestOnTop)
+{
+    KnnHnswEntry top = heap[0];
+    KnnHnswEntry last = heap[--(*count)];
+    int position = 0;
+    while (1)
+    {
+        int child = 2 * position + 1;
+        if (child >= *count)
+        {
+            break;
+        }
+        if (child + 1 < *count && (farthestOnTop ? knnHnswEntryBefore(&heap[child], &heap[child + 1]) : knnHnswEntryBefore(&heap[child + 1], &heap[child])))
+        {
+            child++;
+        }
+        int below = farthestOnTop ? knnHnswEntryBefore(&last, &heap[child]) : knnHnswEntryBefore(&heap[child], &last);
+        if (!below)
+        {
+            break;
+        }
+        heap[position] = heap[child];
+        position = child;
+    }
+    heap[position] = last;
+    return top;
+}
+
+static int knnHnswVisible(const KnnSnapshot* snapshot, int row)
+{
+    if (snapshot == NULL)
+    {
+        return 1;
+    }
+    const KnnChunk* chunk = &snapshot->generation->chunks[row / KNN_CHUNK_ROWS];
+    return row < snapshot->rowCount && __atomic_load_n(&chunk->deletedVersions[row % KNN_CHUNK_ROWS], __ATOMIC_RELAXED) > snapshot->version;
+}
+
+// best first search of one layer from an entry row, leaving the ef nearest in hnswScratch->results sorted nearest first
+// with a snapshot only rows it can see are kept as results, though every linked row is walked through
+static int knnHnswSearchLayer(KnnModel* model, const KnnHnsw* hnsw, const KnnGeneration* generation, const KnnSnapshot* snapshot, KnnHnswScratch* hnswScratch, const float* query, int entryPoint, float entryDistance, int ef, int level, long long* distanceCount)
+{
+    KnnHnswEntry* candidates = hnswScratch->candidates;
+    KnnHnswEntry* results = hnswScratch->results;
+    unsigned int* visited = hnswScratch->visited;
+    if (++hnswScratch->visitedEpoch == 0)
+    {
+        memset(visited, 0, (size_t)hnswScratch->capacity * sizeof(unsigned int));
+        hnswScratch->visitedEpoch = 1;
+    }
+    unsigned int epoch = hnswScratch->visitedEpoch;
+
+    // an entry row linked after the buffers were sized is still expanded, it is just never marked
+    int candidateCount = 0;
+    int resultCount = 0;
+    KnnHnswEntry entry;
+    entry.distance = entryDistance;
+    entry.row = entryPoint;
+    if (entryPoint < hnswScratch->capacity)
+    {
+        visited[entryPoint] = epoch;
+    }
+    knnHnswHeapPush(candidates, &candidateCount, entry, 0);
+    if (knnHnswVisible(snapshot, entryPoint))
+    {
+        knnHnswHeapPush(results, &resultCount, entry, 1);
+    }
+
+    while (candidateCount > 0)
+    {
+        if (resultCount == ef && candidates[0].distance > results[0].distance)
+        {
+            break;
+        }
+        KnnHnswEntry current = knnHnswHeapPop(candidates, &candidateCount, 0);
+
+        int* links = knnHnswLinks(hnsw, current.row, level);
+        knnHnswLockRow(hnsw, current.row);
+        int linkCount = links[0];
+        memcpy(hnswScratch->links, &links[1], linkCount * sizeof(int));
+        knnHnswUnlockRow(hnsw, current.row);
+
+        for (int linkIndex = 0; linkIndex < linkCount; linkIndex++)
+        {
+            // rows linked by other threads after the buffers were sized are left for the next search
+            int row = hnswScratch->links[linkIndex];
+            if (row >= hnswScratch->capacity || visited[row] == epoch)
+            {
+                continue;
+            }
+            visited[row] = epoch;
+            KnnHnswEntry next;
+            next.distance = knnRowDistance(model, query, knnRowInput(model, generation, row));
+            next.row = row;
+            if (distanceCount != NULL)
+            {
+                (*distanceCount)++;
+            }
+            if (resultCount < ef || knnHnswEntryBefore(&next, &results[0]))
+            {
+                knnHnswHeapPush(candidates, &candidateCount, next, 0);
+                if (knnHnswVisible(snapshot, row))
+                {
+                    knnHnswHeapPush(results, &resultCount, next, 1);
+                    if (resultCount > ef)
+                    {
+                        knnHnswHeapPop(results, &resultCount, 1);
+                    }
+                }
+            }
+        }
+    }
+
+    int count = resultCount;
+    while (resultCount > 0)
+    {
+        KnnHnswEntry farthest = knnHnswHeapPop(results, &resultCount, 1);
+        results[resultCount] = farthest;
+    }
+    return count;
+}
+
+// the neighbour heuristic of the hnsw paper: going nearest first, a candidate is kept only when it is nearer the base row
+// than to every row already kept, which spreads the links out in different directions
+static int knnHnswSelect(KnnModel* model, const KnnGeneration* generation, const KnnHnswEntry* candidates, int candidateCount, int limit, KnnHnswEntry* selected)
+{
+    int selectedCount = 0;
+    for (int candidateIndex = 0; candidateIndex < candidateCount && selectedCount < limit; candidateIndex++)
+    {
+        const float* candidateInput = knnRowInput(model, generation, candidates[candidateIndex].row);
+        int keep = 1;
+        for (int selectedIndex = 0; selectedIndex < selectedCount && keep; selectedIndex++)
+        {
+            keep = !(knnRowDistance(model, candidateInput, knnRowInput(model, generation, selected[selectedIndex].row)) < candidates[candidateIndex].distance);
+        }
+        if (keep)
+        {
+            selected[selectedCount++] = candidates[candidateIndex];
+        }
+    }
+    return selectedCount;
+}
+
+static int compareHnswEntry(const void* a, const void* b)
+{
+    const KnnHnswEntry* e1 = (const KnnHnswEntry*)a;
+    const KnnHnswEntry* e2 = (const KnnHnswEntry*)b;
+    if (knnHnswEntryBefore(e1, e2))
+    {
+        return -1;
+    }
+    return knnHnswEntryBefore(e2, e1);
+}
+
+// links a row to its selected neighbours on one layer and each of them back, a full neighbour is pruned by the heuristic again
+static void knnHnswConnect(KnnModel* model, KnnHnsw* hnsw, const KnnGeneration* generation, int row, int level, const KnnHnswEntry* selected, int selectedCount)
+{
+    int maxLinks = level == 0 ? 2 * hnsw->m : hnsw->m;
+    int* links = knnHnswLinks(hnsw, row, level);
+    knnHnswLockRow(hnsw, row);
+    for (int selectedIndex = 0; selectedIndex < selectedCount; selectedIndex++)
+    {
+        links[1 + selectedIndex] = selected[selectedIndex].row;
+    }
+    links[0] = selectedCount;
+    knnHnswUnlockRow(hnsw, row);
+
+    KnnHnswEntry candidates[2 * KNN_HNSW_MAX_M + 1];
+    KnnHnswEntry kept[2 * KNN_HNSW_MAX_M + 1];
+    for (int selectedIndex = 0; selectedIndex < selectedCount; selectedIndex++)
+    {
+        int neighbour = selected[selectedIndex].row;
+        int* neighbourLinks = knnHnswLinks(hnsw, neighbour, level);
+        knnHnswLockRow(hnsw, neighbour);
+        int linkCount = neighbourLinks[0];
+        if (linkCount < maxLinks)
+        {
+            neighbourLinks[1 + linkCount] = row;
+            neighbourLinks[0] = linkCount + 1;
+        }
+        else
+        {
+            const float* neighbourInput = knnRowInput(model, generation, neighbour);
+            for (int linkIndex = 0; linkIndex < linkCount; linkIndex++)
+            {
+                candidates[linkIndex].row = neighbourLinks[1 + linkIndex];
+                candidates[linkIndex].distance = knnRowDistance(model, neighbourInput, knnRowInput(model, generation, candidates[linkIndex].row));
+            }
+            candidates[linkCount].row = row;
+            candidates[linkCount].distance = selected[selectedIndex].distance;
+            qsort(candidates, linkCount + 1, sizeof(KnnHnswEntry), compareHnswEntry);
+            int keptCount = knnHnswSelect(model, generation, candidates, linkCount + 1, maxLinks, kept);
+            for (int keptIndex = 0; keptIndex < keptCount; keptIndex++)
+            {
+                neighbourLinks[1 + keptIndex] = kept[keptIndex].row;
+            }
+            neighbourLinks[0] = keptCount;
+        }
+        knnHnswUnlockRow(hnsw, neighbour);
+    }
+}
+
+// marks a claimed row done, whether or not it could be linked
+static void knnHnswMarkLinked(KnnHnsw* hnsw, int row)
+{
+    KnnHnswChunk* chunk = &hnsw->chunks[row / KNN_CHUNK_ROWS];
+    if (__atomic_load_n(&chunk->levels, __ATOMIC_ACQUIRE) == NULL)
+    {
+        __atomic_store_n(&hnsw->failed, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_store_n(&chunk->linked[row % KNN_CHUNK_ROWS], 1, __ATOMIC_RELEASE);
+}
+
+// greedy descent through the layers above the row's own, then a wide search and link on each layer it lives on,
+// counting the distances into distanceCount unless it is NULL
+static int knnHnswInsert(KnnModel* model, KnnHnsw* hnsw, const KnnGeneration* generation, KnnHnswScratch* hnswScratch, int row, long long* distanceCount)
+{
+    int level = knnHnswLevel(hnsw, row);
+    if (knnHnswAllocateRow(hnsw, row, level) != 0)
+    {
+        knnHnswMarkLinked(hnsw, row);
+        return -1;
+    }
+    const float* input = knnRowInput(model, generation, row);
+
+    WaitForSingleObject(hnsw->lock, INFINITE);
+    int entryPoint = hnsw->entryPoint;
+    int maxLevel = hnsw->maxLevel;
+    if (entryPoint < 0)
+    {
+        hnsw->maxLevel = level;
+        __atomic_store_n(&hnsw->entryPoint, row, __ATOMIC_RELEASE);
+        ReleaseMutex(hnsw->lock);
+        knnHnswMarkLinked(hnsw, row);
+        return 0;
+    }
+    int newTop = level > maxLevel;
+    if (!newTop)
+    {
+        ReleaseMutex(hnsw->lock);
+    }
+
+    float entryDistance = knnRowDistance(model, input, knnRowInput(model, generation, entryPoint));
+    if (distanceCount != NULL)
+    {
+        (*distanceCount)++;
+    }
+    for (int layer = maxLevel; layer > level; layer--)
+    {
+        knnHnswSearchLayer(model, hnsw, generation, NULL, hnswScratch, input, entryPoint, entryDistance, 1, layer, distanceCount);
+        entryPoint = hnswScratch->results[0].row;
+        entryDistance = hnswScratch->results[0].distance;
+    }
+    KnnHnswEntry selected[KNN_HNSW_MAX_M];
+    for (int layer = level < maxLevel ? level : maxLevel; layer >= 0; layer--)
+    {
+        int resultCount = knnHnswSearchLayer(model, hnsw, generation, NULL, hnswScratch, input, entryPoint, entryDistance, hnsw->efConstruction, layer, distanceCount);
+        int selectedCount = knnHnswSelect(model, generation, hnswScratch->results, resultCount, hnsw->m, selected);
+        knnHnswConnect(model, hnsw, generation, row, layer, selected, selectedCount);
+        entryPoint = hnswScratch->results[0].row;
+        entryDistance = hnswScratch->results[0].distance;
+    }
+
+    if (newTop)
+    {
+        hnsw->maxLevel = level;
+        __atomic_store_n(&hnsw->entryPoint, row, __ATOMIC_RELEASE);
+        ReleaseMutex(hnsw->lock);
+    }
+    knnHnswMarkLinked(hnsw, row);
+    return 0;
+}
+
+// links rows up to rowCount that no other thread has claimed yet, returns 0 on success
+// and -1 when the search buffers do not cover them, which only happens when growing them failed
+static int knnHnswCatchUp(KnnModel* model, KnnHnsw* hnsw, const KnnGeneration* generation, KnnHnswScratch* hnswScratch, int rowCount, long long* distanceCount)
+{
+    if (rowCount > hnswScratch->capacity)
+    {
+        return -1;
+    }
+    int row = __atomic_load_n(&hnsw->claimedRows, __ATOMIC_RELAXED);
+    while (row < rowCount)
+    {
+        if (!__atomic_compare_exchange_n(&hnsw->claimedRows, &row, row + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        if (knnHnswInsert(model, hnsw, generation, hnswScratch, row, distanceCount) != 0)
+        {
+            return -1;
+        }
+        row = __atomic_load_n(&hnsw->claimedRows, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// the generation's graph for the current parameters, a graph for other parameters is replaced,
+// which is safe because parameters never change while a prediction or build runs
+static KnnHnsw* knnGenerationHnsw(KnnModel* model, KnnGeneration* generation)
+{
+    KnnHnsw* hnsw = __atomic_load_n(&generation->hnsw, __ATOMIC_ACQUIRE);
+    if (hnsw != NULL && knnHnswMatches(hnsw, &model->parameters))
+    {
+        return hnsw;
+    }
+    WaitForSingleObject(model->indexLock, INFINITE);
+    hnsw = generation->hnsw;
+    if (hnsw == NULL || !knnHnswMatches(hnsw, &model->parameters))
+    {
+        // without memory for a graph the caller quietly falls back to the scan
+        KnnHnsw* created = knnHnswCreate(&model->parameters);
+        if (created != NULL)
+        {
+            __atomic_store_n(&generation->hnsw, created, __ATOMIC_RELEASE);
+            knnHnswFree(hnsw);
+        }
+        hnsw = created;
+    }
+    ReleaseMutex(model->indexLock);
+    return hnsw;
+}
+
+// carries the old generation's graph over to its compacted copy before the swap, so no prediction relinks the rows:
+// each surviving row keeps its level and its links to surviving rows, and the slots its deleted neighbours held go to
+// the nearest of their surviving neighbours, rows the graph had not linked yet are left to be linked as usual,
+// returns NULL when there is no graph to carry or memory runs out, and the copy's graph is then built from scratch
+static KnnHnsw* knnHnswCarry(KnnModel* model, KnnGeneration* old, const KnnGeneration* generation, const int* rowMap, int rowCount)
+{
+    // held so a parameter change cannot replace the old graph while it is read
+    WaitForSingleObject(model->indexLock, INFINITE);
+    KnnHnsw* source = old->hnsw;
+    int carried = 0;
+    if (source != NULL)
+    {
+        carried = __atomic_load_n(&source->claimedRows, __ATOMIC_RELAXED);
+        carried = carried < rowCount ? carried : rowCount;
+    }
+    int failed = carried == 0;
+
+    // predictions may still be linking claimed rows, their links are only complete once they are marked
+    for (int row = 0; row < carried && !failed; row++)
+    {
+        KnnHnswChunk* chunk = &source->chunks[row / KNN_CHUNK_ROWS];
+        while (!failed && (__atomic_load_n(&chunk->levels, __ATOMIC_ACQUIRE) == NULL || !__atomic_load_n(&chunk->linked[row % KNN_CHUNK_ROWS], __ATOMIC_ACQUIRE)))
+        {
+            failed = __atomic_load_n(&source->failed, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    KnnHnsw* hnsw = failed ? NULL : knnHnswCreate(&model->parameters);
+    KnnHnswEntry* candidates = (KnnHnswEntry*)malloc((size_t)(2 * KNN_HNSW_MAX_M) * (2 * KNN_HNSW_MAX_M) * sizeof(KnnHnswEntry));
+    failed |= hnsw == NULL || candidates == NULL;
+    if (!failed)
+    {
+        hnsw->distanceThreshold = source->distanceThreshold;
+        hnsw->distanceExponent = source->distanceExponent;
+        hnsw->m = source->m;
+        hnsw->efConstruction = source->efConstruction;
+        hnsw->levelScale = source->levelScale;
+    }
+    for (int row = 0; row < carried && !failed; row++)
+    {
+        if (rowMap[row] >= 0)
+        {
+            failed = knnHnswAllocateRow(hnsw, rowMap[row], source->chunks[row / KNN_CHUNK_ROWS].levels[row % KNN_CHUNK_ROWS]) != 0;
+        }
+    }
+
+    int sourceLinks[1 + 2 * KNN_HNSW_MAX_M];
+    int deadLinks[1 + 2 * KNN_HNSW_MAX_M];
+    for (int row = 0; row < carried && !failed; row++)
+    {
+        int newRow = rowMap[row];
+        if (newRow < 0)
+        {
+            continue;
+        }
+        const float* input = knnRowInput(model, generation, newRow);
+        int level = source->chunks[row / KNN_CHUNK_ROWS].levels[row % KNN_CHUNK_ROWS];
+        for (int layer = 0; layer <= level; layer++)
+        {
+            int maxLinks = layer == 0 ? 2 * hnsw->m : hnsw->m;
+            int* links = knnHnswLinks(source, row, layer);
+            knnHnswLockRow(source, row);
+            int linkCount = links[0];
+            memcpy(sourceLinks, &links[1], linkCount * sizeof(int));
+            knnHnswUnlockRow(source, row);
+
+            // links to rows linked after the carried ones are dropped, those rows are linked into the copy again
+            int* newLinks = knnHnswLinks(hnsw, newRow, layer);
+            int keptCount = 0;
+            int candidateCount = 0;
+            for (int linkIndex = 0; linkIndex < linkCount; linkIndex++)
+            {
+                int link = sourceLinks[linkIndex];
+                if (link >= carried)
+                {
+                    continue;
+                }
+                if (rowMap[link] >= 0)
+                {
+                    newLinks[1 + keptCount++] = rowMap[link];
+                    continue;
+                }
+                int* linkLinks = knnHnswLinks(source, link, layer);
+                knnHnswLockRow(source, link);
+                int deadCount = linkLinks[0];
+                memcpy(deadLinks, &linkLinks[1], deadCount * sizeof(int));
+                knnHnswUnlockRow(source, link);
+                for (int deadIndex = 0; deadIndex < deadCount; deadIndex++)
+                {
+                    int candidate = deadLinks[deadIndex];
+                    if (candidate != row && candidate < carried && rowMap[candidate] >= 0)
+                    {
+                        candidates[candidateCount].row = rowMap[candidate];
+                        candidates[candidateCount].distance = knnRowDistance(model, input, knnRowInput(model, generation, rowMap[candidate]));
+                        candidateCount++;
+                    }
+                }
+            }
+            qsort(candidates, candidateCount, sizeof(KnnHnswEntry), compareHnswEntry);
+            for (int candidateIndex = 0; candidateIndex < candidateCount && keptCount < maxLinks; candidateIndex++)
+            {
+                int present = 0;
+                for (int keptIndex = 0; keptIndex < keptCount && !present; keptIndex++)
+                {
+                    present = newLinks[1 + keptIndex] == candidates[candidateIndex].row;
+                }
+                if (!present)
+                {
+                    newLinks[1 + keptCount++] = candidates[candidateIndex].row;
+                }
+            }
+            newLinks[0] = keptCount;
+        }
+
+        if (hnsw->entryPoint < 0 || level > hnsw->maxLevel)
+        {
+            hnsw->entryPoint = newRow;
+            hnsw->maxLevel = level;
+        }
+        hnsw->claimedRows = newRow + 1;
+        knnHnswMarkLinked(hnsw, newRow);
+    }
+    ReleaseMutex(model->indexLock);
+    free(candidates);
+    if (failed || hnsw->entryPoint < 0)
+    {
+        knnHnswFree(hnsw);
+        return NULL;
+    }
+    return hnsw;
+}
+
+// copies the rows alive now into a fresh generation outside storeLock, so appends, deletes and snapshots go on meanwhile,
+// then under it copies the rows appended since, replays the deletes made since and swaps the copy in,
+// readers of the old generation finish undisturbed, returns 0 on success or when no row is dead
+static int knnCompact(KnnModel* model)
+{
+    WaitForSingleObject(model->compactLock, INFINITE);
+    WaitForSingleObject(model->storeLock, INFINITE);
+    KnnGeneration* old = model->generation;
+    int rowCount = old->rowCount;
+    uint64_t version = model->version;
+    int idCount = model->nextId;
+    int idCapacity = model->idCapacity;
+    int dead = rowCount > model->liveCount;
+    if (dead)
+    {
+        model->deleteLogging = 1;
+        model->deletedRowCount = 0;
+        model->deleteLogFailed = 0;
+    }
+    ReleaseMutex(model->storeLock);
+    if (!dead)
+    {
+        ReleaseMutex(model->compactLock);
+        return 0;
+    }
+
+    // only a compaction retires a generation, so the old one stays alive through the copy without a reference
+    KnnGeneration* generation = knnGenerationCreate();
+    int* rowMap = (int*)malloc(((size_t)rowCount + 1) * sizeof(int));
+    int* idRows = (int*)malloc(((size_t)idCapacity + 1) * sizeof(int));
+    int failed = generation == NULL || rowMap == NULL || idRows == NULL;
+    if (failed)
+    {
+        printf("Failed to allocate memory for knn compaction.\n");
+    }
+    for (int id = 0; id < idCapacity && !failed; id++)
+    {
+        idRows[id] = -1;
+    }
+    for (int row = 0; row < rowCount && !failed; row++)
+    {
+        KnnChunk* chunk = &old->chunks[row / KNN_CHUNK_ROWS];
+        int chunkRow = row % KNN_CHUNK_ROWS;
+        rowMap[row] = -1;
+        if (__atomic_load_n(&chunk->deletedVersions[chunkRow], __ATOMIC_RELAXED) <= version)
+        {
+            continue;
+        }
+        int newRow = knnGenerationReserve(generation, model->inputSize, model->outputSize);
+        if (newRow < 0)
+        {
+            failed = 1;
+            break;
+        }
+        int id = chunk->ids[chunkRow];
+        knnGenerationWrite(generation, newRow, model->inputSize, model->outputSize, &chunk->inputs[(size_t)chunkRow * model->inputSize], &chunk->outputs[(size_t)chunkRow * model->outputSize], id, KNN_ALIVE);
+        rowMap[row] = newRow;
+        idRows[id] = newRow;
+        generation->rowCount++;
+    }
+
+    // the copy's trees are built before it is swapped in, so no prediction finds its chunks without them
+    if (!failed && knnIndexActive(&model->parameters))
+    {
+        generation->treeExponent = model->parameters.distanceExponent;
+        knnTreesCatchUp(model, generation);
+    }
+    // and the graph is carried over, so the first prediction after the swap does not relink every row
+    if (!failed)
+    {
+        generation->hnsw = knnHnswCarry(model, old, generation, rowMap, rowCount);
+    }
+
+    WaitForSingleObject(model->storeLock, INFINITE);
+    failed |= model->deleteLogFailed;
+    if (!failed && model->idCapacity > idCapacity)
+    {
+        int* grown = (int*)realloc(idRows, (size_t)model->idCapacity * sizeof(int));
+        failed = grown == NULL;
+        idRows = grown != NULL ? grown : idRows;
+        for (int id = idCapacity; id < model->idCapacity && !failed; id++)
+        {
+            idRows[id] = -1;
+        }
+    }
+
+    // rows appended since the copy started, then the deletes of copied rows made since, are few next to the copy
+    for (int row = rowCount; row < old->rowCount && !failed; row++)
+    {
+        KnnChunk* chunk = &old->chunks[row / KNN_CHUNK_ROWS];
+        int chunkRow = row % KNN_CHUNK_ROWS;
+        if (chunk->deletedVersions[chunkRow] != KNN_ALIVE)
+        {
+            continue;
+        }
+        int newRow = knnGenerationReserve(generation, model->inputSize, model->outputSize);
+        if (newRow < 0)
+        {
+            failed = 1;
+            break;
+        }
+        int id = chunk->ids[chunkRow];
+        knnGenerationWrite(generation, newRow, model->inputSize, model->outputSize, &chunk->inputs[(size_t)chunkRow * model->inputSize], &chunk->outputs[(size_t)chunkRow * model->outputSize], id, KNN_ALIVE);
+        idRows[id] = newRow;
+        generation->rowCount++;
+    }
+    for (int deletedIndex = 0; deletedIndex < model->deletedRowCount && !failed; deletedIndex++)
+    {
+        int row = model->deletedRows[deletedIndex];
+        if (row >= rowCount || rowMap[row] < 0)
+        {
+            continue;
+        }
+        KnnChunk* chunk = &old->chunks[row / KNN_CHUNK_ROWS];
+        int chunkRow = row % KNN_CHUNK_ROWS;
+        int newRow = rowMap[row];
+        generation->chunks[newRow / KNN_CHUNK_ROWS].deletedVersions[newRow % KNN_CHUNK_ROWS] = chunk->deletedVersions[chunkRow];
+        idRows[chunk->ids[chunkRow]] = -1;
+    }
+    model->deleteLogging = 0;
+    model->deletedRowCount = 0;
+    if (!failed)
+    {
+        free(model->idRows);
+        model->idRows = idRows;
+        model->idCapacity = model->idCapacity > idCapacity ? model->idCapacity : idCapacity;
+        idRows = NULL;
+        model->generation = generation;
+        model->version++;
+        old->retired = 1;
+        generation = NULL;
+        if (old->references == 0)
+        {
+            knnGenerationFree(old);
+        }
+    }
+    ReleaseMutex(model->storeLock);
+    ReleaseMutex(model->compactLock);
+    knnGenerationFree(generation);
+    free(rowMap);
+    free(idRows);
+
+    // chunks the rows appended meanwhile filled, or an exponent set meanwhile
+    if (!failed)
+    {
+        knnTreesUpdate(model);
+    }
+    return failed ? -1 : 0;
+}
+
+static DWORD WINAPI knnCompactEntry(LPVOID argument)
+{
+    KnnModel* model = (KnnModel*)argument;
+    knnCompact(model);
+    WaitForSingleObject(model->storeLock, INFINITE);
+    model->compactQueued = 0;
+    ReleaseMutex(model->storeLock);
+    return 0;
+}
+
+void knnParametersDefaults(KnnParameters* parameters)
+{
+    parameters->k = 1;
+    parameters->distanceThreshold = 0.0f;
+    parameters->distanceExponent = 2.0f;
+    parameters->weighting = KNN_WEIGHTING_RECIPROCAL;
+    parameters->rooted = 0;
+    parameters->index = KNN_INDEX_VPTREE;
+    parameters->hnsw.m = 16;
+    parameters->hnsw.efConstruction = 200;
+    parameters->hnsw.efSearch = 64;
+}
+
+static int knnParametersValid(const KnnParameters* parameters, int kCapacity)
+{
+    if (parameters->k < 1 || (kCapacity > 0 && parameters->k > kCapacity))
+    {
+        printf("Invalid knn k: %d\n", parameters->k);
+        return 0;
+    }
+    if (!(parameters->distanceExponent > 0.0f))
+    {
+        printf("Invalid knn distance exponent: %f\n", parameters->distanceExponent);
+        return 0;
+    }
+    if (parameters->weighting < KNN_WEIGHTING_AVERAGE || parameters->weighting > KNN_WEIGHTING_RECIPROCAL)
+    {
+        printf("Invalid knn weighting: %d\n", (int)parameters->weighting);
+        return 0;
+    }
+    if (parameters->index < KNN_INDEX_NONE || parameters->index > KNN_INDEX_HNSW)
+    {
+        printf("Invalid knn index: %d\n", (int)parameters->index);
+        return 0;
+    }
+    if (parameters->index == KNN_INDEX_HNSW && (parameters->hnsw.m < 2 || parameters->hnsw.m > KNN_HNSW_MAX_M || parameters->hnsw.efConstruction < 1 || parameters->hnsw.efSearch < 1))
+    {
+        printf("Invalid knn hnsw parameters, m: %d, efConstruction: %d, efSearch: %d\n", parameters->hnsw.m, parameters->hnsw.efConstruction, parameters->hnsw.efSearch);
+        return 0;
+    }
+    return 1;
+}
+
+KnnModel* knnModelCreate(
+    int inputSize,
+    int outputSize,
+    int trainCount,
+    const float* trainInputs,
+    const float* trainOutputs,
+    const KnnParameters* parameters,
+    int threadCount,
+    int batchSize
+)
+{
+    if (inputSize < 1 || outputSize < 1 || trainCount < 0 || threadCount < 1 || batchSize < 1 || (trainCount > 0 && (trainInputs == NULL || trainOutputs == NULL)))
+    {
+        printf("Invalid knn model arguments.\n");
+        return NULL;
+    }
+    if (!knnParametersValid(parameters, 0))
+    {
+        return NULL;
+    }
+
+    KnnModel* model = (KnnModel*)calloc(1, sizeof(KnnModel));
+    if (model == NULL)
+    {
+        printf("Failed to allocate memory for knn model.\n");
+        return NULL;
+    }
+    model->inputSize = inputSize;
+    model->outputSize = outputSize;
+    model->kCapacity = parameters->k;
+    model->threadCount = threadCount;
+    model->batchSize = batchSize;
+    model->parameters = *parameters;
+    model->tileRows = KNN_TILE_BYTES / (int)(inputSize * sizeof(float));
+    if (model->tileRows < 1)
+    {
+        model->tileRows = 1;
+    }
+    model->kernels = selectKernels();
+    model->storeLock = CreateMutex(NULL, FALSE, NULL);
+    model->compactLock = CreateMutex(NULL, FALSE, NULL);
+    model->indexLock = CreateMutex(NULL, FALSE, NULL);
+    model->generation = knnGenerationCreate();
+    model->scratch = (KnnScratch*)calloc(threadCount, sizeof(KnnScratch));
+    if (model->storeLock == NULL || model->compactLock == NULL || model->indexLock == NULL || model->generation == NULL || model->scratch == NULL)
+    {
+        printf("Failed to allocate memory for knn model.\n");
+        knnModelFree(model);
+        return NULL;
+    }
+
+    // own copy of the train set so the caller may free theirs, row i gets id i
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        if (knnAppendLocked(model, &trainInputs[(size_t)trainIndex * inputSize], &trainOutputs[(size_t)trainIndex * outputSize]) < 0)
+        {
+            knnModelFree(model);
+            return NULL;
+        }
+    }
+
+    for (int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        KnnScratch* scratch = &model->scratch[threadIndex];
+        scratch->indexDistances = (KnnCandidate*)calloc((size_t)batchSize * model->kCapacity, sizeof(KnnCandidate));
+        scratch->neighbourCounts = (int*)calloc(batchSize, sizeof(int));
+        scratch->weightSums = (float*)calloc(batchSize, sizeof(float));
+        scratch->maxDistances = (float*)calloc(batchSize, sizeof(float));
+        if (scratch->indexDistances == NULL || scratch->neighbourCounts == NULL || scratch->weightSums == NULL || scratch->maxDistances == NULL)
+        {
+            printf("Failed to allocate memory for knn scratch.\n");
+            knnModelFree(model);
+            return NULL;
+        }
+    }
+
+    // a tree that cannot be built leaves its chunks to the scan
+    knnTreesUpdate(model);
+    return model;
+}
+
+void knnModelFree(KnnModel* model)
+{
+    if (model == NULL)
+    {
+        return;
+    }
+    if (model->compactThread != NULL)
+    {
+        WaitForMultipleObjects(1, &model->compactThread, TRUE, INFINITE);
+    }
+    if (model->scratch != NULL)
+    {
+        for (int threadIndex = 0; threadIndex < model->threadCount; threadIndex++)
+        {
+            KnnScratch* scratch = &model->scratch[threadIndex];
+            free(scratch->indexDistances);
+            free(scratch->neighbourCounts);
+            free(scratch->weightSums);
+            free(scratch->maxDistances);
+            knnHnswScratchFree(&scratch->hnsw);
+            knnHnswScratchFree(&scratch->hnswGrown);
+        }
+    }
+    free(model->scratch);
+    knnGenerationFree(model->generation);
+    free(model->idRows);
+    free(model->deletedRows);
+    free(model);
+}
+
+int knnModelSetParameters(KnnModel* model, const KnnParameters* parameters)
+{
+    if (!knnParametersValid(parameters, model->kCapacity))
+    {
+        return -1;
+    }
+    if (parameters->index == KNN_INDEX_HNSW)
+    {
+        WaitForSingleObject(model->storeLock, INFINITE);
+        int result = knnHnswScratchGrowLocked(model, model->generation->chunkCount * KNN_CHUNK_ROWS);
+        ReleaseMutex(model->storeLock);
+        if (result != 0)
+        {
+            return -1;
+        }
+    }
+    model->parameters = *parameters;
+    knnTreesUpdate(model);
+    return 0;
+}
+
+void knnModelGetParameters(const KnnModel* model, KnnParameters* parameters)
+{
+    *parameters = model->parameters;
+}
+
+int knnModelInputSize(const KnnModel* model)
+{
+    return model->inputSize;
+}
+
+int knnModelOutputSize(const KnnModel* model)
+{
+    return model->outputSize;
+}
+
+int knnModelTrainCount(KnnModel* model)
+{
+    WaitForSingleObject(model->storeLock, INFINITE);
+    int liveCount = model->liveCount;
+    ReleaseMutex(model->storeLock);
+    return liveCount;
+}
+
+int knnModelThreadCount(const KnnModel* model)
+{
+    return model->threadCount;
+}
+
+int knnModelBatchSize(const KnnModel* model)
+{
+    return model->batchSize;
+}
+
+const char* knnModelIsa(const KnnModel* model)
+{
+    return model->kernels->name;
+}
+
+int knnModelIndexActive(const KnnModel* model)
+{
+    return knnIndexActive(&model->parameters);
+}
+
+long long knnModelDistanceCount(const KnnModel* model)
+{
+    long long distanceCount = 0;
+    for (int threadIndex = 0; threadIndex < model->threadCount; threadIndex++)
+    {
+        distanceCount += model->scratch[threadIndex].distanceCount;
+    }
+    return distanceCount;
+}
+
+int knnModelAppend(KnnModel* model, const float* input, const float* output)
+{
+    if (input == NULL || output == NULL)
+    {
+        printf("Invalid knn append arguments.\n");
+        return -1;
+    }
+    WaitForSingleObject(model->storeLock, INFINITE);
+    int id = knnAppendLocked(model, input, output);
+    int filled = id >= 0 && model->generation->rowCount % KNN_CHUNK_ROWS == 0;
+    ReleaseMutex(model->storeLock);
+
+    // the append that fills a chunk builds its tree, merging the trees the counter carries over
+    if (filled)
+    {
+        knnTreesUpdate(model);
+    }
+    return id;
+}
+
+int knnModelDelete(KnnModel* model, int id)
+{
+    WaitForSingleObject(model->storeLock, INFINITE);
+    if (id < 0 || id >= model->nextId || model->idRows[id] < 0)
+    {
+        ReleaseMutex(model->storeLock);
+        return -1;
+    }
+
+    // readers load deletedVersions without the lock, so the tombstone is a single atomic store
+    KnnGeneration* generation = model->generation;
+    int row = model->idRows[id];
+    model->version++;
+    __atomic_store_n(&generation->chunks[row / KNN_CHUNK_ROWS].deletedVersions[row % KNN_CHUNK_ROWS], model->version, __ATOMIC_RELAXED);
+    model->idRows[id] = -1;
+    model->liveCount--;
+
+    // a compaction copying the generation replays this delete onto its copy, when the log cannot grow the copy is dropped
+    if (model->deleteLogging)
+    {
+        if (model->deletedRowCount == model->deletedRowCapacity)
+        {
+            int deletedRowCapacity = model->deletedRowCapacity > 0 ? model->deletedRowCapacity * 2 : KNN_CHUNK_ROWS;
+            int* deletedRows = (int*)realloc(model->deletedRows, (size_t)deletedRowCapacity * sizeof(int));
+            if (deletedRows == NULL)
+            {
+                model->deleteLogFailed = 1;
+            }
+            else
+            {
+                model->deletedRows = deletedRows;
+                model->deletedRowCapacity = deletedRowCapacity;
+            }
+        }
+        if (model->deletedRowCount < model->deletedRowCapacity)
+        {
+            model->deletedRows[model->deletedRowCount++] = row;
+        }
+    }
+
+    // crossing the dead fraction queues a compaction on its own thread, the previous one has already finished
+    int deadCount = generation->rowCount - model->liveCount;
+    if (!model->compactQueued && deadCount > 0 && (float)deadCount >= KNN_COMPACT_FRACTION * (float)generation->rowCount)
+    {
+        if (model->compactThread != NULL)
+        {
+            WaitForMultipleObjects(1, &model->compactThread, TRUE, INFINITE);
+        }
+        model->compactThread = CreateThread(NULL, 0, knnCompactEntry, model, 0, NULL);
+        model->compactQueued = model->compactThread != NULL;
+    }
+    ReleaseMutex(model->storeLock);
+    return 0;
+}
+
+int knnModelCompact(KnnModel* model)
+{
+    return knnCompact(model);
+}
+
+// distance then id, the order compareIndexDistance gives
+static inline int knnCandidateBefore(float distance, int trainIndex, const KnnCandidate* candidate)
+{
+    return distance < candidate->distance || (distance == candidate->distance && trainIndex < candidate->index);
+}
+
+// keeps the k nearest seen so far sorted by distance then id, whatever order the rows arrive in
+static inline void knnInsertNeighbour(KnnCandidate* indexDistances, int* count, int k, int trainIndex, float distance, const float* output)
+{
+    int position = *count;
+    if (position == k)
+    {
+        if (!knnCandidateBefore(distance, trainIndex, &indexDistances[k - 1]))
+        {
+            return;
+        }
+        position = k - 1;
+    }
+    else
+    {
+        (*count)++;
+    }
+    while (position > 0 && knnCandidateBefore(distance, trainIndex, &indexDistances[position - 1]))
+    {
+        indexDistances[position] = indexDistances[position - 1];
+        position--;
+    }
+    indexDistances[position].index = trainIndex;
+    indexDistances[position].distance = distance;
+    indexDistances[position].output = output;
+}
+
+// weighting and normalization for one k, the same arithmetic as the kIndex for that k in the sweep programs
+static void knnVote(KnnModel* model, KnnScratch* scratch, int batchIndex, float* predictionOutput)
+{
+    const KnnParameters* parameters = &model->parameters;
+    int outputSize = model->outputSize;
+    KnnCandidate* indexDistances = &scratch->indexDistances[(size_t)batchIndex * model->kCapacity];
+    int neighbourCount = scratch->neighbourCounts[batchIndex];
+
+    // find max distance
+    float maxDistance = 0.0f;
+    for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+    {
+        if (indexDistances[neighbourIndex].distance > maxDistance)
+        {
+            maxDistance = indexDistances[neighbourIndex].distance;
+        }
+    }
+    scratch->maxDistances[batchIndex] = maxDistance;
+
+    float weightSum = 0.0f;
+    memset(predictionOutput, 0, outputSize * sizeof(float));
+    for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+    {
+        float distance = indexDistances[neighbourIndex].distance;
+        float weight = 1.0f;
+        if (parameters->weighting == KNN_WEIGHTING_LINEAR)
+        {
+            weight = 1.0f - (distance / (maxDistance + EPSILON));
+        }
+        else if (parameters->weighting == KNN_WEIGHTING_RECIPROCAL)
+        {
+            weight = 1.0f / (distance + EPSILON);
+        }
+        weightSum += weight;
+        model->kernels->accumulate(outputSize, indexDistances[neighbourIndex].output, weight, predictionOutput);
+    }
+    scratch->weightSums[batchIndex] = weightSum;
+
+    // normalize
+    float divisor = parameters->weighting == KNN_WEIGHTING_AVERAGE ? (float)parameters->k : weightSum;
+    for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+    {
+        predictionOutput[outputIndex] /= divisor;
+    }
+}
+
+static int knnArgmax(int size, const float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+// measures one row, offering it as a neighbour when the snapshot can see it
+static inline float knnVpVisit(KnnVpSearch* search, int row)
+{
+    KnnModel* model = search->model;
+    KnnChunk* chunk = &search->snapshot->generation->chunks[row / KNN_CHUNK_ROWS];
+    int chunkRow = row % KNN_CHUNK_ROWS;
+    float distance = knnRowDistance(model, search->query, &chunk->inputs[(size_t)chunkRow * model->inputSize]);
+    search->scratch->distanceCount++;
+    if (__atomic_load_n(&chunk->deletedVersions[chunkRow], __ATOMIC_RELAXED) > search->snapshot->version)
+    {
+        knnInsertNeighbour(search->indexDistances, search->neighbourCount, model->parameters.k, chunk->ids[chunkRow], distance, &chunk->outputs[(size_t)chunkRow * model->outputSize]);
+    }
+    return distance;
+}
+
+// nearer side first, the far side only when the triangle inequality cannot rule out a row at or inside the current kth distance,
+// equal distances are still visited so the id tie break sees them
+static void knnVpSearchNode(KnnVpSearch* search, int nodeIndex)
+{
+    const KnnVpNode* node = &search->tree->nodes[nodeIndex];
+    if (node->row < 0)
+    {
+        const KnnGeneration* generation = search->snapshot->generation;
+        for (int leafIndex = node->leafStart; leafIndex < node->leafStart + node->leafCount; leafIndex++)
+        {
+            int row = search->tree->leafRows[leafIndex];
+            if (__atomic_load_n(&generation->chunks[row / KNN_CHUNK_ROWS].deletedVersions[row % KNN_CHUNK_ROWS], __ATOMIC_RELAXED) > search->snapshot->version)
+            {
+                knnVpVisit(search, row);
+            }
+        }
+        return;
+    }
+
+    float distance = knnVpVisit(search, node->row);
+    int inside = distance < node->radius;
+    int nearChild = inside ? node->inside : node->outside;
+    int farChild = inside ? node->outside : node->inside;
+    if (nearChild >= 0)
+    {
+        knnVpSearchNode(search, nearChild);
+    }
+    if (farChild < 0)
+    {
+        return;
+    }
+    int k = search->model->parameters.k;
+    if (*search->neighbourCount == k)
+    {
+        float reach = search->indexDistances[k - 1].distance;
+        float bound = inside ? node->radius - distance : distance - node->radius;
+        if (bound > reach + (reach + distance + node->radius) * search->slackRelative + search->slackAbsolute)
+        {
+            return;
+        }
+    }
+    knnVpSearchNode(search, farChild);
+}
+
+// neighbours of a block of queries from the graph, linking any snapshot rows not yet in it first,
+// returns -1 when the graph is unavailable and the block should be scanned
+static int knnHnswPredictBlock(KnnModel* model, KnnScratch* scratch, KnnSnapshot* snapshot, int queryCount, const float* queries)
+{
+    KnnGeneration* generation = snapshot->generation;
+    KnnHnsw* hnsw = knnGenerationHnsw(model, generation);
+    if (hnsw == NULL || knnHnswCatchUp(model, hnsw, generation, &scratch->hnsw, snapshot->rowCount, &scratch->distanceCount) != 0)
+    {
+        return -1;
+    }
+    int entryPoint = __atomic_load_n(&hnsw->entryPoint, __ATOMIC_ACQUIRE);
+    if (entryPoint < 0)
+    {
+        return -1;
+    }
+    // the top level is the entry row's own, read with it so a concurrent new top cannot pair a row with a level it lacks
+    int topLevel = hnsw->chunks[entryPoint / KNN_CHUNK_ROWS].levels[entryPoint % KNN_CHUNK_ROWS];
+
+    const KnnParameters* parameters = &model->parameters;
+    int k = parameters->k;
+    int ef = parameters->hnsw.efSearch > k ? parameters->hnsw.efSearch : k;
+    KnnHnswScratch* hnswScratch = &scratch->hnsw;
+    for (int batchIndex = 0; batchIndex < queryCount; batchIndex++)
+    {
+        const float* query = &queries[(size_t)batchIndex * model->inputSize];
+        int queryEntry = entryPoint;
+        float entryDistance = knnRowDistance(model, query, knnRowInput(model, generation, queryEntry));
+        scratch->distanceCount++;
+        for (int layer = topLevel; layer > 0; layer--)
+        {
+            knnHnswSearchLayer(model, hnsw, generation, NULL, hnswScratch, query, queryEntry, entryDistance, 1, layer, &scratch->distanceCount);
+            queryEntry = hnswScratch->results[0].row;
+            entryDistance = hnswScratch->results[0].distance;
+        }
+        int resultCount = knnHnswSearchLayer(model, hnsw, generation, snapshot, hnswScratch, query, queryEntry, entryDistance, ef, 0, &scratch->distanceCount);
+
+        // the nearest visible rows go through the same insertion as scanned ones, so ties and voting match the scan
+        KnnCandidate* indexDistances = &scratch->indexDistances[(size_t)batchIndex * model->kCapacity];
+        int* neighbourCount = &scratch->neighbourCounts[batchIndex];
+        for (int resultIndex = 0; resultIndex < resultCount; resultIndex++)
+        {
+            int row = hnswScratch->results[resultIndex].row;
+            KnnChunk* chunk = &generation->chunks[row / KNN_CHUNK_ROWS];
+            int chunkRow = row % KNN_CHUNK_ROWS;
+            knnInsertNeighbour(indexDistances, neighbourCount, k, chunk->ids[chunkRow], hnswScratch->results[resultIndex].distance, &chunk->outputs[(size_t)chunkRow * model->outputSize]);
+        }
+    }
+    return 0;
+}
+
+// one pass over the snapshot for up to batchSize queries, tile by tile so each train tile is read from memory once per batch
+static void knnPredictBlock(KnnModel* model, KnnScratch* scratch, KnnSnapshot* snapshot, int queryCount, const float* queries)
+{
+    const KnnParameters* parameters = &model->parameters;
+    int inputSize = model->inputSize;
+    int outputSize = model->outputSize;
+    int k = parameters->k;
+    memset(scratch->neighbourCounts, 0, queryCount * sizeof(int));
+    if (parameters->index == KNN_INDEX_HNSW && snapshot->rowCount > 0)
+    {
+        if (knnHnswPredictBlock(model, scratch, snapshot, queryCount, queries) == 0)
+        {
+            return;
+        }
+        memset(scratch->neighbourCounts, 0, queryCount * sizeof(int));
+    }
+
+    // the full chunks the snapshot's trees cover go through them when the distance is a metric, the rest is scanned below
+    int tileStart = 0;
+    if (knnIndexActive(parameters))
+    {
+        // the triangle inequality holds for the exact distance, the slack covers how far the float one strays from it,
+        // rounding in the inputSize term sum, and terms that underflow to zero, which the root turns into an absolute error
+        KnnVpSearch search;
+        search.model = model;
+        search.scratch = scratch;
+        search.snapshot = snapshot;
+        search.slackRelative = 4.0f * (float)inputSize * FLT_EPSILON;
+        search.slackAbsolute = 4.0f * (float)pow((double)inputSize * FLT_TRUE_MIN, 1.0 / parameters->distanceExponent);
+        int chunkIndex = 0;
+        for (int level = KNN_VP_LEVELS - 1; level >= 0; level--)
+        {
+            search.tree = snapshot->trees[level];
+            if (search.tree == NULL)
+            {
+                continue;
+            }
+            if (search.tree->distanceExponent != parameters->distanceExponent)
+            {
+                break;
+            }
+            for (int batchIndex = 0; batchIndex < queryCount; batchIndex++)
+            {
+                search.query = &queries[(size_t)batchIndex * inputSize];
+                search.indexDistances = &scratch->indexDistances[(size_t)batchIndex * model->kCapacity];
+                search.neighbourCount = &scratch->neighbourCounts[batchIndex];
+                knnVpSearchNode(&search, 0);
+            }
+            chunkIndex += 1 << level;
+        }
+        tileStart = chunkIndex * KNN_CHUNK_ROWS;
+    }
+
+    while (tileStart < snapshot->rowCount)
+    {
+        // tiles never straddle a chunk
+        KnnChunk* chunk = &snapshot->generation->chunks[tileStart / KNN_CHUNK_ROWS];
+        int chunkStart = tileStart / KNN_CHUNK_ROWS * KNN_CHUNK_ROWS;
+        int tileEnd = tileStart + model->tileRows;
+        if (tileEnd > chunkStart + KNN_CHUNK_ROWS)
+        {
+            tileEnd = chunkStart + KNN_CHUNK_ROWS;
+        }
+        if (tileEnd > snapshot->rowCount)
+        {
+            tileEnd = snapshot->rowCount;
+        }
+
+        for (int batchIndex = 0; batchIndex < queryCount; batchIndex++)
+        {
+            const float* query = &queries[(size_t)batchIndex * inputSize];
+            KnnCandidate* indexDistances = &scratch->indexDistances[(size_t)batchIndex * model->kCapacity];
+            int* neighbourCount = &scratch->neighbourCounts[batchIndex];
+            for (int row = tileStart; row < tileEnd; row++)
+            {
+                int chunkRow = row - chunkStart;
+                if (__atomic_load_n(&chunk->deletedVersions[chunkRow], __ATOMIC_RELAXED) <= snapshot->version)
+                {
+                    continue;
+                }
+                float distance = knnRowDistance(model, query, &chunk->inputs[(size_t)chunkRow * inputSize]);
+                scratch->distanceCount++;
+                knnInsertNeighbour(indexDistances, neighbourCount, k, chunk->ids[chunkRow], distance, &chunk->outputs[(size_t)chunkRow * outputSize]);
+            }
+        }
+
+        tileStart = tileEnd;
+    }
+}
+
+int knnPredictBatch(
+    KnnModel* model,
+    int threadIndex,
+    int queryCount,
+    const float* queries,
+    float* predictionOutputs,
+    int* predictedLabels,
+    KnnNeighbour* neighbours
+)
+{
+    if (threadIndex < 0 || threadIndex >= model->threadCount || queryCount < 0 || (queryCount > 0 && (queries == NULL || predictionOutputs == NULL)))
+    {
+        printf("Invalid knn predict arguments.\n");
+        return -1;
+    }
+
+    // every block of this call sees the same rows
+    KnnScratch* scratch = &model->scratch[threadIndex];
+    KnnSnapshot snapshot = knnSnapshotAcquire(model, scratch);
+    int k = model->parameters.k;
+    for (int blockStart = 0; blockStart < queryCount; blockStart += model->batchSize)
+    {
+        int blockCount = queryCount - blockStart < model->batchSize ? queryCount - blockStart : model->batchSize;
+        knnPredictBlock(model, scratch, &snapshot, blockCount, &queries[(size_t)blockStart * model->inputSize]);
+        for (int batchIndex = 0; batchIndex < blockCount; batchIndex++)
+        {
+            int queryIndex = blockStart + batchIndex;
+            float* predictionOutput = &predictionOutputs[(size_t)queryIndex * model->outputSize];
+            knnVote(model, scratch, batchIndex, predictionOutput);
+            if (predictedLabels != NULL)
+            {
+                predictedLabels[queryIndex] = knnArgmax(model->outputSize, predictionOutput);
+            }
+            if (neighbours != NULL)
+            {
+                // fewer train rows than k leaves the tail marked with index -1
+                KnnNeighbour* queryNeighbours = &neighbours[(size_t)queryIndex * k];
+                KnnCandidate* candidates = &scratch->indexDistances[(size_t)batchIndex * model->kCapacity];
+                int neighbourCount = scratch->neighbourCounts[batchIndex];
+                for (int neighbourIndex = 0; neighbourIndex < k; neighbourIndex++)
+                {
+                    queryNeighbours[neighbourIndex].index = neighbourIndex < neighbourCount ? candidates[neighbourIndex].index : -1;
+                    queryNeighbours[neighbourIndex].distance = neighbourIndex < neighbourCount ? candidates[neighbourIndex].distance : INFINITY;
+                }
+            }
+        }
+    }
+    knnSnapshotRelease(model, &snapshot);
+    return 0;
+}
+
+typedef struct {
+    KnnModel* model;
+    KnnHnsw* hnsw;
+    const KnnGeneration* generation;
+    int rowCount;
+    int result;
+} KnnBuildArgs;
+
+static DWORD WINAPI knnHnswBuildEntry(LPVOID argument)
+{
+    KnnBuildArgs* buildArgs = (KnnBuildArgs*)argument;
+    KnnHnswScratch hnswScratch;
+    buildArgs->result = knnHnswScratchCreate(&hnswScratch, buildArgs->generation->chunkCount * KNN_CHUNK_ROWS);
+    if (buildArgs->result == 0)
+    {
+        buildArgs->result = knnHnswCatchUp(buildArgs->model, buildArgs->hnsw, buildArgs->generation, &hnswScratch, buildArgs->rowCount, NULL);
+        knnHnswScratchFree(&hnswScratch);
+    }
+    return 0;
+}
+
+int knnModelBuildIndex(KnnModel* model, int threadCount)
+{
+    if (threadCount < 1)
+    {
+        printf("Invalid knn build thread count: %d\n", threadCount);
+        return -1;
+    }
+    KnnSnapshot snapshot = knnSnapshotAcquire(model, NULL);
+    int result = 0;
+    if (knnIndexActive(&model->parameters))
+    {
+        // appends keep the trees up to date, this only retries one that could not be built
+        result = knnTreesUpdate(model);
+    }
+    else if (model->parameters.index == KNN_INDEX_HNSW && snapshot.rowCount > 0)
+    {
+        // every thread claims rows from the same counter, so the graph is linked in parallel
+        KnnHnsw* hnsw = knnGenerationHnsw(model, snapshot.generation);
+        KnnBuildArgs* buildArgs = (KnnBuildArgs*)calloc(threadCount, sizeof(KnnBuildArgs));
+        HANDLE* threads = (HANDLE*)calloc(threadCount, sizeof(HANDLE));
+        if (hnsw == NULL || buildArgs == NULL || threads == NULL)
+        {
+            result = -1;
+        }
+        int startedCount = 0;
+        for (int threadIndex = 0; threadIndex < threadCount && result == 0; threadIndex++)
+        {
+            buildArgs[threadIndex].model = model;
+            buildArgs[threadIndex].hnsw = hnsw;
+            buildArgs[threadIndex].generation = snapshot.generation;
+            buildArgs[threadIndex].rowCount = snapshot.rowCount;
+            threads[threadIndex] = CreateThread(NULL, 0, knnHnswBuildEntry, &buildArgs[threadIndex], 0, NULL);
+            if (threads[threadIndex] == NULL)
+            {
+                printf("Failed to create knn build thread.\n");
+                result = -1;
+                break;
+            }
+            startedCount++;
+        }
+        if (startedCount > 0)
+        {
+            WaitForMultipleObjects(startedCount, threads, TRUE, INFINITE);
+        }
+        for (int threadIndex = 0; threadIndex < startedCount; threadIndex++)
+        {
+            result |= buildArgs[threadIndex].result;
+        }
+        free(buildArgs);
+        free(threads);
+    }
+    knnSnapshotRelease(model, &snapshot);
+    return result;
+}
+
+// what a saved graph was built for, followed per row by its level and, for each layer up to it, the link count and links
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inputSize;
+    uint32_t rowCount;
+    uint32_t m;
+    uint32_t efConstruction;
+    float distanceThreshold;
+    float distanceExponent;
+    int32_t entryPoint;
+    int32_t maxLevel;
+    uint64_t inputsHash;
+} KnnHnswFileHeader;
+
+// fnv-1a over the inputs of the leading rows, so a graph is never loaded over different train data
+static uint64_t knnInputsHash(const KnnModel* model, const KnnGeneration* generation, int rowCount)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int row = 0; row < rowCount; row++)
+    {
+        const unsigned char* bytes = (const unsigned char*)knnRowInput(model, generation, row);
+        for (size_t byteIndex = 0; byteIndex < model->inputSize * sizeof(float); byteIndex++)
+        {
+            hash = (hash ^ bytes[byteIndex]) * 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
+
+int knnModelSaveIndex(KnnModel* model, const char* path)
+{
+    KnnSnapshot snapshot = knnSnapshotAcquire(model, NULL);
+    KnnHnsw* hnsw = snapshot.generation->hnsw;
+    if (hnsw == NULL || !knnHnswMatches(hnsw, &model->parameters) || hnsw->entryPoint < 0)
+    {
+        printf("No knn hnsw graph for the current parameters to save.\n");
+        knnSnapshotRelease(model, &snapshot);
+        return -1;
+    }
+    FILE* file = NULL;
+    if (fopen_s(&file, path, "wb") != 0)
+    {
+        printf("Failed to open %s\n", path);
+        knnSnapshotRelease(model, &snapshot);
+        return -1;
+    }
+
+    KnnHnswFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = KNN_HNSW_MAGIC;
+    header.version = KNN_HNSW_FILE_VERSION;
+    header.inputSize = (uint32_t)model->inputSize;
+    header.rowCount = (uint32_t)hnsw->claimedRows;
+    header.m = (uint32_t)hnsw->m;
+    header.efConstruction = (uint32_t)hnsw->efConstruction;
+    header.distanceThreshold = hnsw->distanceThreshold;
+    header.distanceExponent = hnsw->distanceExponent;
+    header.entryPoint = hnsw->entryPoint;
+    header.maxLevel = hnsw->maxLevel;
+    header.inputsHash = knnInputsHash(model, snapshot.generation, hnsw->claimedRows);
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    for (int row = 0; row < hnsw->claimedRows && !failed; row++)
+    {
+        unsigned char level = hnsw->chunks[row / KNN_CHUNK_ROWS].levels[row % KNN_CHUNK_ROWS];
+        failed |= fwrite(&level, 1, 1, file) != 1;
+        for (int layer = 0; layer <= level && !failed; layer++)
+        {
+            int* links = knnHnswLinks(hnsw, row, layer);
+            failed |= fwrite(links, sizeof(int), 1 + links[0], file) != (size_t)(1 + links[0]);
+        }
+    }
+    failed |= fclose(file) != 0;
+    knnSnapshotRelease(model, &snapshot);
+    if (failed)
+    {
+        printf("Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int knnModelLoadIndex(KnnModel* model, const char* path)
+{
+    FILE* file = NULL;
+    if (fopen_s(&file, path, "rb") != 0)
+    {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+    KnnSnapshot snapshot = knnSnapshotAcquire(model, NULL);
+    const KnnParameters* parameters = &model->parameters;
+    KnnHnswFileHeader header;
+    KnnHnsw* hnsw = NULL;
+    int failed = fread(&header, sizeof(header), 1, file) != 1;
+    if (failed || header.magic != KNN_HNSW_MAGIC || header.version != KNN_HNSW_FILE_VERSION)
+    {
+        printf("%s is not a knn hnsw graph.\n", path);
+        failed = 1;
+    }
+    else if (header.inputSize != (uint32_t)model->inputSize || header.rowCount > (uint32_t)snapshot.rowCount || header.entryPoint < 0 || header.entryPoint >= (int32_t)header.rowCount
+        || header.inputsHash != knnInputsHash(model, snapshot.generation, (int)header.rowCount))
+    {
+        printf("%s was built over other train rows.\n", path);
+        failed = 1;
+    }
+    else if (header.m != (uint32_t)parameters->hnsw.m || header.efConstruction != (uint32_t)parameters->hnsw.efConstruction || header.distanceThreshold != parameters->distanceThreshold || header.distanceExponent != parameters->distanceExponent)
+    {
+        printf("%s was built for m %u, efConstruction %u, threshold %f, exponent %f, not the current parameters.\n", path, header.m, header.efConstruction, header.distanceThreshold, header.distanceExponent);
+        failed = 1;
+    }
+    else
+    {
+        hnsw = knnHnswCreate(parameters);
+        failed = hnsw == NULL;
+    }
+
+    // every link is checked against the row count so a damaged file cannot send a search out of bounds
+    for (int row = 0; row < (int)header.rowCount && !failed; row++)
+    {
+        unsigned char level = 0;
+        failed = fread(&level, 1, 1, file) != 1 || level > KNN_HNSW_MAX_LEVEL || knnHnswAllocateRow(hnsw, row, level) != 0;
+        for (int layer = 0; layer <= level && !failed; layer++)
+        {
+            int* links = knnHnswLinks(hnsw, row, layer);
+            int maxLinks = layer == 0 ? 2 * hnsw->m : hnsw->m;
+            failed = fread(links, sizeof(int), 1, file) != 1 || links[0] < 0 || links[0] > maxLinks || fread(&links[1], sizeof(int), links[0], file) != (size_t)links[0];
+            for (int linkIndex = 1; linkIndex <= links[0] && !failed; linkIndex++)
+            {
+                failed = links[linkIndex] < 0 || links[linkIndex] >= (int)header.rowCount;
+            }
+        }
+        if (!failed)
+        {
+            knnHnswMarkLinked(hnsw, row);
+        }
+        if (failed && hnsw != NULL)
+        {
+            printf("%s is damaged at row %d.\n", path, row);
+        }
+    }
+    fclose(file);
+
+    if (!failed && hnsw->chunks[header.entryPoint / KNN_CHUNK_ROWS].levels[header.entryPoint % KNN_CHUNK_ROWS] != header.maxLevel)
+    {
+        printf("%s is damaged at its entry point.\n", path);
+        failed = 1;
+    }
+    if (!failed)
+    {
+        hnsw->entryPoint = header.entryPoint;
+        hnsw->maxLevel = header.maxLevel;
+        hnsw->claimedRows = (int)header.rowCount;
+        WaitForSingleObject(model->indexLock, INFINITE);
+        KnnHnsw* old = snapshot.generation->hnsw;
+        __atomic_store_n(&snapshot.generation->hnsw, hnsw, __ATOMIC_RELEASE);
+        ReleaseMutex(model->indexLock);
+        knnHnswFree(old);
+        hnsw = NULL;
+    }
+    knnHnswFree(hnsw);
+    knnSnapshotRelease(model, &snapshot);
+    return failed ? -1 : 0;
+}
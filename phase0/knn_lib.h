@@ -0,0 +1,144 @@
+#ifndef KNN_LIB_H
+#define KNN_LIB_H
+
+// libknn, the knn() of the sweep programs behind an opaque model for callers that are not sweeps
+// build knn_lib.c into the program, e.g. $CC server.c knn_lib.c -o server.exe -O3 $LIBS
+// a model copies the train set once and preallocates scratch for threadCount callers,
+// after that knnPredictBatch never allocates and gives results identical to knn() for the same k
+//
+// the train set is a mutable store, rows can be appended and deleted while other threads predict,
+// each knnPredictBatch call sees the rows as they were when it started, and deleted rows are
+// tombstoned until a quarter of the store is dead, when a background thread copies the live rows into fresh memory
+// while appends, deletes and predictions go on, and only swaps the copy in under the store lock
+//
+// when the distance is a true metric, see knnModelIndexActive, full chunks of the store are searched through exact
+// vantage point trees instead of scanned, giving the same neighbours in the same order, other parameters scan as before
+//
+// KNN_INDEX_HNSW trades exactness for speed on any distance: the neighbours come from a hierarchical navigable small world
+// graph over the store and are voted exactly as scanned ones, knn_hnsw reports recall against the scan to pick efSearch,
+// when there is no memory for the graph predictions scan instead
+
+typedef enum {
+    KNN_WEIGHTING_AVERAGE,
+    KNN_WEIGHTING_LINEAR,
+    KNN_WEIGHTING_RECIPROCAL
+} KnnWeighting;
+
+typedef enum {
+    KNN_INDEX_NONE,
+    KNN_INDEX_VPTREE,
+    KNN_INDEX_HNSW
+} KnnIndex;
+
+typedef struct {
+    // links per row above the bottom layer, twice as many on it, at most KNN_HNSW_MAX_M
+    int m;
+    // candidates kept while linking a row, a graph is built for one m, efConstruction, threshold and exponent
+    int efConstruction;
+    // candidates kept while searching, at least k, raising it trades throughput for recall
+    int efSearch;
+} KnnHnswParameters;
+
+#define KNN_HNSW_MAX_M 64
+
+typedef struct {
+    int k;
+    float distanceThreshold;
+    float distanceExponent;
+    KnnWeighting weighting;
+    // applies pow(distance, 1 / distanceExponent) after summing, as the _rooted programs do
+    int rooted;
+    // KNN_INDEX_VPTREE is only used while the parameters make a metric and falls back to the scan otherwise
+    KnnIndex index;
+    KnnHnswParameters hnsw;
+} KnnParameters;
+
+// index is the train row id, rows given to knnModelCreate are 0 to trainCount - 1 and appends continue from there
+typedef struct {
+    int index;
+    float distance;
+} KnnNeighbour;
+
+typedef struct KnnModel KnnModel;
+
+// reciprocal weighting, k 1, no threshold, exponent 2 and the vantage point tree index, hnsw m 16, efConstruction 200, efSearch 64
+void knnParametersDefaults(KnnParameters* parameters);
+
+// threadCount is the number of callers that may predict at once, each passing its own threadIndex,
+// batchSize is how many queries share one pass over the train set, and parameters->k is the largest k the model will serve
+// trainCount may be 0 to start from an empty store, returns NULL with a message on invalid arguments or allocation failure
+KnnModel* knnModelCreate(
+    int inputSize,
+    int outputSize,
+    int trainCount,
+    const float* trainInputs,
+    const float* trainOutputs,
+    const KnnParameters* parameters,
+    int threadCount,
+    int batchSize
+);
+
+void knnModelFree(KnnModel* model);
+
+// switches k, threshold, exponent, weighting, rooted or index without reallocating, k may not exceed the k given at create,
+// switching to KNN_INDEX_HNSW sizes each thread's graph search buffers to the store, which appends then grow
+// not safe while another thread predicts or builds, returns 0 on success
+int knnModelSetParameters(KnnModel* model, const KnnParameters* parameters);
+
+void knnModelGetParameters(const KnnModel* model, KnnParameters* parameters);
+int knnModelInputSize(const KnnModel* model);
+int knnModelOutputSize(const KnnModel* model);
+// live rows, deleted rows excluded
+int knnModelTrainCount(KnnModel* model);
+int knnModelThreadCount(const KnnModel* model);
+int knnModelBatchSize(const KnnModel* model);
+const char* knnModelIsa(const KnnModel* model);
+
+// 1 when the current parameters search through the trees: the vptree index, no threshold,
+// and exponent 1 or an exponent above 1 with rooted set, the append that fills a chunk builds or merges its tree
+// and knnModelSetParameters rebuilds them for a new exponent, so predictions never build one
+int knnModelIndexActive(const KnnModel* model);
+
+// distances measured by predictions so far across all threads, including those of linking the hnsw rows a prediction
+// finds unlinked, knnModelBuildIndex excluded, read it while no thread predicts
+long long knnModelDistanceCount(const KnnModel* model);
+
+// builds the index the current parameters select over the rows stored now, so predictions do not build it on first use,
+// threadCount threads link hnsw rows in parallel, rows appended later are linked by the predictions that first see them,
+// the trees are kept up to date by the writers and this only retries one that could not be built
+// returns 0 on success, with KNN_INDEX_NONE or a non metric vptree setting there is nothing to build
+int knnModelBuildIndex(KnnModel* model, int threadCount);
+
+// writes the hnsw graph of the current parameters, call it after knnModelBuildIndex while no thread predicts or appends
+// returns 0 on success
+int knnModelSaveIndex(KnnModel* model, const char* path);
+
+// reads a graph written by knnModelSaveIndex for the same leading train rows, m, efConstruction, threshold and exponent,
+// rows stored after those the graph covers are linked by the next prediction, returns 0 on success
+int knnModelLoadIndex(KnnModel* model, const char* path);
+
+// adds one train row and returns its id, or -1 on allocation failure
+int knnModelAppend(KnnModel* model, const float* input, const float* output);
+
+// tombstones a row, predictions already running still see it, returns -1 for an unknown or already deleted id
+// the delete that crosses the dead fraction starts the compaction on its own thread and returns without waiting for it
+int knnModelDelete(KnnModel* model, int id);
+
+// drops tombstoned rows now on the calling thread rather than waiting for the dead fraction to trigger it,
+// after any compaction already running, an hnsw graph is carried over without them, returns 0 on success
+int knnModelCompact(KnnModel* model);
+
+// queries is queryCount rows of inputSize, predictionOutputs receives queryCount rows of outputSize,
+// predictedLabels (queryCount) and neighbours (queryCount rows of k, nearest first) may be NULL
+// returns 0 on success
+int knnPredictBatch(
+    KnnModel* model,
+    int threadIndex,
+    int queryCount,
+    const float* queries,
+    float* predictionOutputs,
+    int* predictedLabels,
+    KnnNeighbour* neighbours
+);
+
+#endif
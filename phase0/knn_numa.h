@@ -0,0 +1,262 @@
+#ifndef KNN_NUMA_H
+#define KNN_NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_sparse.h"
+
+// numa placement for the sweeps on multi socket machines: the nodes and their cpus come from sysfs, or the os on
+// windows, workers are pinned round robin over the nodes and allocate their scratch after pinning, so first touch
+// puts it on their own node, and each node gets a copy of the read only arrays every distance pass streams, the train
+// and test inputs and the sparse rows, made by a thread pinned to that node for the same reason
+//
+// the claim range is split into one contiguous share per node, a node's workers claim from their own share first and
+// help the other nodes once it runs out, contiguous shares keep each node's combos adjacent for the warm starts and
+// the per exponent powers
+//
+// on when the machine has more than one node, KNN_NUMA=1 also pins workers on a single node and KNN_NUMA=0 turns it off
+#define NUMA_NODE_MAX 64
+
+typedef struct {
+    int nodeCount;
+    int nodeIds[NUMA_NODE_MAX];
+    int cpuCounts[NUMA_NODE_MAX];
+    int* cpus[NUMA_NODE_MAX];
+} NumaTopology;
+
+// a node's copy of the arrays every distance pass reads
+typedef struct {
+    const NumaTopology* topology;
+    int node;
+    int trainCount;
+    int testCount;
+    int inputSize;
+    const float* trainInputs;
+    const float* testInputs;
+    int sparse;
+    float* localTrainInputs;
+    float* localTestInputs;
+    SparseRows localSparseTrain;
+} NumaReplica;
+
+// one share of the claim range per node
+typedef struct {
+    int nodeCount;
+    int next[NUMA_NODE_MAX];
+    int end[NUMA_NODE_MAX];
+} NumaQueues;
+
+// a node's workers, the combos they ran and their summed wall time
+typedef struct {
+    int threadCount;
+    long long comboCount;
+    uint64_t nanoseconds;
+} NumaCounts;
+
+static void numaAddCpu(NumaTopology* topology, int node, int cpu)
+{
+    if (!platformCpuAllowed(cpu))
+    {
+        return;
+    }
+    int* cpus = (int*)realloc(topology->cpus[node], (topology->cpuCounts[node] + 1) * sizeof(int));
+    if (cpus == NULL)
+    {
+        printf("Failed to allocate memory for the numa topology.\n");
+        exit(1);
+    }
+    cpus[topology->cpuCounts[node]++] = cpu;
+    topology->cpus[node] = cpus;
+}
+
+// the nodes with at least one cpu the process may run on, a single node without cpus when nothing can be read
+static void numaDetect(NumaTopology* topology)
+{
+    memset(topology, 0, sizeof(NumaTopology));
+#ifdef _WIN32
+    ULONG highestNode = 0;
+    GetNumaHighestNodeNumber(&highestNode);
+    for (ULONG nodeId = 0; nodeId <= highestNode && topology->nodeCount < NUMA_NODE_MAX; nodeId++)
+    {
+        ULONGLONG mask = 0;
+        if (!GetNumaNodeProcessorMask((UCHAR)nodeId, &mask))
+        {
+            continue;
+        }
+        int node = topology->nodeCount;
+        topology->nodeIds[node] = (int)nodeId;
+        for (int cpu = 0; cpu < 64; cpu++)
+        {
+            if ((mask >> cpu) & 1)
+            {
+                numaAddCpu(topology, node, cpu);
+            }
+        }
+        topology->nodeCount += topology->cpuCounts[node] > 0;
+    }
+#else
+    // nodeN/cpulist holds ranges like 0-15,32-47, node ids can have gaps
+    for (int nodeId = 0; nodeId < NUMA_NODE_MAX && topology->nodeCount < NUMA_NODE_MAX; nodeId++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodeId);
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        char list[4096];
+        int read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        if (!read)
+        {
+            continue;
+        }
+        int node = topology->nodeCount;
+        topology->nodeIds[node] = nodeId;
+        char* range = list;
+        while (*range >= '0' && *range <= '9')
+        {
+            char* end;
+            int first = (int)strtol(range, &end, 10);
+            int last = *end == '-' ? (int)strtol(end + 1, &end, 10) : first;
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                numaAddCpu(topology, node, cpu);
+            }
+            range = *end == ',' ? end + 1 : end;
+        }
+        topology->nodeCount += topology->cpuCounts[node] > 0;
+    }
+#endif
+    if (topology->nodeCount == 0)
+    {
+        topology->nodeCount = 1;
+    }
+}
+
+// 1 when the sweep should pin and place per node
+static int numaSelect(const NumaTopology* topology)
+{
+    const char* override = getenv("KNN_NUMA");
+    if (override != NULL && override[0] != '\0')
+    {
+        return atoi(override) != 0 && topology->cpuCounts[0] > 0;
+    }
+    return topology->nodeCount > 1;
+}
+
+// pins a worker to a cpu of the node it is dealt to, round robin over the nodes, returns the node
+static int numaPin(const NumaTopology* topology, int threadIndex)
+{
+    int node = threadIndex % topology->nodeCount;
+    if (topology->cpuCounts[node] > 0)
+    {
+        platformPinThread(topology->cpus[node][threadIndex / topology->nodeCount % topology->cpuCounts[node]]);
+    }
+    return node;
+}
+
+static DWORD WINAPI numaReplicaEntry(LPVOID arg)
+{
+    NumaReplica* replica = (NumaReplica*)arg;
+    numaPin(replica->topology, replica->node);
+    replica->localTrainInputs = (float*)arenaCalloc((size_t)replica->trainCount * replica->inputSize, sizeof(float));
+    replica->localTestInputs = (float*)arenaCalloc((size_t)replica->testCount * replica->inputSize, sizeof(float));
+    if (replica->localTrainInputs == NULL || replica->localTestInputs == NULL)
+    {
+        printf("Failed to allocate memory for a numa replica.\n");
+        exit(1);
+    }
+    memcpy(replica->localTrainInputs, replica->trainInputs, (size_t)replica->trainCount * replica->inputSize * sizeof(float));
+    memcpy(replica->localTestInputs, replica->testInputs, (size_t)replica->testCount * replica->inputSize * sizeof(float));
+    if (replica->sparse)
+    {
+        sparseRowsCreate(&replica->localSparseTrain, replica->trainCount, replica->inputSize, replica->localTrainInputs);
+    }
+    return 0;
+}
+
+// one copy per node, each made by a thread pinned to that node, sparse rows too when the sweep runs sparse
+static NumaReplica* numaReplicate(const NumaTopology* topology, int trainCount, int testCount, int inputSize, const float* trainInputs, const float* testInputs, int sparse)
+{
+    NumaReplica* replicas = (NumaReplica*)calloc(topology->nodeCount, sizeof(NumaReplica));
+    HANDLE* threads = (HANDLE*)calloc(topology->nodeCount, sizeof(HANDLE));
+    if (replicas == NULL || threads == NULL)
+    {
+        printf("Failed to allocate memory for numa replicas.\n");
+        exit(1);
+    }
+    for (int node = 0; node < topology->nodeCount; node++)
+    {
+        NumaReplica* replica = &replicas[node];
+        replica->topology = topology;
+        replica->node = node;
+        replica->trainCount = trainCount;
+        replica->testCount = testCount;
+        replica->inputSize = inputSize;
+        replica->trainInputs = trainInputs;
+        replica->testInputs = testInputs;
+        replica->sparse = sparse;
+        threads[node] = CreateThread(NULL, 0, numaReplicaEntry, replica, 0, NULL);
+        if (threads[node] == NULL)
+        {
+            printf("Failed to create a numa replica thread.\n");
+            exit(1);
+        }
+    }
+    WaitForMultipleObjects(topology->nodeCount, threads, TRUE, INFINITE);
+    free(threads);
+    return replicas;
+}
+
+// contiguous shares of count claims, one per node
+static void numaQueuesCreate(NumaQueues* queues, int nodeCount, int count)
+{
+    queues->nodeCount = nodeCount;
+    for (int node = 0; node < nodeCount; node++)
+    {
+        queues->next[node] = (int)((long long)count * node / nodeCount);
+        queues->end[node] = (int)((long long)count * (node + 1) / nodeCount);
+    }
+}
+
+// up to maximum consecutive claims from the node's own share, or the next node's with any left,
+// returns the first with their number in *count, or -1 once every share is done, call under the sweep's lock
+static int numaClaim(NumaQueues* queues, int node, int maximum, int* count)
+{
+    for (int offset = 0; offset < queues->nodeCount; offset++)
+    {
+        int share = (node + offset) % queues->nodeCount;
+        int left = queues->end[share] - queues->next[share];
+        if (left <= 0)
+        {
+            continue;
+        }
+        int first = queues->next[share];
+        *count = left < maximum ? left : maximum;
+        queues->next[share] += *count;
+        return first;
+    }
+    *count = 0;
+    return -1;
+}
+
+static void numaReport(const NumaTopology* topology, const NumaCounts* counts)
+{
+    for (int node = 0; node < topology->nodeCount; node++)
+    {
+        double seconds = (double)counts[node].nanoseconds / 1000000000.0;
+        printf("NUMA node %d: %d cpus, %d threads, %lld combos, %.2f combos per thread second\n",
+            topology->nodeIds[node],
+            topology->cpuCounts[node],
+            counts[node].threadCount,
+            counts[node].comboCount,
+            seconds > 0.0 ? counts[node].comboCount / seconds : 0.0);
+    }
+}
+
+#endif
@@ -0,0 +1,618 @@
+#ifndef KNN_PCA_H
+#define KNN_PCA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_sort.h"
+
+// approximate filter and refine: the train rows are projected onto their top principal components, a query ranks every
+// row by euclidean distance in that small space and measures the exact thresholded power distance only for the nearest
+// shortlist, the other rows keep an infinite distance, so the sweep votes on the kmax nearest of the shortlist
+//
+// the euclidean distance between projections only depends on the subspace, not its basis or the mean, so the fit is
+// subspace iteration on the covariance of a sample of rows, and rows are projected uncentred, skipping zero inputs
+// the shortlist does not depend on the threshold or exponent, so every test row's shortlist is picked once per run,
+// and one query in PCA_RECALL_STRIDE, staggered over the combos, also runs the full scan to report recall@kmax against it
+//
+// off unless KNN_PCA sets the shortlist size, KNN_PCA_COMPONENTS sets the dimensions and KNN_PCA_CACHE the file the basis
+// and train projections are kept in, which a later run over the same train rows and dimensions loads instead of fitting
+#define PCA_COMPONENTS_DEFAULT 48
+// covariance sample rows, spread evenly over the train set
+#define PCA_SAMPLE_MAX 10000
+#define PCA_ITERATIONS 24
+#define PCA_RECALL_STRIDE 128
+#define PCA_CACHE_MAGIC 0x31414350u
+#define PCA_CACHE_FILE_VERSION 1
+
+typedef struct {
+    int trainCount;
+    int inputSize;
+    int componentCount;
+    // inputSize x componentCount orthonormal basis and trainCount x componentCount projections
+    float* basis;
+    float* trainProjections;
+    // testCount x shortlistCount train rows, nearest projection first
+    int testCount;
+    int shortlistCount;
+    int* shortlists;
+} PcaFilter;
+
+// sampled queries, the kmax nearest they had to find and found
+typedef struct {
+    long long queryCount;
+    long long sampledCount;
+    long long exactCount;
+    long long foundCount;
+} PcaCounts;
+
+// the per thread state of a sweep: the current query's shortlist, the distances measured for it,
+// and the kmax smallest of the full scan on sampled queries
+typedef struct {
+    const PcaFilter* filter;
+    const int* shortlist;
+    int sampled;
+    int comboCount;
+    float* shortlistDistances;
+    DistanceHeap heap;
+    PcaCounts counts;
+} PcaScratch;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t trainCount;
+    int32_t inputSize;
+    int32_t componentCount;
+    int32_t reserved;
+    uint64_t checksum;
+} PcaCacheHeader;
+
+typedef struct {
+    PcaFilter* filter;
+    int inputSize;
+    int componentCount;
+    int sampleCount;
+    int trainCount;
+    const float* inputs;
+    const double* covariance;
+    const double* basis;
+    double* product;
+    double* sums;
+} PcaFit;
+
+typedef struct {
+    PcaFilter* filter;
+    const float* testInputs;
+} PcaShortlistArgs;
+
+typedef struct {
+    int index;
+    float distance;
+} PcaCandidate;
+
+// the shortlist size, 0 when KNN_PCA is unset, never below kmax so every vote has kmax measured rows
+static int pcaSelect(int kMax, int trainCount, int inputSize, int* componentCount)
+{
+    const char* components = getenv("KNN_PCA_COMPONENTS");
+    *componentCount = components != NULL && components[0] != '\0' ? atoi(components) : PCA_COMPONENTS_DEFAULT;
+    if (*componentCount < 1)
+    {
+        *componentCount = 1;
+    }
+    if (*componentCount > inputSize)
+    {
+        *componentCount = inputSize;
+    }
+    const char* shortlist = getenv("KNN_PCA");
+    int shortlistCount = shortlist != NULL && shortlist[0] != '\0' ? atoi(shortlist) : 0;
+    if (shortlistCount <= 0)
+    {
+        return 0;
+    }
+    if (shortlistCount < kMax)
+    {
+        shortlistCount = kMax;
+    }
+    return shortlistCount < trainCount ? shortlistCount : trainCount;
+}
+
+static const char* pcaCachePath(void)
+{
+    const char* path = getenv("KNN_PCA_CACHE");
+    return path != NULL && path[0] != '\0' ? path : "knn_pca.cache";
+}
+
+// fnv-1a over the bits of every train input, a cache fitted on other rows is refitted
+static uint64_t pcaChecksum(int trainCount, int inputSize, const float* inputs)
+{
+    uint64_t checksum = 0xcbf29ce484222325ull;
+    for (size_t valueIndex = 0; valueIndex < (size_t)trainCount * inputSize; valueIndex++)
+    {
+        uint32_t bits;
+        memcpy(&bits, &inputs[valueIndex], sizeof(bits));
+        checksum = (checksum ^ bits) * 0x100000001b3ull;
+    }
+    return checksum;
+}
+
+// the uncentred second moments of the sample rows for covariance rows [start, end), upper triangle only,
+// each sample adds its products of nonzero inputs, which on mostly zero rows is a small part of inputSize squared
+static void pcaMoments(void* context, int start, int end)
+{
+    PcaFit* fit = (PcaFit*)context;
+    int inputSize = fit->inputSize;
+    int* nonzero = (int*)calloc(inputSize, sizeof(int));
+    if (nonzero == NULL)
+    {
+        printf("Failed to allocate memory for pca moments.\n");
+        exit(1);
+    }
+    for (int sample = 0; sample < fit->sampleCount; sample++)
+    {
+        int row = (int)((long long)fit->trainCount * sample / fit->sampleCount);
+        const float* input = &fit->inputs[(size_t)row * inputSize];
+        int nonzeroCount = 0;
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            if (input[inputIndex] != 0.0f)
+            {
+                nonzero[nonzeroCount++] = inputIndex;
+            }
+        }
+        for (int first = 0; first < nonzeroCount; first++)
+        {
+            int i = nonzero[first];
+            if (i < start || i >= end)
+            {
+                continue;
+            }
+            double value = input[i];
+            double* sums = &fit->sums[(size_t)i * inputSize];
+            for (int second = first; second < nonzeroCount; second++)
+            {
+                sums[nonzero[second]] += value * input[nonzero[second]];
+            }
+        }
+    }
+    free(nonzero);
+}
+
+// rows [start, end) of covariance x basis
+static void pcaMultiply(void* context, int start, int end)
+{
+    PcaFit* fit = (PcaFit*)context;
+    int inputSize = fit->inputSize;
+    int componentCount = fit->componentCount;
+    for (int i = start; i < end; i++)
+    {
+        double* product = &fit->product[(size_t)i * componentCount];
+        memset(product, 0, componentCount * sizeof(double));
+        for (int j = 0; j < inputSize; j++)
+        {
+            double value = fit->covariance[(size_t)i * inputSize + j];
+            if (value == 0.0)
+            {
+                continue;
+            }
+            const double* basis = &fit->basis[(size_t)j * componentCount];
+            for (int component = 0; component < componentCount; component++)
+            {
+                product[component] += value * basis[component];
+            }
+        }
+    }
+}
+
+// a row's coordinates in the basis, zero inputs add nothing
+static void pcaProject(const PcaFilter* filter, const float* input, float* projection)
+{
+    memset(projection, 0, filter->componentCount * sizeof(float));
+    for (int inputIndex = 0; inputIndex < filter->inputSize; inputIndex++)
+    {
+        float value = input[inputIndex];
+        if (value == 0.0f)
+        {
+            continue;
+        }
+        const float* basis = &filter->basis[(size_t)inputIndex * filter->componentCount];
+        for (int component = 0; component < filter->componentCount; component++)
+        {
+            projection[component] += value * basis[component];
+        }
+    }
+}
+
+static void pcaProjectTrain(void* context, int start, int end)
+{
+    PcaFit* fit = (PcaFit*)context;
+    PcaFilter* filter = fit->filter;
+    for (int row = start; row < end; row++)
+    {
+        pcaProject(filter, &fit->inputs[(size_t)row * fit->inputSize], &filter->trainProjections[(size_t)row * filter->componentCount]);
+    }
+}
+
+// the top principal subspace of a sample of the train rows, then every train row's projection onto it
+static void pcaFit(PcaFilter* filter, const float* trainInputs, int threadCount)
+{
+    int inputSize = filter->inputSize;
+    int componentCount = filter->componentCount;
+    PcaFit fit;
+    memset(&fit, 0, sizeof(fit));
+    fit.filter = filter;
+    fit.inputSize = inputSize;
+    fit.componentCount = componentCount;
+    fit.trainCount = filter->trainCount;
+    fit.sampleCount = filter->trainCount < PCA_SAMPLE_MAX ? filter->trainCount : PCA_SAMPLE_MAX;
+    fit.inputs = trainInputs;
+    fit.sums = (double*)calloc((size_t)inputSize * inputSize, sizeof(double));
+    double* mean = (double*)calloc(inputSize, sizeof(double));
+    double* basis = (double*)calloc((size_t)inputSize * componentCount, sizeof(double));
+    fit.product = (double*)calloc((size_t)inputSize * componentCount, sizeof(double));
+    if (fit.sums == NULL || mean == NULL || basis == NULL || fit.product == NULL)
+    {
+        printf("Failed to allocate memory for the pca fit.\n");
+        exit(1);
+    }
+
+    // covariance from the second moments and the mean, mirrored into the lower triangle
+    platformParallel(threadCount, inputSize, pcaMoments, &fit);
+    for (int sample = 0; sample < fit.sampleCount; sample++)
+    {
+        const float* input = &trainInputs[(size_t)((long long)fit.trainCount * sample / fit.sampleCount) * inputSize];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            mean[inputIndex] += input[inputIndex];
+        }
+    }
+    for (int i = 0; i < inputSize; i++)
+    {
+        mean[i] /= fit.sampleCount;
+    }
+    for (int i = 0; i < inputSize; i++)
+    {
+        for (int j = i; j < inputSize; j++)
+        {
+            double covariance = fit.sums[(size_t)i * inputSize + j] / fit.sampleCount - mean[i] * mean[j];
+            fit.sums[(size_t)i * inputSize + j] = covariance;
+            fit.sums[(size_t)j * inputSize + i] = covariance;
+        }
+    }
+    fit.covariance = fit.sums;
+    fit.basis = basis;
+
+    // subspace iteration from a fixed pseudo random start, multiply then orthonormalize with modified gram-schmidt
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t valueIndex = 0; valueIndex < (size_t)inputSize * componentCount; valueIndex++)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        basis[valueIndex] = (double)(state >> 11) / 9007199254740992.0 - 0.5;
+    }
+    for (int iteration = 0; iteration <= PCA_ITERATIONS; iteration++)
+    {
+        if (iteration > 0)
+        {
+            platformParallel(threadCount, inputSize, pcaMultiply, &fit);
+            memcpy(basis, fit.product, (size_t)inputSize * componentCount * sizeof(double));
+        }
+        for (int component = 0; component < componentCount; component++)
+        {
+            for (int previous = 0; previous < component; previous++)
+            {
+                double dot = 0.0;
+                for (int i = 0; i < inputSize; i++)
+                {
+                    dot += basis[(size_t)i * componentCount + component] * basis[(size_t)i * componentCount + previous];
+                }
+                for (int i = 0; i < inputSize; i++)
+                {
+                    basis[(size_t)i * componentCount + component] -= dot * basis[(size_t)i * componentCount + previous];
+                }
+            }
+            double norm = 0.0;
+            for (int i = 0; i < inputSize; i++)
+            {
+                norm += basis[(size_t)i * componentCount + component] * basis[(size_t)i * componentCount + component];
+            }
+            // a component the data does not span is dropped to zero rather than amplified noise
+            norm = sqrt(norm);
+            for (int i = 0; i < inputSize; i++)
+            {
+                basis[(size_t)i * componentCount + component] = norm > 1e-150 ? basis[(size_t)i * componentCount + component] / norm : 0.0;
+            }
+        }
+    }
+    for (size_t valueIndex = 0; valueIndex < (size_t)inputSize * componentCount; valueIndex++)
+    {
+        filter->basis[valueIndex] = (float)basis[valueIndex];
+    }
+    free(fit.sums);
+    free(mean);
+    free(basis);
+    free(fit.product);
+
+    platformParallel(threadCount, filter->trainCount, pcaProjectTrain, &fit);
+}
+
+// 1 when path holds the basis and projections for these train rows
+static int pcaLoad(PcaFilter* filter, const char* path, uint64_t checksum)
+{
+    FILE* file = NULL;
+    if (fopen_s(&file, path, "rb") != 0 || file == NULL)
+    {
+        return 0;
+    }
+    PcaCacheHeader header;
+    int loaded = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == PCA_CACHE_MAGIC && header.version == PCA_CACHE_FILE_VERSION
+        && header.trainCount == filter->trainCount && header.inputSize == filter->inputSize
+        && header.componentCount == filter->componentCount && header.checksum == checksum
+        && fread(filter->basis, sizeof(float), (size_t)filter->inputSize * filter->componentCount, file) == (size_t)filter->inputSize * filter->componentCount
+        && fread(filter->trainProjections, sizeof(float), (size_t)filter->trainCount * filter->componentCount, file) == (size_t)filter->trainCount * filter->componentCount;
+    fclose(file);
+    return loaded;
+}
+
+// a cache that cannot be written only costs the next run a refit
+static void pcaSave(const PcaFilter* filter, const char* path, uint64_t checksum)
+{
+    FILE* file = NULL;
+    if (fopen_s(&file, path, "wb") != 0 || file == NULL)
+    {
+        printf("Could not write pca cache %s\n", path);
+        return;
+    }
+    PcaCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PCA_CACHE_MAGIC;
+    header.version = PCA_CACHE_FILE_VERSION;
+    header.trainCount = filter->trainCount;
+    header.inputSize = filter->inputSize;
+    header.componentCount = filter->componentCount;
+    header.checksum = checksum;
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(filter->basis, sizeof(float), (size_t)filter->inputSize * filter->componentCount, file) != (size_t)filter->inputSize * filter->componentCount
+        || fwrite(filter->trainProjections, sizeof(float), (size_t)filter->trainCount * filter->componentCount, file) != (size_t)filter->trainCount * filter->componentCount;
+    failed |= fclose(file) != 0;
+    if (failed)
+    {
+        printf("Could not write pca cache %s\n", path);
+        remove(path);
+    }
+}
+
+// moves the count smallest candidates to the front, in no particular order
+static void pcaSelectNearest(PcaCandidate* candidates, int candidateCount, int count)
+{
+    int low = 0;
+    int high = candidateCount - 1;
+    while (low < high)
+    {
+        float pivot = candidates[low + (high - low) / 2].distance;
+        int i = low;
+        int j = high;
+        while (i <= j)
+        {
+            while (candidates[i].distance < pivot)
+            {
+                i++;
+            }
+            while (candidates[j].distance > pivot)
+            {
+                j--;
+            }
+            if (i <= j)
+            {
+                PcaCandidate swap = candidates[i];
+                candidates[i] = candidates[j];
+                candidates[j] = swap;
+                i++;
+                j--;
+            }
+        }
+        if (count - 1 <= j)
+        {
+            high = j;
+        }
+        else if (count - 1 >= i)
+        {
+            low = i;
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+static int comparePcaCandidate(const void* a, const void* b)
+{
+    const PcaCandidate* candidate1 = (const PcaCandidate*)a;
+    const PcaCandidate* candidate2 = (const PcaCandidate*)b;
+    if (candidate1->distance < candidate2->distance)
+    {
+        return -1;
+    }
+    if (candidate1->distance > candidate2->distance)
+    {
+        return 1;
+    }
+    return candidate1->index - candidate2->index;
+}
+
+// shortlists of test rows [start, end)
+static void pcaShortlist(void* context, int start, int end)
+{
+    PcaShortlistArgs* args = (PcaShortlistArgs*)context;
+    PcaFilter* filter = args->filter;
+    int componentCount = filter->componentCount;
+    float* projection = (float*)calloc(componentCount, sizeof(float));
+    PcaCandidate* candidates = (PcaCandidate*)calloc(filter->trainCount, sizeof(PcaCandidate));
+    if (projection == NULL || candidates == NULL)
+    {
+        printf("Failed to allocate memory for pca shortlists.\n");
+        exit(1);
+    }
+    for (int testIndex = start; testIndex < end; testIndex++)
+    {
+        pcaProject(filter, &args->testInputs[(size_t)testIndex * filter->inputSize], projection);
+        for (int row = 0; row < filter->trainCount; row++)
+        {
+            const float* trainProjection = &filter->trainProjections[(size_t)row * componentCount];
+            float distance = 0.0f;
+            for (int component = 0; component < componentCount; component++)
+            {
+                float difference = projection[component] - trainProjection[component];
+                distance += difference * difference;
+            }
+            candidates[row].index = row;
+            candidates[row].distance = distance;
+        }
+        // nearest first, so the measured rows are read in a steady order
+        pcaSelectNearest(candidates, filter->trainCount, filter->shortlistCount);
+        qsort(candidates, filter->shortlistCount, sizeof(PcaCandidate), comparePcaCandidate);
+        int* shortlist = &filter->shortlists[(size_t)testIndex * filter->shortlistCount];
+        for (int position = 0; position < filter->shortlistCount; position++)
+        {
+            shortlist[position] = candidates[position].index;
+        }
+    }
+    free(projection);
+    free(candidates);
+}
+
+// loads or fits the projection, then picks every test row's shortlist with threadCount threads, returns 1 when the cache was used
+static int pcaFilterCreate(
+    PcaFilter* filter,
+    int trainCount,
+    int inputSize,
+    const float* trainInputs,
+    int testCount,
+    const float* testInputs,
+    int componentCount,
+    int shortlistCount,
+    int threadCount,
+    const char* cachePath
+)
+{
+    memset(filter, 0, sizeof(PcaFilter));
+    filter->trainCount = trainCount;
+    filter->inputSize = inputSize;
+    filter->componentCount = componentCount;
+    filter->testCount = testCount;
+    filter->shortlistCount = shortlistCount;
+    filter->basis = (float*)arenaCalloc((size_t)inputSize * componentCount, sizeof(float));
+    filter->trainProjections = (float*)arenaCalloc((size_t)trainCount * componentCount, sizeof(float));
+    filter->shortlists = (int*)arenaCalloc((size_t)testCount * shortlistCount > 0 ? (size_t)testCount * shortlistCount : 1, sizeof(int));
+    if (filter->basis == NULL || filter->trainProjections == NULL || filter->shortlists == NULL)
+    {
+        printf("Failed to allocate memory for the pca filter.\n");
+        exit(1);
+    }
+
+    uint64_t checksum = pcaChecksum(trainCount, inputSize, trainInputs);
+    int cached = pcaLoad(filter, cachePath, checksum);
+    if (!cached)
+    {
+        pcaFit(filter, trainInputs, threadCount);
+        pcaSave(filter, cachePath, checksum);
+    }
+
+    PcaShortlistArgs args;
+    args.filter = filter;
+    args.testInputs = testInputs;
+    platformParallel(threadCount, testCount, pcaShortlist, &args);
+    return cached;
+}
+
+static void pcaFilterFree(PcaFilter* filter)
+{
+    arenaFree(filter->basis);
+    arenaFree(filter->trainProjections);
+    arenaFree(filter->shortlists);
+    memset(filter, 0, sizeof(PcaFilter));
+}
+
+// filter may be NULL for a full scan, then nothing is allocated
+static void pcaScratchCreate(PcaScratch* scratch, const PcaFilter* filter)
+{
+    memset(scratch, 0, sizeof(PcaScratch));
+    if (filter == NULL)
+    {
+        return;
+    }
+    scratch->filter = filter;
+    scratch->shortlistDistances = (float*)arenaCalloc(filter->shortlistCount > 0 ? filter->shortlistCount : 1, sizeof(float));
+    if (scratch->shortlistDistances == NULL)
+    {
+        printf("Failed to allocate memory for pca scratch.\n");
+        exit(1);
+    }
+}
+
+static void pcaScratchFree(PcaScratch* scratch)
+{
+    arenaFree(scratch->shortlistDistances);
+    distanceHeapFree(&scratch->heap);
+    memset(scratch, 0, sizeof(PcaScratch));
+}
+
+static void pcaPrepare(PcaScratch* scratch, int kMax)
+{
+    distanceHeapReset(&scratch->heap, kMax);
+    scratch->comboCount++;
+}
+
+static void pcaLoadTest(PcaScratch* scratch, int testIndex)
+{
+    scratch->shortlist = &scratch->filter->shortlists[(size_t)testIndex * scratch->filter->shortlistCount];
+    scratch->sampled = (testIndex + scratch->comboCount) % PCA_RECALL_STRIDE == 0;
+    scratch->heap.count = 0;
+    scratch->counts.queryCount++;
+}
+
+// the distance measured for a shortlist position
+static void pcaOffer(PcaScratch* scratch, int position, float distance)
+{
+    scratch->shortlistDistances[position] = distance;
+}
+
+// a distance of the full scan on a sampled query
+static void pcaExactOffer(PcaScratch* scratch, float distance)
+{
+    distanceHeapOffer(&scratch->heap, distance);
+}
+
+// after the full scan: the shortlist found as many of the kmax nearest as it has rows within the kmax-th exact distance,
+// rows tied with it count as found, either is a valid neighbour
+static void pcaRecall(PcaScratch* scratch)
+{
+    int found = 0;
+    for (int position = 0; position < scratch->filter->shortlistCount; position++)
+    {
+        found += scratch->heap.count < scratch->heap.size || scratch->shortlistDistances[position] <= scratch->heap.values[0];
+    }
+    scratch->counts.sampledCount++;
+    scratch->counts.exactCount += scratch->heap.count;
+    scratch->counts.foundCount += found < scratch->heap.count ? found : scratch->heap.count;
+}
+
+static void pcaCountsAdd(PcaCounts* total, const PcaCounts* counts)
+{
+    total->queryCount += counts->queryCount;
+    total->sampledCount += counts->sampledCount;
+    total->exactCount += counts->exactCount;
+    total->foundCount += counts->foundCount;
+}
+
+static void pcaReport(const PcaCounts* counts, int kMax)
+{
+    printf("PCA recall@%d: %.2f%% over %lld of %lld queries\n", kMax, counts->exactCount > 0 ? 100.0 * counts->foundCount / counts->exactCount : 0.0, counts->sampledCount, counts->queryCount);
+}
+
+#endif
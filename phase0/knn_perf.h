@@ -0,0 +1,168 @@
+#ifndef KNN_PERF_H
+#define KNN_PERF_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// per thread hardware counter group, cycles lead the group so every member is scheduled together
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+static const char* perfEventNames[PERF_EVENT_COUNT] = {
+    "Cycles",
+    "Instructions",
+    "CacheRefs",
+    "CacheMisses",
+    "BranchMisses",
+    "L1DMisses",
+};
+
+typedef struct {
+    int fds[PERF_EVENT_COUNT];
+    int slots[PERF_EVENT_COUNT];
+    int openCount;
+    uint64_t timeEnabled;
+    uint64_t timeRunning;
+} PerfGroup;
+
+#ifdef __linux__
+static int perfEventOpen(PerfEvent event, int groupFd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (event)
+    {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_CACHE_REFERENCES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_REFERENCES;
+            break;
+        case PERF_CACHE_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        default:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+    }
+
+    // pid 0 and cpu -1 counts the calling thread on whichever cpu it runs
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+#endif
+
+// opens the group for the calling thread, returns 0 on success or -1 with a reason
+// members other than the cycles leader that the pmu or container refuses are left out rather than failing the group
+static int perfOpen(PerfGroup* group, char* reason, int reasonSize)
+{
+    memset(group, 0, sizeof(PerfGroup));
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        group->fds[event] = -1;
+        group->slots[event] = -1;
+    }
+#ifdef __linux__
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        int fd = perfEventOpen((PerfEvent)event, event == PERF_CYCLES ? -1 : group->fds[PERF_CYCLES]);
+        if (fd < 0)
+        {
+            if (event == PERF_CYCLES)
+            {
+                snprintf(reason, reasonSize, "perf_event_open failed: %s", strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        group->fds[event] = fd;
+        group->slots[event] = group->openCount++;
+    }
+    return 0;
+#else
+    snprintf(reason, reasonSize, "perf_event_open is only available on linux");
+    return -1;
+#endif
+}
+
+// reads every open member at once, events left out of the group read as zero
+static int perfRead(PerfGroup* group, uint64_t* values)
+{
+    memset(values, 0, PERF_EVENT_COUNT * sizeof(uint64_t));
+#ifdef __linux__
+    uint64_t buffer[3 + PERF_EVENT_COUNT];
+    if (group->openCount == 0)
+    {
+        return -1;
+    }
+    ssize_t size = read(group->fds[PERF_CYCLES], buffer, sizeof(buffer));
+    if (size < (ssize_t)((3 + group->openCount) * sizeof(uint64_t)))
+    {
+        return -1;
+    }
+    group->timeEnabled = buffer[1];
+    group->timeRunning = buffer[2];
+    for (int event = 0; event < PERF_EVENT_COUNT; event++)
+    {
+        if (group->slots[event] >= 0)
+        {
+            values[event] = buffer[3 + group->slots[event]];
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void perfClose(PerfGroup* group)
+{
+#ifdef __linux__
+    for (int event = PERF_EVENT_COUNT - 1; event >= 0; event--)
+    {
+        if (group->fds[event] >= 0)
+        {
+            close(group->fds[event]);
+        }
+    }
+#endif
+    memset(group, 0, sizeof(PerfGroup));
+}
+
+static int perfHasEvent(PerfGroup* group, PerfEvent event)
+{
+    return group->slots[event] >= 0 && group->openCount > 0;
+}
+
+#endif
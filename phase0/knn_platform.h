@@ -0,0 +1,457 @@
+#ifndef KNN_PLATFORM_H
+#define KNN_PLATFORM_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KNN_X86 1
+#else
+#define KNN_X86 0
+#endif
+
+#ifdef _WIN32
+#include <stdlib.h>
+#include <windows.h>
+#include <share.h>
+#include <intrin.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if KNN_X86
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+// the small win32 subset the sweep programs use, mapped onto pthreads so they build and run on linux
+// WaitForSingleObject is only ever used on mutexes and WaitForMultipleObjects only on threads
+typedef void* HANDLE;
+typedef void* LPVOID;
+typedef unsigned long DWORD;
+
+#define WINAPI
+#define INFINITE 0xFFFFFFFF
+#define TRUE 1
+#define FALSE 0
+#define _SH_DENYNO 0
+
+typedef struct {
+    pthread_t thread;
+    DWORD (*start)(LPVOID);
+    LPVOID argument;
+} PlatformThread;
+
+static HANDLE CreateMutex(void* attributes, int initialOwner, const char* name)
+{
+    (void)attributes;
+    (void)name;
+    pthread_mutex_t* mutex = (pthread_mutex_t*)calloc(1, sizeof(pthread_mutex_t));
+    if (mutex == NULL || pthread_mutex_init(mutex, NULL) != 0)
+    {
+        free(mutex);
+        return NULL;
+    }
+    if (initialOwner)
+    {
+        pthread_mutex_lock(mutex);
+    }
+    return mutex;
+}
+
+// only a mutex is ever waited on, and always without a timeout
+static DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+    (void)milliseconds;
+    pthread_mutex_lock((pthread_mutex_t*)handle);
+    return 0;
+}
+
+static int ReleaseMutex(HANDLE handle)
+{
+    return pthread_mutex_unlock((pthread_mutex_t*)handle) == 0;
+}
+
+static void* platformThreadStart(void* argument)
+{
+    PlatformThread* platformThread = (PlatformThread*)argument;
+    platformThread->start(platformThread->argument);
+    return NULL;
+}
+
+static HANDLE CreateThread(void* attributes, size_t stackSize, DWORD (*start)(LPVOID), LPVOID argument, DWORD flags, DWORD* threadId)
+{
+    (void)attributes;
+    (void)stackSize;
+    (void)flags;
+    (void)threadId;
+    PlatformThread* platformThread = (PlatformThread*)calloc(1, sizeof(PlatformThread));
+    if (platformThread == NULL)
+    {
+        return NULL;
+    }
+    platformThread->start = start;
+    platformThread->argument = argument;
+    if (pthread_create(&platformThread->thread, NULL, platformThreadStart, platformThread) != 0)
+    {
+        free(platformThread);
+        return NULL;
+    }
+    return platformThread;
+}
+
+// only threads are ever waited on, all of them and without a timeout
+static DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, int waitAll, DWORD milliseconds)
+{
+    (void)waitAll;
+    (void)milliseconds;
+    for (DWORD index = 0; index < count; index++)
+    {
+        pthread_join(((PlatformThread*)handles[index])->thread, NULL);
+    }
+    return 0;
+}
+
+static int fopen_s(FILE** file, const char* filename, const char* mode)
+{
+    *file = fopen(filename, mode);
+    return *file == NULL;
+}
+
+static FILE* _fsopen(const char* filename, const char* mode, int shareFlag)
+{
+    (void)shareFlag;
+    return fopen(filename, mode);
+}
+#endif
+
+// one contiguous range of a parallel loop
+typedef struct {
+    void (*run)(void* context, int start, int end);
+    void* context;
+    int start;
+    int end;
+} PlatformJob;
+
+static DWORD WINAPI platformJobEntry(LPVOID argument)
+{
+    PlatformJob* job = (PlatformJob*)argument;
+    job->run(job->context, job->start, job->end);
+    return 0;
+}
+
+// splits [0, count) into threadCount contiguous ranges, a range whose thread cannot be started runs on the caller
+static void platformParallel(int threadCount, int count, void (*run)(void* context, int start, int end), void* context)
+{
+    if (threadCount > count)
+    {
+        threadCount = count;
+    }
+    PlatformJob* jobs = threadCount > 1 ? (PlatformJob*)calloc(threadCount, sizeof(PlatformJob)) : NULL;
+    HANDLE* threads = threadCount > 1 ? (HANDLE*)calloc(threadCount, sizeof(HANDLE)) : NULL;
+    if (jobs == NULL || threads == NULL)
+    {
+        free(jobs);
+        free(threads);
+        run(context, 0, count);
+        return;
+    }
+    int startedCount = 0;
+    for (int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        PlatformJob* job = &jobs[threadIndex];
+        job->run = run;
+        job->context = context;
+        job->start = (int)((long long)count * threadIndex / threadCount);
+        job->end = (int)((long long)count * (threadIndex + 1) / threadCount);
+        threads[startedCount] = CreateThread(NULL, 0, platformJobEntry, job, 0, NULL);
+        if (threads[startedCount] == NULL)
+        {
+            run(context, job->start, job->end);
+            continue;
+        }
+        startedCount++;
+    }
+    if (startedCount > 0)
+    {
+        WaitForMultipleObjects(startedCount, threads, TRUE, INFINITE);
+    }
+    free(jobs);
+    free(threads);
+}
+
+// monotonic wall clock in nanoseconds
+static inline uint64_t platformNanoseconds(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = { 0 };
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+    uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000000ull + remainder * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// cpu time of the calling thread in nanoseconds, unlike the wall clock it leaves out time other threads ran
+static inline uint64_t platformThreadNanoseconds(void)
+{
+#ifdef _WIN32
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+    uint64_t kernelTicks = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+    uint64_t userTicks = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+    return (kernelTicks + userTicks) * 100ull;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// maps a whole file read only so its pages are read on first touch and shared between processes,
+// returns NULL when it cannot be opened or is empty, unmap with platformUnmapFile
+static const void* platformMapFile(const char* path, size_t* size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    // the view keeps the mapping alive
+    const void* address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    *size = (size_t)fileSize.QuadPart;
+    return address;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void* address = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (size_t)status.st_size;
+    return address;
+#endif
+}
+
+static void platformUnmapFile(const void* address, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(address);
+#else
+    munmap((void*)address, size);
+#endif
+}
+
+#define PLATFORM_PAGE_BYTES 4096
+#define PLATFORM_HUGE_PAGE_BYTES (2u << 20)
+
+typedef enum {
+    PAGES_SMALL,
+    // madvise on linux, which the kernel may or may not back, plain pages elsewhere
+    PAGES_TRANSPARENT,
+    // reserved huge pages, hugetlbfs on linux and large pages on windows, which need the lock memory privilege
+    PAGES_EXPLICIT
+} PageKind;
+
+// writes a zero to every page so the faults happen here rather than in the first scan
+static void platformPrefault(void* address, size_t size)
+{
+    volatile char* bytes = (volatile char*)address;
+    for (size_t offset = 0; offset < size; offset += PLATFORM_PAGE_BYTES)
+    {
+        bytes[offset] = 0;
+    }
+}
+
+// zeroed anonymous pages, every page faulted in before it returns, *size is rounded up to the pages used and *kind
+// lowered to what was granted, explicit huge pages fall back to transparent ones and those to small pages,
+// returns NULL when even small pages fail, the pages stay mapped until the program exits
+static void* platformAllocatePages(size_t* size, PageKind* kind)
+{
+#ifdef _WIN32
+    if (*kind == PAGES_EXPLICIT)
+    {
+        size_t largePage = GetLargePageMinimum();
+        if (largePage > 0)
+        {
+            size_t largeSize = (*size + largePage - 1) / largePage * largePage;
+            void* address = VirtualAlloc(NULL, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (address != NULL)
+            {
+                *size = largeSize;
+                return address;
+            }
+        }
+    }
+    *kind = PAGES_SMALL;
+    *size = (*size + PLATFORM_PAGE_BYTES - 1) / PLATFORM_PAGE_BYTES * PLATFORM_PAGE_BYTES;
+    void* address = VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (address != NULL)
+    {
+        platformPrefault(address, *size);
+    }
+    return address;
+#else
+    size_t hugeSize = (*size + PLATFORM_HUGE_PAGE_BYTES - 1) / PLATFORM_HUGE_PAGE_BYTES * PLATFORM_HUGE_PAGE_BYTES;
+#ifdef MAP_HUGETLB
+    if (*kind == PAGES_EXPLICIT)
+    {
+        void* address = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (address != MAP_FAILED)
+        {
+            *size = hugeSize;
+            platformPrefault(address, *size);
+            return address;
+        }
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (*kind != PAGES_SMALL)
+    {
+        // the kernel only backs whole aligned huge pages, so map one more and trim both ends to the boundary
+        char* mapped = (char*)mmap(NULL, hugeSize + PLATFORM_HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED)
+        {
+            char* address = (char*)(((uintptr_t)mapped + PLATFORM_HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(PLATFORM_HUGE_PAGE_BYTES - 1));
+            if (address > mapped)
+            {
+                munmap(mapped, address - mapped);
+            }
+            munmap(address + hugeSize, mapped + PLATFORM_HUGE_PAGE_BYTES - address);
+            if (madvise(address, hugeSize, MADV_HUGEPAGE) == 0)
+            {
+                *kind = PAGES_TRANSPARENT;
+                *size = hugeSize;
+                platformPrefault(address, *size);
+                return address;
+            }
+            munmap(address, hugeSize);
+        }
+    }
+#endif
+    *kind = PAGES_SMALL;
+    *size = (*size + PLATFORM_PAGE_BYTES - 1) / PLATFORM_PAGE_BYTES * PLATFORM_PAGE_BYTES;
+    void* address = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED)
+    {
+        return NULL;
+    }
+    platformPrefault(address, *size);
+    return address;
+#endif
+}
+
+#define PLATFORM_CPU_MAX 1024
+
+// whether the process may run on a cpu, cpus outside a container's or a job's set are not
+static int platformCpuAllowed(int cpu)
+{
+    if (cpu < 0 || cpu >= PLATFORM_CPU_MAX)
+    {
+        return 0;
+    }
+#ifdef _WIN32
+    DWORD_PTR processMask, systemMask;
+    if (cpu >= (int)(8 * sizeof(DWORD_PTR)) || !GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+    {
+        return 0;
+    }
+    return (processMask >> cpu) & 1;
+#elif defined(__linux__)
+    // the raw syscall, the glibc wrappers and cpu_set_t need _GNU_SOURCE before the first system header
+    unsigned long mask[PLATFORM_CPU_MAX / (8 * sizeof(unsigned long))] = { 0 };
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0)
+    {
+        return 1;
+    }
+    return (mask[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long)))) & 1;
+#else
+    return 1;
+#endif
+}
+
+// pins the calling thread to one cpu, 0 when the os does not let it
+static int platformPinThread(int cpu)
+{
+    if (cpu < 0 || cpu >= PLATFORM_CPU_MAX)
+    {
+        return 0;
+    }
+#ifdef _WIN32
+    if (cpu >= (int)(8 * sizeof(DWORD_PTR)))
+    {
+        return 0;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+    unsigned long mask[PLATFORM_CPU_MAX / (8 * sizeof(unsigned long))] = { 0 };
+    mask[cpu / (8 * sizeof(unsigned long))] = 1ul << (cpu % (8 * sizeof(unsigned long)));
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0;
+#else
+    return 0;
+#endif
+}
+
+// set bits of a word, a single instruction when the build targets popcnt and a few shifts otherwise
+static inline int platformPopcount64(uint64_t value)
+{
+#ifdef _MSC_VER
+    return (int)__popcnt64(value);
+#else
+    return __builtin_popcountll(value);
+#endif
+}
+
+// time stamp counter ticks, these are reference cycles rather than core cycles on modern cpus
+static inline uint64_t platformCycles(void)
+{
+#if KNN_X86
+    return __rdtsc();
+#else
+    return platformNanoseconds();
+#endif
+}
+
+#endif
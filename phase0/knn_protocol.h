@@ -0,0 +1,82 @@
+#ifndef KNN_PROTOCOL_H
+#define KNN_PROTOCOL_H
+
+#include <stdint.h>
+
+// wire format between knn_server and knn_client over a unix domain stream socket, native endianness since both ends are local
+// on connect the server sends a KnnHello, then the client sends any number of requests without waiting,
+// each a KnnRequestHeader and inputSize floats, and the server answers each with a KnnResponseHeader and outputSize floats
+// responses to one connection can arrive out of order when requests land in different batches, the id pairs them up
+#define KNN_PROTOCOL_MAGIC 0x514E4E4Bu
+#define KNN_DEFAULT_SOCKET "/tmp/knn.sock"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t inputSize;
+    uint32_t outputSize;
+    uint32_t k;
+} KnnHello;
+
+typedef struct {
+    uint32_t id;
+} KnnRequestHeader;
+
+typedef struct {
+    uint32_t id;
+    int32_t label;
+} KnnResponseHeader;
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// loops over partial reads, returns 0 once size bytes arrived or -1 on error or end of stream
+static int readFull(int fd, void* buffer, size_t size)
+{
+    uint8_t* bytes = (uint8_t*)buffer;
+    while (size > 0)
+    {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return -1;
+        }
+        bytes += received;
+        size -= (size_t)received;
+    }
+    return 0;
+}
+
+// MSG_NOSIGNAL so a peer that hung up fails the write instead of raising SIGPIPE
+static int writeFull(int fd, const void* buffer, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    while (size > 0)
+    {
+#ifdef MSG_NOSIGNAL
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+#else
+        ssize_t sent = send(fd, bytes, size, 0);
+#endif
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,1049 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_dispatch.h"
+#include "knn_quantized.h"
+
+#define EPSILON 0.0000001f
+
+#define KNN_IVFPQ_MAGIC 0x51504649u
+#define KNN_IVFPQ_FILE_VERSION 1
+// sections start on cache line boundaries so the mapped arrays are aligned
+#define KNN_IVFPQ_ALIGN 64
+// the default sample gives the larger of the two k-means this many rows per centroid
+#define KNN_IVFPQ_SAMPLES_PER_CENTROID 32
+
+// the file is this header followed by the sections at the offsets it records:
+// centroids (listCount rows of inputSize), codebooks (KNN_IVFPQ_CODES codewords per subspace, subspace after subspace),
+// list starts (listCount + 1), ids and codes (rowCount of each, grouped by list), outputs and optionally inputs (by id)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inputSize;
+    uint32_t outputSize;
+    uint32_t rowCount;
+    uint32_t listCount;
+    uint32_t subspaceCount;
+    uint32_t iterations;
+    uint32_t sampleCount;
+    uint32_t hasInputs;
+    float distanceThreshold;
+    float distanceExponent;
+    uint64_t centroidsOffset;
+    uint64_t codebooksOffset;
+    uint64_t listStartsOffset;
+    uint64_t idsOffset;
+    uint64_t codesOffset;
+    uint64_t outputsOffset;
+    uint64_t inputsOffset;
+    uint64_t fileSize;
+} KnnIvfpqFileHeader;
+
+typedef struct {
+    float distance;
+    int id;
+} KnnIvfpqEntry;
+
+// per thread buffers, sized at open so prediction never allocates
+typedef struct {
+    KnnIvfpqEntry* lists;
+    float* residual;
+    float* table;
+    KnnIvfpqEntry* shortlist;
+    long long codeCount;
+    long long distanceCount;
+} KnnIvfpqScratch;
+
+struct KnnIvfpq {
+    const unsigned char* file;
+    size_t fileSize;
+    KnnIvfpqFileHeader header;
+    const float* centroids;
+    const float* codebooks;
+    const int32_t* listStarts;
+    const int32_t* ids;
+    const uint8_t* codes;
+    const float* outputs;
+    const float* inputs;
+    int* subspaceStarts;
+    KnnIvfpqParameters parameters;
+    int kCapacity;
+    int shortlistCapacity;
+    int threadCount;
+    const KnnKernels* kernels;
+    KnnIvfpqScratch* scratch;
+};
+
+typedef struct {
+    const KnnKernels* kernels;
+    int count;
+    int dimension;
+    // floats from one vector to the next, the vectors of a subspace are slices of wider rows
+    int stride;
+    const float* vectors;
+    int centroidCount;
+    float* centroids;
+    float distanceThreshold;
+    float distanceExponent;
+    int* assignments;
+} KnnKmeans;
+
+typedef struct {
+    const KnnKernels* kernels;
+    const KnnIvfpqTrainParameters* parameters;
+    int inputSize;
+    int subspaceCount;
+    const int* subspaceStarts;
+    int sampleCount;
+    const float* residuals;
+    float* codebooks;
+    int failed;
+} KnnCodebookArgs;
+
+typedef struct {
+    const KnnKernels* kernels;
+    const KnnIvfpqTrainParameters* parameters;
+    int inputSize;
+    int listCount;
+    int subspaceCount;
+    const int* subspaceStarts;
+    const float* trainInputs;
+    const float* centroids;
+    const float* codebooks;
+    int* rowLists;
+    uint8_t* rowCodes;
+    int failed;
+} KnnEncodeArgs;
+
+static inline int knnIvfpqSubspaceStart(int inputSize, int subspaceCount, int subspace)
+{
+    return (int)((long long)inputSize * subspace / subspaceCount);
+}
+
+static int knnNearestCentroid(const KnnKernels* kernels, int dimension, const float* vector, int centroidCount, const float* centroids, float distanceThreshold, float distanceExponent)
+{
+    int nearest = 0;
+    float nearestDistance = INFINITY;
+    for (int centroid = 0; centroid < centroidCount; centroid++)
+    {
+        float distance = kernels->distance(dimension, vector, &centroids[(size_t)centroid * dimension], distanceThreshold, distanceExponent);
+        if (distance < nearestDistance)
+        {
+            nearest = centroid;
+            nearestDistance = distance;
+        }
+    }
+    return nearest;
+}
+
+static void knnKmeansAssign(void* context, int start, int end)
+{
+    KnnKmeans* kmeans = (KnnKmeans*)context;
+    for (int vector = start; vector < end; vector++)
+    {
+        kmeans->assignments[vector] = knnNearestCentroid(kmeans->kernels, kmeans->dimension, &kmeans->vectors[(size_t)vector * kmeans->stride], kmeans->centroidCount, kmeans->centroids, kmeans->distanceThreshold, kmeans->distanceExponent);
+    }
+}
+
+// lloyd's iterations from evenly spaced vectors, the assignment step on threadCount threads,
+// leaves assignments matching the returned centroids, returns 0 on success
+static int knnKmeans(KnnKmeans* kmeans, int iterations, int threadCount)
+{
+    int dimension = kmeans->dimension;
+    int centroidCount = kmeans->centroidCount;
+    double* sums = (double*)calloc((size_t)centroidCount * dimension, sizeof(double));
+    int* counts = (int*)calloc(centroidCount, sizeof(int));
+    if (sums == NULL || counts == NULL)
+    {
+        free(sums);
+        free(counts);
+        return -1;
+    }
+    for (int centroid = 0; centroid < centroidCount; centroid++)
+    {
+        int vector = (int)((long long)kmeans->count * centroid / centroidCount);
+        memcpy(&kmeans->centroids[(size_t)centroid * dimension], &kmeans->vectors[(size_t)vector * kmeans->stride], dimension * sizeof(float));
+    }
+
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        platformParallel(threadCount, kmeans->count, knnKmeansAssign, kmeans);
+        memset(sums, 0, (size_t)centroidCount * dimension * sizeof(double));
+        memset(counts, 0, centroidCount * sizeof(int));
+        for (int vector = 0; vector < kmeans->count; vector++)
+        {
+            int centroid = kmeans->assignments[vector];
+            const float* values = &kmeans->vectors[(size_t)vector * kmeans->stride];
+            double* sum = &sums[(size_t)centroid * dimension];
+            for (int dimensionIndex = 0; dimensionIndex < dimension; dimensionIndex++)
+            {
+                sum[dimensionIndex] += values[dimensionIndex];
+            }
+            counts[centroid]++;
+        }
+        for (int centroid = 0; centroid < centroidCount; centroid++)
+        {
+            float* values = &kmeans->centroids[(size_t)centroid * dimension];
+            if (counts[centroid] > 0)
+            {
+                for (int dimensionIndex = 0; dimensionIndex < dimension; dimensionIndex++)
+                {
+                    values[dimensionIndex] = (float)(sums[(size_t)centroid * dimension + dimensionIndex] / counts[centroid]);
+                }
+                continue;
+            }
+
+            // an empty centroid takes a member of the largest cluster, which the next assignment splits
+            int largest = 0;
+            for (int other = 1; other < centroidCount; other++)
+            {
+                if (counts[other] > counts[largest])
+                {
+                    largest = other;
+                }
+            }
+            int skip = counts[largest] / 2;
+            for (int vector = 0; vector < kmeans->count; vector++)
+            {
+                if (kmeans->assignments[vector] == largest && skip-- == 0)
+                {
+                    memcpy(values, &kmeans->vectors[(size_t)vector * kmeans->stride], dimension * sizeof(float));
+                    kmeans->assignments[vector] = centroid;
+                    counts[largest]--;
+                    counts[centroid]++;
+                    break;
+                }
+            }
+        }
+    }
+    platformParallel(threadCount, kmeans->count, knnKmeansAssign, kmeans);
+    free(sums);
+    free(counts);
+    return 0;
+}
+
+// each subspace's codebook is its own k-means over the residual slices, so subspaces train in parallel
+static void knnTrainCodebooks(void* context, int start, int end)
+{
+    KnnCodebookArgs* codebookArgs = (KnnCodebookArgs*)context;
+    int* assignments = (int*)calloc(codebookArgs->sampleCount, sizeof(int));
+    if (assignments == NULL)
+    {
+        codebookArgs->failed = 1;
+        return;
+    }
+    for (int subspace = start; subspace < end; subspace++)
+    {
+        int subspaceStart = codebookArgs->subspaceStarts[subspace];
+        KnnKmeans kmeans;
+        kmeans.kernels = codebookArgs->kernels;
+        kmeans.count = codebookArgs->sampleCount;
+        kmeans.dimension = codebookArgs->subspaceStarts[subspace + 1] - subspaceStart;
+        kmeans.stride = codebookArgs->inputSize;
+        kmeans.vectors = &codebookArgs->residuals[subspaceStart];
+        kmeans.centroidCount = KNN_IVFPQ_CODES;
+        kmeans.centroids = &codebookArgs->codebooks[(size_t)KNN_IVFPQ_CODES * subspaceStart];
+        kmeans.distanceThreshold = codebookArgs->parameters->distanceThreshold;
+        kmeans.distanceExponent = codebookArgs->parameters->distanceExponent;
+        kmeans.assignments = assignments;
+        if (knnKmeans(&kmeans, codebookArgs->parameters->iterations, 1) != 0)
+        {
+            codebookArgs->failed = 1;
+        }
+    }
+    free(assignments);
+}
+
+static void knnEncodeRows(void* context, int start, int end)
+{
+    KnnEncodeArgs* encodeArgs = (KnnEncodeArgs*)context;
+    int inputSize = encodeArgs->inputSize;
+    float distanceThreshold = encodeArgs->parameters->distanceThreshold;
+    float distanceExponent = encodeArgs->parameters->distanceExponent;
+    float* residual = (float*)calloc(inputSize, sizeof(float));
+    if (residual == NULL)
+    {
+        encodeArgs->failed = 1;
+        return;
+    }
+    for (int row = start; row < end; row++)
+    {
+        const float* input = &encodeArgs->trainInputs[(size_t)row * inputSize];
+        int list = knnNearestCentroid(encodeArgs->kernels, inputSize, input, encodeArgs->listCount, encodeArgs->centroids, distanceThreshold, distanceExponent);
+        const float* centroid = &encodeArgs->centroids[(size_t)list * inputSize];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            residual[inputIndex] = input[inputIndex] - centroid[inputIndex];
+        }
+        encodeArgs->rowLists[row] = list;
+        for (int subspace = 0; subspace < encodeArgs->subspaceCount; subspace++)
+        {
+            int subspaceStart = encodeArgs->subspaceStarts[subspace];
+            int width = encodeArgs->subspaceStarts[subspace + 1] - subspaceStart;
+            encodeArgs->rowCodes[(size_t)row * encodeArgs->subspaceCount + subspace] = (uint8_t)knnNearestCentroid(encodeArgs->kernels, width, &residual[subspaceStart], KNN_IVFPQ_CODES, &encodeArgs->codebooks[(size_t)KNN_IVFPQ_CODES * subspaceStart], distanceThreshold, distanceExponent);
+        }
+    }
+    free(residual);
+}
+
+static uint64_t knnIvfpqAlign(uint64_t offset)
+{
+    return (offset + KNN_IVFPQ_ALIGN - 1) / KNN_IVFPQ_ALIGN * KNN_IVFPQ_ALIGN;
+}
+
+// section offsets from the shape fields, the writer lays the file out with it and the reader checks against it
+static void knnIvfpqLayout(KnnIvfpqFileHeader* header)
+{
+    uint64_t offset = knnIvfpqAlign(sizeof(KnnIvfpqFileHeader));
+    header->centroidsOffset = offset;
+    offset = knnIvfpqAlign(offset + (uint64_t)header->listCount * header->inputSize * sizeof(float));
+    header->codebooksOffset = offset;
+    offset = knnIvfpqAlign(offset + (uint64_t)KNN_IVFPQ_CODES * header->inputSize * sizeof(float));
+    header->listStartsOffset = offset;
+    offset = knnIvfpqAlign(offset + ((uint64_t)header->listCount + 1) * sizeof(int32_t));
+    header->idsOffset = offset;
+    offset = knnIvfpqAlign(offset + (uint64_t)header->rowCount * sizeof(int32_t));
+    header->codesOffset = offset;
+    offset = knnIvfpqAlign(offset + (uint64_t)header->rowCount * header->subspaceCount);
+    header->outputsOffset = offset;
+    offset = knnIvfpqAlign(offset + (uint64_t)header->rowCount * header->outputSize * sizeof(float));
+    header->inputsOffset = offset;
+    if (header->hasInputs)
+    {
+        offset += (uint64_t)header->rowCount * header->inputSize * sizeof(float);
+    }
+    header->fileSize = offset;
+}
+
+// writes one section and pads up to where the next one starts
+static int knnIvfpqWriteSection(FILE* file, uint64_t* position, uint64_t offset, const void* data, size_t size)
+{
+    static const unsigned char padding[KNN_IVFPQ_ALIGN] = { 0 };
+    int failed = 0;
+    while (*position < offset && !failed)
+    {
+        size_t padSize = offset - *position < KNN_IVFPQ_ALIGN ? (size_t)(offset - *position) : KNN_IVFPQ_ALIGN;
+        failed = fwrite(padding, 1, padSize, file) != padSize;
+        *position += padSize;
+    }
+    if (size > 0 && !failed)
+    {
+        failed = fwrite(data, 1, size, file) != size;
+        *position += size;
+    }
+    return failed;
+}
+
+void knnIvfpqTrainDefaults(KnnIvfpqTrainParameters* parameters)
+{
+    parameters->listCount = 0;
+    parameters->subspaceCount = 16;
+    parameters->iterations = 10;
+    parameters->sampleCount = 0;
+    parameters->distanceThreshold = 0.0f;
+    parameters->distanceExponent = 2.0f;
+    parameters->storeInputs = 1;
+}
+
+int knnIvfpqTrain(
+    const char* path,
+    int inputSize,
+    int outputSize,
+    int trainCount,
+    const float* trainInputs,
+    const float* trainOutputs,
+    const KnnIvfpqTrainParameters* parameters,
+    int threadCount
+)
+{
+    int listCount = parameters->listCount > 0 ? parameters->listCount : (int)sqrt((double)trainCount);
+    int sampleCount = parameters->sampleCount > 0 ? parameters->sampleCount : KNN_IVFPQ_SAMPLES_PER_CENTROID * (listCount > KNN_IVFPQ_CODES ? listCount : KNN_IVFPQ_CODES);
+    if (sampleCount > trainCount)
+    {
+        sampleCount = trainCount;
+    }
+    if (listCount > sampleCount)
+    {
+        listCount = sampleCount;
+    }
+    if (inputSize < 1 || outputSize < 1 || trainInputs == NULL || trainOutputs == NULL || threadCount < 1 || parameters->iterations < 0
+        || parameters->subspaceCount < 1 || parameters->subspaceCount > inputSize || !(parameters->distanceExponent > 0.0f))
+    {
+        printf("Invalid knn ivfpq train arguments.\n");
+        return -1;
+    }
+    if (sampleCount < KNN_IVFPQ_CODES)
+    {
+        printf("knn ivfpq needs at least %d train rows, got %d.\n", KNN_IVFPQ_CODES, sampleCount);
+        return -1;
+    }
+
+    const KnnKernels* kernels = selectKernels();
+    int subspaceCount = parameters->subspaceCount;
+    int* subspaceStarts = (int*)calloc(subspaceCount + 1, sizeof(int));
+    float* sample = (float*)calloc((size_t)sampleCount * inputSize, sizeof(float));
+    int* assignments = (int*)calloc(sampleCount, sizeof(int));
+    float* centroids = (float*)calloc((size_t)listCount * inputSize, sizeof(float));
+    float* codebooks = (float*)calloc((size_t)KNN_IVFPQ_CODES * inputSize, sizeof(float));
+    int* rowLists = (int*)calloc(trainCount, sizeof(int));
+    uint8_t* rowCodes = (uint8_t*)calloc((size_t)trainCount * subspaceCount, 1);
+    int32_t* listStarts = (int32_t*)calloc(listCount + 1, sizeof(int32_t));
+    int32_t* ids = (int32_t*)calloc(trainCount, sizeof(int32_t));
+    if (subspaceStarts == NULL || sample == NULL || assignments == NULL || centroids == NULL || codebooks == NULL || rowLists == NULL || rowCodes == NULL || listStarts == NULL || ids == NULL)
+    {
+        printf("Failed to allocate memory for knn ivfpq training.\n");
+        free(subspaceStarts);
+        free(sample);
+        free(assignments);
+        free(centroids);
+        free(codebooks);
+        free(rowLists);
+        free(rowCodes);
+        free(listStarts);
+        free(ids);
+        return -1;
+    }
+    for (int subspace = 0; subspace <= subspaceCount; subspace++)
+    {
+        subspaceStarts[subspace] = knnIvfpqSubspaceStart(inputSize, subspaceCount, subspace);
+    }
+    for (int sampleIndex = 0; sampleIndex < sampleCount; sampleIndex++)
+    {
+        size_t row = (size_t)((long long)trainCount * sampleIndex / sampleCount);
+        memcpy(&sample[(size_t)sampleIndex * inputSize], &trainInputs[row * inputSize], inputSize * sizeof(float));
+    }
+
+    // the coarse quantizer, then the sample becomes its residuals for the codebooks
+    KnnKmeans kmeans;
+    kmeans.kernels = kernels;
+    kmeans.count = sampleCount;
+    kmeans.dimension = inputSize;
+    kmeans.stride = inputSize;
+    kmeans.vectors = sample;
+    kmeans.centroidCount = listCount;
+    kmeans.centroids = centroids;
+    kmeans.distanceThreshold = parameters->distanceThreshold;
+    kmeans.distanceExponent = parameters->distanceExponent;
+    kmeans.assignments = assignments;
+    int failed = knnKmeans(&kmeans, parameters->iterations, threadCount) != 0;
+    for (int sampleIndex = 0; sampleIndex < sampleCount && !failed; sampleIndex++)
+    {
+        float* values = &sample[(size_t)sampleIndex * inputSize];
+        const float* centroid = &centroids[(size_t)assignments[sampleIndex] * inputSize];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            values[inputIndex] -= centroid[inputIndex];
+        }
+    }
+
+    KnnCodebookArgs codebookArgs;
+    codebookArgs.kernels = kernels;
+    codebookArgs.parameters = parameters;
+    codebookArgs.inputSize = inputSize;
+    codebookArgs.subspaceCount = subspaceCount;
+    codebookArgs.subspaceStarts = subspaceStarts;
+    codebookArgs.sampleCount = sampleCount;
+    codebookArgs.residuals = sample;
+    codebookArgs.codebooks = codebooks;
+    codebookArgs.failed = 0;
+    if (!failed)
+    {
+        platformParallel(threadCount, subspaceCount, knnTrainCodebooks, &codebookArgs);
+        failed = codebookArgs.failed;
+    }
+
+    KnnEncodeArgs encodeArgs;
+    encodeArgs.kernels = kernels;
+    encodeArgs.parameters = parameters;
+    encodeArgs.inputSize = inputSize;
+    encodeArgs.listCount = listCount;
+    encodeArgs.subspaceCount = subspaceCount;
+    encodeArgs.subspaceStarts = subspaceStarts;
+    encodeArgs.trainInputs = trainInputs;
+    encodeArgs.centroids = centroids;
+    encodeArgs.codebooks = codebooks;
+    encodeArgs.rowLists = rowLists;
+    encodeArgs.rowCodes = rowCodes;
+    encodeArgs.failed = 0;
+    if (!failed)
+    {
+        platformParallel(threadCount, trainCount, knnEncodeRows, &encodeArgs);
+        failed = encodeArgs.failed;
+    }
+    if (failed)
+    {
+        printf("Failed to allocate memory for knn ivfpq training.\n");
+    }
+
+    // counting sort into lists, rows keep their order within a list
+    for (int row = 0; row < trainCount && !failed; row++)
+    {
+        listStarts[rowLists[row] + 1]++;
+    }
+    for (int list = 0; list < listCount; list++)
+    {
+        listStarts[list + 1] += listStarts[list];
+    }
+    for (int row = 0; row < trainCount && !failed; row++)
+    {
+        ids[listStarts[rowLists[row]]++] = row;
+    }
+    for (int list = listCount; list > 0; list--)
+    {
+        listStarts[list] = listStarts[list - 1];
+    }
+    listStarts[0] = 0;
+
+    FILE* file = NULL;
+    if (!failed && fopen_s(&file, path, "wb") != 0)
+    {
+        printf("Failed to open %s\n", path);
+        failed = 1;
+    }
+    if (!failed)
+    {
+        KnnIvfpqFileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = KNN_IVFPQ_MAGIC;
+        header.version = KNN_IVFPQ_FILE_VERSION;
+        header.inputSize = (uint32_t)inputSize;
+        header.outputSize = (uint32_t)outputSize;
+        header.rowCount = (uint32_t)trainCount;
+        header.listCount = (uint32_t)listCount;
+        header.subspaceCount = (uint32_t)subspaceCount;
+        header.iterations = (uint32_t)parameters->iterations;
+        header.sampleCount = (uint32_t)sampleCount;
+        header.hasInputs = parameters->storeInputs != 0;
+        header.distanceThreshold = parameters->distanceThreshold;
+        header.distanceExponent = parameters->distanceExponent;
+        knnIvfpqLayout(&header);
+
+        uint64_t position = 0;
+        failed = knnIvfpqWriteSection(file, &position, 0, &header, sizeof(header));
+        failed |= knnIvfpqWriteSection(file, &position, header.centroidsOffset, centroids, (size_t)listCount * inputSize * sizeof(float));
+        failed |= knnIvfpqWriteSection(file, &position, header.codebooksOffset, codebooks, (size_t)KNN_IVFPQ_CODES * inputSize * sizeof(float));
+        failed |= knnIvfpqWriteSection(file, &position, header.listStartsOffset, listStarts, ((size_t)listCount + 1) * sizeof(int32_t));
+        failed |= knnIvfpqWriteSection(file, &position, header.idsOffset, ids, (size_t)trainCount * sizeof(int32_t));
+        failed |= knnIvfpqWriteSection(file, &position, header.codesOffset, NULL, 0);
+        for (int listRow = 0; listRow < trainCount && !failed; listRow++)
+        {
+            failed = fwrite(&rowCodes[(size_t)ids[listRow] * subspaceCount], 1, subspaceCount, file) != (size_t)subspaceCount;
+            position += subspaceCount;
+        }
+        failed |= knnIvfpqWriteSection(file, &position, header.outputsOffset, trainOutputs, (size_t)trainCount * outputSize * sizeof(float));
+        if (header.hasInputs)
+        {
+            failed |= knnIvfpqWriteSection(file, &position, header.inputsOffset, trainInputs, (size_t)trainCount * inputSize * sizeof(float));
+        }
+        failed |= knnIvfpqWriteSection(file, &position, header.fileSize, NULL, 0);
+        failed |= fclose(file) != 0;
+        if (failed)
+        {
+            printf("Failed to write %s\n", path);
+        }
+    }
+
+    free(subspaceStarts);
+    free(sample);
+    free(assignments);
+    free(centroids);
+    free(codebooks);
+    free(rowLists);
+    free(rowCodes);
+    free(listStarts);
+    free(ids);
+    return failed ? -1 : 0;
+}
+
+void knnIvfpqParametersDefaults(KnnIvfpqParameters* parameters)
+{
+    parameters->k = 1;
+    parameters->weighting = KNN_WEIGHTING_RECIPROCAL;
+    parameters->rooted = 0;
+    parameters->probeCount = 8;
+    parameters->rerankCount = 0;
+}
+
+static int knnIvfpqParametersValid(const KnnIvfpq* index, const KnnIvfpqParameters* parameters, int kCapacity, int shortlistCapacity)
+{
+    if (parameters->k < 1 || (kCapacity > 0 && parameters->k > kCapacity))
+    {
+        printf("Invalid knn ivfpq k: %d\n", parameters->k);
+        return 0;
+    }
+    if (parameters->weighting < KNN_WEIGHTING_AVERAGE || parameters->weighting > KNN_WEIGHTING_RECIPROCAL)
+    {
+        printf("Invalid knn ivfpq weighting: %d\n", (int)parameters->weighting);
+        return 0;
+    }
+    if (parameters->probeCount < 1)
+    {
+        printf("Invalid knn ivfpq probe count: %d\n", parameters->probeCount);
+        return 0;
+    }
+    if (parameters->rerankCount != 0 && (parameters->rerankCount < parameters->k || (shortlistCapacity > 0 && parameters->rerankCount > shortlistCapacity)))
+    {
+        printf("Invalid knn ivfpq rerank count: %d\n", parameters->rerankCount);
+        return 0;
+    }
+    if (parameters->rerankCount != 0 && !index->header.hasInputs)
+    {
+        printf("The knn ivfpq index was trained without inputs, it cannot re-rank.\n");
+        return 0;
+    }
+    return 1;
+}
+
+KnnIvfpq* knnIvfpqOpen(const char* path, const KnnIvfpqParameters* parameters, int threadCount)
+{
+    if (threadCount < 1)
+    {
+        printf("Invalid knn ivfpq thread count: %d\n", threadCount);
+        return NULL;
+    }
+    KnnIvfpq* index = (KnnIvfpq*)calloc(1, sizeof(KnnIvfpq));
+    if (index == NULL)
+    {
+        printf("Failed to allocate memory for knn ivfpq index.\n");
+        return NULL;
+    }
+    index->file = (const unsigned char*)platformMapFile(path, &index->fileSize);
+    if (index->file == NULL)
+    {
+        printf("Failed to map %s\n", path);
+        free(index);
+        return NULL;
+    }
+
+    // the shape fields must lay the file out exactly as it is, and every list and id must stay in bounds
+    KnnIvfpqFileHeader* header = &index->header;
+    int valid = index->fileSize >= sizeof(KnnIvfpqFileHeader);
+    if (valid)
+    {
+        memcpy(header, index->file, sizeof(KnnIvfpqFileHeader));
+        valid = header->magic == KNN_IVFPQ_MAGIC && header->version == KNN_IVFPQ_FILE_VERSION;
+    }
+    if (!valid)
+    {
+        printf("%s is not a knn ivfpq index.\n", path);
+        knnIvfpqClose(index);
+        return NULL;
+    }
+    KnnIvfpqFileHeader expected = *header;
+    knnIvfpqLayout(&expected);
+    valid = header->inputSize > 0 && header->outputSize > 0 && header->rowCount > 0 && header->rowCount <= INT32_MAX && header->listCount > 0
+        && header->subspaceCount > 0 && header->subspaceCount <= header->inputSize
+        && memcmp(&expected, header, sizeof(KnnIvfpqFileHeader)) == 0 && header->fileSize <= index->fileSize;
+    if (valid)
+    {
+        index->centroids = (const float*)(index->file + header->centroidsOffset);
+        index->codebooks = (const float*)(index->file + header->codebooksOffset);
+        index->listStarts = (const int32_t*)(index->file + header->listStartsOffset);
+        index->ids = (const int32_t*)(index->file + header->idsOffset);
+        index->codes = (const uint8_t*)(index->file + header->codesOffset);
+        index->outputs = (const float*)(index->file + header->outputsOffset);
+        index->inputs = header->hasInputs ? (const float*)(index->file + header->inputsOffset) : NULL;
+        valid = index->listStarts[0] == 0 && index->listStarts[header->listCount] == (int32_t)header->rowCount;
+        for (uint32_t list = 0; list < header->listCount && valid; list++)
+        {
+            valid = index->listStarts[list] <= index->listStarts[list + 1];
+        }
+        for (uint32_t listRow = 0; listRow < header->rowCount && valid; listRow++)
+        {
+            valid = index->ids[listRow] >= 0 && index->ids[listRow] < (int32_t)header->rowCount;
+        }
+    }
+    if (!valid)
+    {
+        printf("%s is damaged.\n", path);
+        knnIvfpqClose(index);
+        return NULL;
+    }
+    if (!knnIvfpqParametersValid(index, parameters, 0, 0))
+    {
+        knnIvfpqClose(index);
+        return NULL;
+    }
+
+    index->parameters = *parameters;
+    index->kCapacity = parameters->k;
+    index->shortlistCapacity = parameters->rerankCount > parameters->k ? parameters->rerankCount : parameters->k;
+    index->threadCount = threadCount;
+    index->kernels = selectKernels();
+    int subspaceCount = (int)header->subspaceCount;
+    index->subspaceStarts = (int*)calloc(subspaceCount + 1, sizeof(int));
+    index->scratch = (KnnIvfpqScratch*)calloc(threadCount, sizeof(KnnIvfpqScratch));
+    if (index->subspaceStarts == NULL || index->scratch == NULL)
+    {
+        printf("Failed to allocate memory for knn ivfpq index.\n");
+        knnIvfpqClose(index);
+        return NULL;
+    }
+    for (int subspace = 0; subspace <= subspaceCount; subspace++)
+    {
+        index->subspaceStarts[subspace] = knnIvfpqSubspaceStart((int)header->inputSize, subspaceCount, subspace);
+    }
+    for (int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        KnnIvfpqScratch* scratch = &index->scratch[threadIndex];
+        scratch->lists = (KnnIvfpqEntry*)calloc(header->listCount, sizeof(KnnIvfpqEntry));
+        scratch->residual = (float*)calloc(header->inputSize, sizeof(float));
+        scratch->table = (float*)calloc((size_t)subspaceCount * KNN_IVFPQ_CODES, sizeof(float));
+        scratch->shortlist = (KnnIvfpqEntry*)calloc(index->shortlistCapacity, sizeof(KnnIvfpqEntry));
+        if (scratch->lists == NULL || scratch->residual == NULL || scratch->table == NULL || scratch->shortlist == NULL)
+        {
+            printf("Failed to allocate memory for knn ivfpq scratch.\n");
+            knnIvfpqClose(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+void knnIvfpqClose(KnnIvfpq* index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    if (index->scratch != NULL)
+    {
+        for (int threadIndex = 0; threadIndex < index->threadCount; threadIndex++)
+        {
+            KnnIvfpqScratch* scratch = &index->scratch[threadIndex];
+            free(scratch->lists);
+            free(scratch->residual);
+            free(scratch->table);
+            free(scratch->shortlist);
+        }
+    }
+    free(index->scratch);
+    free(index->subspaceStarts);
+    if (index->file != NULL)
+    {
+        platformUnmapFile(index->file, index->fileSize);
+    }
+    free(index);
+}
+
+int knnIvfpqSetParameters(KnnIvfpq* index, const KnnIvfpqParameters* parameters)
+{
+    if (!knnIvfpqParametersValid(index, parameters, index->kCapacity, index->shortlistCapacity))
+    {
+        return -1;
+    }
+    index->parameters = *parameters;
+    return 0;
+}
+
+void knnIvfpqGetParameters(const KnnIvfpq* index, KnnIvfpqParameters* parameters)
+{
+    *parameters = index->parameters;
+}
+
+void knnIvfpqGetTrainParameters(const KnnIvfpq* index, KnnIvfpqTrainParameters* parameters)
+{
+    parameters->listCount = (int)index->header.listCount;
+    parameters->subspaceCount = (int)index->header.subspaceCount;
+    parameters->iterations = (int)index->header.iterations;
+    parameters->sampleCount = (int)index->header.sampleCount;
+    parameters->distanceThreshold = index->header.distanceThreshold;
+    parameters->distanceExponent = index->header.distanceExponent;
+    parameters->storeInputs = (int)index->header.hasInputs;
+}
+
+int knnIvfpqInputSize(const KnnIvfpq* index)
+{
+    return (int)index->header.inputSize;
+}
+
+int knnIvfpqOutputSize(const KnnIvfpq* index)
+{
+    return (int)index->header.outputSize;
+}
+
+int knnIvfpqTrainCount(const KnnIvfpq* index)
+{
+    return (int)index->header.rowCount;
+}
+
+size_t knnIvfpqScannedBytes(const KnnIvfpq* index)
+{
+    return (size_t)(index->header.outputsOffset - index->header.centroidsOffset);
+}
+
+long long knnIvfpqCodeCount(const KnnIvfpq* index)
+{
+    long long codeCount = 0;
+    for (int threadIndex = 0; threadIndex < index->threadCount; threadIndex++)
+    {
+        codeCount += index->scratch[threadIndex].codeCount;
+    }
+    return codeCount;
+}
+
+long long knnIvfpqDistanceCount(const KnnIvfpq* index)
+{
+    long long distanceCount = 0;
+    for (int threadIndex = 0; threadIndex < index->threadCount; threadIndex++)
+    {
+        distanceCount += index->scratch[threadIndex].distanceCount;
+    }
+    return distanceCount;
+}
+
+// distance then id, the order knn() ranks neighbours in
+static inline int knnIvfpqEntryBefore(float distance, int id, const KnnIvfpqEntry* entry)
+{
+    return distance < entry->distance || (distance == entry->distance && id < entry->id);
+}
+
+static int compareIvfpqEntry(const void* a, const void* b)
+{
+    const KnnIvfpqEntry* e1 = (const KnnIvfpqEntry*)a;
+    const KnnIvfpqEntry* e2 = (const KnnIvfpqEntry*)b;
+    if (knnIvfpqEntryBefore(e1->distance, e1->id, e2))
+    {
+        return -1;
+    }
+    if (knnIvfpqEntryBefore(e2->distance, e2->id, e1))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// keeps the capacity nearest in a heap with the farthest on top, so a row that does not make it costs one comparison
+static inline void knnIvfpqKeep(KnnIvfpqEntry* heap, int* count, int capacity, float distance, int id)
+{
+    int position;
+    if (*count < capacity)
+    {
+        position = (*count)++;
+        while (position > 0)
+        {
+            int parent = (position - 1) / 2;
+            if (!knnIvfpqEntryBefore(heap[parent].distance, heap[parent].id, &(KnnIvfpqEntry){ distance, id }))
+            {
+                break;
+            }
+            heap[position] = heap[parent];
+            position = parent;
+        }
+    }
+    else
+    {
+        if (!knnIvfpqEntryBefore(distance, id, &heap[0]))
+        {
+            return;
+        }
+        position = 0;
+        while (1)
+        {
+            int child = 2 * position + 1;
+            if (child >= *count)
+            {
+                break;
+            }
+            if (child + 1 < *count && knnIvfpqEntryBefore(heap[child].distance, heap[child].id, &heap[child + 1]))
+            {
+                child++;
+            }
+            if (!knnIvfpqEntryBefore(distance, id, &heap[child]))
+            {
+                break;
+            }
+            heap[position] = heap[child];
+            position = child;
+        }
+    }
+    heap[position].distance = distance;
+    heap[position].id = id;
+}
+
+// fills the shortlist with the nearest rows by quantized distance, re-ranked when asked, and returns how many it holds
+static int knnIvfpqSearch(KnnIvfpq* index, KnnIvfpqScratch* scratch, const float* query)
+{
+    const KnnIvfpqParameters* parameters = &index->parameters;
+    const KnnIvfpqFileHeader* header = &index->header;
+    int inputSize = (int)header->inputSize;
+    int subspaceCount = (int)header->subspaceCount;
+    float distanceThreshold = header->distanceThreshold;
+    float distanceExponent = header->distanceExponent;
+
+    // the probeCount nearest lists
+    int probeCount = parameters->probeCount < (int)header->listCount ? parameters->probeCount : (int)header->listCount;
+    int listCount = 0;
+    for (int list = 0; list < (int)header->listCount; list++)
+    {
+        float distance = index->kernels->distance(inputSize, query, &index->centroids[(size_t)list * inputSize], distanceThreshold, distanceExponent);
+        knnIvfpqKeep(scratch->lists, &listCount, probeCount, distance, list);
+    }
+
+    int capacity = parameters->rerankCount > 0 ? parameters->rerankCount : parameters->k;
+    int shortlistCount = 0;
+    for (int probe = 0; probe < listCount; probe++)
+    {
+        int list = scratch->lists[probe].id;
+        int listStart = index->listStarts[list];
+        int listEnd = index->listStarts[list + 1];
+        if (listStart == listEnd)
+        {
+            continue;
+        }
+
+        // the table holds each subspace's distance from the query's residual to every codeword
+        const float* centroid = &index->centroids[(size_t)list * inputSize];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            scratch->residual[inputIndex] = query[inputIndex] - centroid[inputIndex];
+        }
+        for (int subspace = 0; subspace < subspaceCount; subspace++)
+        {
+            int subspaceStart = index->subspaceStarts[subspace];
+            int width = index->subspaceStarts[subspace + 1] - subspaceStart;
+            const float* codebook = &index->codebooks[(size_t)KNN_IVFPQ_CODES * subspaceStart];
+            float* table = &scratch->table[(size_t)subspace * KNN_IVFPQ_CODES];
+            for (int code = 0; code < KNN_IVFPQ_CODES; code++)
+            {
+                table[code] = index->kernels->distance(width, &scratch->residual[subspaceStart], &codebook[(size_t)code * width], distanceThreshold, distanceExponent);
+            }
+        }
+
+        for (int listRow = listStart; listRow < listEnd; listRow++)
+        {
+            const uint8_t* codes = &index->codes[(size_t)listRow * subspaceCount];
+            float distance = 0.0f;
+            for (int subspace = 0; subspace < subspaceCount; subspace++)
+            {
+                distance += scratch->table[(size_t)subspace * KNN_IVFPQ_CODES + codes[subspace]];
+            }
+            knnIvfpqKeep(scratch->shortlist, &shortlistCount, capacity, distance, index->ids[listRow]);
+        }
+        scratch->codeCount += listEnd - listStart;
+    }
+
+    // the shortlist's rows are read from the file only now, the exact distance is the one knn() ranks by
+    if (parameters->rerankCount > 0)
+    {
+        for (int shortlistIndex = 0; shortlistIndex < shortlistCount; shortlistIndex++)
+        {
+            KnnIvfpqEntry* entry = &scratch->shortlist[shortlistIndex];
+            entry->distance = index->kernels->distance(inputSize, query, &index->inputs[(size_t)entry->id * inputSize], distanceThreshold, distanceExponent);
+        }
+        scratch->distanceCount += shortlistCount;
+    }
+    qsort(scratch->shortlist, shortlistCount, sizeof(KnnIvfpqEntry), compareIvfpqEntry);
+    int neighbourCount = shortlistCount < parameters->k ? shortlistCount : parameters->k;
+    if (parameters->rooted)
+    {
+        for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+        {
+            scratch->shortlist[neighbourIndex].distance = pow(scratch->shortlist[neighbourIndex].distance, 1.0f / distanceExponent);
+        }
+    }
+    return neighbourCount;
+}
+
+// the arithmetic of knnVote in knn_lib.c
+static void knnIvfpqVote(KnnIvfpq* index, const KnnIvfpqEntry* neighbours, int neighbourCount, float* predictionOutput)
+{
+    const KnnIvfpqParameters* parameters = &index->parameters;
+    int outputSize = (int)index->header.outputSize;
+
+    // find max distance
+    float maxDistance = 0.0f;
+    for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+    {
+        if (neighbours[neighbourIndex].distance > maxDistance)
+        {
+            maxDistance = neighbours[neighbourIndex].distance;
+        }
+    }
+
+    float weightSum = 0.0f;
+    memset(predictionOutput, 0, outputSize * sizeof(float));
+    for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+    {
+        float distance = neighbours[neighbourIndex].distance;
+        float weight = 1.0f;
+        if (parameters->weighting == KNN_WEIGHTING_LINEAR)
+        {
+            weight = 1.0f - (distance / (maxDistance + EPSILON));
+        }
+        else if (parameters->weighting == KNN_WEIGHTING_RECIPROCAL)
+        {
+            weight = 1.0f / (distance + EPSILON);
+        }
+        weightSum += weight;
+        index->kernels->accumulate(outputSize, &index->outputs[(size_t)neighbours[neighbourIndex].id * outputSize], weight, predictionOutput);
+    }
+
+    // normalize
+    float divisor = parameters->weighting == KNN_WEIGHTING_AVERAGE ? (float)parameters->k : weightSum;
+    for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+    {
+        predictionOutput[outputIndex] /= divisor;
+    }
+}
+
+static int knnIvfpqArgmax(int size, const float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+int knnIvfpqPredictBatch(
+    KnnIvfpq* index,
+    int threadIndex,
+    int queryCount,
+    const float* queries,
+    float* predictionOutputs,
+    int* predictedLabels,
+    KnnNeighbour* neighbours
+)
+{
+    if (threadIndex < 0 || threadIndex >= index->threadCount || queryCount < 0 || (queryCount > 0 && (queries == NULL || predictionOutputs == NULL)))
+    {
+        printf("Invalid knn ivfpq predict arguments.\n");
+        return -1;
+    }
+
+    // every query probes its own lists, so unlike the scan there is nothing to share across a batch
+    KnnIvfpqScratch* scratch = &index->scratch[threadIndex];
+    int inputSize = (int)index->header.inputSize;
+    int outputSize = (int)index->header.outputSize;
+    int k = index->parameters.k;
+    for (int queryIndex = 0; queryIndex < queryCount; queryIndex++)
+    {
+        int neighbourCount = knnIvfpqSearch(index, scratch, &queries[(size_t)queryIndex * inputSize]);
+        float* predictionOutput = &predictionOutputs[(size_t)queryIndex * outputSize];
+        knnIvfpqVote(index, scratch->shortlist, neighbourCount, predictionOutput);
+        if (predictedLabels != NULL)
+        {
+            predictedLabels[queryIndex] = knnIvfpqArgmax(outputSize, predictionOutput);
+        }
+        if (neighbours != NULL)
+        {
+            // fewer rows in the probed lists than k leaves the tail marked with index -1
+            KnnNeighbour* queryNeighbours = &neighbours[(size_t)queryIndex * k];
+            for (int neighbourIndex = 0; neighbourIndex < k; neighbourIndex++)
+            {
+                queryNeighbours[neighbourIndex].index = neighbourIndex < neighbourCount ? scratch->shortlist[neighbourIndex].id : -1;
+                queryNeighbours[neighbourIndex].distance = neighbourIndex < neighbourCount ? scratch->shortlist[neighbourIndex].distance : INFINITY;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef KNN_QUANTIZED_H
+#define KNN_QUANTIZED_H
+
+#include <stddef.h>
+#include "knn_lib.h"
+
+// the compressed sibling of libknn for train sets too large to keep as floats
+// build knn_quantized.c into the program, e.g. $CC tool.c knn_quantized.c -o tool.exe -O3 $LIBS
+//
+// knnIvfpqTrain runs offline: a k-means coarse quantizer splits the rows into inverted lists and each row's residual
+// from its list centroid is product quantized into one byte per subspace, all written to one file
+// knnIvfpqOpen maps that file read only, so several processes share its pages and only what queries touch is read,
+// a query measures the distance to every centroid, builds asymmetric distance tables for the probeCount nearest lists,
+// scans their codes, and optionally re-ranks the shortlist with the exact distance of knn() on the rows kept in the file
+//
+// the thresholded power distance sums a term per input, so a table of per subspace terms gives it for any threshold and exponent,
+// k-means assigns rows with that distance but moves centroids to the mean, which is the exact update only for exponent 2
+
+typedef struct {
+    // inverted lists, 0 picks sqrt(trainCount)
+    int listCount;
+    // code bytes per row, each subspace covers inputSize / subspaceCount consecutive inputs
+    int subspaceCount;
+    // k-means rounds for the coarse quantizer and every subspace
+    int iterations;
+    // rows k-means trains on, spread evenly over the train set, 0 picks 32 per centroid of the coarse quantizer or a codebook
+    int sampleCount;
+    float distanceThreshold;
+    float distanceExponent;
+    // keeps the float rows at the end of the file for re-ranking, they are only read for shortlisted rows
+    int storeInputs;
+} KnnIvfpqTrainParameters;
+
+typedef struct {
+    int k;
+    KnnWeighting weighting;
+    // applies pow(distance, 1 / distanceExponent) to the final distances, as the _rooted programs do
+    int rooted;
+    // lists scanned per query
+    int probeCount;
+    // rows re-ranked by the exact distance, at least k when set, 0 votes on the quantized distances
+    int rerankCount;
+} KnnIvfpqParameters;
+
+// codes are one byte, so every subspace has this many centroids
+#define KNN_IVFPQ_CODES 256
+
+typedef struct KnnIvfpq KnnIvfpq;
+
+// 0 lists, 16 subspaces, 10 iterations, 0 sample rows, no threshold, exponent 2, inputs stored
+void knnIvfpqTrainDefaults(KnnIvfpqTrainParameters* parameters);
+
+// trains on at least KNN_IVFPQ_CODES rows with threadCount threads and writes the index to path, returns 0 on success,
+// the time goes into distances, about (sample + trainCount) * (listCount + KNN_IVFPQ_CODES) rows' worth
+int knnIvfpqTrain(
+    const char* path,
+    int inputSize,
+    int outputSize,
+    int trainCount,
+    const float* trainInputs,
+    const float* trainOutputs,
+    const KnnIvfpqTrainParameters* parameters,
+    int threadCount
+);
+
+// reciprocal weighting, k 1, 8 probes, no re-ranking
+void knnIvfpqParametersDefaults(KnnIvfpqParameters* parameters);
+
+// threadCount callers may predict at once, parameters->k and parameters->rerankCount are the largest the index will serve,
+// returns NULL with a message when the file is missing, malformed, or the arguments are invalid
+KnnIvfpq* knnIvfpqOpen(const char* path, const KnnIvfpqParameters* parameters, int threadCount);
+
+void knnIvfpqClose(KnnIvfpq* index);
+
+// not safe while another thread predicts, re-ranking needs an index trained with storeInputs, returns 0 on success
+int knnIvfpqSetParameters(KnnIvfpq* index, const KnnIvfpqParameters* parameters);
+
+void knnIvfpqGetParameters(const KnnIvfpq* index, KnnIvfpqParameters* parameters);
+void knnIvfpqGetTrainParameters(const KnnIvfpq* index, KnnIvfpqTrainParameters* parameters);
+int knnIvfpqInputSize(const KnnIvfpq* index);
+int knnIvfpqOutputSize(const KnnIvfpq* index);
+int knnIvfpqTrainCount(const KnnIvfpq* index);
+
+// bytes a query may scan, the centroids, codebooks, lists and codes, without the outputs and rows read per neighbour
+size_t knnIvfpqScannedBytes(const KnnIvfpq* index);
+
+// codes scanned and exact distances measured by predictions so far across all threads, read them while no thread predicts
+long long knnIvfpqCodeCount(const KnnIvfpq* index);
+long long knnIvfpqDistanceCount(const KnnIvfpq* index);
+
+// the same contract as knnPredictBatch, neighbour distances are quantized ones unless re-ranked
+int knnIvfpqPredictBatch(
+    KnnIvfpq* index,
+    int threadIndex,
+    int queryCount,
+    const float* queries,
+    float* predictionOutputs,
+    int* predictedLabels,
+    KnnNeighbour* neighbours
+);
+
+#endif
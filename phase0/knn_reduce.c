@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_dispatch.h"
+#include "knn_synthetic.h"
+#include "knn_reduce.h"
+
+// shrinks the train set by wilson editing, hart's condensing or both, writes the rows kept as a csv the sweeps and the
+// server load with KNN_TRAIN, then reports the test accuracy of the full and the reduced set for every k up to kMax
+
+double reduceSeconds(uint64_t startNanoseconds)
+{
+    return (double)(platformNanoseconds() - startNanoseconds) / 1000000000.0;
+}
+
+// usage: knn_reduce [method=both|edit|condense] [k=3] [threads=8] [distanceThreshold=0] [distanceExponent=2] [kMax=10] [outputPath=./knn_reduced.csv]
+// k is the editing vote, the data is the sweeps': mnist from d:/data unless KNN_SYNTHETIC is set, KNN_TRAIN replaces the train rows
+int main(int argc, char** argv)
+{
+    const char* method = argc > 1 ? argv[1] : "both";
+    int k = argc > 2 ? atoi(argv[2]) : 3;
+    int threadCount = argc > 3 ? atoi(argv[3]) : 8;
+    float distanceThreshold = argc > 4 ? (float)atof(argv[4]) : 0.0f;
+    float distanceExponent = argc > 5 ? (float)atof(argv[5]) : 2.0f;
+    int kMax = argc > 6 ? atoi(argv[6]) : 10;
+    const char* outputPath = argc > 7 ? argv[7] : "./knn_reduced.csv";
+    int edit = strcmp(method, "both") == 0 || strcmp(method, "edit") == 0;
+    int condense = strcmp(method, "both") == 0 || strcmp(method, "condense") == 0;
+    if ((!edit && !condense) || k < 1 || threadCount < 1 || kMax < 1)
+    {
+        printf("Invalid reduce arguments.\n");
+        exit(1);
+    }
+
+    selectKernels();
+    printf("Kernel ISA: %s\n", kernels->name);
+
+    ReduceSet train;
+    ReduceSet test;
+    memset(&train, 0, sizeof(ReduceSet));
+    memset(&test, 0, sizeof(ReduceSet));
+    int trainCount = 60000;
+    int testCount = 10000;
+    int inputSize = 784;
+    int outputSize = 10;
+    SyntheticConfig syntheticConfig;
+    int synthetic = syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize);
+    const char* trainPath = trainCsvPath();
+    if (trainPath != NULL || !synthetic)
+    {
+        trainCount = trainCsvLoad(trainPath != NULL ? trainPath : "d:/data/mnist_train.csv", inputSize, outputSize, &train.inputs, &train.outputs);
+    }
+    else
+    {
+        loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &train.inputs, &train.outputs);
+    }
+    if (synthetic)
+    {
+        loadSynthetic(&syntheticConfig, SYNTHETIC_TEST, testCount, inputSize, outputSize, &test.inputs, &test.outputs);
+    }
+    else
+    {
+        testCount = trainCsvLoad("d:/data/mnist_test.csv", inputSize, outputSize, &test.inputs, &test.outputs);
+    }
+    train.count = trainCount;
+    train.inputSize = inputSize;
+    train.outputSize = outputSize;
+    test.count = testCount;
+    test.inputSize = inputSize;
+    test.outputSize = outputSize;
+    reduceSetLabels(&train);
+    reduceSetLabels(&test);
+    printf("Train: %d, test: %d, inputs: %d, threads: %d, threshold: %f, exponent: %f\n", trainCount, testCount, inputSize, threadCount, distanceThreshold, distanceExponent);
+
+    int* rows = (int*)calloc(trainCount, sizeof(int));
+    int* condensedRows = (int*)calloc(trainCount, sizeof(int));
+    if (rows == NULL || condensedRows == NULL)
+    {
+        printf("Failed to allocate memory for reduced rows.\n");
+        exit(1);
+    }
+    int rowCount = trainCount;
+    for (int row = 0; row < trainCount; row++)
+    {
+        rows[row] = row;
+    }
+
+    // editing first, so condensing does not keep the noisy rows it would otherwise have to store
+    uint64_t startNanoseconds;
+    if (edit)
+    {
+        startNanoseconds = platformNanoseconds();
+        rowCount = reduceEdit(&train, k, distanceThreshold, distanceExponent, threadCount, rows);
+        printf("Edit: k %d, kept %d of %d rows, %.2f%%, %.3f s\n", k, rowCount, trainCount, 100.0 * rowCount / trainCount, reduceSeconds(startNanoseconds));
+    }
+    if (condense)
+    {
+        startNanoseconds = platformNanoseconds();
+        int candidateCount = rowCount;
+        int passCount;
+        rowCount = reduceCondense(&train, rows, candidateCount, distanceThreshold, distanceExponent, threadCount, condensedRows, &passCount);
+        memcpy(rows, condensedRows, rowCount * sizeof(int));
+        printf("Condense: kept %d of %d rows in %d passes, %.3f s\n", rowCount, candidateCount, passCount, reduceSeconds(startNanoseconds));
+    }
+    if (reduceWrite(outputPath, &train, rows, rowCount) != 0)
+    {
+        printf("Could not write %s\n", outputPath);
+        exit(1);
+    }
+    printf("Wrote %s: %d rows, %.1fx fewer than the full set\n", outputPath, rowCount, rowCount > 0 ? (double)trainCount / rowCount : 0.0);
+    if (rowCount == 0)
+    {
+        return 0;
+    }
+
+    // the accuracy check reads the reduced set back from the file, exactly as a sweep on it would
+    ReduceSet reduced;
+    memset(&reduced, 0, sizeof(ReduceSet));
+    reduced.count = trainCsvLoad(outputPath, inputSize, outputSize, &reduced.inputs, &reduced.outputs);
+    reduced.inputSize = inputSize;
+    reduced.outputSize = outputSize;
+    reduceSetLabels(&reduced);
+    long long* fullCounts = (long long*)calloc(kMax, sizeof(long long));
+    long long* reducedCounts = (long long*)calloc(kMax, sizeof(long long));
+    if (fullCounts == NULL || reducedCounts == NULL)
+    {
+        printf("Failed to allocate memory for correct counts.\n");
+        exit(1);
+    }
+    startNanoseconds = platformNanoseconds();
+    reduceAccuracy(&train, &test, kMax, distanceThreshold, distanceExponent, threadCount, fullCounts);
+    double fullSeconds = reduceSeconds(startNanoseconds);
+    startNanoseconds = platformNanoseconds();
+    reduceAccuracy(&reduced, &test, kMax, distanceThreshold, distanceExponent, threadCount, reducedCounts);
+    double reducedSeconds = reduceSeconds(startNanoseconds);
+    printf("Test scan: full %.3f s, reduced %.3f s, %.1fx faster\n", fullSeconds, reducedSeconds, reducedSeconds > 0.0 ? fullSeconds / reducedSeconds : 0.0);
+
+    printf("\n%4s %10s %10s %10s\n", "K", "Full", "Reduced", "Change");
+    for (int kIndex = 0; kIndex < kMax; kIndex++)
+    {
+        double fullAccuracy = 100.0 * fullCounts[kIndex] / testCount;
+        double reducedAccuracy = 100.0 * reducedCounts[kIndex] / testCount;
+        printf("%4d %9.2f%% %9.2f%% %+9.2f%%\n", kIndex + 1, fullAccuracy, reducedAccuracy, reducedAccuracy - fullAccuracy);
+    }
+
+    free(rows);
+    free(condensedRows);
+    free(fullCounts);
+    free(reducedCounts);
+    return 0;
+}
@@ -0,0 +1,385 @@
+#ifndef KNN_REDUCE_H
+#define KNN_REDUCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_dispatch.h"
+#include "knn_interleave.h"
+#include "knn_train.h"
+#include "knn_vote.h"
+
+// prototype reduction of the train set: wilson editing drops every row its k nearest other rows outvote, which clears
+// label noise and the overlap between classes, then hart's condensing keeps only the rows a 1 nn classifier over the
+// rows kept so far gets wrong, which drops the interior of each class, knn_reduce runs both and writes the rows kept
+//
+// condensing is sequential by definition, a row joins the store when the store as it stands misclassifies it, so the
+// candidates go in batches: every thread brings its share of the batch's nearest store rows up to date in parallel,
+// then one pass in order only measures the rows that joined during the batch and decides, which keeps hart's result
+// exactly, each row remembers its nearest store row and how much of the store it has seen, so later passes over the
+// candidates only measure the rows that joined since
+//
+// the neighbours are ranked as the sweeps rank them, by distance and then row, and voted by the average weighting's
+// sweep's own vote, ties go to the lower label as argmax does, the threshold and exponent are
+// the ones the reduced set will be swept or served with, rooting does not change the order so there is no rooted form
+//
+// the reduced set is a csv in the mnist layout, a header row then the label and the inputs times 255 per row, each
+// printed with the fewest digits that read back to the same float, KNN_TRAIN=path makes the sweeps and the server load
+// their train rows from such a file, their test rows stay as they were
+#define REDUCE_BATCH_ROWS 4096
+
+// a labelled set of rows, the labels are the argmax of the outputs
+typedef struct {
+    int count;
+    int inputSize;
+    int outputSize;
+    float* inputs;
+    float* outputs;
+    int* labels;
+} ReduceSet;
+
+// a scan of the whole train set for every query row, the k nearest voted
+typedef struct {
+    const ReduceSet* train;
+    const InterleavedRows* interleaved;
+    const ReduceSet* queries;
+    // 1 when the queries are the train rows, which then skip themselves
+    int leaveOneOut;
+    int k;
+    float distanceThreshold;
+    float distanceExponent;
+    HANDLE lock;
+    // editing: 1 for every row its neighbours agree with
+    unsigned char* keep;
+    // accuracy: correct queries per k from 1 to k
+    long long* correctCounts;
+} ReduceScan;
+
+// hart's condensing over the candidate rows of the train set
+typedef struct {
+    const ReduceSet* train;
+    float distanceThreshold;
+    float distanceExponent;
+    const int* candidates;
+    int candidateCount;
+    // train rows in the order they joined
+    int* store;
+    int storeCount;
+    // per candidate: 1 once it joined, its nearest store row so far and how many store rows it has been measured against
+    unsigned char* stored;
+    float* nearestDistances;
+    int* nearestLabels;
+    int* seenCounts;
+} ReduceCondense;
+
+static void reduceSetLabels(ReduceSet* set)
+{
+    set->labels = (int*)calloc(set->count > 0 ? set->count : 1, sizeof(int));
+    if (set->labels == NULL)
+    {
+        printf("Failed to allocate memory for reduce labels.\n");
+        exit(1);
+    }
+    for (int row = 0; row < set->count; row++)
+    {
+        set->labels[row] = voteArgmax(set->outputSize, &set->outputs[(size_t)row * set->outputSize]);
+    }
+}
+
+// an input as the loader's scaled value, with the fewest significant digits that read back to the same float
+static void reduceWriteValue(FILE* file, float value)
+{
+    char text[32];
+    for (int digits = 6; digits <= 17; digits++)
+    {
+        snprintf(text, sizeof(text), "%.*g", digits, (double)value * 255.0);
+        if ((float)(strtod(text, NULL) / 255.0f) == value)
+        {
+            break;
+        }
+    }
+    fprintf(file, ",%s", text);
+}
+
+// the given rows of a set as a csv trainCsvLoad reads back bit for bit, returns 0 on success
+static int reduceWrite(const char* path, const ReduceSet* set, const int* rows, int rowCount)
+{
+    FILE* file;
+    if (fopen_s(&file, path, "w") != 0)
+    {
+        return -1;
+    }
+    fprintf(file, "label");
+    for (int inputIndex = 0; inputIndex < set->inputSize; inputIndex++)
+    {
+        fprintf(file, ",input%d", inputIndex);
+    }
+    fprintf(file, "\n");
+    for (int position = 0; position < rowCount; position++)
+    {
+        int row = rows[position];
+        fprintf(file, "%d", set->labels[row]);
+        for (int inputIndex = 0; inputIndex < set->inputSize; inputIndex++)
+        {
+            reduceWriteValue(file, set->inputs[(size_t)row * set->inputSize + inputIndex]);
+        }
+        fprintf(file, "\n");
+    }
+    int failed = ferror(file);
+    return fclose(file) == 0 && !failed ? 0 : -1;
+}
+
+// inserts a row into the nearest list, kept by distance then row, the scans offer rows in ascending order
+// so a row only passes the ones strictly farther
+static inline void reduceOffer(IndexDistance* neighbours, int* count, int k, int index, float distance)
+{
+    if (*count == k && !(distance < neighbours[k - 1].distance))
+    {
+        return;
+    }
+    int position = *count < k ? (*count)++ : k - 1;
+    while (position > 0 && distance < neighbours[position - 1].distance)
+    {
+        neighbours[position] = neighbours[position - 1];
+        position--;
+    }
+    neighbours[position].index = index;
+    neighbours[position].distance = distance;
+}
+
+// query rows [start, end): scans every train row through the interleaved block kernel, then votes the k nearest,
+// an edit keeps the rows the vote agrees with and an accuracy scan counts correct queries for every k up to k
+static void reduceScanRows(void* context, int start, int end)
+{
+    ReduceScan* scan = (ReduceScan*)context;
+    const ReduceSet* train = scan->train;
+    const ReduceSet* queries = scan->queries;
+    InterleaveScratch interleave;
+    interleaveScratchCreate(&interleave, scan->interleaved);
+    IndexDistance* neighbours = (IndexDistance*)calloc(scan->k, sizeof(IndexDistance));
+    float* predictionOutputs = (float*)calloc((size_t)scan->k * train->outputSize, sizeof(float));
+    long long* correctCounts = (long long*)calloc(scan->k, sizeof(long long));
+    if (neighbours == NULL || predictionOutputs == NULL || correctCounts == NULL)
+    {
+        printf("Failed to allocate memory for a reduce scan.\n");
+        exit(1);
+    }
+    for (int queryIndex = start; queryIndex < end; queryIndex++)
+    {
+        const float* query = &queries->inputs[(size_t)queryIndex * queries->inputSize];
+        interleaveLoadTest(&interleave, query, scan->distanceThreshold, scan->distanceExponent);
+        int neighbourCount = 0;
+        for (int trainIndex = 0; trainIndex < train->count; trainIndex++)
+        {
+            // every block is measured at its first row, so the query's own row is still read past
+            float distance = interleaveDistance(&interleave, query, trainIndex, scan->distanceThreshold, scan->distanceExponent);
+            if (scan->leaveOneOut && trainIndex == queryIndex)
+            {
+                continue;
+            }
+            reduceOffer(neighbours, &neighbourCount, scan->k, trainIndex, distance);
+        }
+
+        // the average weighting's vote of every k up to k, a k past the train rows votes with all of them
+        voteAverage(train->outputSize, neighbourCount, train->outputs, predictionOutputs, neighbours, scan->k, 1, scan->k);
+        int predicted = 0;
+        for (int kIndex = 0; kIndex < scan->k; kIndex++)
+        {
+            predicted = voteArgmax(train->outputSize, &predictionOutputs[(size_t)kIndex * train->outputSize]);
+            correctCounts[kIndex] += predicted == queries->labels[queryIndex];
+        }
+        if (scan->keep != NULL)
+        {
+            scan->keep[queryIndex] = predicted == queries->labels[queryIndex];
+        }
+    }
+    if (scan->correctCounts != NULL)
+    {
+        WaitForSingleObject(scan->lock, INFINITE);
+        for (int kIndex = 0; kIndex < scan->k; kIndex++)
+        {
+            scan->correctCounts[kIndex] += correctCounts[kIndex];
+        }
+        ReleaseMutex(scan->lock);
+    }
+    interleaveScratchFree(&interleave);
+    free(neighbours);
+    free(predictionOutputs);
+    free(correctCounts);
+}
+
+static void reduceScan(ReduceScan* scan, int threadCount)
+{
+    scan->lock = CreateMutex(NULL, FALSE, NULL);
+    if (scan->lock == NULL)
+    {
+        printf("Failed to create the reduce lock.\n");
+        exit(1);
+    }
+    platformParallel(threadCount, scan->queries->count, reduceScanRows, scan);
+}
+
+// wilson editing, the rows whose k nearest other rows vote for their own label, returns how many, kept in rows
+static int reduceEdit(const ReduceSet* train, int k, float distanceThreshold, float distanceExponent, int threadCount, int* rows)
+{
+    InterleavedRows interleaved;
+    interleavedRowsCreate(&interleaved, train->count, train->inputSize, train->inputs, kernels->interleaveLanes);
+    ReduceScan scan;
+    memset(&scan, 0, sizeof(ReduceScan));
+    scan.train = train;
+    scan.interleaved = &interleaved;
+    scan.queries = train;
+    scan.leaveOneOut = 1;
+    scan.k = k < train->count - 1 ? k : train->count - 1;
+    scan.distanceThreshold = distanceThreshold;
+    scan.distanceExponent = distanceExponent;
+    scan.keep = (unsigned char*)calloc(train->count, 1);
+    if (scan.keep == NULL)
+    {
+        printf("Failed to allocate memory for reduce editing.\n");
+        exit(1);
+    }
+    if (scan.k > 0)
+    {
+        reduceScan(&scan, threadCount);
+    }
+    int keptCount = 0;
+    for (int row = 0; row < train->count; row++)
+    {
+        if (scan.keep[row] || scan.k == 0)
+        {
+            rows[keptCount++] = row;
+        }
+    }
+    free(scan.keep);
+    interleavedRowsFree(&interleaved);
+    return keptCount;
+}
+
+// measures a candidate against the store rows it has not seen yet, a tie keeps the row that joined first
+static void reduceCatchUp(ReduceCondense* condense, int candidate)
+{
+    const ReduceSet* train = condense->train;
+    const float* input = &train->inputs[(size_t)condense->candidates[candidate] * train->inputSize];
+    for (int position = condense->seenCounts[candidate]; position < condense->storeCount; position++)
+    {
+        int storeRow = condense->store[position];
+        float distance = kernels->distance(train->inputSize, input, &train->inputs[(size_t)storeRow * train->inputSize], condense->distanceThreshold, condense->distanceExponent);
+        if (distance < condense->nearestDistances[candidate])
+        {
+            condense->nearestDistances[candidate] = distance;
+            condense->nearestLabels[candidate] = train->labels[storeRow];
+        }
+    }
+    condense->seenCounts[candidate] = condense->storeCount;
+}
+
+typedef struct {
+    ReduceCondense* condense;
+    int batchStart;
+} ReduceCondenseBatch;
+
+// candidates [start, end) of a batch, the store does not change while they run
+static void reduceCondenseRows(void* context, int start, int end)
+{
+    ReduceCondenseBatch* batch = (ReduceCondenseBatch*)context;
+    for (int candidate = batch->batchStart + start; candidate < batch->batchStart + end; candidate++)
+    {
+        if (!batch->condense->stored[candidate])
+        {
+            reduceCatchUp(batch->condense, candidate);
+        }
+    }
+}
+
+// hart's condensed nearest neighbour over the candidates, in their order, passes repeat until one adds no row,
+// returns the store size, the store rows in the order they joined are written to rows, passes to *passCount
+static int reduceCondense(const ReduceSet* train, const int* candidates, int candidateCount, float distanceThreshold, float distanceExponent, int threadCount, int* rows, int* passCount)
+{
+    ReduceCondense condense;
+    memset(&condense, 0, sizeof(ReduceCondense));
+    condense.train = train;
+    condense.distanceThreshold = distanceThreshold;
+    condense.distanceExponent = distanceExponent;
+    condense.candidates = candidates;
+    condense.candidateCount = candidateCount;
+    condense.store = rows;
+    condense.stored = (unsigned char*)calloc(candidateCount > 0 ? candidateCount : 1, 1);
+    condense.nearestDistances = (float*)calloc(candidateCount > 0 ? candidateCount : 1, sizeof(float));
+    condense.nearestLabels = (int*)calloc(candidateCount > 0 ? candidateCount : 1, sizeof(int));
+    condense.seenCounts = (int*)calloc(candidateCount > 0 ? candidateCount : 1, sizeof(int));
+    if (condense.stored == NULL || condense.nearestDistances == NULL || condense.nearestLabels == NULL || condense.seenCounts == NULL)
+    {
+        printf("Failed to allocate memory for reduce condensing.\n");
+        exit(1);
+    }
+    for (int candidate = 0; candidate < candidateCount; candidate++)
+    {
+        condense.nearestDistances[candidate] = INFINITY;
+        condense.nearestLabels[candidate] = -1;
+    }
+    *passCount = 0;
+    if (candidateCount == 0)
+    {
+        return 0;
+    }
+
+    // the first candidate starts the store
+    condense.store[condense.storeCount++] = candidates[0];
+    condense.stored[0] = 1;
+    int addedCount = 1;
+    while (addedCount > 0)
+    {
+        addedCount = 0;
+        (*passCount)++;
+        for (int batchStart = 0; batchStart < candidateCount; batchStart += REDUCE_BATCH_ROWS)
+        {
+            int batchEnd = batchStart + REDUCE_BATCH_ROWS < candidateCount ? batchStart + REDUCE_BATCH_ROWS : candidateCount;
+            ReduceCondenseBatch batch = { &condense, batchStart };
+            platformParallel(threadCount, batchEnd - batchStart, reduceCondenseRows, &batch);
+            for (int candidate = batchStart; candidate < batchEnd; candidate++)
+            {
+                if (condense.stored[candidate])
+                {
+                    continue;
+                }
+                reduceCatchUp(&condense, candidate);
+                if (condense.nearestLabels[candidate] != train->labels[candidates[candidate]])
+                {
+                    condense.store[condense.storeCount++] = candidates[candidate];
+                    condense.stored[candidate] = 1;
+                    addedCount++;
+                }
+            }
+        }
+    }
+    free(condense.stored);
+    free(condense.nearestDistances);
+    free(condense.nearestLabels);
+    free(condense.seenCounts);
+    return condense.storeCount;
+}
+
+// correct test rows for every k from 1 to kMax against the train set, as the average weighting's knnTest counts them
+static void reduceAccuracy(const ReduceSet* train, const ReduceSet* test, int kMax, float distanceThreshold, float distanceExponent, int threadCount, long long* correctCounts)
+{
+    InterleavedRows interleaved;
+    interleavedRowsCreate(&interleaved, train->count, train->inputSize, train->inputs, kernels->interleaveLanes);
+    ReduceScan scan;
+    memset(&scan, 0, sizeof(ReduceScan));
+    scan.train = train;
+    scan.interleaved = &interleaved;
+    scan.queries = test;
+    scan.k = kMax;
+    scan.distanceThreshold = distanceThreshold;
+    scan.distanceExponent = distanceExponent;
+    scan.correctCounts = correctCounts;
+    memset(correctCounts, 0, kMax * sizeof(long long));
+    reduceScan(&scan, threadCount);
+    interleavedRowsFree(&interleaved);
+}
+
+#endif
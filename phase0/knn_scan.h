@@ -0,0 +1,261 @@
+#ifndef KNN_SCAN_H
+#define KNN_SCAN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_dispatch.h"
+#include "knn_sparse.h"
+#include "knn_cascade.h"
+#include "knn_band.h"
+#include "knn_pca.h"
+#include "knn_sketch.h"
+#include "knn_batch.h"
+#include "knn_warm.h"
+#include "knn_interleave.h"
+
+// the distance pass and selection of one query, shared by the sweep programs and knn_verify so the engines it checks are
+// the code the sweeps run: the pass measures each train row against the test row through the sparse merge, a batched
+// block, the interleaved rows or the dense kernel, with the cascade, the band or a prefilter skipping rows, then the
+// selection ranks the rows low to high distance with ties lowest index first and keeps the kmax nearest in front
+//
+// rooted and radix are the program's DISTANCE_ROOTED and USE_RADIX_SORT, constants in the sweeps so the compiler folds
+// the paths they do not take, every module scratch is passed in its off state when the module is off
+
+// equal distances rank by train index
+static int compareIndexDistance(const void* a, const void* b)
+{
+    IndexDistance* id1 = (IndexDistance*)a;
+    IndexDistance* id2 = (IndexDistance*)b;
+    if (id1->distance < id2->distance)
+    {
+        return -1;
+    }
+    if (id1->distance > id2->distance)
+    {
+        return 1;
+    }
+    return id1->index - id2->index;
+}
+
+// the radix sort reads distances by train index, qsort sorts the index distance pairs in place
+static inline void scanStore(IndexDistance* indexDistances, RadixBuffers* radixBuffers, int radix, int trainIndex, float distance)
+{
+    if (radix)
+    {
+        radixBuffers->distances[trainIndex] = distance;
+    }
+    else
+    {
+        indexDistances[trainIndex].index = trainIndex;
+        indexDistances[trainIndex].distance = distance;
+    }
+}
+
+// a row's distance after the pass, before the selection reorders the pairs
+static inline float scanDistance(IndexDistance* indexDistances, RadixBuffers* radixBuffers, int radix, int trainIndex)
+{
+    return radix ? radixBuffers->distances[trainIndex] : indexDistances[trainIndex].distance;
+}
+
+// the distance of every train row to the test row, rows the pass skips are left at an infinite distance,
+// a batched combo reads the distances its block already summed, so its caller loads the block first
+static void scanDistances(
+    const KnnKernels* isa,
+    int inputSize,
+    int trainCount,
+    float* trainInputs,
+    float* testInput,
+    IndexDistance* indexDistances,
+    RadixBuffers* radixBuffers,
+    SparseScratch* sparse,
+    CascadeScratch* cascade,
+    BandScratch* band,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    BatchScratch* batch,
+    WarmScratch* warm,
+    InterleaveScratch* interleave,
+    float distanceThreshold,
+    float distanceExponent,
+    int rooted,
+    int radix
+)
+{
+    int batched = batch->comboCount > 0;
+    if (sparse->rows != NULL && !batched)
+    {
+        sparseLoadTest(sparse, testInput, distanceExponent);
+    }
+
+    // metric combos measure rows outward from the query's norm and leave the rows they skip at an infinite distance,
+    // the cascade prunes with rows in index order so it only runs on the other combos,
+    // and the pca or sketch prefilter, when on, measures only the query's shortlist in place of both
+    int banded = band->active;
+    int cascading = cascade->rows != NULL && !banded;
+    int projected = pca->filter != NULL;
+    int sketched = sketch->trainRows != NULL;
+    int filtered = projected || sketched;
+    if (cascading)
+    {
+        cascadeLoadTest(cascade, testInput);
+    }
+    if (banded)
+    {
+        bandLoadTest(band, testInput);
+    }
+    if (banded || filtered)
+    {
+        for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+        {
+            scanStore(indexDistances, radixBuffers, radix, trainIndex, INFINITY);
+        }
+    }
+
+    // a dense scan of every row in index order measures a block of interleaved rows at its first row
+    int interleaved = interleave->rows != NULL && sparse->rows == NULL && !batched && !banded && !filtered && !(cascading && cascade->active);
+    if (interleaved)
+    {
+        interleaveLoadTest(interleave, testInput, distanceThreshold, distanceExponent);
+    }
+
+    // the rows the previous combo of the run ranked nearest go first, so the cascade prunes the scan from a tight limit,
+    // the scan then skips them
+    int seeded = cascading && cascade->active && warm->seedCount > 0;
+    if (seeded)
+    {
+        cascade->seeded = 1;
+        for (int seed = 0; seed < warm->seedCount; seed++)
+        {
+            int trainIndex = warm->seeds[seed];
+            float distance = sparse->rows != NULL
+                ? sparseDistance(sparse, trainIndex, distanceThreshold, distanceExponent)
+                : isa->distance(inputSize, testInput, &trainInputs[(size_t)trainIndex * inputSize], distanceThreshold, distanceExponent);
+            cascadeOffer(cascade, distance);
+            warmMark(warm, trainIndex);
+            if (rooted)
+            {
+                distance = pow(distance, 1.0f / distanceExponent);
+            }
+            scanStore(indexDistances, radixBuffers, radix, trainIndex, distance);
+        }
+    }
+    int visitCount = projected ? pca->filter->shortlistCount : sketched ? sketch->shortlistCount : trainCount;
+    for (int visit = 0; visit < visitCount; visit++)
+    {
+        int trainIndex = projected ? pca->shortlist[visit] : sketched ? sketch->shortlist[visit] : banded ? bandNext(band) : visit;
+        if (trainIndex < 0)
+        {
+            break;
+        }
+        if (seeded && warmMarked(warm, trainIndex))
+        {
+            // measured as a seed
+            continue;
+        }
+        float distance;
+        if (cascading && cascadePrune(cascade, trainIndex))
+        {
+            // the pooled bound shows this row is not among the kmax nearest
+            distance = INFINITY;
+        }
+        else
+        {
+            distance = batched
+                ? batchDistance(batch, trainIndex)
+                : interleaved
+                ? interleaveDistance(interleave, testInput, trainIndex, distanceThreshold, distanceExponent)
+                : sparse->rows != NULL
+                ? sparseDistance(sparse, trainIndex, distanceThreshold, distanceExponent)
+                : isa->distance(inputSize, testInput, &trainInputs[(size_t)trainIndex * inputSize], distanceThreshold, distanceExponent);
+            if (cascading)
+            {
+                cascadeOffer(cascade, distance);
+            }
+            if (projected)
+            {
+                pcaOffer(pca, visit, distance);
+            }
+            if (sketched)
+            {
+                sketchOffer(sketch, visit, distance);
+            }
+        }
+        if (rooted)
+        {
+            distance = pow(distance, 1.0f / distanceExponent);
+        }
+        if (banded)
+        {
+            bandOffer(band, distance);
+        }
+        scanStore(indexDistances, radixBuffers, radix, trainIndex, distance);
+    }
+
+    // a sampled query also runs the full scan to measure the shortlist's recall
+    if ((projected && pca->sampled) || (sketched && sketch->sampled))
+    {
+        for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+        {
+            float distance = sparse->rows != NULL
+                ? sparseDistance(sparse, trainIndex, distanceThreshold, distanceExponent)
+                : isa->distance(inputSize, testInput, &trainInputs[(size_t)trainIndex * inputSize], distanceThreshold, distanceExponent);
+            if (projected)
+            {
+                pcaExactOffer(pca, distance);
+            }
+            else
+            {
+                sketchExactOffer(sketch, distance);
+            }
+        }
+        if (projected)
+        {
+            pcaRecall(pca);
+        }
+        else
+        {
+            sketchRecall(sketch);
+        }
+    }
+}
+
+// ranks the rows low to high distance, the kmax nearest end up at the head of the index distance pairs,
+// and they seed the same test row in the next combo of a warm run
+static void scanSelect(
+    const KnnKernels* isa,
+    int trainCount,
+    IndexDistance* indexDistances,
+    RadixBuffers* radixBuffers,
+    WarmScratch* warm,
+    int kMax,
+    int radix
+)
+{
+    if (radix)
+    {
+        // rank every train row, then unpack the neighbours up to kmax
+        isa->sortDistances(trainCount, radixBuffers);
+        for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+        {
+            int trainIndex = unpackKeyIndex(radixBuffers->sorted[neighbourIndex]);
+            indexDistances[neighbourIndex].index = trainIndex;
+            indexDistances[neighbourIndex].distance = radixBuffers->distances[trainIndex];
+        }
+    }
+    else
+    {
+        qsort(indexDistances, trainCount, sizeof(IndexDistance), compareIndexDistance);
+    }
+
+    if (warm->marks != NULL)
+    {
+        for (int neighbourIndex = 0; neighbourIndex < warm->recordCount; neighbourIndex++)
+        {
+            warmRecord(warm, neighbourIndex, indexDistances[neighbourIndex].index);
+        }
+    }
+}
+
+#endif
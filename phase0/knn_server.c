@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_synthetic.h"
+#include "knn_lib.h"
+#include "knn_protocol.h"
+#include "knn_train.h"
+
+#ifdef _WIN32
+
+int main(int argc, char** argv)
+{
+    printf("knn_server needs unix domain sockets and pthreads, it is not available on windows yet.\n");
+    return 1;
+}
+
+#else
+
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// long running classifier over a unix socket
+// connection threads read queries into a shared queue, worker threads take up to maxBatch of them at a time,
+// waiting at most maxWait past the oldest arrival for the batch to fill, and run them as one knnPredictBatch pass
+#define SERVER_QUEUE_CAPACITY 4096
+#define SERVER_LATENCY_CAPACITY (1 << 20)
+#define SERVER_REPORT_SECONDS 5
+// a reply that cannot be sent within this long drops its client, so a stalled reader cannot hold a worker
+#define SERVER_SEND_TIMEOUT_SECONDS 2
+
+typedef struct {
+    int fd;
+    int references;
+    // set under writeLock once a reply failed or timed out part way, the stream is then out of step so nothing more is sent
+    int broken;
+    // set by the connection thread as it exits, the accept loop then joins it
+    int finished;
+    pthread_t thread;
+    pthread_mutex_t writeLock;
+} Connection;
+
+typedef struct {
+    Connection* connection;
+    uint32_t id;
+    uint64_t arrivalNanoseconds;
+} PendingQuery;
+
+typedef struct {
+    KnnModel* model;
+    int inputSize;
+    int outputSize;
+    int maxBatch;
+    uint64_t maxWaitNanoseconds;
+
+    // ring of queued queries, inputs live in a parallel ring of rows
+    PendingQuery* pending;
+    float* pendingInputs;
+    int head;
+    int count;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    // latencies from a query's arrival to its response being written, reset every report
+    pthread_mutex_t statsLock;
+    double* latencies;
+    int latencyCount;
+    long long intervalServed;
+    long long intervalBatches;
+    long long totalServed;
+    long long totalBatches;
+    uint64_t intervalStartNanoseconds;
+} Server;
+
+typedef struct {
+    Server* server;
+    int threadIndex;
+} WorkerArgs;
+
+typedef struct {
+    Server* server;
+    Connection* connection;
+} ConnectionArgs;
+
+static volatile sig_atomic_t serverStopRequested = 0;
+
+void handleStopSignal(int signalNumber)
+{
+    serverStopRequested = 1;
+}
+
+int compareDouble(const void* a, const void* b)
+{
+    double d1 = *(double*)a;
+    double d2 = *(double*)b;
+    if (d1 < d2)
+    {
+        return -1;
+    }
+    if (d1 > d2)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+double percentile(double* sorted, int count, double fraction)
+{
+    int index = (int)ceil(fraction * count) - 1;
+    if (index < 0)
+    {
+        index = 0;
+    }
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+void connectionRelease(Connection* connection)
+{
+    if (__atomic_sub_fetch(&connection->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->writeLock);
+        free(connection);
+    }
+}
+
+// absolute CLOCK_REALTIME deadline for pthread_cond_timedwait, the queue itself is timed on the monotonic clock
+struct timespec realtimeDeadline(uint64_t nanosecondsFromNow)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nanoseconds = (uint64_t)deadline.tv_nsec + nanosecondsFromNow;
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000ull);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000ull);
+    return deadline;
+}
+
+void reportStats(Server* server, const char* label)
+{
+    pthread_mutex_lock(&server->statsLock);
+    uint64_t now = platformNanoseconds();
+    double seconds = (double)(now - server->intervalStartNanoseconds) / 1000000000.0;
+    if (server->latencyCount > 0)
+    {
+        qsort(server->latencies, server->latencyCount, sizeof(double), compareDouble);
+        double p50 = percentile(server->latencies, server->latencyCount, 0.50);
+        double p99 = percentile(server->latencies, server->latencyCount, 0.99);
+        double maximum = server->latencies[server->latencyCount - 1];
+        printf("%s, served: %lld, throughput: %.1f/s, p50: %.3f ms, p99: %.3f ms, max: %.3f ms, mean batch: %.2f, total: %lld\n",
+            label,
+            server->intervalServed,
+            seconds > 0.0 ? (double)server->intervalServed / seconds : 0.0,
+            p50 / 1000000.0,
+            p99 / 1000000.0,
+            maximum / 1000000.0,
+            server->intervalBatches > 0 ? (double)server->intervalServed / (double)server->intervalBatches : 0.0,
+            server->totalServed);
+        fflush(stdout);
+    }
+    server->latencyCount = 0;
+    server->intervalServed = 0;
+    server->intervalBatches = 0;
+    server->intervalStartNanoseconds = now;
+    pthread_mutex_unlock(&server->statsLock);
+}
+
+void* workerEntry(void* arg)
+{
+    WorkerArgs* workerArgs = (WorkerArgs*)arg;
+    Server* server = workerArgs->server;
+    int maxBatch = server->maxBatch;
+    int inputSize = server->inputSize;
+    int outputSize = server->outputSize;
+
+    PendingQuery* batch = (PendingQuery*)calloc(maxBatch, sizeof(PendingQuery));
+    float* batchInputs = (float*)calloc((size_t)maxBatch * inputSize, sizeof(float));
+    float* predictionOutputs = (float*)calloc((size_t)maxBatch * outputSize, sizeof(float));
+    int* predictedLabels = (int*)calloc(maxBatch, sizeof(int));
+    double* latencies = (double*)calloc(maxBatch, sizeof(double));
+    if (batch == NULL || batchInputs == NULL || predictionOutputs == NULL || predictedLabels == NULL || latencies == NULL)
+    {
+        printf("Failed to allocate memory for worker buffers.\n");
+        exit(1);
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&server->lock);
+        while (server->count == 0 && !server->stopping)
+        {
+            pthread_cond_wait(&server->notEmpty, &server->lock);
+        }
+        if (server->count == 0)
+        {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        // hold the batch open until it is full or the oldest query has waited maxWait
+        while (server->count < maxBatch && !server->stopping)
+        {
+            uint64_t deadline = server->pending[server->head].arrivalNanoseconds + server->maxWaitNanoseconds;
+            uint64_t now = platformNanoseconds();
+            if (now >= deadline)
+            {
+                break;
+            }
+            struct timespec wakeup = realtimeDeadline(deadline - now);
+            pthread_cond_timedwait(&server->notEmpty, &server->lock, &wakeup);
+            if (server->count == 0)
+            {
+                break;
+            }
+        }
+
+        int batchCount = server->count < maxBatch ? server->count : maxBatch;
+        for (int batchIndex = 0; batchIndex < batchCount; batchIndex++)
+        {
+            int slot = (server->head + batchIndex) % SERVER_QUEUE_CAPACITY;
+            batch[batchIndex] = server->pending[slot];
+            memcpy(&batchInputs[(size_t)batchIndex * inputSize], &server->pendingInputs[(size_t)slot * inputSize], inputSize * sizeof(float));
+        }
+        server->head = (server->head + batchCount) % SERVER_QUEUE_CAPACITY;
+        server->count -= batchCount;
+        pthread_cond_broadcast(&server->notFull);
+        pthread_mutex_unlock(&server->lock);
+        if (batchCount == 0)
+        {
+            continue;
+        }
+
+        // one pass over the train set for the whole batch
+        knnPredictBatch(server->model, workerArgs->threadIndex, batchCount, batchInputs, predictionOutputs, predictedLabels, NULL);
+
+        for (int batchIndex = 0; batchIndex < batchCount; batchIndex++)
+        {
+            Connection* connection = batch[batchIndex].connection;
+            KnnResponseHeader header;
+            header.id = batch[batchIndex].id;
+            header.label = predictedLabels[batchIndex];
+
+            // a client that hung up or stopped reading loses its answers, and its reader is woken to close the connection
+            pthread_mutex_lock(&connection->writeLock);
+            if (!connection->broken && (writeFull(connection->fd, &header, sizeof(header)) != 0 || writeFull(connection->fd, &predictionOutputs[(size_t)batchIndex * outputSize], outputSize * sizeof(float)) != 0))
+            {
+                connection->broken = 1;
+                shutdown(connection->fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&connection->writeLock);
+            latencies[batchIndex] = (double)(platformNanoseconds() - batch[batchIndex].arrivalNanoseconds);
+            connectionRelease(connection);
+        }
+
+        pthread_mutex_lock(&server->statsLock);
+        for (int batchIndex = 0; batchIndex < batchCount && server->latencyCount < SERVER_LATENCY_CAPACITY; batchIndex++)
+        {
+            server->latencies[server->latencyCount++] = latencies[batchIndex];
+        }
+        server->intervalServed += batchCount;
+        server->intervalBatches++;
+        server->totalServed += batchCount;
+        server->totalBatches++;
+        pthread_mutex_unlock(&server->statsLock);
+    }
+
+    free(batch);
+    free(batchInputs);
+    free(predictionOutputs);
+    free(predictedLabels);
+    free(latencies);
+    return NULL;
+}
+
+void* connectionEntry(void* arg)
+{
+    ConnectionArgs* connectionArgs = (ConnectionArgs*)arg;
+    Server* server = connectionArgs->server;
+    Connection* connection = connectionArgs->connection;
+    free(connectionArgs);
+
+    KnnParameters parameters;
+    knnModelGetParameters(server->model, &parameters);
+    KnnHello hello;
+    hello.magic = KNN_PROTOCOL_MAGIC;
+    hello.inputSize = (uint32_t)server->inputSize;
+    hello.outputSize = (uint32_t)server->outputSize;
+    hello.k = (uint32_t)parameters.k;
+
+    float* input = (float*)calloc(server->inputSize, sizeof(float));
+    pthread_mutex_lock(&connection->writeLock);
+    int helloFailed = writeFull(connection->fd, &hello, sizeof(hello));
+    pthread_mutex_unlock(&connection->writeLock);
+
+    while (input != NULL && helloFailed == 0)
+    {
+        KnnRequestHeader header;
+        if (readFull(connection->fd, &header, sizeof(header)) != 0 || readFull(connection->fd, input, server->inputSize * sizeof(float)) != 0)
+        {
+            break;
+        }
+        uint64_t arrivalNanoseconds = platformNanoseconds();
+
+        pthread_mutex_lock(&server->lock);
+        while (server->count == SERVER_QUEUE_CAPACITY && !server->stopping)
+        {
+            pthread_cond_wait(&server->notFull, &server->lock);
+        }
+        if (server->stopping)
+        {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        int slot = (server->head + server->count) % SERVER_QUEUE_CAPACITY;
+        server->pending[slot].connection = connection;
+        server->pending[slot].id = header.id;
+        server->pending[slot].arrivalNanoseconds = arrivalNanoseconds;
+        memcpy(&server->pendingInputs[(size_t)slot * server->inputSize], input, server->inputSize * sizeof(float));
+        __atomic_add_fetch(&connection->references, 1, __ATOMIC_ACQ_REL);
+        server->count++;
+        pthread_cond_broadcast(&server->notEmpty);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    free(input);
+    __atomic_store_n(&connection->finished, 1, __ATOMIC_RELEASE);
+    connectionRelease(connection);
+    return NULL;
+}
+
+// joins the connection threads that have exited and drops the accept loop's reference to them, returns how many are
+// still running, stopping first shuts every socket down so a thread blocked reading its client wakes and exits too
+int connectionsJoin(Connection** connections, int connectionCount, int stopping)
+{
+    int runningCount = 0;
+    for (int connectionIndex = 0; connectionIndex < connectionCount; connectionIndex++)
+    {
+        Connection* connection = connections[connectionIndex];
+        if (stopping)
+        {
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        if (stopping || __atomic_load_n(&connection->finished, __ATOMIC_ACQUIRE))
+        {
+            pthread_join(connection->thread, NULL);
+            connectionRelease(connection);
+        }
+        else
+        {
+            connections[runningCount++] = connection;
+        }
+    }
+    return runningCount;
+}
+
+KnnWeighting parseWeighting(const char* name)
+{
+    if (strcmp(name, "average") == 0)
+    {
+        return KNN_WEIGHTING_AVERAGE;
+    }
+    if (strcmp(name, "linear") == 0)
+    {
+        return KNN_WEIGHTING_LINEAR;
+    }
+    if (strcmp(name, "reciprocal") == 0)
+    {
+        return KNN_WEIGHTING_RECIPROCAL;
+    }
+    printf("Unknown weighting: %s\n", name);
+    exit(1);
+}
+
+KnnIndex parseIndex(const char* name)
+{
+    if (strcmp(name, "none") == 0)
+    {
+        return KNN_INDEX_NONE;
+    }
+    if (strcmp(name, "vptree") == 0)
+    {
+        return KNN_INDEX_VPTREE;
+    }
+    if (strcmp(name, "hnsw") == 0)
+    {
+        return KNN_INDEX_HNSW;
+    }
+    printf("Unknown index: %s\n", name);
+    exit(1);
+}
+
+// usage: knn_server [socketPath] [maxBatch=32] [maxWaitMicroseconds=200] [workers=1] [k=5] [distanceThreshold=0] [distanceExponent=2] [weighting=reciprocal] [rooted=0]
+//                   [index=vptree] [indexPath=-] [efSearch=64]
+// the train set comes from KNN_SYNTHETIC, mnist shaped with 60000 rows when it is not set, or from the csv KNN_TRAIN names
+// the index is built by the workers before listening, an hnsw graph is loaded from indexPath when it holds one and saved there otherwise
+int main(int argc, char** argv)
+{
+    const char* socketPath = argc > 1 ? argv[1] : KNN_DEFAULT_SOCKET;
+    int maxBatch = argc > 2 ? atoi(argv[2]) : 32;
+    int maxWaitMicroseconds = argc > 3 ? atoi(argv[3]) : 200;
+    int workerCount = argc > 4 ? atoi(argv[4]) : 1;
+    KnnParameters parameters;
+    knnParametersDefaults(&parameters);
+    parameters.k = argc > 5 ? atoi(argv[5]) : 5;
+    parameters.distanceThreshold = argc > 6 ? (float)atof(argv[6]) : 0.0f;
+    parameters.distanceExponent = argc > 7 ? (float)atof(argv[7]) : 2.0f;
+    parameters.weighting = argc > 8 ? parseWeighting(argv[8]) : KNN_WEIGHTING_RECIPROCAL;
+    parameters.rooted = argc > 9 ? atoi(argv[9]) : 0;
+    parameters.index = argc > 10 ? parseIndex(argv[10]) : KNN_INDEX_VPTREE;
+    const char* indexPath = argc > 11 && strcmp(argv[11], "-") != 0 ? argv[11] : NULL;
+    parameters.hnsw.efSearch = argc > 12 ? atoi(argv[12]) : 64;
+    if (maxBatch < 1 || maxWaitMicroseconds < 0 || workerCount < 1 || strlen(socketPath) >= sizeof(((struct sockaddr_un*)0)->sun_path))
+    {
+        printf("Invalid server arguments.\n");
+        exit(1);
+    }
+
+    // load the train set once
+    int trainCount = 60000;
+    int testCount = 1;
+    int inputSize = 784;
+    int outputSize = 10;
+    SyntheticConfig syntheticConfig;
+    if (!syntheticFromEnvironment(&syntheticConfig, &trainCount, &testCount, &inputSize, &outputSize))
+    {
+        syntheticDefaults(&syntheticConfig, 1);
+    }
+    float* trainInputs = NULL;
+    float* trainOutputs = NULL;
+    const char* trainPath = trainCsvPath();
+    if (trainPath != NULL)
+    {
+        trainCount = trainCsvLoad(trainPath, inputSize, outputSize, &trainInputs, &trainOutputs);
+        printf("Train: %d rows from %s\n", trainCount, trainPath);
+    }
+    else
+    {
+        loadSynthetic(&syntheticConfig, SYNTHETIC_TRAIN, trainCount, inputSize, outputSize, &trainInputs, &trainOutputs);
+    }
+
+    Server server;
+    memset(&server, 0, sizeof(Server));
+    server.model = knnModelCreate(inputSize, outputSize, trainCount, trainInputs, trainOutputs, &parameters, workerCount, maxBatch);
+    if (server.model == NULL)
+    {
+        printf("Failed to create knn model.\n");
+        exit(1);
+    }
+    free(trainInputs);
+    free(trainOutputs);
+
+    // building up front keeps the first requests from paying for it
+    uint64_t buildStartNanoseconds = platformNanoseconds();
+    FILE* indexFile = NULL;
+    int indexLoaded = 0;
+    if (parameters.index == KNN_INDEX_HNSW && indexPath != NULL && fopen_s(&indexFile, indexPath, "rb") == 0)
+    {
+        fclose(indexFile);
+        indexLoaded = knnModelLoadIndex(server.model, indexPath) == 0;
+    }
+    if (!indexLoaded)
+    {
+        if (knnModelBuildIndex(server.model, workerCount) != 0)
+        {
+            printf("Failed to build the knn index.\n");
+            exit(1);
+        }
+        if (parameters.index == KNN_INDEX_HNSW && indexPath != NULL)
+        {
+            knnModelSaveIndex(server.model, indexPath);
+        }
+    }
+    printf("Index: %s, %s in %.3f s\n", parameters.index == KNN_INDEX_HNSW ? "hnsw" : parameters.index == KNN_INDEX_VPTREE ? "vptree" : "none", indexLoaded ? "loaded" : "built", (double)(platformNanoseconds() - buildStartNanoseconds) / 1000000000.0);
+    server.inputSize = inputSize;
+    server.outputSize = outputSize;
+    server.maxBatch = maxBatch;
+    server.maxWaitNanoseconds = (uint64_t)maxWaitMicroseconds * 1000ull;
+    server.pending = (PendingQuery*)calloc(SERVER_QUEUE_CAPACITY, sizeof(PendingQuery));
+    server.pendingInputs = (float*)calloc((size_t)SERVER_QUEUE_CAPACITY * inputSize, sizeof(float));
+    server.latencies = (double*)calloc(SERVER_LATENCY_CAPACITY, sizeof(double));
+    if (server.pending == NULL || server.pendingInputs == NULL || server.latencies == NULL)
+    {
+        printf("Failed to allocate memory for server queue.\n");
+        exit(1);
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.notEmpty, NULL);
+    pthread_cond_init(&server.notFull, NULL);
+    pthread_mutex_init(&server.statsLock, NULL);
+    server.intervalStartNanoseconds = platformNanoseconds();
+
+    // listen
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        printf("Failed to create socket.\n");
+        exit(1);
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 128) != 0)
+    {
+        printf("Failed to listen on %s: %s\n", socketPath, strerror(errno));
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handleStopSignal);
+    signal(SIGTERM, handleStopSignal);
+
+    pthread_t* workers = (pthread_t*)calloc(workerCount, sizeof(pthread_t));
+    WorkerArgs* workerArgs = (WorkerArgs*)calloc(workerCount, sizeof(WorkerArgs));
+    if (workers == NULL || workerArgs == NULL)
+    {
+        printf("Failed to allocate memory for workers.\n");
+        exit(1);
+    }
+    for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+    {
+        workerArgs[workerIndex].server = &server;
+        workerArgs[workerIndex].threadIndex = workerIndex;
+        if (pthread_create(&workers[workerIndex], NULL, workerEntry, &workerArgs[workerIndex]) != 0)
+        {
+            printf("Failed to create worker thread.\n");
+            exit(1);
+        }
+    }
+
+    printf("Kernel ISA: %s\n", knnModelIsa(server.model));
+    printf("Listening on %s, train: %d, inputs: %d, outputs: %d, k: %d, max batch: %d, max wait: %d us, workers: %d\n", socketPath, trainCount, inputSize, outputSize, parameters.k, maxBatch, maxWaitMicroseconds, workerCount);
+    fflush(stdout);
+
+    // accept until SIGINT or SIGTERM, reporting every few seconds, each connection is held until its thread is joined
+    uint64_t lastReportNanoseconds = platformNanoseconds();
+    Connection** connections = NULL;
+    int connectionCount = 0;
+    int connectionCapacity = 0;
+    while (!serverStopRequested)
+    {
+        struct pollfd listenPoll;
+        listenPoll.fd = listenFd;
+        listenPoll.events = POLLIN;
+        listenPoll.revents = 0;
+        if (poll(&listenPoll, 1, 200) > 0 && (listenPoll.revents & POLLIN))
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0)
+            {
+                if (connectionCount == connectionCapacity)
+                {
+                    connectionCapacity = connectionCapacity > 0 ? connectionCapacity * 2 : 16;
+                    connections = (Connection**)realloc(connections, connectionCapacity * sizeof(Connection*));
+                }
+                Connection* connection = (Connection*)calloc(1, sizeof(Connection));
+                ConnectionArgs* connectionArgs = (ConnectionArgs*)calloc(1, sizeof(ConnectionArgs));
+                if (connections == NULL || connection == NULL || connectionArgs == NULL)
+                {
+                    printf("Failed to allocate memory for connection.\n");
+                    exit(1);
+                }
+                // every send on the socket gives up after the timeout instead of blocking the worker behind it
+                struct timeval sendTimeout;
+                sendTimeout.tv_sec = SERVER_SEND_TIMEOUT_SECONDS;
+                sendTimeout.tv_usec = 0;
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+                connection->fd = fd;
+                connection->references = 2;
+                pthread_mutex_init(&connection->writeLock, NULL);
+                connectionArgs->server = &server;
+                connectionArgs->connection = connection;
+                if (pthread_create(&connection->thread, NULL, connectionEntry, connectionArgs) != 0)
+                {
+                    printf("Failed to create connection thread.\n");
+                    close(fd);
+                    pthread_mutex_destroy(&connection->writeLock);
+                    free(connection);
+                    free(connectionArgs);
+                    continue;
+                }
+                connections[connectionCount++] = connection;
+            }
+        }
+        connectionCount = connectionsJoin(connections, connectionCount, 0);
+
+        uint64_t now = platformNanoseconds();
+        if (now - lastReportNanoseconds >= SERVER_REPORT_SECONDS * 1000000000ull)
+        {
+            reportStats(&server, "Interval");
+            lastReportNanoseconds = now;
+        }
+    }
+
+    // drain what is queued, then stop
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.notEmpty);
+    pthread_cond_broadcast(&server.notFull);
+    pthread_mutex_unlock(&server.lock);
+    for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+    {
+        pthread_join(workers[workerIndex], NULL);
+    }
+    connectionsJoin(connections, connectionCount, 1);
+    free(connections);
+    reportStats(&server, "Final");
+    printf("Stopped, total served: %lld, batches: %lld\n", server.totalServed, server.totalBatches);
+
+    close(listenFd);
+    unlink(socketPath);
+    knnModelFree(server.model);
+    return 0;
+}
+
+#endif
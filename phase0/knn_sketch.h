@@ -0,0 +1,362 @@
+#ifndef KNN_SKETCH_H
+#define KNN_SKETCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+#include "knn_sort.h"
+
+// approximate prefilter for nearly binary images: every train and test row gets a sketch with one bit per input, set
+// above SKETCH_BIT_THRESHOLD, 13 words for mnist's 784 inputs, a query ranks every train row by the hamming distance
+// between sketches, about 100 bytes per row instead of 3 kb of floats, and measures the exact distance only for the
+// nearest shortlist, the other rows keep an infinite distance, so the sweep votes on the kmax nearest of the shortlist
+//
+// each combo sizes its shortlist before its first query from SKETCH_CALIBRATION_QUERIES test rows spread evenly over the
+// test set, which run the full scan: from the starting size the shortlist grows by half while their recall@kmax is below
+// the target, or trims a tenth while it stays perfect, so the size only depends on the combo, not on the thread that runs
+// it or the combos that thread ran before, and one query in SKETCH_RECALL_STRIDE, staggered over the combos, also runs
+// the full scan to report the recall
+//
+// off unless KNN_SKETCH sets the starting shortlist size, KNN_SKETCH_RECALL sets the target recall, 0.99 by default
+#define SKETCH_BIT_THRESHOLD 0.5f
+#define SKETCH_RECALL_DEFAULT 0.99
+#define SKETCH_RECALL_STRIDE 64
+#define SKETCH_CALIBRATION_QUERIES 8
+
+typedef struct {
+    int rowCount;
+    int inputSize;
+    // 64 inputs per word, rowCount x wordCount
+    int wordCount;
+    uint64_t* words;
+} SketchRows;
+
+// queries, sampled queries, the kmax nearest they had to find and found, and rows measured
+typedef struct {
+    long long queryCount;
+    long long sampledCount;
+    long long exactCount;
+    long long foundCount;
+    long long rowCount;
+    long long measuredCount;
+} SketchCounts;
+
+// the per thread state of a sweep: the current query's shortlist and the distances measured for it,
+// the kmax smallest of the full scan on sampled queries, and the calibration the combo's shortlist size comes from
+typedef struct {
+    const SketchRows* trainRows;
+    const SketchRows* testRows;
+    int shortlistStart;
+    int shortlistCount;
+    int shortlistMin;
+    double targetRecall;
+    int* shortlist;
+    float* shortlistDistances;
+    int* hammingDistances;
+    int* histogram;
+    int sampled;
+    int comboCount;
+    // per calibration query, 1 for each train row in hamming order that is within its kmax-th exact distance,
+    // and how many of the kmax nearest it has to find
+    int calibrationCount;
+    unsigned char* calibrationWithin;
+    int calibrationExact[SKETCH_CALIBRATION_QUERIES];
+    DistanceHeap heap;
+    SketchCounts counts;
+} SketchScratch;
+
+// the dense distance kernel the calibration measures with
+typedef float (*SketchDistance)(int inputSize, const float* testInput, const float* trainInput, float distanceThreshold, float distanceExponent);
+
+// the starting shortlist size, 0 when KNN_SKETCH is unset
+static int sketchSelect(int kMax, int trainCount, double* targetRecall)
+{
+    const char* recall = getenv("KNN_SKETCH_RECALL");
+    *targetRecall = recall != NULL && recall[0] != '\0' ? atof(recall) : SKETCH_RECALL_DEFAULT;
+    const char* shortlist = getenv("KNN_SKETCH");
+    int shortlistCount = shortlist != NULL && shortlist[0] != '\0' ? atoi(shortlist) : 0;
+    if (shortlistCount <= 0)
+    {
+        return 0;
+    }
+    if (shortlistCount < kMax)
+    {
+        shortlistCount = kMax;
+    }
+    return shortlistCount < trainCount ? shortlistCount : trainCount;
+}
+
+static void sketchRowsCreate(SketchRows* rows, int count, int inputSize, const float* inputs)
+{
+    rows->rowCount = count;
+    rows->inputSize = inputSize;
+    rows->wordCount = (inputSize + 63) / 64;
+    rows->words = (uint64_t*)arenaCalloc((size_t)count * rows->wordCount > 0 ? (size_t)count * rows->wordCount : 1, sizeof(uint64_t));
+    if (rows->words == NULL)
+    {
+        printf("Failed to allocate memory for sketches.\n");
+        exit(1);
+    }
+    for (int row = 0; row < count; row++)
+    {
+        const float* input = &inputs[(size_t)row * inputSize];
+        uint64_t* words = &rows->words[(size_t)row * rows->wordCount];
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            if (input[inputIndex] > SKETCH_BIT_THRESHOLD)
+            {
+                words[inputIndex / 64] |= 1ull << (inputIndex % 64);
+            }
+        }
+    }
+}
+
+static void sketchRowsFree(SketchRows* rows)
+{
+    arenaFree(rows->words);
+    memset(rows, 0, sizeof(SketchRows));
+}
+
+// trainRows may be NULL for a full scan, then nothing is allocated
+static void sketchScratchCreate(SketchScratch* scratch, const SketchRows* trainRows, const SketchRows* testRows, int shortlistCount, double targetRecall)
+{
+    memset(scratch, 0, sizeof(SketchScratch));
+    if (trainRows == NULL)
+    {
+        return;
+    }
+    int trainCount = trainRows->rowCount;
+    scratch->trainRows = trainRows;
+    scratch->testRows = testRows;
+    scratch->shortlistStart = shortlistCount;
+    scratch->shortlistCount = shortlistCount;
+    scratch->targetRecall = targetRecall;
+    scratch->shortlist = (int*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(int));
+    scratch->shortlistDistances = (float*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(float));
+    scratch->hammingDistances = (int*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(int));
+    scratch->histogram = (int*)arenaCalloc((size_t)trainRows->inputSize + 1, sizeof(int));
+    scratch->calibrationWithin = (unsigned char*)arenaCalloc((size_t)SKETCH_CALIBRATION_QUERIES * (trainCount > 0 ? trainCount : 1), sizeof(unsigned char));
+    if (scratch->shortlist == NULL || scratch->shortlistDistances == NULL || scratch->hammingDistances == NULL || scratch->histogram == NULL || scratch->calibrationWithin == NULL)
+    {
+        printf("Failed to allocate memory for sketch scratch.\n");
+        exit(1);
+    }
+}
+
+static void sketchScratchFree(SketchScratch* scratch)
+{
+    arenaFree(scratch->shortlist);
+    arenaFree(scratch->shortlistDistances);
+    arenaFree(scratch->hammingDistances);
+    arenaFree(scratch->histogram);
+    arenaFree(scratch->calibrationWithin);
+    distanceHeapFree(&scratch->heap);
+    memset(scratch, 0, sizeof(SketchScratch));
+}
+
+// the hamming distance of every train sketch to the test row's, counted per distance
+static void sketchHamming(SketchScratch* scratch, int testIndex)
+{
+    const SketchRows* trainRows = scratch->trainRows;
+    int trainCount = trainRows->rowCount;
+    int wordCount = trainRows->wordCount;
+    const uint64_t* testWords = &scratch->testRows->words[(size_t)testIndex * wordCount];
+    memset(scratch->histogram, 0, ((size_t)trainRows->inputSize + 1) * sizeof(int));
+    for (int row = 0; row < trainCount; row++)
+    {
+        const uint64_t* trainWords = &trainRows->words[(size_t)row * wordCount];
+        int distance = 0;
+        for (int word = 0; word < wordCount; word++)
+        {
+            distance += platformPopcount64(testWords[word] ^ trainWords[word]);
+        }
+        scratch->hammingDistances[row] = distance;
+        scratch->histogram[distance]++;
+    }
+}
+
+// whether a shortlist of count rows meets the target on the calibration queries, or with perfect set finds all they had to
+static int sketchCalibrationMet(const SketchScratch* scratch, int count, int perfect)
+{
+    int trainCount = scratch->trainRows->rowCount;
+    long long exactCount = 0;
+    long long foundCount = 0;
+    for (int query = 0; query < scratch->calibrationCount; query++)
+    {
+        const unsigned char* within = &scratch->calibrationWithin[(size_t)query * trainCount];
+        int found = 0;
+        for (int position = 0; position < count; position++)
+        {
+            found += within[position];
+        }
+        exactCount += scratch->calibrationExact[query];
+        foundCount += found < scratch->calibrationExact[query] ? found : scratch->calibrationExact[query];
+    }
+    return perfect ? foundCount == exactCount : foundCount >= scratch->targetRecall * exactCount;
+}
+
+// the combo's shortlist size from the full scans of the calibration queries, measured with the combo's threshold and
+// exponent, a shortlist of count rows holds the first count rows in hamming order, ties lowest index first, as the cut does
+static void sketchPrepare(
+    SketchScratch* scratch,
+    int kMax,
+    int inputSize,
+    const float* trainInputs,
+    const float* testInputs,
+    float distanceThreshold,
+    float distanceExponent,
+    SketchDistance distance
+)
+{
+    int trainCount = scratch->trainRows->rowCount;
+    int testCount = scratch->testRows->rowCount;
+    distanceHeapReset(&scratch->heap, kMax);
+    scratch->shortlistMin = kMax < trainCount ? kMax : trainCount;
+    scratch->comboCount++;
+
+    scratch->calibrationCount = testCount < SKETCH_CALIBRATION_QUERIES ? testCount : SKETCH_CALIBRATION_QUERIES;
+    for (int query = 0; query < scratch->calibrationCount; query++)
+    {
+        int testIndex = (int)((long long)testCount * query / scratch->calibrationCount);
+        const float* testInput = &testInputs[(size_t)testIndex * inputSize];
+        sketchHamming(scratch, testIndex);
+
+        // a stable counting sort of the rows by hamming distance
+        int start = 0;
+        for (int hamming = 0; hamming <= scratch->trainRows->inputSize; hamming++)
+        {
+            int count = scratch->histogram[hamming];
+            scratch->histogram[hamming] = start;
+            start += count;
+        }
+        for (int row = 0; row < trainCount; row++)
+        {
+            scratch->shortlist[scratch->histogram[scratch->hammingDistances[row]]++] = row;
+        }
+
+        scratch->heap.count = 0;
+        for (int row = 0; row < trainCount; row++)
+        {
+            scratch->shortlistDistances[row] = distance(inputSize, testInput, &trainInputs[(size_t)row * inputSize], distanceThreshold, distanceExponent);
+            distanceHeapOffer(&scratch->heap, scratch->shortlistDistances[row]);
+        }
+        unsigned char* within = &scratch->calibrationWithin[(size_t)query * trainCount];
+        for (int position = 0; position < trainCount; position++)
+        {
+            within[position] = scratch->heap.count < scratch->heap.size || scratch->shortlistDistances[scratch->shortlist[position]] <= scratch->heap.values[0];
+        }
+        scratch->calibrationExact[query] = scratch->heap.count;
+    }
+    scratch->heap.count = 0;
+
+    int count = scratch->shortlistStart < scratch->shortlistMin ? scratch->shortlistMin : scratch->shortlistStart;
+    if (sketchCalibrationMet(scratch, count, 0))
+    {
+        while (count > scratch->shortlistMin)
+        {
+            int trimmed = count - count / 10;
+            trimmed = trimmed > scratch->shortlistMin ? trimmed : scratch->shortlistMin;
+            if (trimmed == count || !sketchCalibrationMet(scratch, trimmed, 1))
+            {
+                break;
+            }
+            count = trimmed;
+        }
+    }
+    else
+    {
+        while (count < trainCount && !sketchCalibrationMet(scratch, count, 0))
+        {
+            long long grown = count + count / 2 + 1;
+            count = grown < trainCount ? (int)grown : trainCount;
+        }
+    }
+    scratch->shortlistCount = count;
+}
+
+// the hamming pass, then the shortlistCount nearest sketches in index order, ties at the cut going to the lower indices
+static void sketchLoadTest(SketchScratch* scratch, int testIndex)
+{
+    int trainCount = scratch->trainRows->rowCount;
+    sketchHamming(scratch, testIndex);
+
+    // the largest hamming distance the shortlist reaches, and how many rows at it make the cut
+    int cutDistance = 0;
+    int belowCount = 0;
+    while (belowCount + scratch->histogram[cutDistance] < scratch->shortlistCount)
+    {
+        belowCount += scratch->histogram[cutDistance];
+        cutDistance++;
+    }
+    int cutCount = scratch->shortlistCount - belowCount;
+    int position = 0;
+    for (int row = 0; row < trainCount; row++)
+    {
+        int distance = scratch->hammingDistances[row];
+        if (distance < cutDistance || (distance == cutDistance && cutCount-- > 0))
+        {
+            scratch->shortlist[position++] = row;
+        }
+    }
+
+    scratch->sampled = (testIndex + scratch->comboCount) % SKETCH_RECALL_STRIDE == 0;
+    scratch->heap.count = 0;
+    scratch->counts.queryCount++;
+    scratch->counts.rowCount += trainCount;
+    scratch->counts.measuredCount += scratch->shortlistCount;
+}
+
+// the distance measured for a shortlist position
+static void sketchOffer(SketchScratch* scratch, int position, float distance)
+{
+    scratch->shortlistDistances[position] = distance;
+}
+
+// a distance of the full scan on a sampled query
+static void sketchExactOffer(SketchScratch* scratch, float distance)
+{
+    distanceHeapOffer(&scratch->heap, distance);
+}
+
+// after the full scan: the shortlist found as many of the kmax nearest as it has rows within the kmax-th exact distance,
+// rows tied with it count as found, either is a valid neighbour
+static void sketchRecall(SketchScratch* scratch)
+{
+    int found = 0;
+    for (int position = 0; position < scratch->shortlistCount; position++)
+    {
+        found += scratch->heap.count < scratch->heap.size || scratch->shortlistDistances[position] <= scratch->heap.values[0];
+    }
+    if (found > scratch->heap.count)
+    {
+        found = scratch->heap.count;
+    }
+    scratch->counts.sampledCount++;
+    scratch->counts.exactCount += scratch->heap.count;
+    scratch->counts.foundCount += found;
+}
+
+static void sketchCountsAdd(SketchCounts* total, const SketchCounts* counts)
+{
+    total->queryCount += counts->queryCount;
+    total->sampledCount += counts->sampledCount;
+    total->exactCount += counts->exactCount;
+    total->foundCount += counts->foundCount;
+    total->rowCount += counts->rowCount;
+    total->measuredCount += counts->measuredCount;
+}
+
+static void sketchReport(const SketchCounts* counts, int kMax)
+{
+    printf("Sketch recall@%d: %.2f%% over %lld of %lld queries, measured: %.1f%% of rows\n",
+        kMax,
+        counts->exactCount > 0 ? 100.0 * counts->foundCount / counts->exactCount : 0.0,
+        counts->sampledCount,
+        counts->queryCount,
+        counts->rowCount > 0 ? 100.0 * counts->measuredCount / counts->rowCount : 0.0);
+}
+
+#endif
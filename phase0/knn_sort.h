@@ -0,0 +1,203 @@
+#ifndef KNN_SORT_H
+#define KNN_SORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "knn_arena.h"
+
+// a full ranking of train rows sorted with an lsd radix sort over packed 64 bit keys
+// the high 32 bits hold the order preserving bits of the distance and the low 32 bits hold the train index
+// so sorting the keys orders by distance and breaks ties by index, exactly like compareIndexDistance
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+// a train row and its distance to the test row, the rankings and the votes read rows in this form
+typedef struct {
+    int index;
+    float distance;
+} IndexDistance;
+
+typedef struct {
+    float* distances;
+    uint64_t* keys;
+    uint64_t* scratch;
+    uint64_t* sorted;
+} RadixBuffers;
+
+static inline uint32_t floatToOrderedBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    // negative floats have every bit flipped, non negative floats only the sign bit
+    if (bits & 0x80000000u)
+    {
+        return ~bits;
+    }
+    return bits | 0x80000000u;
+}
+
+static inline uint64_t packDistanceKey(float distance, int index)
+{
+    return ((uint64_t)floatToOrderedBits(distance) << 32) | (uint32_t)index;
+}
+
+static inline int unpackKeyIndex(uint64_t key)
+{
+    return (int)(uint32_t)key;
+}
+
+static void radixBuffersCreate(RadixBuffers* radixBuffers, int count)
+{
+    radixBuffers->distances = (float*)arenaCalloc(count, sizeof(float));
+    radixBuffers->keys = (uint64_t*)arenaCalloc(count, sizeof(uint64_t));
+    radixBuffers->scratch = (uint64_t*)arenaCalloc(count, sizeof(uint64_t));
+    radixBuffers->sorted = NULL;
+    if (radixBuffers->distances == NULL || radixBuffers->keys == NULL || radixBuffers->scratch == NULL)
+    {
+        printf("Failed to allocate memory for radix buffers.\n");
+        exit(1);
+    }
+}
+
+static void radixBuffersFree(RadixBuffers* radixBuffers)
+{
+    arenaFree(radixBuffers->distances);
+    arenaFree(radixBuffers->keys);
+    arenaFree(radixBuffers->scratch);
+    memset(radixBuffers, 0, sizeof(RadixBuffers));
+}
+
+// sorts keys ascending, ping ponging between keys and scratch, and returns whichever holds the result
+static uint64_t* radixSortKeys(int count, uint64_t* keys, uint64_t* scratch)
+{
+    int histograms[RADIX_PASSES][RADIX_BUCKETS];
+
+    // build every pass histogram in a single read
+    memset(histograms, 0, sizeof(histograms));
+    for (int keyIndex = 0; keyIndex < count; keyIndex++)
+    {
+        uint64_t key = keys[keyIndex];
+        for (int pass = 0; pass < RADIX_PASSES; pass++)
+        {
+            histograms[pass][(key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+
+    uint64_t* source = keys;
+    uint64_t* destination = scratch;
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
+    {
+        int* histogram = histograms[pass];
+        int shift = pass * RADIX_BITS;
+
+        // skip passes where every key lands in the same bucket, e.g. the high index bits
+        if (count == 0 || histogram[(source[0] >> shift) & (RADIX_BUCKETS - 1)] == count)
+        {
+            continue;
+        }
+
+        // exclusive prefix sum into bucket offsets
+        int offset = 0;
+        for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++)
+        {
+            int bucketCount = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucketCount;
+        }
+
+        // stable scatter
+        for (int keyIndex = 0; keyIndex < count; keyIndex++)
+        {
+            uint64_t key = source[keyIndex];
+            destination[histogram[(key >> shift) & (RADIX_BUCKETS - 1)]++] = key;
+        }
+
+        uint64_t* swap = source;
+        source = destination;
+        destination = swap;
+    }
+
+    return source;
+}
+
+// the size smallest distances offered so far as a max heap, values[0] is the largest of them once count reaches size
+typedef struct {
+    float* values;
+    int count;
+    int size;
+    int capacity;
+} DistanceHeap;
+
+static void distanceHeapReset(DistanceHeap* heap, int size)
+{
+    if (size > heap->capacity)
+    {
+        arenaFree(heap->values);
+        heap->values = (float*)arenaCalloc(size, sizeof(float));
+        if (heap->values == NULL)
+        {
+            printf("Failed to allocate memory for distance heap.\n");
+            exit(1);
+        }
+        heap->capacity = size;
+    }
+    heap->size = size;
+    heap->count = 0;
+}
+
+static void distanceHeapFree(DistanceHeap* heap)
+{
+    arenaFree(heap->values);
+    memset(heap, 0, sizeof(DistanceHeap));
+}
+
+// 1 when the distance was kept and the heap is full, so the largest kept distance may have changed
+static int distanceHeapOffer(DistanceHeap* heap, float distance)
+{
+    float* values = heap->values;
+    if (heap->count < heap->size)
+    {
+        // sift up
+        int position = heap->count++;
+        while (position > 0 && values[(position - 1) / 2] < distance)
+        {
+            values[position] = values[(position - 1) / 2];
+            position = (position - 1) / 2;
+        }
+        values[position] = distance;
+        return heap->count == heap->size;
+    }
+    if (!(distance < values[0]))
+    {
+        return 0;
+    }
+
+    // replace the largest and sift down
+    int position = 0;
+    for (;;)
+    {
+        int child = 2 * position + 1;
+        if (child >= heap->count)
+        {
+            break;
+        }
+        if (child + 1 < heap->count && values[child + 1] > values[child])
+        {
+            child++;
+        }
+        if (values[child] <= distance)
+        {
+            break;
+        }
+        values[position] = values[child];
+        position = child;
+    }
+    values[position] = distance;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef KNN_SYNTHETIC_H
+#define KNN_SYNTHETIC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// seeded in memory stand in for loadMNIST
+// each class prototype is a blurred set of strokes on a square canvas (a line when inputSize is not square),
+// overlap of the strokes are shared by every class, flip of them are redrawn per cluster,
+// and each row is its cluster prototype shifted, with noisy ink and stray background pixels
+// rows are generated from (seed, split, row) alone so a smaller count is always a prefix of a larger one
+#define SYNTHETIC_STROKES 12
+
+typedef struct {
+    uint64_t seed;
+    int clusterCount;
+    float overlap;
+    float flip;
+    int shift;
+    float noise;
+    float sparsity;
+    float stray;
+    int quantize;
+} SyntheticConfig;
+
+typedef enum {
+    SYNTHETIC_TRAIN = 1,
+    SYNTHETIC_TEST = 2
+} SyntheticSplit;
+
+static inline uint64_t syntheticMix(uint64_t value)
+{
+    value += 0x9E3779B97F4A7C15ull;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+
+static inline uint64_t syntheticHash(uint64_t seed, uint64_t a, uint64_t b)
+{
+    return syntheticMix(syntheticMix(syntheticMix(seed) ^ a) ^ b);
+}
+
+// uniform in [0, 1) from the top 24 bits
+static inline float syntheticUniform(uint64_t* state)
+{
+    *state = syntheticMix(*state);
+    return (float)(*state >> 40) / 16777216.0f;
+}
+
+static inline float syntheticGaussian(uint64_t* state)
+{
+    float u1 = syntheticUniform(state);
+    float u2 = syntheticUniform(state);
+    if (u1 < 1e-7f)
+    {
+        u1 = 1e-7f;
+    }
+    return sqrtf(-2.0f * logf(u1)) * cosf(6.28318530718f * u2);
+}
+
+// defaults shaped like mnist, about 80% zero pixels stored as uint8 / 255
+static void syntheticDefaults(SyntheticConfig* config, uint64_t seed)
+{
+    config->seed = seed;
+    config->clusterCount = 4;
+    config->overlap = 0.6f;
+    config->flip = 0.25f;
+    config->shift = 3;
+    config->noise = 0.15f;
+    config->sparsity = 0.8f;
+    config->stray = 0.01f;
+    config->quantize = 1;
+}
+
+static int compareFloat(const void* a, const void* b)
+{
+    float f1 = *(const float*)a;
+    float f2 = *(const float*)b;
+    return (f1 > f2) - (f1 < f2);
+}
+
+// fills one prototype, zero means background and ink is in [0.5, 1]
+static void syntheticPrototype(const SyntheticConfig* config, int classIndex, int clusterIndex, int width, int height, float* prototype, float* scratch)
+{
+    int inputSize = width * height;
+    memset(prototype, 0, inputSize * sizeof(float));
+
+    for (int stroke = 0; stroke < SYNTHETIC_STROKES; stroke++)
+    {
+        // pick which stream this stroke comes from, shared by all classes, this class, or this cluster
+        uint64_t state = syntheticHash(config->seed, 0x100000000ull, stroke);
+        if (syntheticUniform(&state) >= config->overlap)
+        {
+            state = syntheticHash(config->seed, 0x200000000ull + classIndex, stroke);
+        }
+        uint64_t clusterState = syntheticHash(config->seed, 0x300000000ull + (uint64_t)classIndex * 65536 + clusterIndex, stroke);
+        if (syntheticUniform(&clusterState) < config->flip)
+        {
+            state = clusterState;
+        }
+
+        // a stroke is a short segment of gaussian blobs
+        float x0 = (0.15f + 0.7f * syntheticUniform(&state)) * width;
+        float y0 = (0.15f + 0.7f * syntheticUniform(&state)) * height;
+        float x1 = (0.15f + 0.7f * syntheticUniform(&state)) * width;
+        float y1 = (0.15f + 0.7f * syntheticUniform(&state)) * height;
+        float radius = 0.8f + 0.8f * syntheticUniform(&state);
+        for (int step = 0; step <= 8; step++)
+        {
+            float cx = x0 + (x1 - x0) * step / 8.0f;
+            float cy = height > 1 ? y0 + (y1 - y0) * step / 8.0f : 0.0f;
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    float dx = x - cx;
+                    float dy = y - cy;
+                    prototype[y * width + x] += expf(-(dx * dx + dy * dy) / (2.0f * radius * radius));
+                }
+            }
+        }
+    }
+
+    // keep the strongest (1 - sparsity) of the field as ink
+    memcpy(scratch, prototype, inputSize * sizeof(float));
+    qsort(scratch, inputSize, sizeof(float), compareFloat);
+    int thresholdIndex = (int)(config->sparsity * inputSize);
+    if (thresholdIndex >= inputSize)
+    {
+        thresholdIndex = inputSize - 1;
+    }
+    float threshold = scratch[thresholdIndex];
+    float peak = scratch[inputSize - 1];
+    for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+    {
+        float field = prototype[inputIndex];
+        if (field <= threshold || peak <= threshold)
+        {
+            prototype[inputIndex] = 0.0f;
+        }
+        else
+        {
+            prototype[inputIndex] = 0.5f + 0.5f * (field - threshold) / (peak - threshold);
+        }
+    }
+}
+
+static int loadSynthetic(const SyntheticConfig* config, SyntheticSplit split, int count, int inputSize, int outputSize, float** inputs, float** outputs)
+{
+    // allocate memory for inputs
+    *inputs = (float*)calloc((size_t)count * inputSize, sizeof(float));
+    if (*inputs == NULL)
+    {
+        printf("Could not allocate memory for inputs\n");
+        exit(1);
+    }
+
+    // allocate memory for outputs
+    *outputs = (float*)calloc((size_t)count * outputSize, sizeof(float));
+    if (*outputs == NULL)
+    {
+        printf("Could not allocate memory for outputs\n");
+        exit(1);
+    }
+
+    // square inputs are images, anything else is a line
+    int width = (int)(sqrt((double)inputSize) + 0.5);
+    int height = width;
+    if (width * height != inputSize)
+    {
+        width = inputSize;
+        height = 1;
+    }
+
+    // cache prototypes so each row is a pass of noise over one of them
+    int clusterCount = config->clusterCount > 0 ? config->clusterCount : 1;
+    float* prototypes = (float*)calloc((size_t)outputSize * clusterCount * inputSize, sizeof(float));
+    float* scratch = (float*)calloc(inputSize, sizeof(float));
+    if (prototypes == NULL || scratch == NULL)
+    {
+        printf("Could not allocate memory for prototypes\n");
+        exit(1);
+    }
+    for (int classIndex = 0; classIndex < outputSize; classIndex++)
+    {
+        for (int clusterIndex = 0; clusterIndex < clusterCount; clusterIndex++)
+        {
+            float* prototype = &prototypes[((size_t)classIndex * clusterCount + clusterIndex) * inputSize];
+            syntheticPrototype(config, classIndex, clusterIndex, width, height, prototype, scratch);
+        }
+    }
+
+    for (int row = 0; row < count; row++)
+    {
+        uint64_t state = syntheticHash(config->seed, split, row);
+        int label = (int)(syntheticMix(state) % (uint64_t)outputSize);
+        int clusterIndex = (int)(syntheticMix(state + 1) % (uint64_t)clusterCount);
+        float* prototype = &prototypes[((size_t)label * clusterCount + clusterIndex) * inputSize];
+        float* input = &(*inputs)[(size_t)row * inputSize];
+        int shiftRange = 2 * config->shift + 1;
+        int shiftX = config->shift > 0 ? (int)(syntheticMix(state + 2) % (uint64_t)shiftRange) - config->shift : 0;
+        int shiftY = config->shift > 0 && height > 1 ? (int)(syntheticMix(state + 3) % (uint64_t)shiftRange) - config->shift : 0;
+
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            int x = inputIndex % width - shiftX;
+            int y = inputIndex / width - shiftY;
+            float ink = x >= 0 && x < width && y >= 0 && y < height ? prototype[y * width + x] : 0.0f;
+            float value = 0.0f;
+            if (ink > 0.0f)
+            {
+                value = ink + config->noise * syntheticGaussian(&state);
+            }
+            else if (syntheticUniform(&state) < config->stray)
+            {
+                value = syntheticUniform(&state);
+            }
+
+            if (value < 0.0f)
+            {
+                value = 0.0f;
+            }
+            if (value > 1.0f)
+            {
+                value = 1.0f;
+            }
+            if (config->quantize)
+            {
+                value = (float)(int)(value * 255.0f + 0.5f) / 255.0f;
+            }
+            input[inputIndex] = value;
+        }
+        (*outputs)[(size_t)row * outputSize + label] = 1.0f;
+    }
+
+    free(prototypes);
+    free(scratch);
+    return 0;
+}
+
+// KNN_SYNTHETIC=seed=1,train=60000,test=10000,inputs=784,outputs=10,clusters=4,overlap=0.6,flip=0.25,shift=3,noise=0.15,sparsity=0.8,stray=0.01,quantize=1
+// every key is optional, sizes left out keep the caller's values, returns 0 when the variable is not set
+static int syntheticFromEnvironment(SyntheticConfig* config, int* trainCount, int* testCount, int* inputSize, int* outputSize)
+{
+    const char* value = getenv("KNN_SYNTHETIC");
+    if (value == NULL || value[0] == '\0')
+    {
+        return 0;
+    }
+
+    syntheticDefaults(config, 1);
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s", value);
+    char* field = buffer;
+    while (field != NULL)
+    {
+        char* comma = strchr(field, ',');
+        if (comma != NULL)
+        {
+            *comma = '\0';
+        }
+
+        char* equals = strchr(field, '=');
+        if (equals == NULL)
+        {
+            // a bare number is the seed
+            if (field[0] != '\0')
+            {
+                config->seed = strtoull(field, NULL, 10);
+            }
+        }
+        else
+        {
+            *equals = '\0';
+            char* key = field;
+            char* setting = equals + 1;
+            if (strcmp(key, "seed") == 0)
+            {
+                config->seed = strtoull(setting, NULL, 10);
+            }
+            else if (strcmp(key, "train") == 0)
+            {
+                *trainCount = atoi(setting);
+            }
+            else if (strcmp(key, "test") == 0)
+            {
+                *testCount = atoi(setting);
+            }
+            else if (strcmp(key, "inputs") == 0)
+            {
+                *inputSize = atoi(setting);
+            }
+            else if (strcmp(key, "outputs") == 0)
+            {
+                *outputSize = atoi(setting);
+            }
+            else if (strcmp(key, "clusters") == 0)
+            {
+                config->clusterCount = atoi(setting);
+            }
+            else if (strcmp(key, "overlap") == 0)
+            {
+                config->overlap = (float)atof(setting);
+            }
+            else if (strcmp(key, "flip") == 0)
+            {
+                config->flip = (float)atof(setting);
+            }
+            else if (strcmp(key, "shift") == 0)
+            {
+                config->shift = atoi(setting);
+            }
+            else if (strcmp(key, "noise") == 0)
+            {
+                config->noise = (float)atof(setting);
+            }
+            else if (strcmp(key, "sparsity") == 0)
+            {
+                config->sparsity = (float)atof(setting);
+            }
+            else if (strcmp(key, "stray") == 0)
+            {
+                config->stray = (float)atof(setting);
+            }
+            else if (strcmp(key, "quantize") == 0)
+            {
+                config->quantize = atoi(setting);
+            }
+            else
+            {
+                printf("Unknown KNN_SYNTHETIC key: %s\n", key);
+                exit(1);
+            }
+        }
+
+        field = comma != NULL ? comma + 1 : NULL;
+    }
+
+    if (*trainCount < 1 || *testCount < 1 || *inputSize < 1 || *outputSize < 1)
+    {
+        printf("Invalid KNN_SYNTHETIC sizes.\n");
+        exit(1);
+    }
+    printf("Synthetic data, seed: %llu, train: %d, test: %d, inputs: %d, outputs: %d\n", (unsigned long long)config->seed, *trainCount, *testCount, *inputSize, *outputSize);
+    return 1;
+}
+
+#endif
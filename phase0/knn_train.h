@@ -0,0 +1,96 @@
+#ifndef KNN_TRAIN_H
+#define KNN_TRAIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "knn_platform.h"
+#include "knn_arena.h"
+
+// train rows from a csv in the mnist layout, the file knn_reduce writes, KNN_TRAIN=path makes the sweeps and the server
+// load their train rows from it, their test rows stay as they were
+
+// the train csv KNN_TRAIN names, NULL when unset
+static const char* trainCsvPath(void)
+{
+    const char* path = getenv("KNN_TRAIN");
+    return path != NULL && path[0] != '\0' ? path : NULL;
+}
+
+// reads a csv in the mnist layout, inputs divided by 255 as the sweeps' loader does, returns the row count,
+// the arrays come from the arena when it is on, exits when the file is missing or malformed
+static int trainCsvLoad(const char* path, int inputSize, int outputSize, float** inputs, float** outputs)
+{
+    FILE* file;
+    if (fopen_s(&file, path, "r") != 0)
+    {
+        printf("Could not open file %s\n", path);
+        exit(1);
+    }
+
+    // one row per line after the header
+    int count = -1;
+    int character;
+    int lineLength = 0;
+    while ((character = fgetc(file)) != EOF)
+    {
+        if (character == '\n')
+        {
+            count += lineLength > 0;
+            lineLength = 0;
+        }
+        else if (character != '\r')
+        {
+            lineLength++;
+        }
+    }
+    count += lineLength > 0;
+    if (count < 1)
+    {
+        printf("File %s has no rows\n", path);
+        fclose(file);
+        exit(1);
+    }
+
+    *inputs = (float*)arenaCalloc((size_t)count * inputSize, sizeof(float));
+    *outputs = (float*)arenaCalloc((size_t)count * outputSize, sizeof(float));
+    if (*inputs == NULL || *outputs == NULL)
+    {
+        printf("Could not allocate memory for %d rows of %s\n", count, path);
+        fclose(file);
+        exit(1);
+    }
+    rewind(file);
+    while ((character = fgetc(file)) != EOF && character != '\n')
+    {
+    }
+    for (int row = 0; row < count; row++)
+    {
+        int label;
+        if (fscanf(file, " %d", &label) != 1 || label < 0 || label >= outputSize)
+        {
+            printf("Invalid label in row %d of %s\n", row + 1, path);
+            fclose(file);
+            exit(1);
+        }
+        (*outputs)[(size_t)row * outputSize + label] = 1.0f;
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            double value;
+            if (fscanf(file, " ,%lf", &value) != 1)
+            {
+                printf("Row %d of %s has fewer than %d inputs\n", row + 1, path, inputSize);
+                fclose(file);
+                exit(1);
+            }
+            (*inputs)[(size_t)row * inputSize + inputIndex] = value / 255.0f;
+        }
+        // columns past inputSize are ignored as the sweeps' loader ignores them
+        while ((character = fgetc(file)) != EOF && character != '\n')
+        {
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+#endif
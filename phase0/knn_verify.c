@@ -0,0 +1,1778 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knn_platform.h"
+#include "knn_dispatch.h"
+#include "knn_synthetic.h"
+#include "knn_sparse.h"
+#include "knn_cascade.h"
+#include "knn_band.h"
+#include "knn_batch.h"
+#include "knn_warm.h"
+#include "knn_interleave.h"
+#include "knn_scan.h"
+#include "knn_curve.h"
+#include "knn_lib.h"
+
+// differential check of every optimized engine against the scalar knn() the sweep programs started from
+// the oracle below is that code kept verbatim, the engines are the kernel tables the sweep programs dispatch to,
+// the sparse distance they switch to on mostly zero data, the pooled cascade and the norm band that skip rows, the cascade warm started from the previous combo's neighbours, the parameter batched distances, the interleaved row layout, and libknn, which serves one k per model
+// so it is checked at kmax, once scanning and once through its vantage point trees, and the pca and sketch prefilters,
+// whose neighbours are checked against the oracle's nearest rows of their shortlist and whose recall against the oracle's
+// ranking, and the learning curve, whose every train prefix is checked against the oracle run on only that prefix's rows
+// run with no arguments for the default sizes, exits 1 when any engine disagrees with the oracle
+#define EPSILON 0.0000001f
+#define MISMATCH_PRINT_LIMIT 10
+// one library model per KnnIndex, KNN_INDEX_NONE and KNN_INDEX_VPTREE
+#define LIBRARY_COUNT 2
+// the clustered data, whose pruning must skip rows
+#define CLUSTER_COUNT 16
+#define CLUSTER_RANGE 8.0f
+#define CLUSTER_SPREAD 0.05f
+// the approximate prefilters, each checked with both selection paths after the library store
+#define PREFILTER_COUNT 2
+#define PCA_VERIFY_COMPONENTS 8
+#define PCA_VERIFY_CACHE "knn_verify_pca.cache"
+// the learning curve's train prefixes: one row, half of kmax and kmax, so prefixes shorter than kmax vote with every
+// row they have, and half the train set
+#define CURVE_VERIFY_PREFIXES 4
+
+typedef enum {
+    WEIGHTING_AVERAGE,
+    WEIGHTING_LINEAR,
+    WEIGHTING_RECIPROCAL,
+    WEIGHTING_COUNT
+} Weighting;
+
+static const char* weightingNames[WEIGHTING_COUNT] = {
+    "average",
+    "linear",
+    "reciprocal",
+};
+
+typedef enum {
+    SORT_QSORT,
+    SORT_RADIX,
+    SORT_COUNT
+} SortMode;
+
+static const char* sortModeNames[SORT_COUNT] = {
+    "qsort",
+    "radix",
+};
+
+typedef struct {
+    const char* name;
+    int trainCount;
+    int testCount;
+    int inputSize;
+    int outputSize;
+    float* trainInputs;
+    float* trainOutputs;
+    float* testInputs;
+    int* testArgmax;
+    // 1 when the band and the trees must skip rows on metric combos
+    int pruned;
+} Dataset;
+
+// per engine tallies, a neighbour list or vote that differs only inside a run of equal distances is a tie, not a mismatch
+typedef struct {
+    char name[64];
+    long long queries;
+    long long distanceMismatches;
+    long long neighbourMismatches;
+    long long tiePermutations;
+    long long voteMismatches;
+    long long tieVoteDifferences;
+    long long correctCountMismatches;
+    long long tieCorrectCountDifferences;
+    long long recallMismatches;
+    int printed;
+} EngineReport;
+
+typedef struct {
+    int kCount;
+    int kMin;
+    int kMax;
+    IndexDistance* oracleNeighbours;
+    IndexDistance* engineNeighbours;
+    RadixBuffers radixBuffers;
+    // the current dataset's train rows in sparse form
+    SparseRows sparseRows;
+    SparseScratch sparse;
+    CascadeRows cascadeRows;
+    CascadeScratch cascade;
+    BandScratch band;
+    BatchScratch batch;
+    int batchSparse;
+    // the warm started cascade, with the seeds of each selection path kept apart
+    CascadeScratch warmCascade;
+    WarmScratch warm[SORT_COUNT];
+    // the current dataset's train rows in interleaved blocks
+    InterleavedRows interleavedRows;
+    InterleaveScratch interleave;
+    // left zeroed, the off state of each module an engine does not use
+    SparseScratch sparseOff;
+    CascadeScratch cascadeOff;
+    BandScratch bandOff;
+    PcaScratch pcaOff;
+    SketchScratch sketchOff;
+    BatchScratch batchOff;
+    WarmScratch warmOff;
+    InterleaveScratch interleaveOff;
+    // the pca prefilter fitted to the current dataset, every query is sampled so each recall is checked
+    PcaFilter pcaFilter;
+    PcaScratch pca;
+    // the sketch prefilter over the current dataset, its shortlist calibrated per combo, every query sampled
+    SketchRows sketchTrainRows;
+    SketchRows sketchTestRows;
+    SketchScratch sketch;
+    // the learning curve over the current dataset, its combo slots one per weighting, the oracle's nearest rows of each
+    // prefix, its vote and correct counts per prefix, weighting and k, and the combo's queries with a tie in some prefix
+    CurvePrefixes curvePrefixes;
+    CurveScratch curve;
+    IndexDistance* curveNeighbours;
+    float* curvePredictions;
+    int* curveCorrectCounts;
+    int curveTies;
+    // the oracle ranking unrooted, which the prefilters count recall on, and restricted to a query's shortlist
+    IndexDistance* exactNeighbours;
+    IndexDistance* filterNeighbours;
+    unsigned char* listed;
+    float* maxDistances;
+    float* weightSums;
+    float* oraclePredictions;
+    float* enginePredictions;
+    int* oracleCorrectCounts;
+    int* engineCorrectCounts;
+    int* tieQueries;
+    KnnNeighbour* libraryNeighbours;
+    float* libraryPredictions;
+    // distances the tree model measured on combos where its index was active, and what the scan measured there
+    long long treeDistances;
+    long long scanDistances;
+} VerifyState;
+
+int argmax(int size, float* values)
+{
+    int maxIndex = 0;
+    float maxValue = values[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (values[i] > maxValue)
+        {
+            maxIndex = i;
+            maxValue = values[i];
+        }
+    }
+    return maxIndex;
+}
+
+// the original comparator, the order of equal distances is left to qsort
+int compareIndexDistanceOracle(const void* a, const void* b)
+{
+    IndexDistance* id1 = (IndexDistance*)a;
+    IndexDistance* id2 = (IndexDistance*)b;
+    if (id1->distance < id2->distance)
+    {
+        return -1;
+    }
+    if (id1->distance > id2->distance)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// oracle distance pass and sort, rooted is the pow the _rooted programs apply after summing
+void oracleRank(
+    int inputSize,
+    int trainCount,
+    float* trainInputs,
+    float* testInput,
+    IndexDistance* indexDistances,
+    float distanceThreshold,
+    float distanceExponent,
+    int rooted
+)
+{
+    // calculate distances between test input and train inputs
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        float distance = 0.0f;
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            float difference = fabs(testInput[inputIndex] - trainInputs[trainIndex * inputSize + inputIndex]);
+            if (difference <= distanceThreshold)
+            {
+                continue;
+            }
+            distance += pow(difference, distanceExponent);
+        }
+        if (rooted)
+        {
+            distance = pow(distance, 1.0f / distanceExponent);
+        }
+        indexDistances[trainIndex].index = trainIndex;
+        indexDistances[trainIndex].distance = distance;
+    }
+
+    // sort low to high distance
+    qsort(indexDistances, trainCount, sizeof(IndexDistance), compareIndexDistanceOracle);
+}
+
+// oracle voting, one branch per weighting exactly as the knn_k_dt_de_ programs had it
+void oracleVote(
+    Weighting weighting,
+    int outputSize,
+    int trainCount,
+    float* trainOutputs,
+    float* maxDistances,
+    float* weightSums,
+    float* predictionOutputs,
+    IndexDistance* indexDistances,
+    int kCount,
+    int kMin,
+    int kMax
+)
+{
+    // find max distances for each k
+    memset(maxDistances, 0, kCount * sizeof(float));
+    if (weighting == WEIGHTING_LINEAR)
+    {
+        for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+        {
+            float distance = indexDistances[neighbourIndex].distance;
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                int k = kMin + kIndex;
+                if (neighbourIndex < k)
+                {
+                    if (distance > maxDistances[kIndex])
+                    {
+                        maxDistances[kIndex] = distance;
+                    }
+                }
+            }
+        }
+    }
+
+    // zero weight sums
+    memset(weightSums, 0, kCount * sizeof(float));
+
+    // zero prediction outputs
+    memset(predictionOutputs, 0, kCount * outputSize * sizeof(float));
+
+    // iterate neighbours up to kmax
+    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+    {
+        int trainIndex = indexDistances[neighbourIndex].index;
+        float distance = indexDistances[neighbourIndex].distance;
+        float reciprocalWeight = 1.0f / (distance + EPSILON);
+        for (int kIndex = 0; kIndex < kCount; kIndex++)
+        {
+            int k = kMin + kIndex;
+            if (neighbourIndex < k)
+            {
+                float weight = 1.0f;
+                if (weighting == WEIGHTING_LINEAR)
+                {
+                    float maxDistance = maxDistances[kIndex];
+                    weight = 1.0f - (distance / (maxDistance + EPSILON));
+                }
+                else if (weighting == WEIGHTING_RECIPROCAL)
+                {
+                    weight = reciprocalWeight;
+                }
+                weightSums[kIndex] += weight;
+                for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+                {
+                    float outputValue = trainOutputs[trainIndex * outputSize + outputIndex];
+                    if (weighting == WEIGHTING_AVERAGE)
+                    {
+                        predictionOutputs[kIndex * outputSize + outputIndex] += outputValue;
+                    }
+                    else
+                    {
+                        predictionOutputs[kIndex * outputSize + outputIndex] += outputValue * weight;
+                    }
+                }
+            }
+        }
+    }
+
+    // normalize
+    for (int kIndex = 0; kIndex < kCount; kIndex++)
+    {
+        int k = kMin + kIndex;
+        float weightSum = weightSums[kIndex];
+        for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+        {
+            if (weighting == WEIGHTING_AVERAGE)
+            {
+                predictionOutputs[kIndex * outputSize + outputIndex] /= (float)k;
+            }
+            else
+            {
+                predictionOutputs[kIndex * outputSize + outputIndex] /= weightSum;
+            }
+        }
+    }
+}
+
+// engine distance pass and selection through the scan the sweep programs run, the modules an engine leaves out are
+// passed off, and every row's distance is left in the radix buffers for the distance check
+void engineRank(
+    VerifyState* state,
+    const KnnKernels* engine,
+    SortMode sortMode,
+    int inputSize,
+    int trainCount,
+    float* trainInputs,
+    float* testInput,
+    SparseScratch* sparse,
+    CascadeScratch* cascade,
+    BandScratch* band,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    BatchScratch* batch,
+    WarmScratch* warm,
+    InterleaveScratch* interleave,
+    float distanceThreshold,
+    float distanceExponent,
+    int rooted
+)
+{
+    int radix = sortMode == SORT_RADIX;
+    if (batch != NULL)
+    {
+        // a block of one combo, summed from the terms of the sparse merge when sparse is set
+        batchLoadTest(batch, sparse, testInput, trainInputs, 1, &distanceThreshold, distanceExponent);
+    }
+    scanDistances(
+        engine,
+        inputSize,
+        trainCount,
+        trainInputs,
+        testInput,
+        state->engineNeighbours,
+        &state->radixBuffers,
+        sparse != NULL ? sparse : &state->sparseOff,
+        cascade != NULL ? cascade : &state->cascadeOff,
+        band != NULL ? band : &state->bandOff,
+        pca != NULL ? pca : &state->pcaOff,
+        sketch != NULL ? sketch : &state->sketchOff,
+        batch != NULL ? batch : &state->batchOff,
+        warm != NULL ? warm : &state->warmOff,
+        interleave != NULL ? interleave : &state->interleaveOff,
+        distanceThreshold,
+        distanceExponent,
+        rooted,
+        radix
+    );
+    if (!radix)
+    {
+        // qsort reorders the pairs in place, so the distances by row are copied out first
+        for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+        {
+            state->radixBuffers.distances[trainIndex] = state->engineNeighbours[trainIndex].distance;
+        }
+    }
+    scanSelect(engine, trainCount, state->engineNeighbours, &state->radixBuffers, warm != NULL ? warm : &state->warmOff, state->kMax, radix);
+}
+
+// engine voting through the dispatched accumulate kernel
+void engineVote(
+    const KnnKernels* engine,
+    Weighting weighting,
+    int outputSize,
+    int trainCount,
+    float* trainOutputs,
+    float* maxDistances,
+    float* weightSums,
+    float* predictionOutputs,
+    IndexDistance* indexDistances,
+    int kCount,
+    int kMin,
+    int kMax
+)
+{
+    memset(maxDistances, 0, kCount * sizeof(float));
+    if (weighting == WEIGHTING_LINEAR)
+    {
+        for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+        {
+            float distance = indexDistances[neighbourIndex].distance;
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                if (neighbourIndex < kMin + kIndex && distance > maxDistances[kIndex])
+                {
+                    maxDistances[kIndex] = distance;
+                }
+            }
+        }
+    }
+
+    memset(weightSums, 0, kCount * sizeof(float));
+    memset(predictionOutputs, 0, kCount * outputSize * sizeof(float));
+    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < trainCount; neighbourIndex++)
+    {
+        int trainIndex = indexDistances[neighbourIndex].index;
+        float distance = indexDistances[neighbourIndex].distance;
+        float reciprocalWeight = 1.0f / (distance + EPSILON);
+        for (int kIndex = 0; kIndex < kCount; kIndex++)
+        {
+            if (neighbourIndex >= kMin + kIndex)
+            {
+                continue;
+            }
+            float weight = 1.0f;
+            if (weighting == WEIGHTING_LINEAR)
+            {
+                weight = 1.0f - (distance / (maxDistances[kIndex] + EPSILON));
+            }
+            else if (weighting == WEIGHTING_RECIPROCAL)
+            {
+                weight = reciprocalWeight;
+            }
+            weightSums[kIndex] += weight;
+            engine->accumulate(outputSize, &trainOutputs[(size_t)trainIndex * outputSize], weight, &predictionOutputs[kIndex * outputSize]);
+        }
+    }
+
+    for (int kIndex = 0; kIndex < kCount; kIndex++)
+    {
+        float divisor = weighting == WEIGHTING_AVERAGE ? (float)(kMin + kIndex) : weightSums[kIndex];
+        for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+        {
+            predictionOutputs[kIndex * outputSize + outputIndex] /= divisor;
+        }
+    }
+}
+
+// first and one past last position of the run of distances equal to the one at position
+void distanceRun(IndexDistance* indexDistances, int trainCount, int position, int* runStart, int* runEnd)
+{
+    float distance = indexDistances[position].distance;
+    int start = position;
+    int end = position + 1;
+    while (start > 0 && indexDistances[start - 1].distance == distance)
+    {
+        start--;
+    }
+    while (end < trainCount && indexDistances[end].distance == distance)
+    {
+        end++;
+    }
+    *runStart = start;
+    *runEnd = end;
+}
+
+typedef enum {
+    NEIGHBOURS_EQUAL,
+    NEIGHBOURS_TIE,
+    NEIGHBOURS_MISMATCH
+} NeighbourMatch;
+
+// the first kmax neighbours must carry the same distances position by position,
+// and a differing index is allowed only when it belongs to the oracle's run of equal distances at that position,
+// which also covers a run cut by the kmax boundary where either side may keep any of the tied rows
+NeighbourMatch compareNeighbours(IndexDistance* oracle, IndexDistance* engine, int trainCount, int kMax, int* position)
+{
+    NeighbourMatch match = NEIGHBOURS_EQUAL;
+    int count = kMax < trainCount ? kMax : trainCount;
+    for (int neighbourIndex = 0; neighbourIndex < count; neighbourIndex++)
+    {
+        *position = neighbourIndex;
+        if (memcmp(&oracle[neighbourIndex].distance, &engine[neighbourIndex].distance, sizeof(float)) != 0)
+        {
+            return NEIGHBOURS_MISMATCH;
+        }
+        if (oracle[neighbourIndex].index == engine[neighbourIndex].index)
+        {
+            continue;
+        }
+        int runStart;
+        int runEnd;
+        distanceRun(oracle, trainCount, neighbourIndex, &runStart, &runEnd);
+        int found = 0;
+        for (int runIndex = runStart; runIndex < runEnd; runIndex++)
+        {
+            found |= oracle[runIndex].index == engine[neighbourIndex].index;
+        }
+        if (!found)
+        {
+            return NEIGHBOURS_MISMATCH;
+        }
+        match = NEIGHBOURS_TIE;
+    }
+
+    // a row may not appear twice
+    for (int neighbourIndex = 0; neighbourIndex < count && match == NEIGHBOURS_TIE; neighbourIndex++)
+    {
+        for (int otherIndex = neighbourIndex + 1; otherIndex < count; otherIndex++)
+        {
+            if (engine[neighbourIndex].index == engine[otherIndex].index)
+            {
+                *position = otherIndex;
+                return NEIGHBOURS_MISMATCH;
+            }
+        }
+    }
+    return match;
+}
+
+// bitwise, except that any nan equals any nan
+int sameFloat(float a, float b)
+{
+    if (isnan(a) && isnan(b))
+    {
+        return 1;
+    }
+    return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+void reportMismatch(EngineReport* report, Dataset* dataset, const char* what, Weighting weighting, int rooted, float distanceThreshold, float distanceExponent, int testIndex, int detail)
+{
+    if (report->printed >= MISMATCH_PRINT_LIMIT)
+    {
+        return;
+    }
+    report->printed++;
+    printf("  %s %s mismatch, data: %s, weighting: %s%s, threshold: %f, exponent: %f, test: %d, at: %d\n", report->name, what, dataset->name, weighting < WEIGHTING_COUNT ? weightingNames[weighting] : "-", rooted ? " rooted" : "", distanceThreshold, distanceExponent, testIndex, detail);
+}
+
+// the library neighbours and votes for one test row, at k = kmax only
+void verifyLibrary(
+    VerifyState* state,
+    Dataset* dataset,
+    EngineReport* report,
+    int reportIndex,
+    int libraryIndex,
+    int rooted,
+    float distanceThreshold,
+    float distanceExponent,
+    int testIndex
+)
+{
+    int outputSize = dataset->outputSize;
+    int kCount = state->kCount;
+    int kMax = state->kMax;
+    report->queries++;
+
+    NeighbourMatch match = NEIGHBOURS_EQUAL;
+    for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+    {
+        KnnNeighbour* libraryNeighbours = &state->libraryNeighbours[(((size_t)libraryIndex * WEIGHTING_COUNT + weighting) * dataset->testCount + testIndex) * kMax];
+        for (int neighbourIndex = 0; neighbourIndex < kMax; neighbourIndex++)
+        {
+            state->engineNeighbours[neighbourIndex].index = libraryNeighbours[neighbourIndex].index;
+            state->engineNeighbours[neighbourIndex].distance = libraryNeighbours[neighbourIndex].distance;
+        }
+        int position = 0;
+        NeighbourMatch weightingMatch = compareNeighbours(state->oracleNeighbours, state->engineNeighbours, dataset->trainCount, kMax, &position);
+        if (weightingMatch == NEIGHBOURS_MISMATCH)
+        {
+            reportMismatch(report, dataset, "neighbour", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, position);
+        }
+        if (weightingMatch > match)
+        {
+            match = weightingMatch;
+        }
+    }
+    if (match == NEIGHBOURS_MISMATCH)
+    {
+        report->neighbourMismatches++;
+    }
+    else if (match == NEIGHBOURS_TIE)
+    {
+        report->tiePermutations++;
+        state->tieQueries[reportIndex]++;
+    }
+
+    for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+    {
+        float* oraclePrediction = &state->oraclePredictions[((size_t)weighting * kCount + kCount - 1) * outputSize];
+        float* libraryPrediction = &state->libraryPredictions[(((size_t)libraryIndex * WEIGHTING_COUNT + weighting) * dataset->testCount + testIndex) * outputSize];
+        int voteDiffers = 0;
+        for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+        {
+            voteDiffers |= !sameFloat(libraryPrediction[outputIndex], oraclePrediction[outputIndex]);
+        }
+        if (argmax(outputSize, libraryPrediction) == dataset->testArgmax[testIndex])
+        {
+            state->engineCorrectCounts[((size_t)reportIndex * WEIGHTING_COUNT + weighting) * kCount + kCount - 1]++;
+        }
+        if (voteDiffers && match == NEIGHBOURS_EQUAL)
+        {
+            report->voteMismatches++;
+            reportMismatch(report, dataset, "vote", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, kMax);
+        }
+        else if (voteDiffers && match == NEIGHBOURS_TIE)
+        {
+            report->tieVoteDifferences++;
+        }
+    }
+}
+
+// a prefilter's scan of one test row with the query sampled: the rows on its shortlist must carry the oracle's distances
+// and the rest an infinite one, the neighbours must be the oracle's nearest among the shortlist, and the recall it counted
+// must be the one recounted from the unrooted oracle ranking, the shortlisted rows within its kmax-th distance
+void verifyPrefilter(
+    VerifyState* state,
+    Dataset* dataset,
+    EngineReport* report,
+    SortMode sortMode,
+    PcaScratch* pca,
+    SketchScratch* sketch,
+    const int* shortlist,
+    int shortlistCount,
+    const long long* exactCount,
+    const long long* foundCount,
+    IndexDistance* exactNeighbours,
+    int rooted,
+    float distanceThreshold,
+    float distanceExponent,
+    int testIndex
+)
+{
+    int trainCount = dataset->trainCount;
+    int kMax = state->kMax;
+    report->queries++;
+    memset(state->listed, 0, trainCount);
+    for (int position = 0; position < shortlistCount; position++)
+    {
+        state->listed[shortlist[position]] = 1;
+    }
+    long long exactBefore = *exactCount;
+    long long foundBefore = *foundCount;
+    engineRank(state, kernels, sortMode, dataset->inputSize, trainCount, dataset->trainInputs, &dataset->testInputs[(size_t)testIndex * dataset->inputSize], NULL, NULL, NULL, pca, sketch, NULL, NULL, NULL, distanceThreshold, distanceExponent, rooted);
+
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        int oracleIndex = state->oracleNeighbours[trainIndex].index;
+        float expected = state->listed[oracleIndex] ? state->oracleNeighbours[trainIndex].distance : INFINITY;
+        if (!sameFloat(expected, state->radixBuffers.distances[oracleIndex]))
+        {
+            report->distanceMismatches++;
+            reportMismatch(report, dataset, "distance", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, oracleIndex);
+            break;
+        }
+    }
+
+    int listedCount = 0;
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        if (state->listed[state->oracleNeighbours[trainIndex].index])
+        {
+            state->filterNeighbours[listedCount++] = state->oracleNeighbours[trainIndex];
+        }
+    }
+    int position = 0;
+    NeighbourMatch match = compareNeighbours(state->filterNeighbours, state->engineNeighbours, listedCount, kMax, &position);
+    if (match == NEIGHBOURS_MISMATCH)
+    {
+        report->neighbourMismatches++;
+        reportMismatch(report, dataset, "neighbour", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, position);
+    }
+    else if (match == NEIGHBOURS_TIE)
+    {
+        report->tiePermutations++;
+    }
+
+    // rows tied with the kmax-th exact distance count as found, as in the sweeps
+    int expectedExact = kMax < trainCount ? kMax : trainCount;
+    float limit = exactNeighbours[expectedExact - 1].distance;
+    int found = 0;
+    for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+    {
+        found += state->listed[exactNeighbours[trainIndex].index] && (trainCount <= kMax || exactNeighbours[trainIndex].distance <= limit);
+    }
+    if (found > expectedExact)
+    {
+        found = expectedExact;
+    }
+    if (*exactCount - exactBefore != expectedExact || *foundCount - foundBefore != found)
+    {
+        report->recallMismatches++;
+        reportMismatch(report, dataset, "recall", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, (int)(*foundCount - foundBefore));
+    }
+}
+
+// a learning curve over one test row: the full scan's distances are offered in index order as the sweeps offer them,
+// then each prefix's snapshot must hold the oracle's nearest rows of a scan over only the prefix's rows, all of them
+// when it has fewer than kmax, and each weighting's vote of the snapshot must be the oracle's vote of that scan
+void verifyCurve(
+    VerifyState* state,
+    Dataset* dataset,
+    EngineReport* report,
+    int rooted,
+    float distanceThreshold,
+    float distanceExponent,
+    int testIndex
+)
+{
+    CurveScratch* curve = &state->curve;
+    int inputSize = dataset->inputSize;
+    int outputSize = dataset->outputSize;
+    int kCount = state->kCount;
+    int kMax = state->kMax;
+    float* testInput = &dataset->testInputs[(size_t)testIndex * inputSize];
+    report->queries++;
+    engineRank(state, kernels, SORT_RADIX, inputSize, dataset->trainCount, dataset->trainInputs, testInput, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, distanceThreshold, distanceExponent, rooted);
+    curveLoadTest(curve);
+    int rowCount = curveRowCount(curve);
+    for (int trainIndex = 0; trainIndex < rowCount; trainIndex++)
+    {
+        curveOffer(curve, trainIndex, scanDistance(state->engineNeighbours, &state->radixBuffers, 1, trainIndex));
+    }
+
+    NeighbourMatch matches[CURVE_VERIFY_PREFIXES];
+    for (int prefix = 0; prefix < curve->prefixes->prefixCount; prefix++)
+    {
+        int prefixCount = curve->prefixes->trainCounts[prefix];
+        oracleRank(inputSize, prefixCount, dataset->trainInputs, testInput, state->filterNeighbours, distanceThreshold, distanceExponent, rooted);
+        int expectedCount = kMax < prefixCount ? kMax : prefixCount;
+        memcpy(&state->curveNeighbours[(size_t)prefix * kMax], state->filterNeighbours, expectedCount * sizeof(IndexDistance));
+        int neighbourCount = curve->neighbourCounts[prefix];
+        for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+        {
+            state->engineNeighbours[neighbourIndex].index = curve->neighbourIndices[(size_t)prefix * curve->capacity + neighbourIndex];
+            state->engineNeighbours[neighbourIndex].distance = curve->neighbourDistances[(size_t)prefix * curve->capacity + neighbourIndex];
+        }
+        int position = neighbourCount;
+        matches[prefix] = neighbourCount != expectedCount ? NEIGHBOURS_MISMATCH : compareNeighbours(state->filterNeighbours, state->engineNeighbours, prefixCount, kMax, &position);
+        if (matches[prefix] == NEIGHBOURS_MISMATCH)
+        {
+            report->neighbourMismatches++;
+            reportMismatch(report, dataset, "neighbour", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, prefixCount);
+        }
+        else if (matches[prefix] == NEIGHBOURS_TIE)
+        {
+            report->tiePermutations++;
+            state->curveTies++;
+        }
+    }
+
+    // each weighting votes every prefix into the curve's predictions and counts them in its own combo slot
+    for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+    {
+        for (int prefix = 0; prefix < curve->prefixes->prefixCount; prefix++)
+        {
+            int prefixCount = curve->prefixes->trainCounts[prefix];
+            IndexDistance* oracleNeighbours = &state->curveNeighbours[(size_t)prefix * kMax];
+            oracleVote((Weighting)weighting, outputSize, prefixCount, dataset->trainOutputs, state->maxDistances, state->weightSums, state->curvePredictions, oracleNeighbours, kCount, state->kMin, kMax);
+            int neighbourCount = curve->neighbourCounts[prefix];
+            for (int neighbourIndex = 0; neighbourIndex < neighbourCount; neighbourIndex++)
+            {
+                state->engineNeighbours[neighbourIndex].index = curve->neighbourIndices[(size_t)prefix * curve->capacity + neighbourIndex];
+                state->engineNeighbours[neighbourIndex].distance = curve->neighbourDistances[(size_t)prefix * curve->capacity + neighbourIndex];
+            }
+            float* predictionOutputs = curvePredictions(curve, prefix);
+            engineVote(kernels, (Weighting)weighting, outputSize, neighbourCount, dataset->trainOutputs, state->maxDistances, state->weightSums, predictionOutputs, state->engineNeighbours, kCount, state->kMin, kMax);
+            int voteDiffers = 0;
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+                {
+                    if (!sameFloat(predictionOutputs[kIndex * outputSize + outputIndex], state->curvePredictions[kIndex * outputSize + outputIndex]))
+                    {
+                        voteDiffers = kIndex + 1;
+                    }
+                }
+                if (argmax(outputSize, &state->curvePredictions[kIndex * outputSize]) == dataset->testArgmax[testIndex])
+                {
+                    state->curveCorrectCounts[((size_t)prefix * WEIGHTING_COUNT + weighting) * kCount + kIndex]++;
+                }
+            }
+            if (voteDiffers && matches[prefix] == NEIGHBOURS_EQUAL)
+            {
+                report->voteMismatches++;
+                reportMismatch(report, dataset, "vote", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, prefixCount);
+            }
+            else if (voteDiffers && matches[prefix] == NEIGHBOURS_TIE)
+            {
+                report->tieVoteDifferences++;
+            }
+        }
+        curve->combo = weighting;
+        curveCount(curve, dataset->testArgmax[testIndex]);
+    }
+}
+
+// the curve's correct counts per prefix, weighting and k, which a curve sweep writes, against the oracle's
+void verifyCurveCounts(VerifyState* state, Dataset* dataset, EngineReport* report, int rooted, float distanceThreshold, float distanceExponent)
+{
+    CurveScratch* curve = &state->curve;
+    int kCount = state->kCount;
+    for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+    {
+        int* curveCounts = curveCorrectCounts(curve, weighting);
+        for (int prefix = 0; prefix < curve->prefixes->prefixCount; prefix++)
+        {
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                int oracleCount = state->curveCorrectCounts[((size_t)prefix * WEIGHTING_COUNT + weighting) * kCount + kIndex];
+                int curveCount = curveCounts[prefix * kCount + kIndex];
+                if (oracleCount == curveCount)
+                {
+                    continue;
+                }
+                if (state->curveTies > 0)
+                {
+                    report->tieCorrectCountDifferences++;
+                    continue;
+                }
+                report->correctCountMismatches++;
+                if (report->printed < MISMATCH_PRINT_LIMIT)
+                {
+                    report->printed++;
+                    printf("  %s correct count mismatch, data: %s, weighting: %s%s, threshold: %f, exponent: %f, train: %d, k: %d, oracle: %d, engine: %d\n", report->name, dataset->name, weightingNames[weighting], rooted ? " rooted" : "", distanceThreshold, distanceExponent, curve->prefixes->trainCounts[prefix], state->kMin + kIndex, oracleCount, curveCount);
+                }
+            }
+        }
+    }
+}
+
+void verifyCombo(
+    VerifyState* state,
+    Dataset* dataset,
+    EngineReport* reports,
+    int engineCount,
+    KnnModel** models,
+    int rooted,
+    float distanceThreshold,
+    float distanceExponent
+)
+{
+    int outputSize = dataset->outputSize;
+    int trainCount = dataset->trainCount;
+    int kCount = state->kCount;
+
+    memset(state->oracleCorrectCounts, 0, (size_t)WEIGHTING_COUNT * kCount * sizeof(int));
+    memset(state->engineCorrectCounts, 0, (size_t)(engineCount + LIBRARY_COUNT) * WEIGHTING_COUNT * kCount * sizeof(int));
+    memset(state->tieQueries, 0, (size_t)(engineCount + LIBRARY_COUNT) * sizeof(int));
+    sparsePrepareExponent(&state->sparse, distanceExponent);
+    cascadePrepare(&state->cascade, state->kMax, distanceThreshold, distanceExponent);
+    bandPrepare(&state->band, state->kMax, distanceThreshold, distanceExponent, rooted);
+    cascadePrepare(&state->warmCascade, state->kMax, distanceThreshold, distanceExponent);
+    for (int sortMode = 0; sortMode < SORT_COUNT; sortMode++)
+    {
+        warmPrepare(&state->warm[sortMode], state->kMax);
+    }
+    pcaPrepare(&state->pca, state->kMax);
+    if (state->curve.prefixes != NULL)
+    {
+        curvePrepare(&state->curve, state->kMax);
+        memset(curveCorrectCounts(&state->curve, 0), 0, (size_t)WEIGHTING_COUNT * state->curve.prefixes->prefixCount * kCount * sizeof(int));
+        memset(state->curveCorrectCounts, 0, (size_t)CURVE_VERIFY_PREFIXES * WEIGHTING_COUNT * kCount * sizeof(int));
+        state->curveTies = 0;
+    }
+
+    // the sketch shortlist size depends on the combo alone, a scratch that ran no combo before must pick the same one
+    sketchPrepare(&state->sketch, state->kMax, dataset->inputSize, dataset->trainInputs, dataset->testInputs, distanceThreshold, distanceExponent, kernels->distance);
+    SketchScratch freshSketch;
+    sketchScratchCreate(&freshSketch, &state->sketchTrainRows, &state->sketchTestRows, state->sketch.shortlistStart, state->sketch.targetRecall);
+    sketchPrepare(&freshSketch, state->kMax, dataset->inputSize, dataset->trainInputs, dataset->testInputs, distanceThreshold, distanceExponent, kernels->distance);
+    if (freshSketch.shortlistCount != state->sketch.shortlistCount)
+    {
+        EngineReport* report = &reports[engineCount + LIBRARY_COUNT + 1 + SORT_COUNT];
+        report->recallMismatches++;
+        reportMismatch(report, dataset, "sketch calibration", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, -1, freshSketch.shortlistCount);
+    }
+    sketchScratchFree(&freshSketch);
+
+    // each library model predicts every test row in batches up front, once per weighting
+    long long distanceCounts[LIBRARY_COUNT];
+    int indexActive = 0;
+    for (int libraryIndex = 0; libraryIndex < LIBRARY_COUNT; libraryIndex++)
+    {
+        KnnModel* model = models[libraryIndex];
+        distanceCounts[libraryIndex] = knnModelDistanceCount(model);
+        for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+        {
+            KnnParameters parameters;
+            parameters.k = state->kMax;
+            parameters.distanceThreshold = distanceThreshold;
+            parameters.distanceExponent = distanceExponent;
+            parameters.weighting = (KnnWeighting)weighting;
+            parameters.rooted = rooted;
+            parameters.index = (KnnIndex)libraryIndex;
+            size_t slice = ((size_t)libraryIndex * WEIGHTING_COUNT + weighting) * dataset->testCount;
+            if (knnModelSetParameters(model, &parameters) != 0 || knnPredictBatch(model, 0, dataset->testCount, dataset->testInputs, &state->libraryPredictions[slice * outputSize], NULL, &state->libraryNeighbours[slice * state->kMax]) != 0)
+            {
+                printf("Failed to run the knn library.\n");
+                exit(1);
+            }
+            indexActive |= knnModelIndexActive(model);
+        }
+        distanceCounts[libraryIndex] = knnModelDistanceCount(model) - distanceCounts[libraryIndex];
+    }
+    if (indexActive)
+    {
+        state->treeDistances += distanceCounts[KNN_INDEX_VPTREE];
+        state->scanDistances += distanceCounts[KNN_INDEX_NONE];
+    }
+
+    for (int testIndex = 0; testIndex < dataset->testCount; testIndex++)
+    {
+        float* testInput = &dataset->testInputs[(size_t)testIndex * dataset->inputSize];
+        oracleRank(dataset->inputSize, trainCount, dataset->trainInputs, testInput, state->oracleNeighbours, distanceThreshold, distanceExponent, rooted);
+        for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+        {
+            float* oraclePredictions = &state->oraclePredictions[(size_t)weighting * kCount * outputSize];
+            oracleVote((Weighting)weighting, outputSize, trainCount, dataset->trainOutputs, state->maxDistances, state->weightSums, oraclePredictions, state->oracleNeighbours, kCount, state->kMin, state->kMax);
+            for (int kIndex = 0; kIndex < kCount; kIndex++)
+            {
+                if (argmax(outputSize, &oraclePredictions[kIndex * outputSize]) == dataset->testArgmax[testIndex])
+                {
+                    state->oracleCorrectCounts[weighting * kCount + kIndex]++;
+                }
+            }
+        }
+
+        for (int engineIndex = 0; engineIndex < engineCount; engineIndex++)
+        {
+            EngineReport* report = &reports[engineIndex];
+            // the last six pairs of engines are the sparse distance, the cascade, the band, the batch, the warm started cascade
+            // and the interleaved rows
+            // over the selected isa's kernels
+            int sparseEngine = engineIndex / SORT_COUNT == supportedKernelCount();
+            int cascadeEngine = engineIndex / SORT_COUNT == supportedKernelCount() + 1;
+            int bandEngine = engineIndex / SORT_COUNT == supportedKernelCount() + 2;
+            int batchEngine = engineIndex / SORT_COUNT == supportedKernelCount() + 3;
+            int warmEngine = engineIndex / SORT_COUNT == supportedKernelCount() + 4;
+            int interleaveEngine = engineIndex / SORT_COUNT == supportedKernelCount() + 5;
+            const KnnKernels* engine = sparseEngine || cascadeEngine || bandEngine || batchEngine || warmEngine || interleaveEngine ? kernels : &kernelTable[engineIndex / SORT_COUNT];
+            SortMode sortMode = (SortMode)(engineIndex % SORT_COUNT);
+            report->queries++;
+
+            if (warmEngine)
+            {
+                warmLoadTest(&state->warm[sortMode], testIndex);
+            }
+            engineRank(state, engine, sortMode, dataset->inputSize, trainCount, dataset->trainInputs, testInput, sparseEngine || (batchEngine && state->batchSparse) ? &state->sparse : NULL, cascadeEngine ? &state->cascade : warmEngine ? &state->warmCascade : NULL, bandEngine ? &state->band : NULL, NULL, NULL, batchEngine ? &state->batch : NULL, warmEngine ? &state->warm[sortMode] : NULL, interleaveEngine ? &state->interleave : NULL, distanceThreshold, distanceExponent, rooted);
+
+            // the distance of every train row, not only the neighbours, must match bit for bit, except rows the cascade or band skipped
+            for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+            {
+                int oracleIndex = state->oracleNeighbours[trainIndex].index;
+                if ((cascadeEngine || bandEngine || warmEngine) && state->radixBuffers.distances[oracleIndex] == INFINITY)
+                {
+                    continue;
+                }
+                if (!sameFloat(state->oracleNeighbours[trainIndex].distance, state->radixBuffers.distances[oracleIndex]))
+                {
+                    report->distanceMismatches++;
+                    reportMismatch(report, dataset, "distance", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, oracleIndex);
+                    break;
+                }
+            }
+
+            int position = 0;
+            NeighbourMatch match = compareNeighbours(state->oracleNeighbours, state->engineNeighbours, trainCount, state->kMax, &position);
+            if (match == NEIGHBOURS_MISMATCH)
+            {
+                report->neighbourMismatches++;
+                reportMismatch(report, dataset, "neighbour", WEIGHTING_COUNT, rooted, distanceThreshold, distanceExponent, testIndex, position);
+            }
+            else if (match == NEIGHBOURS_TIE)
+            {
+                report->tiePermutations++;
+                state->tieQueries[engineIndex]++;
+            }
+
+            for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+            {
+                float* oraclePredictions = &state->oraclePredictions[(size_t)weighting * kCount * outputSize];
+                engineVote(engine, (Weighting)weighting, outputSize, trainCount, dataset->trainOutputs, state->maxDistances, state->weightSums, state->enginePredictions, state->engineNeighbours, kCount, state->kMin, state->kMax);
+                int voteDiffers = 0;
+                for (int kIndex = 0; kIndex < kCount; kIndex++)
+                {
+                    float* predictionOutput = &state->enginePredictions[kIndex * outputSize];
+                    for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+                    {
+                        if (!sameFloat(predictionOutput[outputIndex], oraclePredictions[kIndex * outputSize + outputIndex]))
+                        {
+                            voteDiffers = kIndex + 1;
+                        }
+                    }
+                    if (argmax(outputSize, predictionOutput) == dataset->testArgmax[testIndex])
+                    {
+                        state->engineCorrectCounts[((size_t)engineIndex * WEIGHTING_COUNT + weighting) * kCount + kIndex]++;
+                    }
+                }
+                if (voteDiffers && match == NEIGHBOURS_EQUAL)
+                {
+                    report->voteMismatches++;
+                    reportMismatch(report, dataset, "vote", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, state->kMin + voteDiffers - 1);
+                }
+                else if (voteDiffers && match == NEIGHBOURS_TIE)
+                {
+                    report->tieVoteDifferences++;
+                }
+            }
+        }
+
+        for (int libraryIndex = 0; libraryIndex < LIBRARY_COUNT; libraryIndex++)
+        {
+            verifyLibrary(state, dataset, &reports[engineCount + libraryIndex], engineCount + libraryIndex, libraryIndex, rooted, distanceThreshold, distanceExponent, testIndex);
+        }
+
+        if (state->curve.prefixes != NULL)
+        {
+            verifyCurve(state, dataset, &reports[engineCount + LIBRARY_COUNT + 1 + PREFILTER_COUNT * SORT_COUNT], rooted, distanceThreshold, distanceExponent, testIndex);
+        }
+
+        // the prefilters count recall against the distances before the root
+        IndexDistance* exactNeighbours = state->oracleNeighbours;
+        if (rooted)
+        {
+            oracleRank(dataset->inputSize, trainCount, dataset->trainInputs, testInput, state->exactNeighbours, distanceThreshold, distanceExponent, 0);
+            exactNeighbours = state->exactNeighbours;
+        }
+        EngineReport* prefilterReports = &reports[engineCount + LIBRARY_COUNT + 1];
+        for (int sortMode = 0; sortMode < SORT_COUNT; sortMode++)
+        {
+            pcaLoadTest(&state->pca, testIndex);
+            state->pca.sampled = 1;
+            verifyPrefilter(state, dataset, &prefilterReports[sortMode], (SortMode)sortMode, &state->pca, NULL, state->pca.shortlist, state->pcaFilter.shortlistCount, &state->pca.counts.exactCount, &state->pca.counts.foundCount, exactNeighbours, rooted, distanceThreshold, distanceExponent, testIndex);
+            sketchLoadTest(&state->sketch, testIndex);
+            state->sketch.sampled = 1;
+            verifyPrefilter(state, dataset, &prefilterReports[SORT_COUNT + sortMode], (SortMode)sortMode, NULL, &state->sketch, state->sketch.shortlist, state->sketch.shortlistCount, &state->sketch.counts.exactCount, &state->sketch.counts.foundCount, exactNeighbours, rooted, distanceThreshold, distanceExponent, testIndex);
+        }
+    }
+
+    if (state->curve.prefixes != NULL)
+    {
+        verifyCurveCounts(state, dataset, &reports[engineCount + LIBRARY_COUNT + 1 + PREFILTER_COUNT * SORT_COUNT], rooted, distanceThreshold, distanceExponent);
+    }
+
+    // correct counts per k are what the sweep writes, a difference is only excused when some query of this combo had a tie
+    for (int engineIndex = 0; engineIndex < engineCount + LIBRARY_COUNT; engineIndex++)
+    {
+        EngineReport* report = &reports[engineIndex];
+        for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+        {
+            for (int kIndex = engineIndex < engineCount ? 0 : kCount - 1; kIndex < kCount; kIndex++)
+            {
+                int oracleCount = state->oracleCorrectCounts[weighting * kCount + kIndex];
+                int engineCount = state->engineCorrectCounts[((size_t)engineIndex * WEIGHTING_COUNT + weighting) * kCount + kIndex];
+                if (oracleCount == engineCount)
+                {
+                    continue;
+                }
+                if (state->tieQueries[engineIndex] > 0)
+                {
+                    report->tieCorrectCountDifferences++;
+                    continue;
+                }
+                report->correctCountMismatches++;
+                if (report->printed < MISMATCH_PRINT_LIMIT)
+                {
+                    report->printed++;
+                    printf("  %s correct count mismatch, data: %s, weighting: %s%s, threshold: %f, exponent: %f, k: %d, oracle: %d, engine: %d\n", report->name, dataset->name, weightingNames[weighting], rooted ? " rooted" : "", distanceThreshold, distanceExponent, state->kMin + kIndex, oracleCount, engineCount);
+                }
+            }
+        }
+    }
+}
+
+// fits the pca prefilter to the dataset through a fresh cache file, which a second filter then loads, the two must agree,
+// and every test row's shortlist must be the rows with the smallest projected distances, nearest first
+void verifyPcaFilter(VerifyState* state, Dataset* dataset, EngineReport* report)
+{
+    int trainCount = dataset->trainCount;
+    int componentCount = dataset->inputSize < PCA_VERIFY_COMPONENTS ? dataset->inputSize : PCA_VERIFY_COMPONENTS;
+    int shortlistCount = trainCount / 4 > state->kMax ? trainCount / 4 : state->kMax;
+    if (shortlistCount > trainCount)
+    {
+        shortlistCount = trainCount;
+    }
+    remove(PCA_VERIFY_CACHE);
+    pcaFilterCreate(&state->pcaFilter, trainCount, dataset->inputSize, dataset->trainInputs, dataset->testCount, dataset->testInputs, componentCount, shortlistCount, 4, PCA_VERIFY_CACHE);
+    PcaFilter loaded;
+    int cached = pcaFilterCreate(&loaded, trainCount, dataset->inputSize, dataset->trainInputs, dataset->testCount, dataset->testInputs, componentCount, shortlistCount, 4, PCA_VERIFY_CACHE);
+    if (!cached
+        || memcmp(loaded.basis, state->pcaFilter.basis, (size_t)dataset->inputSize * componentCount * sizeof(float)) != 0
+        || memcmp(loaded.trainProjections, state->pcaFilter.trainProjections, (size_t)trainCount * componentCount * sizeof(float)) != 0
+        || memcmp(loaded.shortlists, state->pcaFilter.shortlists, (size_t)dataset->testCount * shortlistCount * sizeof(int)) != 0)
+    {
+        report->distanceMismatches++;
+        reportMismatch(report, dataset, "pca cache", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, cached);
+    }
+    pcaFilterFree(&loaded);
+    remove(PCA_VERIFY_CACHE);
+
+    float* projection = (float*)calloc(componentCount, sizeof(float));
+    float* projectedDistances = (float*)calloc(trainCount, sizeof(float));
+    if (projection == NULL || projectedDistances == NULL)
+    {
+        printf("Failed to allocate memory for pca check.\n");
+        exit(1);
+    }
+    for (int testIndex = 0; testIndex < dataset->testCount; testIndex++)
+    {
+        pcaProject(&state->pcaFilter, &dataset->testInputs[(size_t)testIndex * dataset->inputSize], projection);
+        for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+        {
+            const float* trainProjection = &state->pcaFilter.trainProjections[(size_t)trainIndex * componentCount];
+            float distance = 0.0f;
+            for (int component = 0; component < componentCount; component++)
+            {
+                float difference = projection[component] - trainProjection[component];
+                distance += difference * difference;
+            }
+            projectedDistances[trainIndex] = distance;
+        }
+        const int* shortlist = &state->pcaFilter.shortlists[(size_t)testIndex * shortlistCount];
+        memset(state->listed, 0, trainCount);
+        int failed = 0;
+        for (int position = 0; position < shortlistCount; position++)
+        {
+            failed |= state->listed[shortlist[position]];
+            failed |= position > 0 && projectedDistances[shortlist[position]] < projectedDistances[shortlist[position - 1]];
+            state->listed[shortlist[position]] = 1;
+        }
+        float farthest = projectedDistances[shortlist[shortlistCount - 1]];
+        for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+        {
+            failed |= !state->listed[trainIndex] && projectedDistances[trainIndex] < farthest;
+        }
+        if (failed)
+        {
+            report->neighbourMismatches++;
+            reportMismatch(report, dataset, "pca shortlist", WEIGHTING_COUNT, 0, 0.0f, 0.0f, testIndex, -1);
+        }
+    }
+    free(projection);
+    free(projectedDistances);
+    pcaScratchCreate(&state->pca, &state->pcaFilter);
+}
+
+// one store check against the oracle over the rows a sequence of appends and deletes leaves alive
+void verifyStoreStep(VerifyState* state, Dataset* dataset, EngineReport* report, KnnModel* model, int* rowIds, int rowCount, float* liveInputs, float* liveOutputs, int step, int rooted, float distanceThreshold, float distanceExponent)
+{
+    int inputSize = dataset->inputSize;
+    int outputSize = dataset->outputSize;
+    int kCount = state->kCount;
+    int kMax = state->kMax;
+
+    if (knnModelTrainCount(model) != rowCount)
+    {
+        report->neighbourMismatches++;
+        reportMismatch(report, dataset, "store count", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, step);
+        return;
+    }
+    for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+    {
+        KnnParameters parameters;
+        parameters.k = kMax;
+        parameters.distanceThreshold = distanceThreshold;
+        parameters.distanceExponent = distanceExponent;
+        parameters.weighting = (KnnWeighting)weighting;
+        parameters.rooted = rooted;
+        parameters.index = KNN_INDEX_VPTREE;
+        if (knnModelSetParameters(model, &parameters) != 0 || knnPredictBatch(model, 0, dataset->testCount, dataset->testInputs, &state->libraryPredictions[(size_t)weighting * dataset->testCount * outputSize], NULL, &state->libraryNeighbours[(size_t)weighting * dataset->testCount * kMax]) != 0)
+        {
+            printf("Failed to run the knn library.\n");
+            exit(1);
+        }
+    }
+
+    for (int testIndex = 0; testIndex < dataset->testCount; testIndex++)
+    {
+        // the oracle ranks the live rows, then its positions are mapped back to store ids
+        float* testInput = &dataset->testInputs[(size_t)testIndex * inputSize];
+        oracleRank(inputSize, rowCount, liveInputs, testInput, state->oracleNeighbours, distanceThreshold, distanceExponent, rooted);
+        report->queries++;
+        NeighbourMatch match = NEIGHBOURS_EQUAL;
+        for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+        {
+            float* oraclePrediction = &state->oraclePredictions[(size_t)weighting * kCount * outputSize];
+            oracleVote((Weighting)weighting, outputSize, rowCount, liveOutputs, state->maxDistances, state->weightSums, oraclePrediction, state->oracleNeighbours, kCount, state->kMin, kMax);
+        }
+        for (int neighbourIndex = 0; neighbourIndex < rowCount; neighbourIndex++)
+        {
+            state->oracleNeighbours[neighbourIndex].index = rowIds[state->oracleNeighbours[neighbourIndex].index];
+        }
+
+        for (int weighting = 0; weighting < WEIGHTING_COUNT; weighting++)
+        {
+            KnnNeighbour* libraryNeighbours = &state->libraryNeighbours[((size_t)weighting * dataset->testCount + testIndex) * kMax];
+            for (int neighbourIndex = 0; neighbourIndex < kMax; neighbourIndex++)
+            {
+                state->engineNeighbours[neighbourIndex].index = libraryNeighbours[neighbourIndex].index;
+                state->engineNeighbours[neighbourIndex].distance = libraryNeighbours[neighbourIndex].distance;
+            }
+            int position = 0;
+            NeighbourMatch weightingMatch = compareNeighbours(state->oracleNeighbours, state->engineNeighbours, rowCount, kMax, &position);
+            if (weightingMatch == NEIGHBOURS_MISMATCH)
+            {
+                reportMismatch(report, dataset, "store neighbour", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, step);
+            }
+            if (weightingMatch > match)
+            {
+                match = weightingMatch;
+            }
+
+            float* oraclePrediction = &state->oraclePredictions[((size_t)weighting * kCount + kCount - 1) * outputSize];
+            float* libraryPrediction = &state->libraryPredictions[((size_t)weighting * dataset->testCount + testIndex) * outputSize];
+            int voteDiffers = 0;
+            for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+            {
+                voteDiffers |= !sameFloat(libraryPrediction[outputIndex], oraclePrediction[outputIndex]);
+            }
+            if (voteDiffers && weightingMatch == NEIGHBOURS_EQUAL)
+            {
+                report->voteMismatches++;
+                reportMismatch(report, dataset, "store vote", (Weighting)weighting, rooted, distanceThreshold, distanceExponent, testIndex, step);
+            }
+            else if (voteDiffers && weightingMatch == NEIGHBOURS_TIE)
+            {
+                report->tieVoteDifferences++;
+            }
+        }
+        if (match == NEIGHBOURS_MISMATCH)
+        {
+            report->neighbourMismatches++;
+        }
+        else if (match == NEIGHBOURS_TIE)
+        {
+            report->tiePermutations++;
+        }
+    }
+}
+
+// builds a store from half the train rows, appends the rest, deletes a fifth, deletes another fifth
+// which crosses the compaction fraction, then re-appends the first fifth under new ids, checking after each step
+void verifyStore(VerifyState* state, Dataset* dataset, EngineReport* report)
+{
+    int inputSize = dataset->inputSize;
+    int outputSize = dataset->outputSize;
+    int trainCount = dataset->trainCount;
+    int capacity = trainCount + trainCount / 5 + 1;
+    int* rowIds = (int*)calloc(capacity, sizeof(int));
+    float* liveInputs = (float*)calloc((size_t)capacity * inputSize, sizeof(float));
+    float* liveOutputs = (float*)calloc((size_t)capacity * outputSize, sizeof(float));
+    int* idSources = (int*)calloc(capacity, sizeof(int));
+    if (rowIds == NULL || liveInputs == NULL || liveOutputs == NULL || idSources == NULL)
+    {
+        printf("Failed to allocate memory for store check.\n");
+        exit(1);
+    }
+
+    KnnParameters parameters;
+    knnParametersDefaults(&parameters);
+    parameters.k = state->kMax;
+    int initialCount = trainCount / 2;
+    KnnModel* model = knnModelCreate(inputSize, outputSize, initialCount, dataset->trainInputs, dataset->trainOutputs, &parameters, 1, 8);
+    if (model == NULL)
+    {
+        printf("Failed to create knn model.\n");
+        exit(1);
+    }
+    int idCount = initialCount;
+    for (int trainIndex = 0; trainIndex < initialCount; trainIndex++)
+    {
+        idSources[trainIndex] = trainIndex;
+    }
+    for (int trainIndex = initialCount; trainIndex < trainCount; trainIndex++)
+    {
+        int id = knnModelAppend(model, &dataset->trainInputs[(size_t)trainIndex * inputSize], &dataset->trainOutputs[(size_t)trainIndex * outputSize]);
+        if (id != idCount)
+        {
+            report->neighbourMismatches++;
+            reportMismatch(report, dataset, "store append id", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, id);
+        }
+        idSources[idCount++] = trainIndex;
+    }
+
+    for (int step = 0; step < 4; step++)
+    {
+        if (step == 1 || step == 2)
+        {
+            for (int id = 0; id < trainCount; id++)
+            {
+                if (id % 5 == step && knnModelDelete(model, id) != 0)
+                {
+                    report->neighbourMismatches++;
+                    reportMismatch(report, dataset, "store delete", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, id);
+                }
+            }
+        }
+        if (step == 3)
+        {
+            for (int trainIndex = 0; trainIndex < trainCount; trainIndex++)
+            {
+                if (trainIndex % 5 == 1)
+                {
+                    idSources[knnModelAppend(model, &dataset->trainInputs[(size_t)trainIndex * inputSize], &dataset->trainOutputs[(size_t)trainIndex * outputSize])] = trainIndex;
+                    idCount++;
+                }
+            }
+        }
+
+        // the rows alive after this step in id order, which is the order the store scans them
+        int rowCount = 0;
+        for (int id = 0; id < idCount; id++)
+        {
+            int deleted = id < trainCount && ((step >= 1 && id % 5 == 1) || (step >= 2 && id % 5 == 2));
+            if (deleted)
+            {
+                continue;
+            }
+            int source = idSources[id];
+            rowIds[rowCount] = id;
+            memcpy(&liveInputs[(size_t)rowCount * inputSize], &dataset->trainInputs[(size_t)source * inputSize], inputSize * sizeof(float));
+            memcpy(&liveOutputs[(size_t)rowCount * outputSize], &dataset->trainOutputs[(size_t)source * outputSize], outputSize * sizeof(float));
+            rowCount++;
+        }
+        // once with a threshold, which scans, and once as a metric, which searches the trees over the full chunks
+        verifyStoreStep(state, dataset, report, model, rowIds, rowCount, liveInputs, liveOutputs, step, 0, 0.05f, 2.0f);
+        verifyStoreStep(state, dataset, report, model, rowIds, rowCount, liveInputs, liveOutputs, step, 1, 0.0f, 2.0f);
+    }
+
+    knnModelFree(model);
+    free(rowIds);
+    free(liveInputs);
+    free(liveOutputs);
+    free(idSources);
+}
+
+// predicts every test row through the graph, returning the distances it measured and the seconds it took
+long long verifyStoreGraphPredict(VerifyState* state, Dataset* dataset, KnnModel* model, double* seconds)
+{
+    long long distanceCount = knnModelDistanceCount(model);
+    uint64_t start = platformNanoseconds();
+    if (knnPredictBatch(model, 0, dataset->testCount, dataset->testInputs, state->libraryPredictions, NULL, state->libraryNeighbours) != 0)
+    {
+        printf("Failed to run the knn library.\n");
+        exit(1);
+    }
+    *seconds = (double)(platformNanoseconds() - start) * 1e-9;
+    return knnModelDistanceCount(model) - distanceCount;
+}
+
+// builds the hnsw graph over the train rows, deletes a third of them, which crosses the compaction fraction,
+// and checks the compacted store answers from the carried graph: only live ids come back, and the next predict
+// measures about as many distances as before rather than linking every row again
+void verifyStoreGraph(VerifyState* state, Dataset* dataset, EngineReport* report)
+{
+    int trainCount = dataset->trainCount;
+    int kMax = state->kMax;
+    KnnParameters parameters;
+    knnParametersDefaults(&parameters);
+    parameters.k = kMax;
+    parameters.index = KNN_INDEX_HNSW;
+    KnnModel* model = knnModelCreate(dataset->inputSize, dataset->outputSize, trainCount, dataset->trainInputs, dataset->trainOutputs, &parameters, 1, 8);
+    if (model == NULL || knnModelBuildIndex(model, 1) != 0)
+    {
+        printf("Failed to create knn model.\n");
+        exit(1);
+    }
+    double secondsBefore = 0.0;
+    long long distancesBefore = verifyStoreGraphPredict(state, dataset, model, &secondsBefore);
+
+    for (int id = 0; id < trainCount; id += 3)
+    {
+        if (knnModelDelete(model, id) != 0)
+        {
+            report->neighbourMismatches++;
+            reportMismatch(report, dataset, "store graph delete", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, id);
+        }
+    }
+    // waits for the compaction the deletes started, then drops the rows deleted while it ran
+    if (knnModelCompact(model) != 0 || knnModelTrainCount(model) != trainCount - (trainCount + 2) / 3)
+    {
+        report->neighbourMismatches++;
+        reportMismatch(report, dataset, "store graph count", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, knnModelTrainCount(model));
+    }
+    double secondsAfter = 0.0;
+    long long distancesAfter = verifyStoreGraphPredict(state, dataset, model, &secondsAfter);
+
+    for (int testIndex = 0; testIndex < dataset->testCount; testIndex++)
+    {
+        report->queries++;
+        for (int neighbourIndex = 0; neighbourIndex < kMax; neighbourIndex++)
+        {
+            int id = state->libraryNeighbours[(size_t)testIndex * kMax + neighbourIndex].index;
+            if (id < 0 || id >= trainCount || id % 3 == 0)
+            {
+                report->neighbourMismatches++;
+                reportMismatch(report, dataset, "store graph neighbour", WEIGHTING_COUNT, 0, 0.0f, 0.0f, testIndex, id);
+                break;
+            }
+        }
+    }
+    // a third fewer rows to search, so linking them all again would show as several times the distances
+    if (distancesAfter > distancesBefore + distancesBefore / 2)
+    {
+        report->neighbourMismatches++;
+        reportMismatch(report, dataset, "store graph distances", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, (int)distancesAfter);
+    }
+    if (secondsAfter > 4.0 * secondsBefore + 0.1)
+    {
+        report->neighbourMismatches++;
+        reportMismatch(report, dataset, "store graph time", WEIGHTING_COUNT, 0, 0.0f, 0.0f, -1, (int)(secondsAfter * 1000.0));
+    }
+    printf("  store graph distances before compaction: %lld, after: %lld\n", distancesBefore, distancesAfter);
+    knnModelFree(model);
+}
+
+// one hot outputs for labels drawn from the same seed stream
+void randomLabels(uint64_t* state, int count, int outputSize, float* outputs)
+{
+    for (int row = 0; row < count; row++)
+    {
+        *state = syntheticMix(*state);
+        outputs[(size_t)row * outputSize + (int)(*state % (uint64_t)outputSize)] = 1.0f;
+    }
+}
+
+// uniform inputs, levels above zero snaps each value to one of that many steps so equal distances are common
+void loadRandom(uint64_t seed, int count, int inputSize, int outputSize, int levels, float** inputs, float** outputs)
+{
+    *inputs = (float*)calloc((size_t)count * inputSize, sizeof(float));
+    *outputs = (float*)calloc((size_t)count * outputSize, sizeof(float));
+    if (*inputs == NULL || *outputs == NULL)
+    {
+        printf("Failed to allocate memory for random data.\n");
+        exit(1);
+    }
+    uint64_t state = seed;
+    for (size_t valueIndex = 0; valueIndex < (size_t)count * inputSize; valueIndex++)
+    {
+        float value = syntheticUniform(&state);
+        if (levels > 0)
+        {
+            value = (float)(int)(value * levels) / (float)(levels > 1 ? levels - 1 : 1);
+        }
+        (*inputs)[valueIndex] = value;
+    }
+    randomLabels(&state, count, outputSize, *outputs);
+}
+
+// rows scattered tightly around centres spread over a wide range, labelled by their centre, so a query's nearest rows
+// are its own cluster's and the band and the trees can rule the other clusters out, the centres come from their own seed
+// so train and test rows share them
+void loadClustered(uint64_t centreSeed, uint64_t seed, int count, int inputSize, int outputSize, float** inputs, float** outputs)
+{
+    *inputs = (float*)calloc((size_t)count * inputSize, sizeof(float));
+    *outputs = (float*)calloc((size_t)count * outputSize, sizeof(float));
+    if (*inputs == NULL || *outputs == NULL)
+    {
+        printf("Failed to allocate memory for clustered data.\n");
+        exit(1);
+    }
+    uint64_t state = seed;
+    for (int row = 0; row < count; row++)
+    {
+        state = syntheticMix(state);
+        int cluster = (int)(state % CLUSTER_COUNT);
+        uint64_t centreState = syntheticHash(centreSeed, (uint64_t)cluster, 0);
+        for (int inputIndex = 0; inputIndex < inputSize; inputIndex++)
+        {
+            float centre = syntheticUniform(&centreState) * CLUSTER_RANGE;
+            (*inputs)[(size_t)row * inputSize + inputIndex] = centre + syntheticGaussian(&state) * CLUSTER_SPREAD;
+        }
+        (*outputs)[(size_t)row * outputSize + cluster % outputSize] = 1.0f;
+    }
+}
+
+void finishDataset(Dataset* dataset, float* testOutputs)
+{
+    dataset->testArgmax = (int*)calloc(dataset->testCount, sizeof(int));
+    if (dataset->testArgmax == NULL)
+    {
+        printf("Failed to allocate memory for test argmax.\n");
+        exit(1);
+    }
+    for (int testIndex = 0; testIndex < dataset->testCount; testIndex++)
+    {
+        dataset->testArgmax[testIndex] = argmax(dataset->outputSize, &testOutputs[(size_t)testIndex * dataset->outputSize]);
+    }
+    free(testOutputs);
+}
+
+void freeDataset(Dataset* dataset)
+{
+    free(dataset->trainInputs);
+    free(dataset->trainOutputs);
+    free(dataset->testInputs);
+    free(dataset->testArgmax);
+}
+
+// usage: knn_verify [trainCount=300] [testCount=30] [seed=1]
+int main(int argc, char** argv)
+{
+    int trainCount = argc > 1 ? atoi(argv[1]) : 300;
+    int testCount = argc > 2 ? atoi(argv[2]) : 30;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    if (trainCount < 1 || testCount < 1)
+    {
+        printf("Invalid verify parameters.\n");
+        exit(1);
+    }
+
+    // a coarse slice of the sweep grid, plus the ends where distances underflow to zero or skip every pixel
+    float distanceThresholds[] = { 0.00f, 0.05f, 0.30f, 0.99f };
+    float distanceExponents[] = { 0.1f, 0.5f, 1.0f, 2.0f, 7.3f, 20.0f };
+    int thresholdCount = (int)(sizeof(distanceThresholds) / sizeof(distanceThresholds[0]));
+    int exponentCount = (int)(sizeof(distanceExponents) / sizeof(distanceExponents[0]));
+
+    // random dense rows, coarse rows full of ties, mnist shaped synthetic digits, and low dimension clusters
+    Dataset datasets[4];
+    int datasetCount = 4;
+    float* testOutputs = NULL;
+    memset(datasets, 0, sizeof(datasets));
+
+    datasets[0].name = "random";
+    datasets[0].inputSize = 64;
+    datasets[1].name = "ties";
+    datasets[1].inputSize = 12;
+    datasets[2].name = "synthetic";
+    datasets[2].inputSize = 784;
+    datasets[3].name = "clustered";
+    datasets[3].inputSize = 3;
+    datasets[3].pruned = 1;
+    for (int datasetIndex = 0; datasetIndex < datasetCount; datasetIndex++)
+    {
+        Dataset* dataset = &datasets[datasetIndex];
+        dataset->trainCount = trainCount;
+        dataset->testCount = testCount;
+        dataset->outputSize = 10;
+        if (datasetIndex < 2)
+        {
+            int levels = datasetIndex == 0 ? 0 : 3;
+            loadRandom(syntheticHash(seed, datasetIndex, SYNTHETIC_TRAIN), trainCount, dataset->inputSize, dataset->outputSize, levels, &dataset->trainInputs, &dataset->trainOutputs);
+            loadRandom(syntheticHash(seed, datasetIndex, SYNTHETIC_TEST), testCount, dataset->inputSize, dataset->outputSize, levels, &dataset->testInputs, &testOutputs);
+        }
+        else if (dataset->pruned)
+        {
+            uint64_t centreSeed = syntheticHash(seed, datasetIndex, 0);
+            loadClustered(centreSeed, syntheticHash(seed, datasetIndex, SYNTHETIC_TRAIN), trainCount, dataset->inputSize, dataset->outputSize, &dataset->trainInputs, &dataset->trainOutputs);
+            loadClustered(centreSeed, syntheticHash(seed, datasetIndex, SYNTHETIC_TEST), testCount, dataset->inputSize, dataset->outputSize, &dataset->testInputs, &testOutputs);
+        }
+        else
+        {
+            SyntheticConfig config;
+            syntheticDefaults(&config, seed);
+            loadSynthetic(&config, SYNTHETIC_TRAIN, trainCount, dataset->inputSize, dataset->outputSize, &dataset->trainInputs, &dataset->trainOutputs);
+            loadSynthetic(&config, SYNTHETIC_TEST, testCount, dataset->inputSize, dataset->outputSize, &dataset->testInputs, &testOutputs);
+        }
+        finishDataset(dataset, testOutputs);
+    }
+
+    // every isa this cpu runs, the sparse distance, the cascade, the band, the batch, the warm started cascade and the
+    // interleaved rows, each with both selection paths, then the library on the isa it selects, scanning and with trees
+    selectKernels();
+    int engineCount = (supportedKernelCount() + 6) * SORT_COUNT;
+    int reportCount = engineCount + LIBRARY_COUNT + 1 + PREFILTER_COUNT * SORT_COUNT + 1;
+    EngineReport* reports = (EngineReport*)calloc(reportCount, sizeof(EngineReport));
+    if (reports == NULL)
+    {
+        printf("Failed to allocate memory for reports.\n");
+        exit(1);
+    }
+    for (int engineIndex = 0; engineIndex < engineCount; engineIndex++)
+    {
+        int kernelIndex = engineIndex / SORT_COUNT;
+        const char* engineName = kernelIndex == supportedKernelCount() ? "sparse" : kernelIndex == supportedKernelCount() + 1 ? "cascade" : kernelIndex == supportedKernelCount() + 2 ? "band" : kernelIndex == supportedKernelCount() + 3 ? "batch" : kernelIndex == supportedKernelCount() + 4 ? "warm" : kernelIndex == supportedKernelCount() + 5 ? "interleave" : kernelTable[kernelIndex].name;
+        snprintf(reports[engineIndex].name, sizeof(reports[engineIndex].name), "%s/%s", engineName, sortModeNames[engineIndex % SORT_COUNT]);
+    }
+    snprintf(reports[engineCount].name, sizeof(reports[engineCount].name), "libknn/%s", kernels->name);
+    snprintf(reports[engineCount + 1].name, sizeof(reports[engineCount + 1].name), "libknn/vptree");
+    snprintf(reports[engineCount + LIBRARY_COUNT].name, sizeof(reports[engineCount + LIBRARY_COUNT].name), "libknn/store");
+    EngineReport* prefilterReports = &reports[engineCount + LIBRARY_COUNT + 1];
+    for (int sortMode = 0; sortMode < SORT_COUNT; sortMode++)
+    {
+        snprintf(prefilterReports[sortMode].name, sizeof(prefilterReports[sortMode].name), "pca/%s", sortModeNames[sortMode]);
+        snprintf(prefilterReports[SORT_COUNT + sortMode].name, sizeof(prefilterReports[SORT_COUNT + sortMode].name), "sketch/%s", sortModeNames[sortMode]);
+    }
+    snprintf(reports[reportCount - 1].name, sizeof(reports[reportCount - 1].name), "curve/%s", kernels->name);
+
+    VerifyState state;
+    memset(&state, 0, sizeof(state));
+    state.kMin = 1;
+    state.kMax = 20;
+    state.kCount = state.kMax - state.kMin + 1;
+    int outputSize = 10;
+    state.oracleNeighbours = (IndexDistance*)calloc(trainCount, sizeof(IndexDistance));
+    state.engineNeighbours = (IndexDistance*)calloc(trainCount > state.kMax ? trainCount : state.kMax, sizeof(IndexDistance));
+    state.exactNeighbours = (IndexDistance*)calloc(trainCount, sizeof(IndexDistance));
+    state.filterNeighbours = (IndexDistance*)calloc(trainCount, sizeof(IndexDistance));
+    state.listed = (unsigned char*)calloc(trainCount, sizeof(unsigned char));
+    state.maxDistances = (float*)calloc(state.kCount, sizeof(float));
+    state.weightSums = (float*)calloc(state.kCount, sizeof(float));
+    state.oraclePredictions = (float*)calloc((size_t)WEIGHTING_COUNT * state.kCount * outputSize, sizeof(float));
+    state.enginePredictions = (float*)calloc((size_t)state.kCount * outputSize, sizeof(float));
+    state.oracleCorrectCounts = (int*)calloc((size_t)WEIGHTING_COUNT * state.kCount, sizeof(int));
+    state.engineCorrectCounts = (int*)calloc((size_t)(engineCount + LIBRARY_COUNT) * WEIGHTING_COUNT * state.kCount, sizeof(int));
+    state.tieQueries = (int*)calloc(engineCount + LIBRARY_COUNT, sizeof(int));
+    state.libraryNeighbours = (KnnNeighbour*)calloc((size_t)LIBRARY_COUNT * WEIGHTING_COUNT * testCount * state.kMax, sizeof(KnnNeighbour));
+    state.libraryPredictions = (float*)calloc((size_t)LIBRARY_COUNT * WEIGHTING_COUNT * testCount * outputSize, sizeof(float));
+    state.curveNeighbours = (IndexDistance*)calloc((size_t)CURVE_VERIFY_PREFIXES * state.kMax, sizeof(IndexDistance));
+    state.curvePredictions = (float*)calloc((size_t)state.kCount * outputSize, sizeof(float));
+    state.curveCorrectCounts = (int*)calloc((size_t)CURVE_VERIFY_PREFIXES * WEIGHTING_COUNT * state.kCount, sizeof(int));
+    if (state.curveNeighbours == NULL || state.curvePredictions == NULL || state.curveCorrectCounts == NULL)
+    {
+        printf("Failed to allocate memory for curve check.\n");
+        exit(1);
+    }
+    if (state.oracleNeighbours == NULL || state.engineNeighbours == NULL || state.exactNeighbours == NULL || state.filterNeighbours == NULL || state.listed == NULL || state.maxDistances == NULL || state.weightSums == NULL || state.oraclePredictions == NULL || state.enginePredictions == NULL || state.oracleCorrectCounts == NULL || state.engineCorrectCounts == NULL || state.tieQueries == NULL || state.libraryNeighbours == NULL || state.libraryPredictions == NULL)
+    {
+        printf("Failed to allocate memory for verify state.\n");
+        exit(1);
+    }
+    radixBuffersCreate(&state.radixBuffers, trainCount);
+
+    printf("Verify, train: %d, test: %d, seed: %llu, engines: %d\n", trainCount, testCount, (unsigned long long)seed, reportCount);
+    int comboCount = 0;
+    int pruneFailed = 0;
+    for (int datasetIndex = 0; datasetIndex < datasetCount; datasetIndex++)
+    {
+        // a small batch size so the library runs full and partial batches
+        Dataset* dataset = &datasets[datasetIndex];
+        KnnModel* models[LIBRARY_COUNT];
+        for (int libraryIndex = 0; libraryIndex < LIBRARY_COUNT; libraryIndex++)
+        {
+            KnnParameters parameters;
+            knnParametersDefaults(&parameters);
+            parameters.k = state.kMax;
+            parameters.index = (KnnIndex)libraryIndex;
+            models[libraryIndex] = knnModelCreate(dataset->inputSize, dataset->outputSize, dataset->trainCount, dataset->trainInputs, dataset->trainOutputs, &parameters, 1, 8);
+            if (models[libraryIndex] == NULL)
+            {
+                printf("Failed to create knn model.\n");
+                exit(1);
+            }
+        }
+        state.treeDistances = 0;
+        state.scanDistances = 0;
+        sparseRowsCreate(&state.sparseRows, dataset->trainCount, dataset->inputSize, dataset->trainInputs);
+        sparseScratchCreate(&state.sparse, &state.sparseRows);
+        cascadeRowsCreate(&state.cascadeRows, dataset->trainCount, dataset->inputSize, dataset->trainInputs);
+        cascadeScratchCreate(&state.cascade, &state.cascadeRows, CASCADE_ON);
+        bandScratchCreate(&state.band, dataset->trainCount, dataset->inputSize, dataset->trainInputs, 1);
+        batchScratchCreate(&state.batch, 1, dataset->trainCount, dataset->inputSize);
+        // the batch sums the sparse merge's terms on data the sweeps would run sparse
+        state.batchSparse = sparseSelect(sparseDensity(dataset->trainCount, dataset->inputSize, dataset->trainInputs));
+        // the whole grid is one run, each combo seeded by the one before it
+        cascadeScratchCreate(&state.warmCascade, &state.cascadeRows, CASCADE_ON);
+        for (int sortMode = 0; sortMode < SORT_COUNT; sortMode++)
+        {
+            warmScratchCreate(&state.warm[sortMode], 2, dataset->trainCount, dataset->testCount);
+        }
+        interleavedRowsCreate(&state.interleavedRows, dataset->trainCount, dataset->inputSize, dataset->trainInputs, kernels->interleaveLanes);
+        interleaveScratchCreate(&state.interleave, &state.interleavedRows);
+        verifyPcaFilter(&state, dataset, &prefilterReports[SORT_QSORT]);
+        sketchRowsCreate(&state.sketchTrainRows, dataset->trainCount, dataset->inputSize, dataset->trainInputs);
+        sketchRowsCreate(&state.sketchTestRows, dataset->testCount, dataset->inputSize, dataset->testInputs);
+        sketchScratchCreate(&state.sketch, &state.sketchTrainRows, &state.sketchTestRows, dataset->trainCount / 4 > state.kMax ? dataset->trainCount / 4 : state.kMax, SKETCH_RECALL_DEFAULT);
+        int curveCounts[CURVE_VERIFY_PREFIXES] = { 1, state.kMax / 2, state.kMax, dataset->trainCount / 2 };
+        memset(&state.curvePrefixes, 0, sizeof(CurvePrefixes));
+        for (int prefix = 0; prefix < CURVE_VERIFY_PREFIXES; prefix++)
+        {
+            int last = state.curvePrefixes.prefixCount > 0 ? state.curvePrefixes.trainCounts[state.curvePrefixes.prefixCount - 1] : 0;
+            if (curveCounts[prefix] > last && curveCounts[prefix] < dataset->trainCount)
+            {
+                state.curvePrefixes.trainCounts[state.curvePrefixes.prefixCount++] = curveCounts[prefix];
+            }
+        }
+        curveScratchCreate(&state.curve, &state.curvePrefixes, dataset->outputSize, state.kCount, WEIGHTING_COUNT);
+
+        for (int rooted = 0; rooted <= 1; rooted++)
+        {
+            for (int thresholdIndex = 0; thresholdIndex < thresholdCount; thresholdIndex++)
+            {
+                for (int exponentIndex = 0; exponentIndex < exponentCount; exponentIndex++)
+                {
+                    verifyCombo(&state, dataset, reports, engineCount, models, rooted, distanceThresholds[thresholdIndex], distanceExponents[exponentIndex]);
+                    comboCount++;
+                }
+            }
+        }
+        for (int libraryIndex = 0; libraryIndex < LIBRARY_COUNT; libraryIndex++)
+        {
+            knnModelFree(models[libraryIndex]);
+        }
+        sparseScratchFree(&state.sparse);
+        sparseRowsFree(&state.sparseRows);
+
+        // appends, deletes and compaction in the library's train store
+        verifyStore(&state, dataset, &reports[engineCount + LIBRARY_COUNT]);
+        verifyStoreGraph(&state, dataset, &reports[engineCount + LIBRARY_COUNT]);
+        printf("Data: %s, inputs: %d, tree distances on metric combos: %.1f%% of the scan, done\n", datasets[datasetIndex].name, datasets[datasetIndex].inputSize, state.scanDistances > 0 ? 100.0 * state.treeDistances / state.scanDistances : 0.0);
+        printf("  ");
+        cascadeReport(&state.cascade.counts);
+        printf("  warm ");
+        cascadeReport(&state.warmCascade.counts);
+        cascadeScratchFree(&state.warmCascade);
+        for (int sortMode = 0; sortMode < SORT_COUNT; sortMode++)
+        {
+            warmScratchFree(&state.warm[sortMode]);
+        }
+        cascadeScratchFree(&state.cascade);
+        cascadeRowsFree(&state.cascadeRows);
+        printf("  ");
+        bandReport(&state.band.counts);
+
+        // pruning that measures every row on data built for it is not running at all
+        if (dataset->pruned && (state.band.counts.measuredCount >= state.band.counts.rowCount || state.treeDistances >= state.scanDistances))
+        {
+            printf("  no rows pruned on %s\n", dataset->name);
+            pruneFailed = 1;
+        }
+        bandScratchFree(&state.band);
+        batchScratchFree(&state.batch);
+        interleaveScratchFree(&state.interleave);
+        interleavedRowsFree(&state.interleavedRows);
+        printf("  ");
+        pcaReport(&state.pca.counts, state.kMax);
+        pcaScratchFree(&state.pca);
+        pcaFilterFree(&state.pcaFilter);
+        printf("  ");
+        sketchReport(&state.sketch.counts, state.kMax);
+        sketchScratchFree(&state.sketch);
+        sketchRowsFree(&state.sketchTrainRows);
+        sketchRowsFree(&state.sketchTestRows);
+        curveScratchFree(&state.curve);
+    }
+
+    int failed = pruneFailed;
+    printf("\n%-16s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "Engine", "Queries", "Distance", "Neighbour", "Tie", "Vote", "TieVote", "Correct", "TieCorrect", "Recall");
+    for (int engineIndex = 0; engineIndex < reportCount; engineIndex++)
+    {
+        EngineReport* report = &reports[engineIndex];
+        printf("%-16s %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld\n", report->name, report->queries, report->distanceMismatches, report->neighbourMismatches, report->tiePermutations, report->voteMismatches, report->tieVoteDifferences, report->correctCountMismatches, report->tieCorrectCountDifferences, report->recallMismatches);
+        failed |= report->distanceMismatches > 0 || report->neighbourMismatches > 0 || report->voteMismatches > 0 || report->correctCountMismatches > 0 || report->recallMismatches > 0;
+    }
+    printf("\nCombos: %d, weightings: %d, %s\n", comboCount, WEIGHTING_COUNT, failed ? "FAILED" : "PASSED");
+
+    for (int datasetIndex = 0; datasetIndex < datasetCount; datasetIndex++)
+    {
+        freeDataset(&datasets[datasetIndex]);
+    }
+    radixBuffersFree(&state.radixBuffers);
+    free(state.oracleNeighbours);
+    free(state.engineNeighbours);
+    free(state.exactNeighbours);
+    free(state.filterNeighbours);
+    free(state.listed);
+    free(state.maxDistances);
+    free(state.weightSums);
+    free(state.oraclePredictions);
+    free(state.enginePredictions);
+    free(state.oracleCorrectCounts);
+    free(state.engineCorrectCounts);
+    free(state.tieQueries);
+    free(state.libraryNeighbours);
+    free(state.libraryPredictions);
+    free(state.curveNeighbours);
+    free(state.curvePredictions);
+    free(state.curveCorrectCounts);
+    free(reports);
+    return failed;
+}
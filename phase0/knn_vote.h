@@ -0,0 +1,66 @@
+#ifndef KNN_VOTE_H
+#define KNN_VOTE_H
+
+#include <string.h>
+#include "knn_dispatch.h"
+
+// the average weighting's vote, shared by its sweep and knn_reduce so the reduced set's accuracy is counted as the
+// sweep would count it: every k from kmin takes the mean of its k nearest rows' outputs, and the prediction is the
+// first largest output
+
+// the prediction per k from the nearest neighbourCount rows, ranked low to high distance, a k past the rows votes with
+// all of them and still divides by k
+static void voteAverage(
+    int outputSize,
+    int neighbourCount,
+    const float* trainOutputs,
+    float* predictionOutputs,
+    const IndexDistance* indexDistances,
+    int kCount,
+    int kMin,
+    int kMax
+)
+{
+    // zero prediction outputs
+    memset(predictionOutputs, 0, kCount * outputSize * sizeof(float));
+
+    // iterate neighbours up to kmax
+    for (int neighbourIndex = 0; neighbourIndex < kMax && neighbourIndex < neighbourCount; neighbourIndex++)
+    {
+        int trainIndex = indexDistances[neighbourIndex].index;
+        for (int kIndex = 0; kIndex < kCount; kIndex++)
+        {
+            int k = kMin + kIndex;
+            if (neighbourIndex < k)
+            {
+                kernels->accumulate(outputSize, &trainOutputs[(size_t)trainIndex * outputSize], 1.0f, &predictionOutputs[kIndex * outputSize]);
+            }
+        }
+    }
+
+    // normalize
+    for (int kIndex = 0; kIndex < kCount; kIndex++)
+    {
+        int k = kMin + kIndex;
+        for (int outputIndex = 0; outputIndex < outputSize; outputIndex++)
+        {
+            predictionOutputs[kIndex * outputSize + outputIndex] /= (float)k;
+        }
+    }
+}
+
+// the first largest output
+static inline int voteArgmax(int size, const float* values)
+{
+    int maxIndex = 0;
+    for (int index = 1; index < size; index++)
+    {
+        if (values[index] > values[maxIndex])
+        {
+            maxIndex = index;
+        }
+    }
+    return maxIndex;
+}
+
+#endif
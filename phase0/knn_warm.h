@@ -0,0 +1,135 @@
+#ifndef KNN_WARM_H
+#define KNN_WARM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "knn_arena.h"
+
+// warm starts for the cascade: adjacent combos of a sweep, the same threshold and the next exponent, mostly share their
+// nearest rows, so an unbatched sweep hands each thread runs of adjacent combos, and each query of a combo first measures
+// the rows the previous combo of the run ranked nearest for the same test row, their kmax distances give the cascade a
+// tight limit before the first row of the scan, which then skips those rows and prunes the rest against it
+//
+// the seeds are measured ahead of lower rows they may tie with, so a seeded query only prunes a bound strictly past the
+// limit, a tie still reaches the sort, which keeps the lower index first exactly as the unseeded scan does
+//
+// runs of WARM_RUN_DEFAULT combos whenever the cascade is on, KNN_WARM sets the run length and 0 or 1 turns it off
+#define WARM_RUN_DEFAULT 8
+
+// the per thread state of a sweep: the nearest rows of every test row in the previous combo of the run,
+// and a stamp per train row that marks the current query's seeds
+typedef struct {
+    int runLength;
+    int trainCount;
+    int testCount;
+    // neighbour slots per test row, grown to the largest kmax seen
+    int capacity;
+    // 1 until the first combo of a claimed run has prepared
+    int runStart;
+    // seeds per test row for the current combo, 0 on the first combo of a run, and the neighbours it keeps for the next
+    int seedCount;
+    int recordCount;
+    int* neighbours;
+    // the current test row's slot, read as seeds before the scan and overwritten with its neighbours after the sort
+    int* seeds;
+    unsigned int* marks;
+    unsigned int stamp;
+} WarmScratch;
+
+// the run length, 1 when KNN_WARM turns warm starts off
+static int warmSelect(void)
+{
+    const char* override = getenv("KNN_WARM");
+    if (override != NULL && override[0] != '\0')
+    {
+        int runLength = atoi(override);
+        return runLength > 1 ? runLength : 1;
+    }
+    return WARM_RUN_DEFAULT;
+}
+
+// a run length of 1 leaves warm starts off and allocates nothing
+static void warmScratchCreate(WarmScratch* scratch, int runLength, int trainCount, int testCount)
+{
+    memset(scratch, 0, sizeof(WarmScratch));
+    scratch->runLength = runLength;
+    scratch->trainCount = trainCount;
+    scratch->testCount = testCount;
+    if (runLength <= 1)
+    {
+        return;
+    }
+    scratch->marks = (unsigned int*)arenaCalloc(trainCount > 0 ? trainCount : 1, sizeof(unsigned int));
+    if (scratch->marks == NULL)
+    {
+        printf("Failed to allocate memory for warm scratch.\n");
+        exit(1);
+    }
+}
+
+static void warmScratchFree(WarmScratch* scratch)
+{
+    arenaFree(scratch->neighbours);
+    arenaFree(scratch->marks);
+    memset(scratch, 0, sizeof(WarmScratch));
+}
+
+// the next combo prepared starts a run and has no seeds
+static void warmRunStart(WarmScratch* scratch)
+{
+    scratch->runStart = 1;
+}
+
+// seeds from the previous combo of the run unless this one starts it or needs more neighbours than were kept
+static void warmPrepare(WarmScratch* scratch, int kMax)
+{
+    int recordCount = kMax < scratch->trainCount ? kMax : scratch->trainCount;
+    if (recordCount > scratch->capacity)
+    {
+        arenaFree(scratch->neighbours);
+        scratch->neighbours = (int*)arenaCalloc((size_t)(scratch->testCount > 0 ? scratch->testCount : 1) * recordCount, sizeof(int));
+        if (scratch->neighbours == NULL)
+        {
+            printf("Failed to allocate memory for warm neighbours.\n");
+            exit(1);
+        }
+        scratch->capacity = recordCount;
+        scratch->runStart = 1;
+    }
+    scratch->seedCount = scratch->runStart || recordCount > scratch->recordCount ? 0 : recordCount;
+    scratch->recordCount = recordCount;
+    scratch->runStart = 0;
+}
+
+// a new stamp for the test row's seeds, the marks are cleared once the stamp wraps
+static void warmLoadTest(WarmScratch* scratch, int testIndex)
+{
+    scratch->seeds = &scratch->neighbours[(size_t)testIndex * scratch->capacity];
+    if (scratch->stamp == UINT_MAX)
+    {
+        memset(scratch->marks, 0, scratch->trainCount * sizeof(unsigned int));
+        scratch->stamp = 0;
+    }
+    scratch->stamp++;
+}
+
+static inline void warmMark(WarmScratch* scratch, int trainIndex)
+{
+    scratch->marks[trainIndex] = scratch->stamp;
+}
+
+// 1 for a row the current query measured as a seed
+static inline int warmMarked(const WarmScratch* scratch, int trainIndex)
+{
+    return scratch->marks[trainIndex] == scratch->stamp;
+}
+
+// keeps the test row's neighbour at a position as a seed for the next combo
+static inline void warmRecord(WarmScratch* scratch, int position, int trainIndex)
+{
+    scratch->seeds[position] = trainIndex;
+}
+
+#endif